@@ -0,0 +1,38 @@
+#!/bin/sh
+# run.sh, times the benchmark programs in this directory
+# usage: ./run.sh path/to/whitespace [options...], for example ./run.sh /tmp/whitespace -O1
+# prints the best wall time of 3 runs of each program, with the options given. The first run compiles the program,
+# the others load it from the .wsc it leaves, which gets removed afterwards.
+#
+# loop.ws   20M iterations of adding 3 to a heap value, counting down a stack counter
+# loop2.ws  30M iterations of counting down on the stack, through a chain of jumps
+# hv.ws     3M iterations of a heap accumulator, counting up a heap counter
+# sb2.ws    3M iterations of arithmetic and stack shuffling on the top few values
+#
+# sb2 and loop2 were used to try caching the top two stack values in locals, in a second main loop. It didn't win
+# reliably at any level: at -O0 sb2 and loop got faster but loop2 slower, at -O1 loop got about 30% slower, and at -O2
+# all of them but loop2 got slower, by up to 25% for sb2. The optimizer already keeps most of those values out of the
+# stack, so that main loop was dropped again.
+
+BIN=${1:?usage: ./run.sh path/to/whitespace [options...]}
+shift
+case $BIN in
+    */*) BIN=$(cd "$(dirname "$BIN")" && pwd)/$(basename "$BIN") ;;
+esac
+cd "$(dirname "$0")" || exit 1
+
+for program in *.ws; do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        "$BIN" "$@" "$program" < /dev/null > /dev/null
+        end=$(date +%s%N)
+        time=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$time" -lt "$best" ]; then
+            best=$time
+        fi
+    done
+    printf '%-10s %6d ms\n' "$program" "$best"
+    # the .wsc cache the runs left behind
+    rm -f "${program}c"
+done
@@ -0,0 +1,30 @@
+#!/bin/sh
+# super.sh, regenerates src/wssuper.h from profiles of the benchmark programs in this directory
+# usage: ./super.sh path/to/whitespace path/to/wsgen, with both built from the sources in src/
+# profiles every program at -O1 and -O2, as those are the levels which run superinstructions, and hands all of the
+# profiles to wsgen. The profiles don't depend on the superinstructions the whitespace binary was built with, so
+# running this again with a binary built from the result gives the same wssuper.h.
+
+BIN=${1:?usage: ./super.sh path/to/whitespace path/to/wsgen}
+GEN=${2:?usage: ./super.sh path/to/whitespace path/to/wsgen}
+for tool in BIN GEN; do
+    eval path=\$$tool
+    case $path in
+        */*) eval $tool='$(cd "$(dirname "$path")" && pwd)/$(basename "$path")' ;;
+    esac
+done
+cd "$(dirname "$0")" || exit 1
+
+profiles=$(mktemp -d) || exit 1
+for program in *.ws; do
+    for level in 1 2; do
+        "$BIN" -O$level --profile "$profiles/${program%.ws}.$level.prof" "$program" < /dev/null > /dev/null
+    done
+    # the .wsc cache the runs left behind
+    rm -f "${program}c"
+done
+
+"$GEN" -t ../src/wssuper.template -o ../src/wssuper.h "$profiles"/*.prof
+status=$?
+rm -rf "$profiles"
+exit $status
@@ -0,0 +1,87 @@
+/* vm.c, checks that a ws_vm reports the errors of the programs it runs instead of exiting, at every level
+ * build and run from this directory with: gcc -I../src -o vm vm.c && ./vm
+ */
+
+#include "whitespace.h"
+
+#define S " "
+#define T "\t"
+#define L "\n"
+
+#define PUSH S S
+#define PRINTC T L S S
+#define PRINTN T L S T
+#define SUBTRACT T S S T
+#define MULTIPLY T S S L
+#define SET T T S
+#define GET T T T
+#define ZEROS S S S S S S S S
+#define DIVIDE T S T S
+#define MODULO T S T T
+#define END L L L
+
+typedef struct {
+    const char *name;
+    const char *source;
+    ws_status status;
+    const char *message;
+    const char *output;
+} ws_check;
+
+static const ws_check ws_checks[] = {
+    {"prints", PUSH S T S S T S S S L PRINTC PUSH S T S T S L PUSH S T T L DIVIDE PRINTN END,
+     WS_STATUS_OK, "", "H3"},
+    {"divides by zero", PUSH S T L PUSH S S L DIVIDE END,
+     WS_STATUS_RUNTIME_ERROR, "division by zero", ""},
+    {"modulo by zero", PUSH S T T T L PRINTN PUSH S T L PUSH S S L MODULO PRINTN END,
+     WS_STATUS_RUNTIME_ERROR, "modulo by zero", "7"},
+    {"underflows", PUSH S T L DIVIDE END,
+     WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to divide", ""},
+    // the big int goes through the heap, so it doesn't get folded and -O1 makes a multiplyadd
+    {"multiplies a big int by zero", PUSH S S L PUSH T T ZEROS ZEROS ZEROS ZEROS L SET PUSH S S L GET
+                                     PUSH S S L MULTIPLY PUSH S S L SUBTRACT PRINTN END,
+     WS_STATUS_OK, "", "0"},
+    {"divides by a big zero", PUSH S S L PUSH T T ZEROS ZEROS ZEROS ZEROS L SET PUSH S T T T L PUSH S S L GET
+                              PUSH S S L MULTIPLY DIVIDE END,
+     WS_STATUS_RUNTIME_ERROR, "division by zero", ""},
+    {"subtracts from nothing", PUSH S T S T L SUBTRACT END,
+     WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to subtract", ""},
+    {"misses a parameter", PUSH S T,
+     WS_STATUS_PARSE_ERROR, NULL, ""},
+};
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    ws_vm *const vm = ws_vm_create();
+    int failures = 0;
+
+    // the same machine runs every case, so each one also checks that it recovers from the one before
+    for(int optimize = 0; optimize <= 3; optimize++) {
+        for(size_t i = 0; i < sizeof(ws_checks) / sizeof(ws_check); i++) {
+            const ws_check *const check = ws_checks + i;
+            char *buffer = NULL;
+            size_t length = 0;
+            FILE *const output = open_memstream(&buffer, &length);
+            ws_vm_io(vm, stdin, output);
+
+            ws_status status = ws_vm_load(vm, check->source, strlen(check->source), optimize);
+            if (status == WS_STATUS_OK) {
+                status = ws_vm_run(vm);
+            }
+            fclose(output);
+
+            if (status != check->status || strcmp(buffer, check->output) ||
+                (check->message && strcmp(ws_vm_message(vm), check->message))) {
+                printf("-O%d %s: got status %d, \"%s\" and output \"%s\"\n", optimize, check->name, (int)status,
+                       ws_vm_message(vm), buffer);
+                failures++;
+            }
+            free(buffer);
+        }
+    }
+
+    ws_vm_destroy(vm);
+    printf("%d failures\n", failures);
+    return failures? EXIT_FAILURE: EXIT_SUCCESS;
+}
@@ -2,19 +2,146 @@
 
 #include "whitespace.h"
 
+typedef struct {
+    const char **inputs; //the input files of --batch, NULL without it
+    size_t length;
+    size_t jobs;
+    int lockstep;        //runs the inputs in lockstep, see wslockstep.h
+} ws_batch_options;
+
+static int ws_run(ws_program *const program, const char *const profilename,
+                  const ws_batch_options *const batch) {
+    if (batch->inputs) {
+        const size_t failures = ws_batch_run(program, batch->inputs, batch->length, batch->jobs,
+                                             batch->lockstep);
+        ws_program_finish(program);
+        free(batch->inputs);
+        return failures? EXIT_FAILURE: EXIT_SUCCESS;
+    }
+    if (profilename) {
+        ws_execute_profile(program, ws_profile_initialize(profilename));
+    } else {
+        ws_execute(program);
+    }
+    ws_program_finish(program);
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
+    const char *filename = NULL;
+    const char *profilename = NULL;
+    int lazy = 0;
+    int instrument = 0;
+    int rebuild = 0;
+    int freeze = 0;
+    int optimize = 0;
+    ws_batch_options batch = {NULL, 0, 0, 0};
+    const char *servename = NULL;  //the socket of --serve
+    const char *clientname = NULL; //the socket of --client
+    size_t cachesize = WS_SERVE_CACHE_SIZE;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--lazy")) {
+            lazy = 1;
+        } else if (!strcmp(argv[i], "--rebuild")) {
+            rebuild = 1;
+        } else if (!strcmp(argv[i], "--freeze")) {
+            freeze = 1;
+        } else if (!strcmp(argv[i], "--instrument")) {
+            instrument = 1;
+        } else if (!strcmp(argv[i], "--batch")) {
+            batch.inputs = (const char **)malloc(sizeof(const char *) * argc);
+        } else if (!strcmp(argv[i], "--lockstep")) {
+            batch.lockstep = 1;
+        } else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+            batch.jobs = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            servename = argv[++i];
+        } else if (!strcmp(argv[i], "--client") && i + 1 < argc) {
+            clientname = argv[++i];
+        } else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+            cachesize = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profilename = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '9' && !argv[i][3]) {
+            optimize = argv[i][2] - '0';
+        } else if (argv[i][0] == '-') {
+            printf("unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        } else if (batch.inputs && filename) {
+            // with --batch everything after the program is an input
+            batch.inputs[batch.length++] = argv[i];
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if ((servename || clientname) && (lazy || rebuild || freeze || instrument || profilename ||
+                                      batch.inputs || batch.lockstep)) {
+        printf("--serve and --client run without --lazy, --rebuild, --freeze, --instrument, --profile "
+               "or --batch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the daemon compiles whatever programs its clients send
+    if (servename) {
+        if (filename || clientname) {
+            printf("--serve doesn't take a program\n");
+            exit(EXIT_FAILURE);
+        }
+        return ws_serve(servename, cachesize, batch.jobs);
+    }
+
+    if (!filename) {
         printf("expected at least one argument\n");
         exit(EXIT_FAILURE);
     }
 
-    FILE *wsfile = fopen(argv[1], "rb");
+    if (instrument && (lazy || optimize)) {
+        printf("--instrument runs the program as it was parsed, without --lazy or optimization\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (batch.inputs && (lazy || profilename || instrument)) {
+        printf("--batch runs without --lazy, --profile or --instrument\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (batch.lockstep && !batch.inputs) {
+        printf("--lockstep only works with --batch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (freeze && (lazy || instrument || optimize > 2)) {
+        printf("--freeze works up to -O2, without --lazy or --instrument\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (clientname) {
+        return ws_serve_client(clientname, filename, optimize);
+    }
+
+    FILE *wsfile = fopen(filename, "rb");
 
     if (!wsfile) {
         printf("failure to open file\n");
         exit(EXIT_FAILURE);
     }
 
+    size_t length =strlen(filename);
+    char *compiledname = (char *)malloc(length+2);
+    memcpy(compiledname, filename, length);
+    memcpy(compiledname + length, "c\0", 2);
+
+    // the source is described by its size, mtime and hash
+    struct stat wsstat;
+    ws_cache_header header = {0, 0, 0};
+    if (!fstat(fileno(wsfile), &wsstat)) {
+        header.mtime = (int64_t)wsstat.st_mtim.tv_sec * 1000000000 + wsstat.st_mtim.tv_nsec;
+    }
+
+    ws_program program;
+
     fseek(wsfile, 0L, SEEK_END);
     int wssize = ftell(wsfile);
     rewind(wsfile);
@@ -32,28 +159,47 @@ int main(int argc, char **argv) {
     data.length = fread(data.data, 1, wssize, wsfile);
     fclose(wsfile);
 
-    ws_program program;
-    ws_parse(&program, &data);
-    ws_string_free(&data);
-
-    size_t length =strlen(argv[1]);
-    char *compiledname = (char *)malloc(length+2);
-    memcpy(compiledname, argv[1], length);
-    memcpy(compiledname + length, "c\0", 2);
+    if (lazy) {
+        //the lazy program owns data, and never gets fully compiled or serialized
+        ws_lazy_parse(&program, &data);
+        if (profilename) {
+            ws_execute_profile(&program, ws_profile_initialize(profilename));
+        } else {
+            ws_execute(&program);
+        }
+        ws_program_finish(&program);
+        return 0;
+    }
 
-    ws_string serialized;
-    ws_serialize(&serialized, &program);
+    // a frozen image runs without parsing or compiling the source
+    ws_cache_header_of(&header, &data, header.mtime);
+    if (!instrument && !rebuild && !freeze && ws_image_load(&program, compiledname, &header, optimize)) {
+        ws_string_free(&data);
+        return ws_run(&program, profilename, &batch);
+    }
 
-    FILE *wscfile = fopen(compiledname, "wb");
-    fwrite(serialized.data, serialized.length, 1, wscfile);
-    fclose(wscfile);
+    // the .wsc holds the compiled program, and the block profile if there was an instrumented run
+    if (instrument || rebuild || !ws_cache_load(&program, compiledname, &header)) {
+        ws_parse(&program, &data);
+        ws_compile(&program);
+        ws_cache_store(compiledname, &program, &header);
+    }
+    ws_string_free(&data);
 
-    ws_string_free(&serialized);
+    if (instrument) {
+        // the .wsc gets stored again with the block profile at exit
+        ws_profile *const profile = ws_profile_initialize(profilename);
+        ws_profile_blocks(profile, &program, compiledname, &header);
+        ws_execute_profile(&program, profile);
+    }
 
-    ws_compile(&program);
+    // which lays the program out by its block profile first
+    ws_optimize(&program, optimize);
 
-    ws_execute(&program);
-    ws_program_finish(&program);
+    // replaces the .wsc by a frozen image of the optimized program
+    if (freeze) {
+        ws_image_store(compiledname, &program, &header, optimize);
+    }
 
-    return 0;
+    return ws_run(&program, profilename, &batch);
 }
@@ -6,14 +6,37 @@
 #include "wsparser.h"
 #include "wsserialize.h"
 #include "wscompiler.h"
+#include "wslazy.h"
+#include "wscfg.h"
+#include "wsoptimizer.h"
+#include "wsregister.h"
+#include "wsprofile.h"
+#include "wssuper.h"
+#include "wsimage.h"
 #include "wsmachine.h"
+#include "wsvm.h"
+#include "wslockstep.h"
+#include "wsbatch.h"
+#include "wssched.h"
+#include "wsserve.h"
 
 /* ok, so how does this work.
  * wstypes.h contains the defintions of all non-ws-runtime data types used by the program,
  * wsparser.h contains the code necessary to parse the whitespace code into a data structure
  * wscompile.h compiles this structure by replacing any labels by instruction indexes in the data structure
+ * wslazy.h does the parsing and compiling on demand while the program executes, for huge programs
+ * wscfg.h builds control flow graphs of compiled programs and analyses them, such as verifying stack depths
+ * wsoptimizer.h contains optimization passes which rewrite compiled programs into faster ones
+ * wsregister.h turns the blocks of optimized programs into register code
+ * wsprofile.h counts which sequences of commands run most, wsgen.c turns those into the superinstructions of wssuper.h
  * wsserialize.h can convert these data structures into a string format for serialization purposes
+ * wsimage.h stores optimized programs as frozen images, which run straight from the mapped file
  * wsmachine.h contains a full implementation of the intepreter executing these commands
+ * wsvm.h wraps it in a machine which can be embedded, and reports errors instead of exiting on them
+ * wslockstep.h runs machines with the same program in lockstep, with their small ints in vector lanes
+ * wsbatch.h runs a program on many inputs at once, with a machine per thread sharing the program
+ * wssched.h runs many machines on a few threads, which switch to another machine whenever one waits for input
+ * wsserve.h keeps compiled programs in a daemon, which runs them for clients on their own stdin and stdout
  */ 
 
 int main(int argc, char **argv);
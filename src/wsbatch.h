@@ -0,0 +1,282 @@
+/* wsbatch.h, runs one program against many inputs at once */
+#ifndef WSBATCH_H
+#define WSBATCH_H
+
+#include <unistd.h>
+#if WS_THREADS
+#include <pthread.h>
+#endif
+#include "wstypes.h"
+#include "wsvm.h"
+#include "wslockstep.h"
+
+#define WS_BATCH_THREADS_MAX 256
+#define WS_BATCH_BUFFER_SIZE 65536
+#define WS_BATCH_EXTENSION ".out"
+
+
+
+/* The program is loaded once and shared by a ws_vm per thread, which each run it on an input file at a time and write
+ * what it prints to the input's name followed by .out, exactly as a run with the input on stdin would print it,
+ * errors included. Every thread starts out with an equal part of the inputs. A thread which is done with its own
+ * takes half of what is left of another, so a few slow inputs don't keep the others waiting for one thread.
+ *
+ * With lockstep a thread takes up to WS_LOCKSTEP_LANES inputs at a time and runs them together, see wslockstep.h.
+ * Without WS_THREADS everything runs on the calling thread.
+ */
+typedef struct {
+#if WS_THREADS
+    pthread_mutex_t lock;
+#endif
+    size_t start; //the inputs which are still left to this worker
+    size_t end;
+} ws_batch_queue;
+
+typedef struct ws_batch {
+    const ws_program *program;
+    const char *const *inputs;
+    ws_batch_queue queues[WS_BATCH_THREADS_MAX];
+    size_t workers;
+    int lockstep;
+} ws_batch;
+
+typedef struct {
+    ws_batch *batch;
+    size_t index;
+    size_t failures;
+} ws_batch_worker;
+
+// the files of an input which is being run
+typedef struct {
+    FILE *input;
+    FILE *output;
+    char *outputname;
+    char *buffers; //the buffers of both, WS_BATCH_BUFFER_SIZE each
+} ws_batch_files;
+
+/* forward declarations
+ */
+size_t ws_batch_run(const ws_program *, const char *const *, size_t, size_t, int);
+static void *ws_batch_work(void *);
+static int ws_batch_next(ws_batch *, size_t, size_t *);
+static int ws_batch_open(ws_batch_files *, const char *);
+static int ws_batch_close(ws_batch_files *, const ws_vm *);
+
+
+
+static void ws_batch_lock(ws_batch_queue *const queue) {
+#if WS_THREADS
+    pthread_mutex_lock(&queue->lock);
+#else
+    (void)queue;
+#endif
+}
+
+static void ws_batch_unlock(ws_batch_queue *const queue) {
+#if WS_THREADS
+    pthread_mutex_unlock(&queue->lock);
+#else
+    (void)queue;
+#endif
+}
+
+/* Runs program, which has to be compiled, on each of the length inputs with up to workers threads, or as many as
+ * there are processors if that is 0, in lockstep if lockstep is set. Returns how many of them failed.
+ */
+size_t ws_batch_run(const ws_program *const program, const char *const *const inputs, const size_t length,
+                    size_t workers, const int lockstep) {
+#if WS_THREADS
+    if (!workers) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0)? (size_t)cpus: 1;
+    }
+    if (workers > WS_BATCH_THREADS_MAX) {
+        workers = WS_BATCH_THREADS_MAX;
+    }
+    if (workers > length) {
+        workers = length;
+    }
+#else
+    workers = 1;
+#endif
+    if (!length) {
+        return 0;
+    }
+
+    ws_batch *const batch = (ws_batch *)malloc(sizeof(ws_batch));
+    batch->program = program;
+    batch->inputs = inputs;
+    batch->workers = workers;
+    batch->lockstep = lockstep;
+
+    ws_batch_worker *const pool = (ws_batch_worker *)malloc(sizeof(ws_batch_worker) * workers);
+    for(size_t i = 0; i < workers; i++) {
+#if WS_THREADS
+        pthread_mutex_init(&batch->queues[i].lock, NULL);
+#endif
+        batch->queues[i].start = length * i / workers;
+        batch->queues[i].end = length * (i + 1) / workers;
+        pool[i].batch = batch;
+        pool[i].index = i;
+        pool[i].failures = 0;
+    }
+
+#if WS_THREADS
+    // the current thread is the first worker, if a thread can't be started the others take over its part
+    pthread_t threads[WS_BATCH_THREADS_MAX];
+    size_t started = 1;
+    for(; started < workers; started++) {
+        if (pthread_create(threads + started, NULL, ws_batch_work, pool + started)) {
+            break;
+        }
+    }
+    ws_batch_work(pool);
+    for(size_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    ws_batch_work(pool);
+#endif
+
+    size_t failures = 0;
+    for(size_t i = 0; i < workers; i++) {
+        failures += pool[i].failures;
+#if WS_THREADS
+        pthread_mutex_destroy(&batch->queues[i].lock);
+#endif
+    }
+    free(pool);
+    free(batch);
+    return failures;
+}
+
+static void *ws_batch_work(void *const argument) {
+    ws_batch_worker *const worker = (ws_batch_worker *)argument;
+    ws_batch *const batch = worker->batch;
+    const size_t lanes = batch->lockstep? WS_LOCKSTEP_LANES: 1;
+
+    ws_vm *vms[WS_LOCKSTEP_LANES];
+    ws_batch_files files[WS_LOCKSTEP_LANES];
+    for(size_t i = 0; i < lanes; i++) {
+        vms[i] = ws_vm_create();
+        if (ws_vm_share(vms[i], batch->program) != WS_STATUS_OK) {
+            printf("%s\n", ws_vm_message(vms[i]));
+            exit(EXIT_FAILURE);
+        }
+        files[i].buffers = (char *)malloc(2 * WS_BATCH_BUFFER_SIZE);
+    }
+
+    size_t input;
+    int more = 1;
+    while (more) {
+        size_t running = 0;
+        while (running < lanes && (more = ws_batch_next(batch, worker->index, &input))) {
+            if (!ws_batch_open(files + running, batch->inputs[input])) {
+                worker->failures++;
+                continue;
+            }
+            ws_vm_reset(vms[running]);
+            ws_vm_io(vms[running], files[running].input, files[running].output);
+            running++;
+        }
+
+        if (running == 1) {
+            ws_vm_run(vms[0]);
+        } else if (running) {
+            ws_lockstep_run(vms, running);
+        }
+        for(size_t i = 0; i < running; i++) {
+            if (!ws_batch_close(files + i, vms[i])) {
+                worker->failures++;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < lanes; i++) {
+        free(files[i].buffers);
+        ws_vm_destroy(vms[i]);
+    }
+    return NULL;
+}
+
+/* Takes the next input of worker self, or steals half of the inputs of another. Returns 0 once all are taken.
+ */
+static int ws_batch_next(ws_batch *const batch, const size_t self, size_t *const input) {
+    ws_batch_queue *const own = batch->queues + self;
+    int found = 0;
+
+    ws_batch_lock(own);
+    if (own->start != own->end) {
+        *input = own->start++;
+        found = 1;
+    }
+    ws_batch_unlock(own);
+    if (found) {
+        return 1;
+    }
+
+    // only the owner of a queue adds to it, so a queue which is empty here stays empty for everyone but self
+    for(size_t i = 1; i < batch->workers && !found; i++) {
+        ws_batch_queue *const victim = batch->queues + (self + i) % batch->workers;
+        size_t start = 0, end = 0;
+
+        ws_batch_lock(victim);
+        if (victim->start != victim->end) {
+            end = victim->end;
+            start = end - (end - victim->start + 1) / 2;
+            victim->end = start;
+            found = 1;
+        }
+        ws_batch_unlock(victim);
+
+        if (found) {
+            *input = start;
+            ws_batch_lock(own);
+            own->start = start + 1;
+            own->end = end;
+            ws_batch_unlock(own);
+        }
+    }
+    return found;
+}
+
+/* Opens the input file name, and name.out for the output. Returns 0 if that failed.
+ */
+static int ws_batch_open(ws_batch_files *const files, const char *const name) {
+    const size_t length = strlen(name);
+    files->outputname = (char *)malloc(length + sizeof(WS_BATCH_EXTENSION));
+    memcpy(files->outputname, name, length);
+    memcpy(files->outputname + length, WS_BATCH_EXTENSION, sizeof(WS_BATCH_EXTENSION));
+
+    files->input = fopen(name, "rb");
+    files->output = files->input? fopen(files->outputname, "wb"): NULL;
+    if (!files->output) {
+        printf("failure to open %s\n", files->input? files->outputname: name);
+        if (files->input) {
+            fclose(files->input);
+        }
+        free(files->outputname);
+        return 0;
+    }
+    setvbuf(files->input, files->buffers, _IOFBF, WS_BATCH_BUFFER_SIZE);
+    setvbuf(files->output, files->buffers + WS_BATCH_BUFFER_SIZE, _IOFBF, WS_BATCH_BUFFER_SIZE);
+    return 1;
+}
+
+/* Adds the error vm ran into to the output, if any, and closes the files. Returns 0 if the run or writing failed.
+ */
+static int ws_batch_close(ws_batch_files *const files, const ws_vm *const vm) {
+    if (vm->status != WS_STATUS_OK) {
+        fprintf(files->output, "%s\n", ws_vm_message(vm));
+    }
+
+    const int written = !fclose(files->output);
+    fclose(files->input);
+    if (!written) {
+        printf("failure to write %s\n", files->outputname);
+    }
+    free(files->outputname);
+    return vm->status == WS_STATUS_OK && written;
+}
+
+#endif
@@ -0,0 +1,522 @@
+/* wscfg.h, control flow graphs of compiled programs and the analyses done on them */
+#ifndef WSCFG_H
+#define WSCFG_H
+
+#include <limits.h>
+#include "wstypes.h"
+#include "wsparser.h"
+
+#define WS_CFG_NONE ((size_t)-1)
+#define WS_CFG_BUDGET ((size_t)1 << 24) //the maximum amount of blocks visited while finding subroutine bodies
+
+#define WS_DEPTH_UNKNOWN LONG_MAX       //ws_block.depth of a block which can't be reached
+#define WS_DEPTH_INVALID (LONG_MAX / 4) //the need of a copy or slide which always fails
+
+
+
+/* A compiled program is split into basic blocks: runs of commands which are only entered at the top,
+ * and only leave at the bottom. Blocks end at every jump, call, endsubroutine and endprogram.
+ *
+ * The first successor of a block is the block it falls through to, the second one the target of its jump.
+ * For a block ending in a call that is the block control comes back to after the subroutine returns,
+ * the called subroutine is stored separately.
+ *
+ * Every call target starts a subroutine. The body of a subroutine is everything that can be reached
+ * from its entry without following calls, so code shared between subroutines belongs to all of them.
+ * That is what endsubroutine can return from: an endsubroutine in the body of a subroutine
+ * continues at the return sites of the calls to that subroutine.
+ */
+
+typedef struct {
+    size_t start;
+    size_t end;             //one past the last command
+    size_t successors[2];   //WS_CFG_NONE if absent
+    size_t callee;          //index of the subroutine called at the end of the block, or WS_CFG_NONE
+    size_t subroutine;      //index of the subroutine starting at this block, or WS_CFG_NONE
+
+    // filled in by ws_cfg_stack_depths
+    long need;              //items which have to be on the stack for the whole block to run
+    long net;               //how much the stack grows when it does
+    long growth;            //how far above the starting depth the stack gets
+    long depth;             //lower bound on the stack depth when the block is entered
+} ws_block;
+
+typedef struct {
+    size_t entry;
+    size_t *blocks;
+    size_t length;
+    size_t *returns;        //the blocks following calls to this subroutine
+    size_t returns_length;
+    char leaf;              //doesn't call anything
+} ws_subroutine;
+
+typedef struct {
+    ws_block *blocks;
+    size_t length;
+    size_t *block_of;       //the block every command belongs to
+
+    ws_subroutine *subroutines;
+    size_t subroutines_length;
+    char complete;          //if the bodies of all subroutines fit in WS_CFG_BUDGET
+} ws_cfg;
+
+/* forward declarations
+ */
+void ws_cfg_build(ws_cfg *, const ws_program *);
+void ws_cfg_finish(ws_cfg *);
+void ws_stack_effect(const ws_command *, long *, long *);
+void ws_cfg_stack_depths(ws_cfg *, const ws_program *);
+static void ws_cfg_blocks(ws_cfg *, const ws_program *);
+static void ws_cfg_subroutines(ws_cfg *);
+
+
+
+// commands which go somewhere else than the next command
+static int ws_is_branch(const ws_command_type type) {
+    return ws_label_map[type] && type != label;
+}
+
+void ws_cfg_build(ws_cfg *const cfg, const ws_program *const program) {
+    ws_cfg_blocks(cfg, program);
+    ws_cfg_subroutines(cfg);
+}
+
+void ws_cfg_finish(ws_cfg *const cfg) {
+    for(size_t i = 0; i < cfg->subroutines_length; i++) {
+        free(cfg->subroutines[i].blocks);
+        free(cfg->subroutines[i].returns);
+    }
+    free(cfg->subroutines);
+    free(cfg->blocks);
+    free(cfg->block_of);
+}
+
+static void ws_cfg_blocks(ws_cfg *const cfg, const ws_program *const program) {
+    const size_t length = program->length;
+    char *const leaders = (char *)calloc(length + 1, 1);
+    const ws_command *command;
+    ws_block *block;
+
+    leaders[0] = 1;
+    for(size_t i = 0; i < length; i++) {
+        command = program->commands + i;
+        if (ws_is_branch(command->type)) {
+            leaders[command->jumpoffset] = 1;
+            leaders[i + 1] = 1;
+        } else if (command->type == endsubroutine || command->type == endprogram) {
+            leaders[i + 1] = 1;
+        }
+    }
+
+    cfg->length = 0;
+    for(size_t i = 0; i < length; i++) {
+        cfg->length += leaders[i];
+    }
+    cfg->blocks = (ws_block *)malloc(sizeof(ws_block) * (cfg->length + !cfg->length));
+    cfg->block_of = (size_t *)malloc(sizeof(size_t) * (length + 1));
+
+    size_t current = WS_CFG_NONE;
+    for(size_t i = 0; i < length; i++) {
+        if (leaders[i]) {
+            block = cfg->blocks + ++current;
+            block->start = i;
+            block->callee = WS_CFG_NONE;
+            block->subroutine = WS_CFG_NONE;
+        }
+        cfg->block_of[i] = current;
+        cfg->blocks[current].end = i + 1;
+    }
+    //jumps past the last command end up nowhere
+    cfg->block_of[length] = WS_CFG_NONE;
+
+    for(size_t b = 0; b < cfg->length; b++) {
+        block = cfg->blocks + b;
+        command = program->commands + block->end - 1;
+
+        block->successors[0] = cfg->block_of[block->end];
+        block->successors[1] = WS_CFG_NONE;
+        if (ws_is_branch(command->type)) {
+            block->successors[1] = cfg->block_of[command->jumpoffset];
+        }
+
+        switch (command->type) {
+            case jump:
+            case endsubroutine:
+            case endprogram:
+                block->successors[0] = WS_CFG_NONE;
+                break;
+
+            case call:
+                //the target is stored as the callee for now, ws_cfg_subroutines turns it into a subroutine index
+                block->callee = block->successors[1];
+                block->successors[1] = WS_CFG_NONE;
+                if (block->callee == WS_CFG_NONE) {
+                    block->successors[0] = WS_CFG_NONE;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    free(leaders);
+}
+
+static void ws_cfg_subroutines(ws_cfg *const cfg) {
+    ws_block *block;
+    ws_subroutine *subroutine;
+
+    cfg->subroutines_length = 0;
+    for(size_t b = 0; b < cfg->length; b++) {
+        block = cfg->blocks + b;
+        if (block->callee != WS_CFG_NONE && cfg->blocks[block->callee].subroutine == WS_CFG_NONE) {
+            cfg->blocks[block->callee].subroutine = cfg->subroutines_length++;
+        }
+    }
+
+    cfg->subroutines = (ws_subroutine *)calloc(cfg->subroutines_length + 1, sizeof(ws_subroutine));
+    for(size_t b = 0; b < cfg->length; b++) {
+        block = cfg->blocks + b;
+        if (block->subroutine != WS_CFG_NONE) {
+            cfg->subroutines[block->subroutine].entry = b;
+        }
+        if (block->callee != WS_CFG_NONE) {
+            block->callee = cfg->blocks[block->callee].subroutine;
+            if (block->successors[0] != WS_CFG_NONE) {
+                cfg->subroutines[block->callee].returns_length++;
+            }
+        }
+    }
+
+    // the return sites
+    for(size_t s = 0; s < cfg->subroutines_length; s++) {
+        subroutine = cfg->subroutines + s;
+        subroutine->returns = (size_t *)malloc(sizeof(size_t) * (subroutine->returns_length + 1));
+        subroutine->returns_length = 0;
+    }
+    for(size_t b = 0; b < cfg->length; b++) {
+        block = cfg->blocks + b;
+        if (block->callee != WS_CFG_NONE && block->successors[0] != WS_CFG_NONE) {
+            subroutine = cfg->subroutines + block->callee;
+            subroutine->returns[subroutine->returns_length++] = block->successors[0];
+        }
+    }
+
+    // and the bodies, walked with a stamp per block so nothing has to be cleared between subroutines
+    size_t *const stamps = (size_t *)malloc(sizeof(size_t) * (cfg->length + 1));
+    size_t *const worklist = (size_t *)malloc(sizeof(size_t) * (cfg->length + 1));
+    size_t worklist_length, next;
+    size_t visited = 0;
+
+    for(size_t b = 0; b < cfg->length; b++) {
+        stamps[b] = WS_CFG_NONE;
+    }
+
+    cfg->complete = 1;
+    for(size_t s = 0; s < cfg->subroutines_length; s++) {
+        subroutine = cfg->subroutines + s;
+        subroutine->blocks = (size_t *)malloc(sizeof(size_t) * 4);
+        subroutine->length = 0;
+        subroutine->leaf = 1;
+
+        if (!cfg->complete) {
+            continue;
+        }
+
+        size_t size = 4;
+        worklist_length = 0;
+        stamps[subroutine->entry] = s;
+        worklist[worklist_length++] = subroutine->entry;
+        while (worklist_length) {
+            block = cfg->blocks + worklist[--worklist_length];
+
+            if (subroutine->length == size) {
+                size *= 2;
+                subroutine->blocks = (size_t *)realloc(subroutine->blocks, sizeof(size_t) * size);
+            }
+            subroutine->blocks[subroutine->length++] = (size_t)(block - cfg->blocks);
+            if (block->callee != WS_CFG_NONE) {
+                subroutine->leaf = 0;
+            }
+
+            for(int i = 0; i < 2; i++) {
+                next = block->successors[i];
+                if (next != WS_CFG_NONE && stamps[next] != s) {
+                    stamps[next] = s;
+                    worklist[worklist_length++] = next;
+                }
+            }
+        }
+
+        visited += subroutine->length;
+        if (visited > WS_CFG_BUDGET) {
+            cfg->complete = 0;
+        }
+    }
+
+    free(stamps);
+    free(worklist);
+}
+
+
+
+/* The stack effect of a single command: how many items it needs on the stack, and how much it grows the stack
+ */
+void ws_stack_effect(const ws_command *const command, long *const need, long *const net) {
+    *need = ws_stack_need_map[command->type];
+    *net = ws_stack_net_map[command->type];
+
+    // copy and slide count from the bottom of the stack
+    if (command->type == copy || command->type == slide ||
+        command->type == copyunchecked || command->type == slideunchecked) {
+
+        const ws_int *const parameter = &command->parameter;
+        if (parameter->length || parameter->data < 0) {
+            *need = WS_DEPTH_INVALID;
+            return;
+        }
+        *need = (long)parameter->data + 1;
+        if (command->type == slide || command->type == slideunchecked) {
+            *net = -(long)parameter->data;
+        }
+    }
+}
+
+/* Finds a lower bound on the stack depth at the start of every block.
+ *
+ * A block can only run to its end if the stack holds at least need items when it starts, so after the block
+ * there are at least max(depth, need) + net items. The depth of a block is the smallest depth any of its
+ * predecessors leaves behind, with the program starting at 0.
+ *
+ * Calls pass their depth on to the entry of the subroutine. What comes back is described by a summary of
+ * the subroutine: when it is entered at depth d, it returns with at least max(d + shift, floor) items.
+ * These summaries are found first, by running the same analysis over the body of each subroutine with bounds
+ * of that form instead of plain numbers, until the summaries of recursive subroutines stop changing.
+ * Bounds that keep going down in a loop are widened so that always happens. If not all bodies were found,
+ * return sites are assumed to start at depth 0.
+ */
+#define WS_DEPTH_MIN (-(LONG_MAX / 4)) //shift of a bound which only depends on its floor
+#define WS_DEPTH_WIDEN 16              //the amount of times a bound can go down before it is widened
+
+// a lower bound max(d + shift, floor) relative to the depth d at the entry of a subroutine
+typedef struct {
+    long shift;
+    long floor;                        //WS_DEPTH_UNKNOWN if it can't be reached
+} ws_depth_bound;
+
+static long ws_depth_clamp(const long depth) {
+    return (depth < WS_DEPTH_MIN)? WS_DEPTH_MIN: (depth > WS_DEPTH_INVALID)? WS_DEPTH_INVALID: depth;
+}
+
+// the bound after running a block
+static ws_depth_bound ws_depth_through_block(const ws_depth_bound bound, const ws_block *const block) {
+    ws_depth_bound result;
+    result.shift = ws_depth_clamp(bound.shift + block->net);
+    result.floor = ws_depth_clamp(((bound.floor > block->need)? bound.floor: block->need) + block->net);
+    return result;
+}
+
+// the bound after calling a subroutine with a summary
+static ws_depth_bound ws_depth_through_call(const ws_depth_bound bound, const ws_depth_bound summary) {
+    ws_depth_bound result;
+    if (summary.floor == WS_DEPTH_UNKNOWN) {
+        result.shift = 0;
+        result.floor = WS_DEPTH_UNKNOWN;
+        return result;
+    }
+    result.shift = ws_depth_clamp(bound.shift + summary.shift);
+    result.floor = ws_depth_clamp(bound.floor + summary.shift);
+    if (summary.floor > result.floor) {
+        result.floor = summary.floor;
+    }
+    return result;
+}
+
+// lowers target to include bound, returns if anything changed
+static int ws_depth_join(ws_depth_bound *const target, const ws_depth_bound bound, size_t *const lowered) {
+    if (bound.floor == WS_DEPTH_UNKNOWN) {
+        return 0;
+    }
+    if (target->floor == WS_DEPTH_UNKNOWN) {
+        *target = bound;
+        return 1;
+    }
+    if (bound.shift >= target->shift && bound.floor >= target->floor) {
+        return 0;
+    }
+    if (++*lowered > WS_DEPTH_WIDEN) {
+        target->shift = (bound.shift < target->shift)? WS_DEPTH_MIN: target->shift;
+        target->floor = (bound.floor < target->floor)? 0: target->floor;
+    } else {
+        target->shift = (bound.shift < target->shift)? bound.shift: target->shift;
+        target->floor = (bound.floor < target->floor)? bound.floor: target->floor;
+    }
+    return 1;
+}
+
+/* Runs the analysis over the body of one subroutine, and returns the bound at its endsubroutines.
+ */
+static ws_depth_bound ws_cfg_summarize(const ws_cfg *const cfg, const ws_program *const program, const ws_subroutine *const subroutine,
+                                       const ws_depth_bound *const summaries, ws_depth_bound *const bounds, size_t *const lowered,
+                                       size_t *const worklist, char *const queued) {
+    ws_depth_bound result, out, identity;
+    size_t worklist_length = 0;
+    const ws_block *block;
+    size_t b, next;
+
+    result.shift = 0;
+    result.floor = WS_DEPTH_UNKNOWN;
+    identity.shift = 0;
+    identity.floor = 0;
+    for(size_t i = 0; i < subroutine->length; i++) {
+        bounds[subroutine->blocks[i]] = result;
+        lowered[subroutine->blocks[i]] = 0;
+    }
+
+    bounds[subroutine->entry] = identity;
+    queued[subroutine->entry] = 1;
+    worklist[worklist_length++] = subroutine->entry;
+
+    while (worklist_length) {
+        b = worklist[--worklist_length];
+        queued[b] = 0;
+        block = cfg->blocks + b;
+        out = ws_depth_through_block(bounds[b], block);
+
+        if (block->callee != WS_CFG_NONE) {
+            out = ws_depth_through_call(out, summaries[block->callee]);
+            next = block->successors[0];
+            if (next != WS_CFG_NONE && ws_depth_join(bounds + next, out, lowered + next) && !queued[next]) {
+                queued[next] = 1;
+                worklist[worklist_length++] = next;
+            }
+            continue;
+        }
+        if (program->commands[block->end - 1].type == endsubroutine) {
+            if (result.floor == WS_DEPTH_UNKNOWN || out.shift < result.shift || out.floor < result.floor) {
+                result.shift = (result.floor == WS_DEPTH_UNKNOWN || out.shift < result.shift)? out.shift: result.shift;
+                result.floor = (result.floor == WS_DEPTH_UNKNOWN || out.floor < result.floor)? out.floor: result.floor;
+            }
+            continue;
+        }
+        for(int i = 0; i < 2; i++) {
+            next = block->successors[i];
+            if (next != WS_CFG_NONE && ws_depth_join(bounds + next, out, lowered + next) && !queued[next]) {
+                queued[next] = 1;
+                worklist[worklist_length++] = next;
+            }
+        }
+    }
+
+    return result;
+}
+
+static void ws_cfg_relax(ws_cfg *const cfg, size_t *const worklist, size_t *const worklist_length, char *const queued, const size_t b, const long depth) {
+    if (b == WS_CFG_NONE || depth >= cfg->blocks[b].depth) {
+        return;
+    }
+    cfg->blocks[b].depth = depth;
+    if (!queued[b]) {
+        queued[b] = 1;
+        worklist[(*worklist_length)++] = b;
+    }
+}
+
+void ws_cfg_stack_depths(ws_cfg *const cfg, const ws_program *const program) {
+    ws_block *block;
+    long need, net, running;
+
+    for(size_t b = 0; b < cfg->length; b++) {
+        block = cfg->blocks + b;
+        block->need = 0;
+        block->growth = 0;
+        block->depth = WS_DEPTH_UNKNOWN;
+
+        running = 0;
+        for(size_t i = block->start; i < block->end; i++) {
+            ws_stack_effect(program->commands + i, &need, &net);
+            if (need - running > block->need) {
+                block->need = need - running;
+            }
+            running += net;
+            if (running > block->growth) {
+                block->growth = running;
+            }
+        }
+        // the stack can't end up below 0 either
+        if (-running > block->need) {
+            block->need = -running;
+        }
+        block->net = running;
+    }
+
+    if (!cfg->length) {
+        return;
+    }
+
+    size_t *const worklist = (size_t *)malloc(sizeof(size_t) * cfg->length);
+    char *const queued = (char *)calloc(cfg->length, 1);
+    size_t worklist_length = 0;
+
+    // the summaries of all subroutines, starting from subroutines which never return
+    ws_depth_bound *const summaries = (ws_depth_bound *)malloc(sizeof(ws_depth_bound) * (cfg->subroutines_length + 1));
+    size_t *const summaries_lowered = (size_t *)calloc(cfg->subroutines_length + 1, sizeof(size_t));
+    for(size_t s = 0; s < cfg->subroutines_length; s++) {
+        summaries[s].shift = 0;
+        summaries[s].floor = WS_DEPTH_UNKNOWN;
+    }
+
+    if (cfg->complete && cfg->subroutines_length) {
+        ws_depth_bound *const bounds = (ws_depth_bound *)malloc(sizeof(ws_depth_bound) * cfg->length);
+        size_t *const lowered = (size_t *)malloc(sizeof(size_t) * cfg->length);
+        int changed = 1;
+
+        while (changed) {
+            changed = 0;
+            for(size_t s = 0; s < cfg->subroutines_length; s++) {
+                const ws_depth_bound summary = ws_cfg_summarize(cfg, program, cfg->subroutines + s, summaries, bounds, lowered, worklist, queued);
+                changed |= ws_depth_join(summaries + s, summary, summaries_lowered + s);
+            }
+        }
+
+        free(bounds);
+        free(lowered);
+    }
+
+    // and the depths of all blocks
+    long out;
+    ws_depth_bound returned;
+
+    ws_cfg_relax(cfg, worklist, &worklist_length, queued, 0, 0);
+    while (worklist_length) {
+        const size_t b = worklist[--worklist_length];
+        queued[b] = 0;
+        block = cfg->blocks + b;
+        out = ((block->depth > block->need)? block->depth: block->need) + block->net;
+
+        if (block->callee != WS_CFG_NONE) {
+            ws_cfg_relax(cfg, worklist, &worklist_length, queued, cfg->subroutines[block->callee].entry, out);
+
+            if (!cfg->complete) {
+                ws_cfg_relax(cfg, worklist, &worklist_length, queued, block->successors[0], 0);
+            } else if (summaries[block->callee].floor != WS_DEPTH_UNKNOWN) {
+                returned.shift = out;
+                returned.floor = out;
+                returned = ws_depth_through_call(returned, summaries[block->callee]);
+                ws_cfg_relax(cfg, worklist, &worklist_length, queued, block->successors[0], (returned.floor > 0)? returned.floor: 0);
+            }
+
+        } else if (program->commands[block->end - 1].type != endsubroutine) {
+            ws_cfg_relax(cfg, worklist, &worklist_length, queued, block->successors[0], out);
+            ws_cfg_relax(cfg, worklist, &worklist_length, queued, block->successors[1], out);
+        }
+    }
+
+    free(worklist);
+    free(queued);
+    free(summaries);
+    free(summaries_lowered);
+}
+
+#endif
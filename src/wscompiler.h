@@ -4,24 +4,36 @@
 
 #include "wstypes.h"
 
-#define WS_JUMPOFFSETS_SIZE 32
-#define WS_JUMPOFFSETS_RESIZE 2
+#if WS_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
+#define WS_RESOLVE_THREADS_MAX 16
+#define WS_RESOLVE_PARALLEL_MIN 65536 //below this amount of jumps threads aren't worth starting
+#define WS_TAILCALL_LIMIT 64 //the maximum length of a jump chain that gets followed looking for a return
 
 
-/* compiling is done in two steps.
- * first, iterate over the entire program, storing all indexes which have labels, and adding the index
- * of labels to a map.
- * second, iterate over the indexes which have labels, and replace the labels by the actual offsets in the
- * program.
+
+/* compiling is done in three steps.
+ * first, count the labels and jumps in the program so everything can be allocated up front.
+ * second, collect all label definitions and all jumps into map entries, sort them by the position
+ * they will have in the map and insert the labels in that order.
+ * third, look up the jumps in the same order and replace their labels by the actual offsets in the program.
+ * As the map is only read at this point, this can be split over multiple threads for large programs.
+ * Sorting the lookups means the map is walked through front to back instead of being hit at random,
+ * which is what matters once the program has millions of labels.
  * the labels will be free'd in the process.
+ * Finally, calls in tail position are turned into jumps, see ws_compile_tailcalls.
  */
 
-// a map entry used for compiling labels
+// a map entry used for compiling labels. labels of up to 64 bits are stored in key itself,
+// longer labels store a pointer to their data. length is the label length in bits + 1, 0 for unused entries
 typedef struct {
-    ws_label key;
+    uint64_t key;
     size_t value;
-    char initialized;
+    unsigned int hash;
+    unsigned int length;
 } ws_map_entry;
 
 // the map used for compiling labels
@@ -31,12 +43,31 @@ typedef struct {
     size_t length;
 } ws_map;
 
+#define WS_MAP_MISSING ((size_t)-1)
+#define WS_MAP_INLINE_BITS 64
+
+// the part of the jumps resolved by a single thread
+typedef struct {
+    ws_program *program;
+    const ws_map *map;
+    ws_map_entry *jumps;
+    size_t length;
+    size_t failure;
+} ws_resolve_job;
+
 /* forward declarations
  */
-static void ws_map_initialize(ws_map *);
+static void ws_map_initialize(ws_map *, size_t);
+static void ws_map_key(ws_map_entry *, const ws_label *, size_t);
+static int ws_map_insert(ws_map *, const ws_map_entry *);
+static size_t ws_map_find(const ws_map *, const ws_map_entry *);
+static void ws_map_sort(const ws_map *, ws_map_entry *, size_t);
 static int ws_map_set(ws_map *, const ws_label *, const size_t);
-static int ws_map_get(const ws_map *, const ws_label *);
+static size_t ws_map_get(const ws_map *, const ws_label *);
+static void ws_map_entry_free(const ws_map_entry *);
 static void ws_map_finish(ws_map *);
+static size_t ws_resolve(ws_program *, const ws_map *, ws_map_entry *, size_t);
+static void ws_compile_tailcalls(ws_program *);
 
 
 
@@ -44,126 +75,336 @@ static void ws_map_finish(ws_map *);
  */
 void ws_compile(ws_program *const parsed) {
     if (parsed->flags & 0x1) {
-        printf("cannot compile already compiled program");
-        exit(EXIT_FAILURE);
+        ws_fail(WS_STATUS_COMPILE_ERROR, "cannot compile already compiled program");
     }
-    size_t jump_offsets_size = WS_JUMPOFFSETS_SIZE;
-    size_t jump_offsets_length = 0;
-    size_t *jump_offsets = (size_t *)malloc(sizeof(size_t) * WS_JUMPOFFSETS_SIZE);
-
-    int offset;
+    size_t labels_length = 0;
+    size_t jumps_length = 0;
+    size_t failure = WS_MAP_MISSING;
     ws_command *current_command;
 
-    ws_map map;
-    ws_map_initialize(&map);
+    for(size_t i = 0; i < parsed->length; i++) {
+        if (parsed->commands[i].type == label) {
+            labels_length++;
+        } else if (ws_label_map[parsed->commands[i].type]) {
+            jumps_length++;
+        }
+    }
+
+    ws_map_entry *const labels = (ws_map_entry *)malloc(sizeof(ws_map_entry) * (labels_length + 1));
+    ws_map_entry *const jumps = (ws_map_entry *)malloc(sizeof(ws_map_entry) * (jumps_length + 1));
+    labels_length = 0;
+    jumps_length = 0;
 
+    // the entries take over the labels of the commands
     for(size_t i = 0; i < parsed->length; i++) {
         current_command = parsed->commands + i;
 
         if (current_command->type == label) {
-
-            // insert the label offset into the hashmap
-            if (ws_map_set(&map, &current_command->label, i)) {
-
-                printf("duplicate label found at command %d\n", i);
-                exit(EXIT_FAILURE);
-            }
+            ws_map_key(labels + labels_length++, &current_command->label, i);
             current_command->jumpoffset = i;
 
         } else if (ws_label_map[current_command->type]) {
+            ws_map_key(jumps + jumps_length++, &current_command->label, i);
+        }
+    }
 
-            // resize if necessary
-            if (jump_offsets_size == jump_offsets_length) {
-                jump_offsets_size *= 2;
-                jump_offsets = (size_t *)realloc(jump_offsets, sizeof(size_t) * jump_offsets_size);
+    ws_map map;
+    ws_map_initialize(&map, labels_length);
+
+    // insert the label offsets into the hashmap
+    ws_map_sort(&map, labels, labels_length);
+    for(size_t i = 0; i < labels_length; i++) {
+        if (ws_map_insert(&map, labels + i)) {
+            if (labels[i].value < failure) {
+                failure = labels[i].value;
             }
+            ws_map_entry_free(labels + i);
+        }
+    }
+    free(labels);
 
-            jump_offsets[jump_offsets_length++] = i;
+    // the labels of the commands belong to the entries now, so the program must not free them anymore
+    if (failure != WS_MAP_MISSING) {
+        for(size_t i = 0; i < jumps_length; i++) {
+            ws_map_entry_free(jumps + i);
+        }
+        free(jumps);
+        ws_map_finish(&map);
+        parsed->flags |= 0x1;
+        ws_fail(WS_STATUS_COMPILE_ERROR, "duplicate label found at command %zu\n", failure);
+    }
 
+    //for each of the jump/calls, replace the label by the offset
+    ws_map_sort(&map, jumps, jumps_length);
+    failure = ws_resolve(parsed, &map, jumps, jumps_length);
+    free(jumps);
+
+    ws_map_finish(&map);
+    if (failure != WS_MAP_MISSING) {
+        parsed->flags |= 0x1;
+        ws_fail(WS_STATUS_COMPILE_ERROR, "label not found at command %zu\n", failure);
+    }
+
+    ws_compile_tailcalls(parsed);
+
+    parsed->flags |= 0x1;
+}
+
+/* A call that is followed by a return, possibly through labels and jumps, doesn't have to come back:
+ * the return of the called subroutine can just as well go straight to our own caller.
+ * So call L; endsubroutine becomes jump L, which keeps the callstack from growing in tail recursive subroutines.
+ */
+static int ws_compile_returns(const ws_program *const program, size_t index) {
+    size_t steps = 0;
+
+    while (index < program->length && steps < WS_TAILCALL_LIMIT) {
+        switch (program->commands[index].type) {
+            case label:
+                index++;
+                break;
+            case jump:
+                index = program->commands[index].jumpoffset;
+                steps++;
+                break;
+            case endsubroutine:
+                return 1;
+            default:
+                return 0;
         }
     }
-    
-    //for each of the jump/calls, replace the label by 
-    for(size_t i = 0; i < jump_offsets_length; i++) {
-        current_command = parsed->commands + jump_offsets[i];
-        offset = ws_map_get(&map, &current_command->label);
+    return 0;
+}
 
-        if (offset < 0) {
-            printf("label not found at command %d\n", jump_offsets[i]);
-            exit(EXIT_FAILURE);
+static void ws_compile_tailcalls(ws_program *const program) {
+    for(size_t i = 0; i < program->length; i++) {
+        if (program->commands[i].type == call && ws_compile_returns(program, i + 1)) {
+            program->commands[i].type = jump;
         }
-        current_command->jumpoffset = offset;
     }
+}
 
-    ws_map_finish(&map); //note, this frees all the old label strings too because I didn't copy the char *'s.
-    free(jump_offsets);
+/* Replaces the labels of the given jumps by their offset.
+ * failure is set to the first index of which the label couldn't be found, or WS_MAP_MISSING.
+ */
+static void *ws_resolve_range(void *const argument) {
+    ws_resolve_job *const job = (ws_resolve_job *)argument;
+    size_t offset;
 
-    parsed->flags |= 0x1;
+    job->failure = WS_MAP_MISSING;
+    for(size_t i = 0; i < job->length; i++) {
+        offset = ws_map_find(job->map, job->jumps + i);
+
+        if (offset == WS_MAP_MISSING) {
+            if (job->jumps[i].value < job->failure) {
+                job->failure = job->jumps[i].value;
+            }
+        } else {
+            job->program->commands[job->jumps[i].value].jumpoffset = offset;
+        }
+        ws_map_entry_free(job->jumps + i);
+    }
+    return NULL;
 }
 
-/* an implementation of a label: int map follows. 
- * It is implemented as a hash table
+/* Returns the first index of a jump which couldn't be resolved, or WS_MAP_MISSING
+ */
+static size_t ws_resolve(ws_program *const program, const ws_map *const map, ws_map_entry *const jumps, const size_t length) {
+    ws_resolve_job jobs[WS_RESOLVE_THREADS_MAX];
+    size_t jobs_length = 1;
+    size_t failure = WS_MAP_MISSING;
+
+#if WS_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (length >= WS_RESOLVE_PARALLEL_MIN && cpus > 1) {
+        jobs_length = (cpus > WS_RESOLVE_THREADS_MAX)? WS_RESOLVE_THREADS_MAX: (size_t)cpus;
+    }
+#endif
+
+    // split the jumps in equal parts
+    for(size_t i = 0; i < jobs_length; i++) {
+        jobs[i].program = program;
+        jobs[i].map = map;
+        jobs[i].jumps = jumps + length * i / jobs_length;
+        jobs[i].length = length * (i + 1) / jobs_length - length * i / jobs_length;
+    }
+
+#if WS_THREADS
+    pthread_t threads[WS_RESOLVE_THREADS_MAX];
+    size_t started = 1;
+
+    // the current thread takes the first part itself
+    for(; started < jobs_length; started++) {
+        if (pthread_create(threads + started, NULL, ws_resolve_range, jobs + started)) {
+            break;
+        }
+    }
+    ws_resolve_range(jobs);
+    for(size_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // if we couldn't start a thread just do the rest here
+    for(size_t i = started; i < jobs_length; i++) {
+        ws_resolve_range(jobs + i);
+    }
+#else
+    ws_resolve_range(jobs);
+#endif
+
+    for(size_t i = 0; i < jobs_length; i++) {
+        if (jobs[i].failure < failure) {
+            failure = jobs[i].failure;
+        }
+    }
+    return failure;
+}
+
+/* an implementation of a label: size_t map follows.
+ * It is implemented as a hash table with a power of two size and linear probing,
+ * so it can be presized for the amount of labels that will be inserted and never needs
+ * to be rehashed while compiling, and so entries sorted by ws_map_sort are visited in order.
  * It is impossible to overwrite keys in this implementation, -1 will be returned.
  * for more comments see wsmachine's heap
  */
 #define WS_MAP_SIZE 16
 #define WS_MAP_RESIZE_FACTOR 4
 #define WS_MAP_RESIZE_TIME(length, size) (((length)+1)*3 > (size)*2)
-#define WS_MAP_PERTURB_SHIFT 5
+#define WS_MAP_RADIX_BITS 11
 
-static void ws_map_initialize(ws_map *const map) {
+static void ws_map_initialize(ws_map *const map, const size_t expected) {
     map->size = WS_MAP_SIZE;
+    while (WS_MAP_RESIZE_TIME(expected, map->size)) {
+        map->size *= 2;
+    }
     map->length = 0;
-    map->entries = (ws_map_entry *)malloc(sizeof(ws_map_entry) * WS_MAP_SIZE);
-    for(size_t i = 0; i < WS_MAP_SIZE; i++) {
-        map->entries[i].initialized = 0;
+    map->entries = (ws_map_entry *)calloc(map->size, sizeof(ws_map_entry));
+    if (!map->entries) {
+        ws_fail(WS_STATUS_COMPILE_ERROR, "out of memory in ws_map_initialize\n");
     }
 }
 
 static void ws_map_finish(ws_map *const map) {
     for(size_t i = 0; i < map->size; i++) {
-        if (map->entries[i].initialized) {
-            ws_label_free(&map->entries[i].key);
-        }  
+        ws_map_entry_free(map->entries + i);
     }
     free(map->entries);
 }
 
 void ws_map_print(ws_map *const map) {
-    printf("hashtable size %#X, length %#X\n", map->size, map->length);
+    printf("hashtable size %#zX, length %#zX\n", map->size, map->length);
     for(size_t i = 0; i < map->size; i++) {
-        if (map->entries[i].initialized) {
-            printf("%#4X ", i % map->size);
-            ws_label_print(&map->entries[i].key);
-            printf(": %4d\n", map->entries[i].value);
+        if (map->entries[i].length) {
+            printf("%#4zX %#8X (%u bits): %4zu\n", i, map->entries[i].hash, map->entries[i].length - 1, map->entries[i].value);
         } else {
-            printf("%#4X NULL: NULL\n", i % map->size);
+            printf("%#4zX NULL: NULL\n", i);
         }
     }
 }
 
-static int ws_map_insert(ws_map *const map, const ws_label *const key, const int value) {
+/* Turns a label into a map entry. The entry takes over the label, so it should be
+ * released with ws_map_entry_free unless it was inserted into the map
+ */
+static void ws_map_key(ws_map_entry *const entry, const ws_label *const key, const size_t value) {
+    entry->hash = ws_label_hash(key);
+    entry->length = key->length + 1;
+    entry->value = value;
+    if (key->length <= WS_MAP_INLINE_BITS) {
+        entry->key = 0;
+        memcpy(&entry->key, key->data, ws_round8up(key->length));
+        ws_label_free(key);
+    } else {
+        entry->key = (uint64_t)(uintptr_t)key->data;
+    }
+}
 
-    unsigned int hash = ws_label_hash(key);
-    unsigned int perturb = hash;
-    size_t position = hash % map->size;
-    while (map->entries[position].initialized &&
-           ws_label_compare(&map->entries[position].key, key)) {
-        position = (position * 5 + 1 + perturb) % map->size;
-        perturb >>= WS_MAP_PERTURB_SHIFT;
+static void ws_map_entry_free(const ws_map_entry *const entry) {
+    if (entry->length > WS_MAP_INLINE_BITS + 1) {
+        free((char *)(uintptr_t)entry->key);
     }
-    if (map->entries[position].initialized) {
+}
+
+static int ws_map_entry_compare(const ws_map_entry *const a, const ws_map_entry *const b) {
+    if (a->hash != b->hash || a->length != b->length) {
         return -1;
     }
-    map->entries[position].initialized = 1;
-    map->entries[position].key = *key; //not ws_string_copying here since he char * should be freed
-    map->entries[position].value = value;
+    if (a->length <= WS_MAP_INLINE_BITS + 1) {
+        return a->key != b->key;
+    }
+    return memcmp((char *)(uintptr_t)a->key, (char *)(uintptr_t)b->key, ws_round8up(a->length - 1));
+}
+
+static int ws_map_insert(ws_map *const map, const ws_map_entry *const entry) {
+
+    const size_t mask = map->size - 1;
+    size_t position = entry->hash & mask;
+    while (map->entries[position].length) {
+        if (!ws_map_entry_compare(map->entries + position, entry)) {
+            return -1;
+        }
+        position = (position + 1) & mask;
+    }
+    map->entries[position] = *entry; //the map owns the key from here on
     map->length++;
     return 0;
 }
 
+static size_t ws_map_find(const ws_map *const map, const ws_map_entry *const entry) {
+
+    const size_t mask = map->size - 1;
+    size_t position = entry->hash & mask;
+    while (map->entries[position].length) {
+        if (!ws_map_entry_compare(map->entries + position, entry)) {
+            return map->entries[position].value;
+        }
+        position = (position + 1) & mask;
+    }
+    return WS_MAP_MISSING;
+}
+
+/* Sorts entries on their initial position in the map with a radix sort, keeping the order of equal positions
+ */
+static void ws_map_sort(const ws_map *const map, ws_map_entry *entries, const size_t length) {
+    const size_t mask = map->size - 1;
+    ws_map_entry *buffer = (ws_map_entry *)malloc(sizeof(ws_map_entry) * (length + 1));
+    ws_map_entry *const original = entries;
+    ws_map_entry *temp;
+    size_t counts[1 << WS_MAP_RADIX_BITS];
+    size_t total, count;
+
+    for(unsigned int shift = 0; mask >> shift; shift += WS_MAP_RADIX_BITS) {
+        memset(counts, 0, sizeof(counts));
+        for(size_t i = 0; i < length; i++) {
+            counts[((entries[i].hash & mask) >> shift) & ((1 << WS_MAP_RADIX_BITS) - 1)]++;
+        }
+
+        total = 0;
+        for(size_t i = 0; i < (1 << WS_MAP_RADIX_BITS); i++) {
+            count = counts[i];
+            counts[i] = total;
+            total += count;
+        }
+
+        for(size_t i = 0; i < length; i++) {
+            buffer[counts[((entries[i].hash & mask) >> shift) & ((1 << WS_MAP_RADIX_BITS) - 1)]++] = entries[i];
+        }
+
+        temp = entries;
+        entries = buffer;
+        buffer = temp;
+    }
+
+    if (entries != original) {
+        memcpy(original, entries, sizeof(ws_map_entry) * length);
+        buffer = entries;
+    }
+    free(buffer);
+}
+
+/* Single label insertion and lookup, for when the labels aren't known up front.
+ * set takes over the label, get doesn't.
+ */
 static int ws_map_set(ws_map *const map, const ws_label *const key, const size_t value) {
-    // check if we should resize
+    // check if we should resize. this doesn't happen if the map was presized correctly
     if (WS_MAP_RESIZE_TIME(map->length, map->size)) {
 
         ws_map_entry *old = map->entries;
@@ -171,37 +412,36 @@ static int ws_map_set(ws_map *const map, const ws_label *const key, const size_t
 
         map->size *= WS_MAP_RESIZE_FACTOR;
         map->length = 0;
-        map->entries = (ws_map_entry *)malloc(sizeof(ws_map_entry) * map->size);
-
-        for(size_t i = 0; i < map->size; i++) {
-            map->entries[i].initialized = 0;
+        map->entries = (ws_map_entry *)calloc(map->size, sizeof(ws_map_entry));
+        if (!map->entries) {
+            ws_fail(WS_STATUS_COMPILE_ERROR, "out of memory in ws_map_set\n");
         }
 
         for(size_t i = 0; i < old_size; i++) {
-            if (old[i].initialized) {
-                ws_map_insert(map, &old[i].key, old[i].value);
+            if (old[i].length) {
+                ws_map_insert(map, old + i);
             }
         }
 
         free(old);
     }
 
-    return ws_map_insert(map, key, value);
+    ws_map_entry entry;
+    ws_map_key(&entry, key, value);
+    return ws_map_insert(map, &entry);
 }
 
-static int ws_map_get(const ws_map *const map, const ws_label *const key) {
-
-    unsigned int hash = ws_label_hash(key);
-    unsigned int perturb = hash;
-    size_t position = hash % map->size;
-    while (map->entries[position].initialized) {
-        if (!ws_label_compare(&map->entries[position].key, key)) {
-            return map->entries[position].value;
-        }
-        position = (position * 5 + 1 + perturb) % map->size;
-        perturb >>= WS_MAP_PERTURB_SHIFT;
+static size_t ws_map_get(const ws_map *const map, const ws_label *const key) {
+    ws_map_entry entry;
+    entry.hash = ws_label_hash(key);
+    entry.length = key->length + 1;
+    entry.key = 0;
+    if (key->length <= WS_MAP_INLINE_BITS) {
+        memcpy(&entry.key, key->data, ws_round8up(key->length));
+    } else {
+        entry.key = (uint64_t)(uintptr_t)key->data;
     }
-    return -1;
+    return ws_map_find(map, &entry);
 }
 
-#endif
\ No newline at end of file
+#endif
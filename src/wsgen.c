@@ -0,0 +1,361 @@
+/* wsgen.c, generates the superinstructions of wssuper.h from profiles written by whitespace --profile
+ *
+ * usage: wsgen [-n count] [-t template] [-o output] profile...
+ *
+ * The profiles of all runs are merged, and the count sequences that save the most dispatches become superinstructions,
+ * leaving out the ones that mostly run as part of a sequence which already has one.
+ * Their code is stitched together from the snippets in the template, src/wssuper.template by default.
+ * It is built from the same sources as the interpreter, and the result replaces src/wssuper.h:
+ *
+ * cc -O2 -o wsgen src/wsgen.c
+ * whitespace --profile a.prof a.ws; whitespace -O1 --profile b.prof b.ws
+ * wsgen -o src/wssuper.h a.prof b.prof
+ */
+
+#include "whitespace.h"
+
+#define WS_GEN_LINE 256
+
+typedef struct {
+    unsigned char types[WS_PROFILE_MAX];
+    unsigned int length;
+    uint64_t count;
+} ws_gen_sequence;
+
+typedef struct {
+    size_t size;
+    size_t length;
+    ws_gen_sequence *sequences;
+} ws_gen_profile;
+
+static char *ws_gen_snippets[COMMANDTYPES]; //the code of every command in the template, NULL if it has none
+
+
+
+static int ws_gen_type(const char *const name) {
+    for(int type = 0; type < superinstruction; type++) {
+        if (!strcmp(ws_command_names[type].data, name)) {
+            return type;
+        }
+    }
+    return -1;
+}
+
+/* A command that can jump can only be the last one of a superinstruction
+ */
+static int ws_gen_falls_through(const int type) {
+    return !ws_label_map[type] || type == label;
+}
+
+/* Calls, returns and the end of the program can't be part of a superinstruction at all,
+ * as ws_execute_super doesn't get the callstack
+ */
+static int ws_gen_uses_callstack(const int type) {
+    return type == call || type == endsubroutine || type == endprogram;
+}
+
+static void ws_gen_read_template(const char *const filename) {
+    FILE *const file = fopen(filename, "r");
+    if (!file) {
+        printf("failure to open template %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[WS_GEN_LINE];
+    size_t length, start;
+    int type = -1;
+    while (fgets(line, WS_GEN_LINE, file)) {
+        length = strcspn(line, "\r\n");
+        line[length] = 0;
+        if (line[0] == '#' || !length) {
+            continue;
+        }
+
+        if (line[0] != ' ') {
+            type = ws_gen_type(line);
+            if (type < 0) {
+                printf("unknown command %s in template\n", line);
+                exit(EXIT_FAILURE);
+            }
+            // commands without code still get an empty snippet
+            ws_gen_snippets[type] = (char *)calloc(1, 1);
+            continue;
+        }
+        if (type < 0) {
+            printf("code without a command in template\n");
+            exit(EXIT_FAILURE);
+        }
+
+        start = strspn(line, " ");
+        const size_t old = strlen(ws_gen_snippets[type]);
+        ws_gen_snippets[type] = (char *)realloc(ws_gen_snippets[type], old + length - start + 2);
+        memcpy(ws_gen_snippets[type] + old, line + start, length - start);
+        memcpy(ws_gen_snippets[type] + old + length - start, "\n", 2);
+    }
+    fclose(file);
+}
+
+static void ws_gen_read_profile(ws_gen_profile *const profile, const char *const filename) {
+    FILE *const file = fopen(filename, "r");
+    if (!file) {
+        printf("failure to open profile %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[WS_GEN_LINE];
+    ws_gen_sequence sequence;
+    unsigned long long count;
+    char *name;
+    int type;
+    while (fgets(line, WS_GEN_LINE, file)) {
+        name = strtok(line, " \r\n");
+        if (!name) {
+            continue;
+        }
+        count = strtoull(name, NULL, 10);
+
+        memset(&sequence, 0, sizeof(ws_gen_sequence));
+        sequence.count = count;
+        while ((name = strtok(NULL, " \r\n"))) {
+            type = ws_gen_type(name);
+            if (type < 0 || sequence.length == WS_PROFILE_MAX) {
+                printf("invalid sequence in profile %s\n", filename);
+                exit(EXIT_FAILURE);
+            }
+            sequence.types[sequence.length++] = (unsigned char)type;
+        }
+        if (sequence.length < WS_PROFILE_MIN) {
+            printf("invalid sequence in profile %s\n", filename);
+            exit(EXIT_FAILURE);
+        }
+
+        if (profile->length == profile->size) {
+            profile->size *= 2;
+            profile->sequences = (ws_gen_sequence *)realloc(profile->sequences, sizeof(ws_gen_sequence) * profile->size);
+        }
+        profile->sequences[profile->length++] = sequence;
+    }
+    fclose(file);
+}
+
+static int ws_gen_compare_types(const void *const a, const void *const b) {
+    const ws_gen_sequence *const left = (const ws_gen_sequence *)a;
+    const ws_gen_sequence *const right = (const ws_gen_sequence *)b;
+    if (left->length != right->length) {
+        return (left->length > right->length) - (left->length < right->length);
+    }
+    return memcmp(left->types, right->types, WS_PROFILE_MAX);
+}
+
+/* A superinstruction of length commands saves length - 1 dispatches every time it runs
+ */
+static int ws_gen_compare_savings(const void *const a, const void *const b) {
+    const ws_gen_sequence *const left = (const ws_gen_sequence *)a;
+    const ws_gen_sequence *const right = (const ws_gen_sequence *)b;
+    const uint64_t left_savings = left->count * (left->length - 1);
+    const uint64_t right_savings = right->count * (right->length - 1);
+    if (left_savings != right_savings) {
+        return (left_savings < right_savings) - (left_savings > right_savings);
+    }
+    return ws_gen_compare_types(a, b);
+}
+
+// the longest sequences are matched first
+static int ws_gen_compare_length(const void *const a, const void *const b) {
+    const ws_gen_sequence *const left = (const ws_gen_sequence *)a;
+    const ws_gen_sequence *const right = (const ws_gen_sequence *)b;
+    if (left->length != right->length) {
+        return (left->length < right->length) - (left->length > right->length);
+    }
+    return ws_gen_compare_savings(a, b);
+}
+
+/* Adds up the counts of the same sequence in different profiles, and drops every sequence
+ * which can't be a superinstruction. Returns the amount of sequences left.
+ */
+static size_t ws_gen_merge(ws_gen_profile *const profile) {
+    qsort(profile->sequences, profile->length, sizeof(ws_gen_sequence), ws_gen_compare_types);
+
+    size_t length = 0;
+    ws_gen_sequence *sequence;
+    int usable;
+    for(size_t i = 0; i < profile->length; i++) {
+        sequence = profile->sequences + i;
+        if (length && !ws_gen_compare_types(sequence, profile->sequences + length - 1)) {
+            profile->sequences[length - 1].count += sequence->count;
+            continue;
+        }
+
+        usable = 1;
+        for(unsigned int j = 0; j < sequence->length; j++) {
+            usable &= ws_gen_snippets[sequence->types[j]] && !ws_gen_uses_callstack(sequence->types[j]) &&
+                      (j == sequence->length - 1 || ws_gen_falls_through(sequence->types[j]));
+        }
+        if (usable) {
+            profile->sequences[length++] = *sequence;
+        }
+    }
+    return length;
+}
+
+/* Checks if b lies inside a, or is a shifted by one command. Those are mostly counted in the same runs of commands
+ * as a, which a superinstruction for a already covers.
+ */
+static int ws_gen_overlaps(const ws_gen_sequence *const a, const ws_gen_sequence *const b) {
+    for(unsigned int start = 0; start + b->length <= a->length; start++) {
+        if (!memcmp(a->types + start, b->types, b->length)) {
+            return 1;
+        }
+    }
+
+    const unsigned int shared = ((a->length < b->length)? a->length: b->length) - 1;
+    return shared >= WS_PROFILE_MIN && (!memcmp(a->types + a->length - shared, b->types, shared) ||
+                                        !memcmp(b->types + b->length - shared, a->types, shared));
+}
+
+/* Picks up to count of the sequences with the most savings that don't overlap each other,
+ * moves them to the front and returns how many there are.
+ */
+static size_t ws_gen_select(ws_gen_sequence *const sequences, const size_t length, const size_t count) {
+    qsort(sequences, length, sizeof(ws_gen_sequence), ws_gen_compare_savings);
+
+    size_t selected = 0;
+    int overlaps;
+    for(size_t i = 0; i < length && selected < count; i++) {
+        overlaps = 0;
+        for(size_t j = 0; j < selected; j++) {
+            overlaps |= ws_gen_overlaps(sequences + j, sequences + i) || ws_gen_overlaps(sequences + i, sequences + j);
+        }
+        if (!overlaps) {
+            sequences[selected++] = sequences[i];
+        }
+    }
+    return selected;
+}
+
+static void ws_gen_write_names(FILE *const file, const ws_gen_sequence *const sequence) {
+    for(unsigned int j = 0; j < sequence->length; j++) {
+        fprintf(file, (j? " %s": "%s"), ws_command_names[sequence->types[j]].data);
+    }
+}
+
+// writes a snippet as lines of the WS_SUPER_CASES macro, with $ replaced by the part-th command after the superinstruction
+static void ws_gen_write_snippet(FILE *const file, const char *snippet, const unsigned int part) {
+    while (*snippet) {
+        fputs("            ", file);
+        for(; *snippet != '\n'; snippet++) {
+            if (*snippet == '$') {
+                fprintf(file, "(current_command + %u)", part + 1);
+            } else {
+                fputc(*snippet, file);
+            }
+        }
+        fputs(" \\\n", file);
+        snippet++;
+    }
+}
+
+static void ws_gen_write(FILE *const file, const ws_gen_sequence *const sequences, const size_t count, const int profiles) {
+    fprintf(file, "/* wssuper.h, the superinstructions found in %d profile%s. generated by wsgen.c, don't edit */\n",
+            profiles, (profiles == 1)? "": "s");
+    fputs("#ifndef WSSUPER_H\n#define WSSUPER_H\n\n#include \"wstypes.h\"\n\n", file);
+    fprintf(file, "#define WS_SUPER_COUNT %zu\n\n\n\n", count);
+
+    fputs("/* The commands every superinstruction stands for, the longest ones first.\n", file);
+    fputs(" * ws_super in wsoptimizer.h puts superinstruction + i in front of every run of the commands of entry i.\n */\n", file);
+    fputs("const unsigned char ws_super_lengths[WS_SUPER_COUNT + !WS_SUPER_COUNT] = {\n   ", file);
+    for(size_t i = 0; i < count; i++) {
+        fprintf(file, " %u%s", sequences[i].length, (i + 1 < count)? ",": "");
+    }
+    fprintf(file, "%s\n};\n\n", count? "": " 0");
+
+    fprintf(file, "const unsigned char ws_super_patterns[WS_SUPER_COUNT + !WS_SUPER_COUNT][%d] = {\n", WS_PROFILE_MAX);
+    for(size_t i = 0; i < count; i++) {
+        fputs("    {", file);
+        for(unsigned int j = 0; j < sequences[i].length; j++) {
+            fprintf(file, (j? ", %s": "%s"), ws_command_names[sequences[i].types[j]].data);
+        }
+        fprintf(file, "}%s // %llu times\n", (i + 1 < count)? ",": "", (unsigned long long)sequences[i].count);
+    }
+    fprintf(file, "%s};\n\n\n\n", count? "": "    {0}\n");
+
+    fputs("/* The cases of ws_execute_super in wsmachine.h that run them. The commands of a superinstruction follow it,\n", file);
+    fputs(" * so every part moves next_index past its own command first.\n */\n", file);
+    fputs("#define WS_SUPER_CASES \\\n", file);
+    for(size_t i = 0; i < count; i++) {
+        fprintf(file, "        case superinstruction + %zu: /* ", i);
+        ws_gen_write_names(file, sequences + i);
+        fputs(" */ \\\n", file);
+        for(unsigned int j = 0; j < sequences[i].length; j++) {
+            fputs("            *next_index += 1; \\\n", file);
+            ws_gen_write_snippet(file, ws_gen_snippets[sequences[i].types[j]], j);
+        }
+        fputs("            break; \\\n", file);
+    }
+    fputs("\n#endif\n", file);
+}
+
+int main(int argc, char **argv) {
+    const char *template_name = "src/wssuper.template";
+    const char *output_name = NULL;
+    size_t count = WS_SUPER_LIMIT;
+
+    ws_gen_profile profile;
+    profile.size = 64;
+    profile.length = 0;
+    profile.sequences = (ws_gen_sequence *)malloc(sizeof(ws_gen_sequence) * profile.size);
+    int profiles = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = strtoul(argv[++i], NULL, 10);
+            if (count > WS_SUPER_LIMIT) {
+                printf("at most %d superinstructions are possible\n", WS_SUPER_LIMIT);
+                exit(EXIT_FAILURE);
+            }
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            template_name = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (argv[i][0] == '-') {
+            printf("unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        } else {
+            // the template has to be known before the profiles can be filtered, so they're read afterwards
+            profiles++;
+        }
+    }
+
+    if (!profiles) {
+        printf("expected at least one profile\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ws_gen_read_template(template_name);
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-') {
+            i++;
+        } else {
+            ws_gen_read_profile(&profile, argv[i]);
+        }
+    }
+
+    count = ws_gen_select(profile.sequences, ws_gen_merge(&profile), count);
+    qsort(profile.sequences, count, sizeof(ws_gen_sequence), ws_gen_compare_length);
+
+    FILE *const output = output_name? fopen(output_name, "w"): stdout;
+    if (!output) {
+        printf("failure to open %s\n", output_name);
+        exit(EXIT_FAILURE);
+    }
+    ws_gen_write(output, profile.sequences, count, profiles);
+    if (output_name) {
+        fclose(output);
+    }
+
+    for(int type = 0; type < COMMANDTYPES; type++) {
+        free(ws_gen_snippets[type]);
+    }
+    free(profile.sequences);
+    return 0;
+}
@@ -0,0 +1,337 @@
+/* wsimage.h, frozen images: optimized programs stored in their .wsc exactly as the machine runs them */
+#ifndef WSIMAGE_H
+#define WSIMAGE_H
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "wstypes.h"
+#include "wsparser.h"
+#include "wsserialize.h"
+#include "wssuper.h"
+
+#define WS_IMAGE_MAGIC "\x7FWSF"
+#define WS_IMAGE_MAGIC_SIZE 4
+#define WS_IMAGE_ORDER 0x01020304U //reads differently on a machine of another byte order
+#define WS_IMAGE_ALIGN 8
+
+
+
+/* A frozen image is the command array of an optimized program as it is in memory, followed by its slots and the
+ * digits and strings these point to. A pointer is stored as its offset from the start of the image, and the
+ * relocations are the offsets of all of them, so loading an image is mapping the .wsc and adding the address it
+ * got mapped at to those. Programs without big ints, printstring or slots have none, and start without reading
+ * any of their commands. The pages only get read once the machine gets to them, and stay shared between all
+ * processes running the program, as the machine never writes to them.
+ *
+ * The layout of the commands depends on the build, so an image only loads in a build which has the same
+ * byte order, command size, command types and superinstructions as the one that wrote it. It also stores the
+ * optimization level, the size, mtime and hash of the source, and the CRC-32 of the whole image with the checksum
+ * itself taken as 0. Before running it every command gets checked as well: its type has to be one the optimizer
+ * can leave behind, its jump has to stay inside the program, its slot has to exist, its immediates and ints have
+ * to be in range with their digits or string inside the image, and a superinstruction has to be followed by the
+ * commands it stands for. An image which fails any of it doesn't load, so the source gets compiled again and
+ * replaces it. Only the unchecked commands are taken on trust, as proving them safe takes the stack verifier.
+ *
+ * -O3 programs can't be frozen, as their register code is a tree of pointers.
+ */
+typedef struct {
+    char magic[WS_IMAGE_MAGIC_SIZE];
+    uint32_t order;
+    uint64_t build;
+    int32_t flags;
+    int32_t optimize;
+    ws_cache_header source;
+    uint64_t size;
+    uint64_t length;
+    uint64_t commands;
+    uint64_t slots_length;
+    uint64_t slots;
+    uint64_t relocations_length;
+    uint64_t relocations;
+    uint32_t checksum;
+    int32_t reserved;
+} ws_image_header;
+
+// a mapped image, which the commands and slots of a program loaded from it point into
+typedef struct ws_image {
+    char *base;
+    size_t size;
+} ws_image;
+
+
+
+/* Describes the build: the command size, the command names in their order and the superinstructions
+ */
+static uint64_t ws_image_build(void) {
+    ws_serializing_buffer build;
+    serializing_buffer_initialize(&build);
+    serialize_varint(sizeof(ws_command), &build);
+    serialize_varint(COMMANDTYPES, &build);
+    for(size_t i = 0; i < COMMANDTYPES; i++) {
+        serialize_bytes(ws_command_names[i].data, ws_command_names[i].length + 1, &build);
+    }
+    serialize_bytes((const char *)ws_super_patterns, sizeof(ws_super_patterns), &build);
+
+    const uint64_t hash = ws_serializing_hash(build.buffer, build.index);
+    free(build.buffer);
+    return hash;
+}
+
+static size_t ws_image_align(ws_serializing_buffer *const image) {
+    reserve_space(image, WS_IMAGE_ALIGN);
+    while (image->index % WS_IMAGE_ALIGN) {
+        image->buffer[image->index++] = 0;
+    }
+    return image->index;
+}
+
+/* Copies length bytes of data behind the image, and stores their offset in the pointer at field
+ */
+static void ws_image_relocate(ws_serializing_buffer *const image, ws_serializing_buffer *const relocations,
+                              const size_t field, const char *const data, const size_t length) {
+    const uintptr_t offset = ws_image_align(image);
+    const uint64_t relocation = field;
+    serialize_bytes(data, length, image);
+    memcpy(image->buffer + field, &offset, sizeof(uintptr_t));
+    serialize_bytes((const char *)&relocation, sizeof(uint64_t), relocations);
+}
+
+static void ws_image_relocate_int(ws_serializing_buffer *const image, ws_serializing_buffer *const relocations,
+                                  const size_t field, const ws_int *const number) {
+    if (number->length) {
+        ws_image_relocate(image, relocations, field + offsetof(ws_int, digits),
+                          (const char *)number->digits, sizeof(digit) * ACTLEN(number->length));
+    }
+}
+
+/* Writes the frozen image of program, which was optimized at level optimize, to compiledname
+ */
+void ws_image_store(const char *const compiledname, const ws_program *const program,
+                    const ws_cache_header *const source, const int optimize) {
+    ws_serializing_buffer image, relocations;
+    serializing_buffer_initialize(&image);
+    serializing_buffer_initialize(&relocations);
+
+    ws_image_header header;
+    memset(&header, 0, sizeof(ws_image_header));
+    serialize_bytes((const char *)&header, sizeof(ws_image_header), &image);
+
+    header.commands = ws_image_align(&image);
+    serialize_bytes((const char *)program->commands, sizeof(ws_command) * program->length, &image);
+    header.slots = ws_image_align(&image);
+    serialize_bytes((const char *)program->slots, sizeof(ws_int) * program->slots_length, &image);
+
+    for(size_t i = 0; i < program->length; i++) {
+        const ws_command *const command = program->commands + i;
+        const size_t field = header.commands + sizeof(ws_command) * i;
+        if (ws_parameter_map[command->type]) {
+            ws_image_relocate_int(&image, &relocations, field + offsetof(ws_command, parameter), &command->parameter);
+        } else if (command->type == printstring) {
+            ws_image_relocate(&image, &relocations, field + offsetof(ws_command, string.data),
+                              command->string.data, command->string.length);
+        }
+#if DEBUG
+        memset(image.buffer + field + offsetof(ws_command, text), 0, sizeof(ws_string));
+#endif
+    }
+    for(size_t i = 0; i < program->slots_length; i++) {
+        ws_image_relocate_int(&image, &relocations, header.slots + sizeof(ws_int) * i, program->slots + i);
+    }
+
+    header.relocations = ws_image_align(&image);
+    serialize_bytes(relocations.buffer, relocations.index, &image);
+    free(relocations.buffer);
+
+    memcpy(header.magic, WS_IMAGE_MAGIC, WS_IMAGE_MAGIC_SIZE);
+    header.order = WS_IMAGE_ORDER;
+    header.build = ws_image_build();
+    header.flags = program->flags;
+    header.optimize = optimize;
+    header.source = *source;
+    header.size = image.index;
+    header.length = program->length;
+    header.slots_length = program->slots_length;
+    header.relocations_length = relocations.index / sizeof(uint64_t);
+    memcpy(image.buffer, &header, sizeof(ws_image_header));
+    header.checksum = ws_crc32(0, image.buffer, image.index);
+    memcpy(image.buffer, &header, sizeof(ws_image_header));
+
+    ws_cache_write(compiledname, image.buffer, image.index);
+    free(image.buffer);
+}
+
+// whether count items of size fit in the image at offset
+static int ws_image_fits(const ws_image_header *const header, const uint64_t offset, const uint64_t count,
+                         const size_t size) {
+    return offset % WS_IMAGE_ALIGN == 0 && offset <= header->size && count <= (header->size - offset) / size;
+}
+
+// whether length bytes at pointer lie inside the image
+static int ws_image_inside(const char *const base, const uint64_t size, const void *const pointer,
+                           const uint64_t length) {
+    const uintptr_t offset = (uintptr_t)pointer - (uintptr_t)base;
+    return (uintptr_t)pointer >= (uintptr_t)base && offset <= size && length <= size - offset;
+}
+
+// whether value fits in a small int, as all immediates which aren't a slot or a reserve do
+static int ws_image_small(const sdigit value) {
+    return value > -(sdigit)WS_INT_BASE && value < (sdigit)WS_INT_BASE;
+}
+
+// a big int has at least one digit, and all of them inside the image
+static int ws_image_int_valid(const char *const base, const uint64_t size, const ws_int *const number) {
+    if (!number->length) {
+        return ws_image_small(number->data);
+    }
+    const uint64_t length = ACTLEN(number->length);
+    if (!length || (uintptr_t)number->digits % sizeof(digit) ||
+        !ws_image_inside(base, size, number->digits, sizeof(digit) * length)) {
+        return 0;
+    }
+    for(uint64_t i = 0; i < length; i++) {
+        if (number->digits[i] >= WS_INT_BASE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Checks command i of the commands of an image once its pointers are relocated
+ */
+static int ws_image_command_valid(const char *const base, const ws_image_header *const header,
+                                  const ws_command *const commands, const size_t i) {
+    const ws_command *const command = commands + i;
+    const unsigned int type = (unsigned int)command->type;
+    // lazy jumps and register code never end up in an image
+    if (type >= superinstruction + WS_SUPER_COUNT || (type >= lazycall && type <= lazyjumpifnegative) ||
+        type == registerblock) {
+        return 0;
+    }
+
+    if (type >= superinstruction) {
+        const unsigned int super = type - superinstruction;
+        if (ws_super_lengths[super] >= header->length - i) {
+            return 0;
+        }
+        for(unsigned int j = 0; j < ws_super_lengths[super]; j++) {
+            if ((unsigned int)commands[i + 1 + j].type != ws_super_patterns[super][j]) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    // a jump to the end of the program ends it
+    if (type != label && ws_label_map[type] && command->jumpoffset > header->length) {
+        return 0;
+    }
+    const int slot = type == getslot || type == setslot || type == storeslot || type == decrementslotjumpifnonzero ||
+                     type == incrementslotjumpifless;
+    if (slot && (command->immediate < 0 || (uint64_t)command->immediate >= header->slots_length)) {
+        return 0;
+    }
+    if (ws_immediate_map[type] && !slot && type != reserve && !ws_image_small(command->immediate)) {
+        return 0;
+    }
+    if (type == reserve && command->immediate < 0) {
+        return 0;
+    }
+    if ((type == incrementslotjumpifless || type == fillheap || type == copyheap) && !ws_image_small(command->limit)) {
+        return 0;
+    }
+    if (type == multiplyadd && !ws_image_small(command->addend)) {
+        return 0;
+    }
+    if (ws_parameter_map[type]) {
+        return ws_image_int_valid(base, header->size, &command->parameter);
+    }
+    if (type == printstring) {
+        return ws_image_inside(base, header->size, command->string.data, command->string.length);
+    }
+    return 1;
+}
+
+/* Loads the frozen image in compiledname into program if it was stored by this build, at level optimize,
+ * for a source of the size, mtime and hash in source, and is intact. Returns 0 otherwise.
+ */
+int ws_image_load(ws_program *const program, const char *const compiledname, const ws_cache_header *const source,
+                  const int optimize) {
+    const int descriptor = open(compiledname, O_RDONLY);
+    if (descriptor < 0) {
+        return 0;
+    }
+
+    ws_image_header header;
+    struct stat status;
+    const int valid = !fstat(descriptor, &status) &&
+                      pread(descriptor, &header, sizeof(ws_image_header), 0) == sizeof(ws_image_header) &&
+                      !memcmp(header.magic, WS_IMAGE_MAGIC, WS_IMAGE_MAGIC_SIZE) &&
+                      header.order == WS_IMAGE_ORDER &&
+                      header.build == ws_image_build() &&
+                      header.optimize == optimize &&
+                      header.source.size == source->size &&
+                      header.source.mtime == source->mtime &&
+                      header.source.hash == source->hash &&
+                      header.size == (uint64_t)status.st_size &&
+                      ws_image_fits(&header, header.commands, header.length, sizeof(ws_command)) &&
+                      ws_image_fits(&header, header.slots, header.slots_length, sizeof(ws_int)) &&
+                      ws_image_fits(&header, header.relocations, header.relocations_length, sizeof(uint64_t));
+    char *const base = valid? (char *)mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0):
+                              (char *)MAP_FAILED;
+    close(descriptor);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+
+    // the checksum was computed with itself as 0
+    ws_image_header zeroed = header;
+    zeroed.checksum = 0;
+    int intact = ws_crc32(ws_crc32(0, (const char *)&zeroed, sizeof(ws_image_header)),
+                          base + sizeof(ws_image_header), header.size - sizeof(ws_image_header)) == header.checksum;
+
+    uint64_t field;
+    uintptr_t pointer;
+    for(size_t i = 0; intact && i < header.relocations_length; i++) {
+        memcpy(&field, base + header.relocations + sizeof(uint64_t) * i, sizeof(uint64_t));
+        intact = field <= header.size - sizeof(uintptr_t);
+        if (intact) {
+            memcpy(&pointer, base + field, sizeof(uintptr_t));
+            pointer += (uintptr_t)base;
+            memcpy(base + field, &pointer, sizeof(uintptr_t));
+        }
+    }
+
+    const ws_command *const commands = (const ws_command *)(base + header.commands);
+    const ws_int *const slots = (const ws_int *)(base + header.slots);
+    for(size_t i = 0; intact && i < header.length; i++) {
+        intact = ws_image_command_valid(base, &header, commands, i);
+    }
+    for(size_t i = 0; intact && i < header.slots_length; i++) {
+        intact = ws_image_int_valid(base, header.size, slots + i);
+    }
+    if (!intact) {
+        munmap(base, header.size);
+        return 0;
+    }
+    // nothing writes to it from here on
+    mprotect(base, header.size, PROT_READ);
+
+    ws_program_initialize(program, 0);
+    program->flags = header.flags;
+    program->length = header.length;
+    program->commands = (ws_command *)(base + header.commands);
+    program->slots = (ws_int *)(base + header.slots);
+    program->slots_length = header.slots_length;
+    program->image = (ws_image *)malloc(sizeof(ws_image));
+    program->image->base = base;
+    program->image->size = header.size;
+    return 1;
+}
+
+void ws_image_finish(ws_image *const image) {
+    munmap(image->base, image->size);
+    free(image);
+}
+
+#endif
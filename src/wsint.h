@@ -59,8 +59,9 @@ void ws_int_normalize(ws_int *const input) {
     }*/
     if (i != length) {
         input->digits = realloc(input->digits, sizeof(digit) * i);
-        input->length = i | (input->length & WS_INT_SIGN_MASK);
     }
+    // zero has no sign, so -0 can't come out of any operation
+    input->length = i | ((i == 1 && !input->digits[0])? 0: input->length & WS_INT_SIGN_MASK);
 }
 
 void ws_int_free(const ws_int *const input) {
@@ -320,9 +321,14 @@ void ws_int_print(const ws_int *const input) {
 }
 
 void ws_int_input(ws_int *const result) { 
-    // not ready for bigints yet
-    int input;
-    scanf("%d", &input);
+    // not ready for bigints yet, and 0 if there's no number
+    int input = 0;
+    if (ws_input_source) {
+        const size_t position = ws_input_number(ws_input_source, ws_input_source->start, &input);
+        ws_input_source->start = (position == WS_INPUT_MORE)? ws_input_source->end: position;
+    } else {
+        fscanf(WS_INPUT, "%d", &input);
+    }
     ws_int_from_int(result, input, NULL);
 }
 
@@ -385,7 +391,14 @@ void ws_int_multiply(ws_int *const result, const ws_int *left, const ws_int *rig
     }
 }
 
+int ws_int_iszero(const ws_int *);
+
 void ws_int_divide(ws_int *const result, const ws_int *left, const ws_int *right) {
+    // a bigint can be 0 too, with a single digit which is 0
+    if (ws_int_iszero(right)) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "division by zero\n");
+    }
+
     // currently no bigint support yet
     if (!left->length && !right->length) {
 
@@ -409,12 +422,16 @@ void ws_int_divide(ws_int *const result, const ws_int *left, const ws_int *right
         }
 
         // bigint algorithm
-        printf("not implemented yet");
-        exit(EXIT_FAILURE);
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "not implemented yet");
     }
 }
 
 void ws_int_modulo(ws_int *const result, const ws_int *left, const ws_int *right) {
+    // a bigint can be 0 too, with a single digit which is 0
+    if (ws_int_iszero(right)) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "modulo by zero\n");
+    }
+
     // currently no bigint support yet
     if (!left->length && !right->length) {
 
@@ -438,8 +455,7 @@ void ws_int_modulo(ws_int *const result, const ws_int *left, const ws_int *right
         }
 
         // bigint algorithm
-        printf("not implemented yet");
-        exit(EXIT_FAILURE);
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "not implemented yet");
     }
 }
 
@@ -486,7 +502,7 @@ static void ws_long_sub(ws_int *const result, const ws_int *left, const ws_int *
 
     //ensure that left is the largest one to guarantee no sign changes
     size_t i = (leftlength > rightlength)? leftlength: rightlength;
-    for (i-- ; i >= 0; i--) {
+    while (i-- > 0) {
         if (i >= rightlength && left->digits[i]) {
             sign = 1;
             break;
@@ -629,6 +645,85 @@ void ws_int_subtract(ws_int *const result, const ws_int *left, const ws_int *rig
     }
 }
 
+/* Computes input * multiplier + addend in place, where multiplier and addend have to be small (between -2^30 and 2^30).
+ * The result is the same as that of ws_int_multiply followed by ws_int_add, also in which representation it ends up,
+ * but it takes a single pass over the digits and only reallocates when the number grows.
+ */
+void ws_int_muladd_small(ws_int *const input, const sdigit multiplier, const sdigit addend) {
+    if (!input->length) {
+        stwodigits product = (stwodigits)input->data * multiplier;
+        if (product < (stwodigits)WS_INT_BASE && -product < (stwodigits)WS_INT_BASE) {
+            ws_int_from_int(input, (sdigit)product + addend, NULL);
+            return;
+        }
+        ws_int_from_long(input, product, NULL);
+
+    } else {
+        size_t length = ACTLEN(input->length);
+        const digit factor = (multiplier < 0)? -multiplier: multiplier;
+        twodigits carry = 0;
+
+        for (size_t i = 0; i < length; i++) {
+            carry += (twodigits)input->digits[i] * factor;
+            input->digits[i] = (digit)(carry & WS_INT_MASK);
+            carry >>= WS_INT_SHIFT;
+        }
+        if (carry) {
+            input->digits = (digit *)realloc(input->digits, sizeof(digit) * (length + 1));
+            input->digits[length++] = (digit)carry;
+        }
+        input->length = length | ((multiplier < 0)? (input->length ^ WS_INT_SIGN_MASK) & WS_INT_SIGN_MASK: input->length & WS_INT_SIGN_MASK);
+    }
+
+    // the product is a big int now, which gets the addend added to its magnitude or subtracted from it
+    size_t length = ACTLEN(input->length);
+    const digit sign = input->length & WS_INT_SIGN_MASK;
+    const digit magnitude = (addend < 0)? -addend: addend;
+    if (!magnitude) {
+        ws_int_normalize(input);
+        return;
+    }
+
+    if (!sign == !(addend < 0)) {
+        digit carry = magnitude;
+        for (size_t i = 0; i < length && carry; i++) {
+            carry += input->digits[i];
+            input->digits[i] = carry & WS_INT_MASK;
+            carry >>= WS_INT_SHIFT;
+        }
+        if (carry) {
+            input->digits = (digit *)realloc(input->digits, sizeof(digit) * (length + 1));
+            input->digits[length++] = carry;
+            input->length = length | sign;
+        }
+
+    } else {
+        // the magnitude can only be smaller than the addend if it fits in the lowest digit
+        int smaller = input->digits[0] <= magnitude;
+        for (size_t i = 1; i < length && smaller; i++) {
+            smaller = !input->digits[i];
+        }
+
+        if (smaller) {
+            input->digits[0] = magnitude - input->digits[0];
+            for (size_t i = 1; i < length; i++) {
+                input->digits[i] = 0;
+            }
+            // a difference of zero has no sign, otherwise it's the sign of the addend
+            input->length = length | ((input->digits[0])? sign ^ WS_INT_SIGN_MASK: 0);
+
+        } else {
+            digit borrow = magnitude;
+            for (size_t i = 0; i < length && borrow; i++) {
+                borrow = input->digits[i] - borrow;
+                input->digits[i] = borrow & WS_INT_MASK;
+                borrow = (borrow >> WS_INT_SHIFT) & 1;
+            }
+        }
+    }
+    ws_int_normalize(input);
+}
+
 unsigned int ws_int_hash(const ws_int *const input) {
     if (!input->length) {
         return (unsigned int)input->data;
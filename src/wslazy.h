@@ -0,0 +1,258 @@
+/* wslazy.h, parses and compiles whitespace while it is being executed */
+#ifndef WSLAZY_H
+#define WSLAZY_H
+
+#include "wstypes.h"
+#include "wsparser.h"
+#include "wscompiler.h"
+
+#define WS_LAZY_LABELS_SIZE 32
+#define WS_LAZY_LABELS_RESIZE 2
+
+#define WS_LAZY_UNPARSED ((size_t)-1) //ws_lazy_label.index of a label which hasn't been reached yet
+#define WS_LAZY_MISSING WS_MAP_MISSING //lazy jump to a label which doesn't exist
+#define WS_LAZY_END ((size_t)-2)      //lazy jump to the end of the text
+
+
+
+/* For huge programs of which only a small part gets executed parsing and compiling
+ * everything up front is a waste of time. Instead, ws_lazy_parse only does a quick scan
+ * for the positions of all labels in the text, and parses the code starting at position 0.
+ *
+ * Code is parsed in blocks. A block continues until an unconditional jump, endsubroutine or endprogram,
+ * or until it runs into a label which has already been parsed, at which point a jump to that label is emitted.
+ * Label commands themselves are not emitted as they don't do anything after compilation.
+ * This way every part of the text is parsed at most once.
+ *
+ * Jumps to labels which have been parsed are compiled immediately, any other jumps become
+ * lazy jumps which refer to an entry in the label table. When a lazy jump is executed, ws_lazy_resolve
+ * parses the target block if necessary and turns the lazy jump into a normal jump.
+ */
+
+// the location of a label in the text and the command it ended up at
+typedef struct {
+    size_t position;
+    size_t index;
+} ws_lazy_label;
+
+// the state needed to parse a program while it executes
+typedef struct ws_lazy {
+    ws_program *program;
+    size_t size;
+
+    ws_string text;
+    ws_map map;
+    ws_lazy_label *labels;
+    size_t labels_length;
+    size_t labels_size;
+
+    ws_string parameter;
+    size_t parameter_size;
+} ws_lazy;
+
+/* forward declarations
+ */
+static void ws_lazy_scan(ws_lazy *);
+static void ws_lazy_parse_block(ws_lazy *, size_t);
+static ws_command *ws_lazy_emit(ws_lazy *);
+void ws_lazy_finish(ws_lazy *);
+
+
+
+/* Sets up program for lazy execution. The lazy program takes ownership of text.
+ */
+void ws_lazy_parse(ws_program *const program, const ws_string *const text) {
+    ws_lazy *const lazy = (ws_lazy *)malloc(sizeof(ws_lazy));
+    lazy->program = program;
+    lazy->size = COMMAND_ARRAY_SIZE;
+    lazy->text = *text;
+
+    lazy->labels_size = WS_LAZY_LABELS_SIZE;
+    lazy->labels_length = 0;
+    lazy->labels = (ws_lazy_label *)malloc(sizeof(ws_lazy_label) * WS_LAZY_LABELS_SIZE);
+    ws_map_initialize(&lazy->map, 0);
+
+    lazy->parameter_size = PARAMETER_CACHE_SIZE;
+    lazy->parameter.data = (char *)malloc(PARAMETER_CACHE_SIZE);
+    lazy->parameter.length = 0;
+
+    ws_program_initialize(program, COMMAND_ARRAY_SIZE);
+    program->length = 0;
+    program->lazy = lazy;
+
+    ws_lazy_scan(lazy);
+    ws_lazy_parse_block(lazy, 0);
+
+    // labels are resolved while executing
+    program->flags |= 0x1;
+}
+
+/* Called by ws_execute when it encounters a lazy jump at index.
+ * Afterwards the command at index is a normal jump, and can be executed again.
+ */
+void ws_lazy_resolve(ws_lazy *const lazy, const size_t index) {
+    ws_command *command = lazy->program->commands + index;
+
+    if (command->jumpoffset == WS_LAZY_END) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "code index out of bounds\n");
+    }
+    if (command->jumpoffset == WS_LAZY_MISSING) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "label not found at command %zu\n", index);
+    }
+
+    ws_lazy_label *const target = lazy->labels + command->jumpoffset;
+    if (target->index == WS_LAZY_UNPARSED) {
+        target->index = lazy->program->length;
+        ws_lazy_parse_block(lazy, target->position);
+
+        // parsing can move the command array
+        command = lazy->program->commands + index;
+    }
+
+    command->type = command->type - lazycall + call;
+    command->jumpoffset = target->index;
+}
+
+void ws_lazy_finish(ws_lazy *const lazy) {
+    ws_map_finish(&lazy->map);
+    free(lazy->labels);
+    ws_string_free(&lazy->parameter);
+    ws_string_free(&lazy->text);
+    free(lazy);
+}
+
+
+
+/* The label scan only decodes commands and skips over their parameters,
+ * except for labels which get added to the label table. it still catches any
+ * duplicate labels or invalid commands before the program starts running.
+ */
+static void ws_lazy_scan(ws_lazy *const lazy) {
+    const ws_string *const text = &lazy->text;
+    ws_command_type type;
+    ws_label current_label;
+    char *parameter_end_loc;
+
+    size_t i = ws_skip_comments(text, 0);
+    if (i == text->length) {
+        ws_fail(WS_STATUS_PARSE_ERROR, "empty program\n");
+    }
+
+    while (i < text->length) {
+        i = ws_parse_command_type(&type, text, i);
+
+        if (type == label) {
+            i = ws_parse_parameter(&lazy->parameter, &lazy->parameter_size, text, i);
+            ws_label_from_whitespace(&current_label, &lazy->parameter);
+
+            if (lazy->labels_length == lazy->labels_size) {
+                lazy->labels_size *= WS_LAZY_LABELS_RESIZE;
+                lazy->labels = (ws_lazy_label *)realloc(lazy->labels, sizeof(ws_lazy_label) * lazy->labels_size);
+            }
+
+            // the map owns the label from now on
+            if (ws_map_set(&lazy->map, &current_label, lazy->labels_length)) {
+                ws_fail(WS_STATUS_PARSE_ERROR, "duplicate label found at position %zu\n", i);
+            }
+            lazy->labels[lazy->labels_length].position = i;
+            lazy->labels[lazy->labels_length].index = WS_LAZY_UNPARSED;
+            lazy->labels_length++;
+
+        } else if (ws_parameter_map[type] || ws_label_map[type]) {
+            parameter_end_loc = (char *)memchr(text->data + i, BREAK, text->length - i);
+            if (!parameter_end_loc) {
+                ws_fail(WS_STATUS_PARSE_ERROR, "end of buffer while parsing parameter at position %zu\n", i);
+            }
+            i = (size_t)(parameter_end_loc - text->data) + 1;
+        }
+
+        i = ws_skip_comments(text, i);
+    }
+}
+
+/* Returns the index of the label in the label table or WS_LAZY_MISSING, and frees the label
+ */
+static size_t ws_lazy_find_label(ws_lazy *const lazy, const ws_label *const target) {
+    const size_t found = ws_map_get(&lazy->map, target);
+    ws_label_free(target);
+    return found;
+}
+
+static void ws_lazy_parse_block(ws_lazy *const lazy, size_t i) {
+    const ws_string *const text = &lazy->text;
+    ws_program *const program = lazy->program;
+    ws_command *current_node;
+    ws_lazy_label *current_label;
+    size_t found;
+
+    i = ws_skip_comments(text, i);
+    while (i < text->length) {
+        current_node = ws_lazy_emit(lazy);
+        i = ws_parse_command(current_node, &lazy->parameter, &lazy->parameter_size, text, i);
+
+        switch (current_node->type) {
+
+            case label:
+                // labels don't get emitted, but mark where their code ended up
+                program->length--;
+#if DEBUG
+                ws_string_free(&current_node->text);
+#endif
+                current_label = lazy->labels + ws_lazy_find_label(lazy, &current_node->label);
+
+                if (current_label->index == WS_LAZY_UNPARSED) {
+                    current_label->index = program->length;
+                    break;
+                }
+
+                // we ran into code which was parsed before
+                current_node = ws_lazy_emit(lazy);
+                current_node->type = jump;
+                current_node->jumpoffset = current_label->index;
+                return;
+
+            case call:
+            case jump:
+            case jumpifzero:
+            case jumpifnegative:
+                found = ws_lazy_find_label(lazy, &current_node->label);
+
+                if (found != WS_LAZY_MISSING && lazy->labels[found].index != WS_LAZY_UNPARSED) {
+                    current_node->jumpoffset = lazy->labels[found].index;
+                } else {
+                    current_node->type = current_node->type - call + lazycall;
+                    current_node->jumpoffset = found;
+                }
+
+                if (current_node->type == jump || current_node->type == lazyjump) {
+                    return;
+                }
+                break;
+
+            case endsubroutine:
+            case endprogram:
+                return;
+
+            default:
+                break;
+        }
+    }
+
+    // we fell off the end of the text, which is only an error if it actually gets executed
+    current_node = ws_lazy_emit(lazy);
+    current_node->type = lazyjump;
+    current_node->jumpoffset = WS_LAZY_END;
+}
+
+/* bumps the length of the command array and returns the new command
+ */
+static ws_command *ws_lazy_emit(ws_lazy *const lazy) {
+    ws_program *const program = lazy->program;
+    if (program->length == lazy->size) {
+        lazy->size *= COMMAND_ARRAY_RESIZE;
+        program->commands = (ws_command *)realloc(program->commands, sizeof(ws_command) * lazy->size);
+    }
+    return program->commands + program->length++;
+}
+
+#endif
@@ -0,0 +1,773 @@
+/* wslockstep.h, runs one program on several inputs in lockstep, doing their small int arithmetic across vector lanes */
+#ifndef WSLOCKSTEP_H
+#define WSLOCKSTEP_H
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "wstypes.h"
+#include "wsmachine.h"
+#include "wsvm.h"
+
+#define WS_LOCKSTEP_LANES 8
+#define WS_LOCKSTEP_DEPTH 64 //how much of the top of the stacks is kept in lanes
+#define WS_LOCKSTEP_WINDOW 1024 //how often the machines run on their own before lockstep is checked for paying off
+#define WS_LOCKSTEP_RATIO 16 //how many commands have to be done in lanes per time they do that for it to pay off
+
+
+
+/* Up to WS_LOCKSTEP_LANES machines which run the same program on different inputs take the same path through it for
+ * as long as their inputs don't make them branch differently. While they do, a command only has to be dispatched once
+ * for all of them, and the tops of their stacks are kept as a stack of ws_lanes, one sdigit per machine, so pushing,
+ * stack shuffling, arithmetic and comparisons are done for all of them with a few vector instructions (AVX2 when the
+ * compiler targets it, plain loops otherwise). The stacks of the machines themselves hold what lies below that.
+ *
+ * Anything that isn't a small int leaves this: a machine which would read a big int into the lanes, or whose result
+ * wouldn't be a small int, drops out and redoes the command on its own. When a conditional jump splits the machines
+ * up, the larger part stays in lockstep and the others drop out at their side of the jump. Commands which aren't done
+ * in lanes, such as reading, printing and the heap, run one machine at a time, and the machines which end up somewhere
+ * else than the first one after that drop out as well. Switching back and forth costs more than dispatching, so when
+ * the machines keep running on their own, they all drop out. Machines which dropped out run on their own once the
+ * ones in lockstep are done. Register blocks and superinstructions are skipped in favour of the commands they stand for,
+ * which follow them.
+ */
+typedef struct {
+    sdigit lanes[WS_LOCKSTEP_LANES];
+} ws_lanes;
+
+typedef struct {
+    ws_vm *vms[WS_LOCKSTEP_LANES];
+    unsigned int active;    //the machines which are still in lockstep, a bit per lane
+    size_t next_index;      //where all of those are
+    size_t depth;
+    size_t steps;           //the commands dispatched and the times the machines ran on their own, in this window
+    size_t runs;
+    ws_lanes stack[WS_LOCKSTEP_DEPTH];
+} ws_lockstep;
+
+// the commands done in lockstep, or skipped for the commands after them. The others run a machine at a time.
+const char ws_lockstep_map[COMMANDTYPES] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 0, 0, 1, 1,
+    1, 1, 1,
+    1, 1, 1, 1,
+    0, 0,
+    0, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+/* forward declarations
+ */
+void ws_lockstep_run(ws_vm *const *, size_t);
+static void ws_lockstep_loop(ws_lockstep *, const ws_program *);
+static void ws_lockstep_drop(ws_lockstep *, unsigned int, size_t);
+static int ws_lockstep_need(ws_lockstep *, size_t);
+static void ws_lockstep_room(ws_lockstep *);
+static void ws_lockstep_branch(ws_lockstep *, unsigned int, size_t);
+static void ws_lockstep_scalar(ws_lockstep *);
+
+
+
+/* The operations on ws_lanes. The arithmetic ones return the lanes whose result isn't a small int, the comparisons
+ * the lanes for which they hold, both a bit per lane. Lanes of machines which aren't in lockstep hold anything.
+ */
+#if defined(__AVX2__)
+
+#define WS_LANES_LOAD(x) _mm256_loadu_si256((const __m256i *)(x)->lanes)
+#define WS_LANES_STORE(x, v) _mm256_storeu_si256((__m256i *)(x)->lanes, (v))
+#define WS_LANES_MASK(v) ((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(v)))
+
+static WS_INLINE unsigned int ws_lanes_big(const __m256i value) {
+    const __m256i max = _mm256_set1_epi32((sdigit)WS_INT_BASE - 1);
+    const __m256i min = _mm256_set1_epi32(1 - (sdigit)WS_INT_BASE);
+    return WS_LANES_MASK(_mm256_or_si256(_mm256_cmpgt_epi32(value, max), _mm256_cmpgt_epi32(min, value)));
+}
+
+static WS_INLINE void ws_lanes_broadcast(ws_lanes *const result, const sdigit value) {
+    WS_LANES_STORE(result, _mm256_set1_epi32(value));
+}
+
+static WS_INLINE unsigned int ws_lanes_add(ws_lanes *const result, const ws_lanes *const left, const ws_lanes *const right) {
+    const __m256i sum = _mm256_add_epi32(WS_LANES_LOAD(left), WS_LANES_LOAD(right));
+    WS_LANES_STORE(result, sum);
+    return ws_lanes_big(sum);
+}
+
+static WS_INLINE unsigned int ws_lanes_subtract(ws_lanes *const result, const ws_lanes *const left, const ws_lanes *const right) {
+    const __m256i difference = _mm256_sub_epi32(WS_LANES_LOAD(left), WS_LANES_LOAD(right));
+    WS_LANES_STORE(result, difference);
+    return ws_lanes_big(difference);
+}
+
+// the even and odd lanes are multiplied into 64 bits separately, and checked before they're put back together
+static WS_INLINE unsigned int ws_lanes_multiply(ws_lanes *const result, const ws_lanes *const left, const ws_lanes *const right) {
+    const __m256i a = WS_LANES_LOAD(left), b = WS_LANES_LOAD(right);
+    const __m256i even = _mm256_mul_epi32(a, b);
+    const __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+    const __m256i max = _mm256_set1_epi64x((stwodigits)WS_INT_BASE - 1);
+    const __m256i min = _mm256_set1_epi64x(1 - (stwodigits)WS_INT_BASE);
+    const __m256i evenbig = _mm256_or_si256(_mm256_cmpgt_epi64(even, max), _mm256_cmpgt_epi64(min, even));
+    const __m256i oddbig = _mm256_or_si256(_mm256_cmpgt_epi64(odd, max), _mm256_cmpgt_epi64(min, odd));
+    WS_LANES_STORE(result, _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA));
+    return WS_LANES_MASK(_mm256_blend_epi32(evenbig, oddbig, 0xAA));
+}
+
+static WS_INLINE void ws_lanes_negate(ws_lanes *const value) {
+    WS_LANES_STORE(value, _mm256_sub_epi32(_mm256_setzero_si256(), WS_LANES_LOAD(value)));
+}
+
+static WS_INLINE unsigned int ws_lanes_zero(const ws_lanes *const value) {
+    return WS_LANES_MASK(_mm256_cmpeq_epi32(WS_LANES_LOAD(value), _mm256_setzero_si256()));
+}
+
+static WS_INLINE unsigned int ws_lanes_negative(const ws_lanes *const value) {
+    return WS_LANES_MASK(WS_LANES_LOAD(value));
+}
+
+static WS_INLINE unsigned int ws_lanes_equal(const ws_lanes *const left, const ws_lanes *const right) {
+    return WS_LANES_MASK(_mm256_cmpeq_epi32(WS_LANES_LOAD(left), WS_LANES_LOAD(right)));
+}
+
+static WS_INLINE unsigned int ws_lanes_less(const ws_lanes *const left, const ws_lanes *const right) {
+    return WS_LANES_MASK(_mm256_cmpgt_epi32(WS_LANES_LOAD(right), WS_LANES_LOAD(left)));
+}
+
+#else
+
+static WS_INLINE unsigned int ws_lanes_big(const stwodigits value, const size_t lane) {
+    return (unsigned int)(value >= (stwodigits)WS_INT_BASE || -value >= (stwodigits)WS_INT_BASE) << lane;
+}
+
+static WS_INLINE void ws_lanes_broadcast(ws_lanes *const result, const sdigit value) {
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        result->lanes[i] = value;
+    }
+}
+
+static WS_INLINE unsigned int ws_lanes_add(ws_lanes *const result, const ws_lanes *const left, const ws_lanes *const right) {
+    unsigned int big = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        const stwodigits sum = (stwodigits)left->lanes[i] + right->lanes[i];
+        result->lanes[i] = (sdigit)sum;
+        big |= ws_lanes_big(sum, i);
+    }
+    return big;
+}
+
+static WS_INLINE unsigned int ws_lanes_subtract(ws_lanes *const result, const ws_lanes *const left, const ws_lanes *const right) {
+    unsigned int big = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        const stwodigits difference = (stwodigits)left->lanes[i] - right->lanes[i];
+        result->lanes[i] = (sdigit)difference;
+        big |= ws_lanes_big(difference, i);
+    }
+    return big;
+}
+
+static WS_INLINE unsigned int ws_lanes_multiply(ws_lanes *const result, const ws_lanes *const left, const ws_lanes *const right) {
+    unsigned int big = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        const stwodigits product = (stwodigits)left->lanes[i] * right->lanes[i];
+        result->lanes[i] = (sdigit)product;
+        big |= ws_lanes_big(product, i);
+    }
+    return big;
+}
+
+static WS_INLINE void ws_lanes_negate(ws_lanes *const value) {
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        value->lanes[i] = (sdigit)-(stwodigits)value->lanes[i];
+    }
+}
+
+static WS_INLINE unsigned int ws_lanes_zero(const ws_lanes *const value) {
+    unsigned int mask = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        mask |= (unsigned int)(value->lanes[i] == 0) << i;
+    }
+    return mask;
+}
+
+static WS_INLINE unsigned int ws_lanes_negative(const ws_lanes *const value) {
+    unsigned int mask = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        mask |= (unsigned int)(value->lanes[i] < 0) << i;
+    }
+    return mask;
+}
+
+static WS_INLINE unsigned int ws_lanes_equal(const ws_lanes *const left, const ws_lanes *const right) {
+    unsigned int mask = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        mask |= (unsigned int)(left->lanes[i] == right->lanes[i]) << i;
+    }
+    return mask;
+}
+
+static WS_INLINE unsigned int ws_lanes_less(const ws_lanes *const left, const ws_lanes *const right) {
+    unsigned int mask = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        mask |= (unsigned int)(left->lanes[i] < right->lanes[i]) << i;
+    }
+    return mask;
+}
+
+#endif
+
+static unsigned int ws_lanes_count(unsigned int mask) {
+    unsigned int count = 0;
+    for(; mask; mask &= mask - 1) {
+        count++;
+    }
+    return count;
+}
+
+static size_t ws_lanes_first(const unsigned int mask) {
+    size_t lane = 0;
+    while (!(mask & (1U << lane))) {
+        lane++;
+    }
+    return lane;
+}
+
+
+
+/* Runs the length machines, which have to run the same program from the same place, until they're done. Machines
+ * which aren't running, or are fed by a ws_input, just run on their own. The output of every machine gets flushed.
+ */
+void ws_lockstep_run(ws_vm *const *const vms, size_t length) {
+    ws_lockstep *const lockstep = (ws_lockstep *)malloc(sizeof(ws_lockstep));
+    if (length > WS_LOCKSTEP_LANES) {
+        length = WS_LOCKSTEP_LANES;
+    }
+
+    lockstep->active = 0;
+    lockstep->depth = 0;
+    lockstep->steps = 0;
+    lockstep->runs = 0;
+    lockstep->next_index = length? vms[0]->next_index: 0;
+    for(size_t i = 0; i < length; i++) {
+        lockstep->vms[i] = vms[i];
+        if (vms[i]->status == WS_STATUS_RUNNING && !vms[i]->source && vms[i]->program == vms[0]->program &&
+            vms[i]->next_index == lockstep->next_index) {
+            lockstep->active |= 1U << i;
+        }
+    }
+    // a single machine is better off without the bookkeeping
+    if (ws_lanes_count(lockstep->active) > 1) {
+        ws_lockstep_loop(lockstep, vms[0]->program);
+    }
+
+    for(size_t i = 0; i < length; i++) {
+        ws_vm_run(vms[i]);
+    }
+    free(lockstep);
+}
+
+static void ws_lockstep_loop(ws_lockstep *const lockstep, const ws_program *const program) {
+    ws_lanes result;
+    unsigned int big;
+
+    while (lockstep->active) {
+        const size_t index = lockstep->next_index;
+        if (index >= program->length) {
+            // fails the way it does for a machine on its own
+            ws_lockstep_scalar(lockstep);
+            continue;
+        }
+        const ws_command *const command = program->commands + index;
+        ws_lanes *const stack = lockstep->stack;
+        lockstep->steps++;
+
+        switch ((int)command->type) {
+            case label:
+                lockstep->next_index++;
+                continue;
+
+            case push:
+            case pushunchecked:
+                if (command->parameter.length) {
+                    break;
+                }
+                ws_lockstep_room(lockstep);
+                ws_lanes_broadcast(stack + lockstep->depth++, command->parameter.data);
+                lockstep->next_index++;
+                continue;
+
+            case pushpush:
+                if (command->parameter.length) {
+                    break;
+                }
+                ws_lockstep_room(lockstep);
+                ws_lanes_broadcast(stack + lockstep->depth++, command->immediate);
+                ws_lockstep_room(lockstep);
+                ws_lanes_broadcast(stack + lockstep->depth++, command->parameter.data);
+                lockstep->next_index++;
+                continue;
+
+            case duplicate:
+            case duplicateunchecked:
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                ws_lockstep_room(lockstep);
+                stack[lockstep->depth] = stack[lockstep->depth - 1];
+                lockstep->depth++;
+                lockstep->next_index++;
+                continue;
+
+            case copy:
+            case copyunchecked: {
+                // copy counts from the bottom of the stack, which only the lanes hold if it's above what the machines hold
+                if (command->parameter.length) {
+                    break;
+                }
+                ws_lockstep_room(lockstep);
+                const size_t base = lockstep->vms[ws_lanes_first(lockstep->active)]->stack.length;
+                if (command->parameter.data < 0 || (size_t)command->parameter.data < base ||
+                    (size_t)command->parameter.data - base >= lockstep->depth) {
+                    break;
+                }
+                stack[lockstep->depth] = stack[command->parameter.data - base];
+                lockstep->depth++;
+                lockstep->next_index++;
+                continue;
+            }
+
+            case swap:
+            case swapunchecked:
+                if (!ws_lockstep_need(lockstep, 2)) {
+                    break;
+                }
+                result = stack[lockstep->depth - 1];
+                stack[lockstep->depth - 1] = stack[lockstep->depth - 2];
+                stack[lockstep->depth - 2] = result;
+                lockstep->next_index++;
+                continue;
+
+            case discard:
+            case discardunchecked:
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                lockstep->depth--;
+                lockstep->next_index++;
+                continue;
+
+            case slide:
+            case slideunchecked:
+                if (command->parameter.length || command->parameter.data < 0 ||
+                    command->parameter.data >= WS_LOCKSTEP_DEPTH ||
+                    !ws_lockstep_need(lockstep, (size_t)command->parameter.data + 1)) {
+                    break;
+                }
+                stack[lockstep->depth - 1 - command->parameter.data] = stack[lockstep->depth - 1];
+                lockstep->depth -= command->parameter.data;
+                lockstep->next_index++;
+                continue;
+
+            case add:
+            case addunchecked:
+            case subtract:
+            case subtractunchecked:
+            case multiply:
+            case multiplyunchecked:
+                if (!ws_lockstep_need(lockstep, 2)) {
+                    break;
+                }
+                if (command->type == add || command->type == addunchecked) {
+                    big = ws_lanes_add(&result, stack + lockstep->depth - 2, stack + lockstep->depth - 1);
+                } else if (command->type == subtract || command->type == subtractunchecked) {
+                    big = ws_lanes_subtract(&result, stack + lockstep->depth - 2, stack + lockstep->depth - 1);
+                } else {
+                    big = ws_lanes_multiply(&result, stack + lockstep->depth - 2, stack + lockstep->depth - 1);
+                }
+                ws_lockstep_drop(lockstep, big, index);
+                stack[lockstep->depth - 2] = result;
+                lockstep->depth--;
+                lockstep->next_index++;
+                continue;
+
+            case addimmediate:
+            case multiplyadd: {
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                ws_lanes operand;
+                big = 0;
+                result = stack[lockstep->depth - 1];
+                if (command->type == multiplyadd) {
+                    ws_lanes_broadcast(&operand, command->immediate);
+                    big = ws_lanes_multiply(&result, &result, &operand);
+                    ws_lanes_broadcast(&operand, command->addend);
+                } else {
+                    ws_lanes_broadcast(&operand, command->immediate);
+                }
+                big |= ws_lanes_add(&result, &result, &operand);
+                ws_lockstep_drop(lockstep, big, index);
+                stack[lockstep->depth - 1] = result;
+                lockstep->next_index++;
+                continue;
+            }
+
+            case negate:
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                ws_lanes_negate(stack + lockstep->depth - 1);
+                lockstep->next_index++;
+                continue;
+
+            case jump:
+                lockstep->next_index = command->jumpoffset;
+                continue;
+
+            case jumpifzero:
+            case jumpifzerounchecked:
+            case duplicatejumpifzero:
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                big = ws_lanes_zero(stack + lockstep->depth - 1);
+                if (command->type != duplicatejumpifzero) {
+                    lockstep->depth--;
+                }
+                ws_lockstep_branch(lockstep, big, command->jumpoffset);
+                continue;
+
+            case jumpifnegative:
+            case jumpifnegativeunchecked:
+            case duplicatejumpifnegative:
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                big = ws_lanes_negative(stack + lockstep->depth - 1);
+                if (command->type != duplicatejumpifnegative) {
+                    lockstep->depth--;
+                }
+                ws_lockstep_branch(lockstep, big, command->jumpoffset);
+                continue;
+
+            case jumpifequal:
+            case jumpifless:
+                if (!ws_lockstep_need(lockstep, 2)) {
+                    break;
+                }
+                if (command->type == jumpifequal) {
+                    big = ws_lanes_equal(stack + lockstep->depth - 2, stack + lockstep->depth - 1);
+                } else {
+                    big = ws_lanes_less(stack + lockstep->depth - 2, stack + lockstep->depth - 1);
+                }
+                lockstep->depth -= 2;
+                ws_lockstep_branch(lockstep, big, command->jumpoffset);
+                continue;
+
+            case jumpifequalimmediate:
+            case jumpiflessimmediate:
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                ws_lanes_broadcast(&result, command->immediate);
+                if (command->type == jumpifequalimmediate) {
+                    big = ws_lanes_equal(stack + lockstep->depth - 1, &result);
+                } else {
+                    big = ws_lanes_less(stack + lockstep->depth - 1, &result);
+                }
+                lockstep->depth--;
+                ws_lockstep_branch(lockstep, big, command->jumpoffset);
+                continue;
+
+            case decrementjumpifnonzero:
+            case incrementjumpifnotequal: {
+                if (!ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                ws_lanes operand;
+                ws_lanes_broadcast(&operand, (command->type == decrementjumpifnonzero)? -command->immediate: 1);
+                big = ws_lanes_add(&result, stack + lockstep->depth - 1, &operand);
+                ws_lockstep_drop(lockstep, big, index);
+                stack[lockstep->depth - 1] = result;
+                if (command->type == decrementjumpifnonzero) {
+                    big = ~ws_lanes_zero(&result);
+                } else {
+                    ws_lanes_broadcast(&operand, command->immediate);
+                    big = ~ws_lanes_equal(&result, &operand);
+                }
+                ws_lockstep_branch(lockstep, big, command->jumpoffset);
+                continue;
+            }
+
+            // the heap of every machine is its own, so slots are done a machine at a time, but without leaving lockstep
+            case getslot:
+                ws_lockstep_room(lockstep);
+                for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+                    if (!(lockstep->active & (1U << i))) {
+                        continue;
+                    }
+                    const ws_heap_entry *const slot = lockstep->vms[i]->heap.slots + command->immediate;
+                    if (!slot->initialized || slot->value.length) {
+                        ws_lockstep_drop(lockstep, 1U << i, index);
+                    } else {
+                        stack[lockstep->depth].lanes[i] = slot->value.data;
+                    }
+                }
+                lockstep->depth++;
+                lockstep->next_index++;
+                continue;
+
+            case setslot:
+            case storeslot:
+                if (command->type == storeslot? command->parameter.length != 0: !ws_lockstep_need(lockstep, 1)) {
+                    break;
+                }
+                for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+                    if (!(lockstep->active & (1U << i))) {
+                        continue;
+                    }
+                    ws_heap_entry *const slot = lockstep->vms[i]->heap.slots + command->immediate;
+                    if (slot->initialized) {
+                        ws_int_free(&slot->value);
+                    }
+                    ws_int_from_int(&slot->value, (command->type == storeslot)? command->parameter.data:
+                                    stack[lockstep->depth - 1].lanes[i], NULL);
+                    slot->initialized = 1;
+                }
+                if (command->type == setslot) {
+                    lockstep->depth--;
+                }
+                lockstep->next_index++;
+                continue;
+
+            case decrementslotjumpifnonzero:
+            case incrementslotjumpifless:
+                big = 0;
+                for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+                    if (!(lockstep->active & (1U << i))) {
+                        continue;
+                    }
+                    ws_heap *const heap = &lockstep->vms[i]->heap;
+                    size_t next_index = index + 1;
+                    if (!heap->slots[command->immediate].initialized) {
+                        ws_lockstep_drop(lockstep, 1U << i, index);
+                    } else if (command->type == decrementslotjumpifnonzero) {
+                        ws_command_decrementslotjumpifnonzero(&next_index, heap, command->immediate, command->jumpoffset);
+                    } else {
+                        ws_command_incrementslotjumpifless(&next_index, heap, command->immediate, command->limit,
+                                                           command->jumpoffset);
+                    }
+                    if (next_index != index + 1) {
+                        big |= 1U << i;
+                    }
+                }
+                ws_lockstep_branch(lockstep, big, command->jumpoffset);
+                continue;
+
+            case call: {
+                for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+                    if (lockstep->active & (1U << i)) {
+                        size_t next_index = index + 1;
+                        ws_command_call(&next_index, &lockstep->vms[i]->callstack, command->jumpoffset);
+                    }
+                }
+                lockstep->next_index = command->jumpoffset;
+                continue;
+            }
+
+            case endsubroutine: {
+                // all of them called from the same place, unless one of them fails here
+                const ws_callstack *const callstack = &lockstep->vms[ws_lanes_first(lockstep->active)]->callstack;
+                if (!callstack->length) {
+                    break;
+                }
+                lockstep->next_index = callstack->entries[callstack->length - 1];
+                for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+                    if (lockstep->active & (1U << i)) {
+                        lockstep->vms[i]->callstack.length--;
+                    }
+                }
+                continue;
+            }
+
+            case reserve:
+                for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+                    if (lockstep->active & (1U << i)) {
+                        ws_command_reserve(&lockstep->vms[i]->stack, command->immediate + (sdigit)lockstep->depth);
+                    }
+                }
+                lockstep->next_index++;
+                continue;
+
+            case registerblock:
+                lockstep->next_index++;
+                continue;
+
+            default:
+                if (WS_IS_SUPER(command->type)) {
+                    lockstep->next_index++;
+                    continue;
+                }
+                break;
+        }
+
+        // the lanes may all have dropped out instead
+        if (lockstep->active) {
+            ws_lockstep_scalar(lockstep);
+        }
+    }
+}
+
+/* Takes the machines of lanes out of lockstep, to go on from next_index on their own.
+ */
+static void ws_lockstep_drop(ws_lockstep *const lockstep, unsigned int lanes, const size_t next_index) {
+    lanes &= lockstep->active;
+    for(size_t i = 0; lanes; i++) {
+        if (!(lanes & (1U << i))) {
+            continue;
+        }
+        ws_vm *const vm = lockstep->vms[i];
+        ws_int value;
+        for(size_t j = 0; j < lockstep->depth; j++) {
+            ws_int_from_int(&value, lockstep->stack[j].lanes[i], NULL);
+            ws_stack_spill(&vm->stack, &value);
+        }
+        vm->next_index = next_index;
+        lockstep->active &= ~(1U << i);
+        lanes &= ~(1U << i);
+    }
+}
+
+/* Makes sure the top amount items of the stacks are in the lanes. Returns 0 if a stack doesn't have them, as the
+ * command fails, or if one of the machines still in lockstep would need more than WS_LOCKSTEP_DEPTH.
+ */
+static int ws_lockstep_need(ws_lockstep *const lockstep, const size_t amount) {
+    if (lockstep->depth >= amount) {
+        return 1;
+    }
+    const size_t missing = amount - lockstep->depth;
+    if (amount > WS_LOCKSTEP_DEPTH) {
+        return 0;
+    }
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        if ((lockstep->active & (1U << i)) && lockstep->vms[i]->stack.length < missing) {
+            return 0;
+        }
+    }
+
+    // machines with a big int among them can't be in lanes
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        if (!(lockstep->active & (1U << i))) {
+            continue;
+        }
+        const ws_stack *const stack = &lockstep->vms[i]->stack;
+        for(size_t j = stack->length - missing; j < stack->length; j++) {
+            if (stack->entries[j].length) {
+                ws_lockstep_drop(lockstep, 1U << i, lockstep->next_index);
+                break;
+            }
+        }
+    }
+    if (!lockstep->active) {
+        return 0;
+    }
+
+    memmove(lockstep->stack + missing, lockstep->stack, sizeof(ws_lanes) * lockstep->depth);
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        if (!(lockstep->active & (1U << i))) {
+            continue;
+        }
+        ws_stack *const stack = &lockstep->vms[i]->stack;
+        stack->length -= missing;
+        for(size_t j = 0; j < missing; j++) {
+            lockstep->stack[j].lanes[i] = stack->entries[stack->length + j].data;
+        }
+    }
+    lockstep->depth = amount;
+    return 1;
+}
+
+// makes room for one more item in the lanes, by moving the bottom half of them to the stacks of the machines
+static void ws_lockstep_room(ws_lockstep *const lockstep) {
+    if (lockstep->depth < WS_LOCKSTEP_DEPTH) {
+        return;
+    }
+    const size_t spilled = WS_LOCKSTEP_DEPTH / 2;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        if (!(lockstep->active & (1U << i))) {
+            continue;
+        }
+        ws_stack *const stack = &lockstep->vms[i]->stack;
+        ws_int value;
+        for(size_t j = 0; j < spilled; j++) {
+            ws_int_from_int(&value, lockstep->stack[j].lanes[i], NULL);
+            ws_stack_spill(stack, &value);
+        }
+    }
+    lockstep->depth -= spilled;
+    memmove(lockstep->stack, lockstep->stack + spilled, sizeof(ws_lanes) * lockstep->depth);
+}
+
+/* Continues at dest with the lanes which take the jump, and after it with the others. If both happen, the larger part
+ * stays in lockstep.
+ */
+static void ws_lockstep_branch(ws_lockstep *const lockstep, unsigned int taken, const size_t dest) {
+    const size_t next_index = lockstep->next_index + 1;
+    taken &= lockstep->active;
+
+    if (taken && taken != lockstep->active) {
+        if (ws_lanes_count(taken) * 2 >= ws_lanes_count(lockstep->active)) {
+            ws_lockstep_drop(lockstep, lockstep->active & ~taken, next_index);
+        } else {
+            ws_lockstep_drop(lockstep, taken, dest);
+            taken = 0;
+        }
+    }
+    lockstep->next_index = taken? dest: next_index;
+}
+
+/* Runs the next command on each machine on its own, along with the commands after it up to one that is done in
+ * lockstep. The machines which end or fail there are done, and the ones which don't end up where the first one does
+ * drop out.
+ */
+static void ws_lockstep_scalar(ws_lockstep *const lockstep) {
+    const ws_program *const program = lockstep->vms[ws_lanes_first(lockstep->active)]->program;
+    const unsigned int lanes = lockstep->active;
+    ws_lockstep_drop(lockstep, lanes, lockstep->next_index);
+    lockstep->depth = 0;
+
+    size_t steps = 1;
+    while (lockstep->next_index + steps < program->length &&
+           !ws_lockstep_map[program->commands[lockstep->next_index + steps].type]) {
+        steps++;
+    }
+
+    int found = 0;
+    for(size_t i = 0; i < WS_LOCKSTEP_LANES; i++) {
+        if (!(lanes & (1U << i))) {
+            continue;
+        }
+        ws_vm *const vm = lockstep->vms[i];
+        if (ws_vm_advance(vm, steps, 0) != WS_STATUS_RUNNING) {
+            continue;
+        }
+        if (!found) {
+            lockstep->next_index = vm->next_index;
+            found = 1;
+        }
+        if (vm->next_index == lockstep->next_index) {
+            lockstep->active |= 1U << i;
+        }
+    }
+
+    // the stacks are all with the machines now, so they can just be left to themselves
+    if (++lockstep->runs == WS_LOCKSTEP_WINDOW) {
+        if (lockstep->steps < WS_LOCKSTEP_WINDOW * (WS_LOCKSTEP_RATIO + 1)) {
+            lockstep->active = 0;
+        }
+        lockstep->steps = 0;
+        lockstep->runs = 0;
+    }
+}
+
+#endif
@@ -2,6 +2,8 @@
 #define WSMACHINE_H
 
 #include "wstypes.h"
+#include "wsprofile.h"
+#include "wssuper.h"
 //#include "time.h"
 
 //data structures for ws intepretation runtime
@@ -15,6 +17,8 @@ typedef struct {
     size_t size;
     size_t length;
     ws_heap_entry *entries;
+    ws_heap_entry *slots;
+    size_t slots_length;
 } ws_heap;
 
 typedef struct {
@@ -32,17 +36,30 @@ typedef struct {
 /* Forward declarations of everything used in the main loop
  */
 void ws_heap_initialize(ws_heap *);
+void ws_heap_slots(ws_heap *, const ws_program *);
+void ws_heap_clear(ws_heap *);
 void ws_heap_finish(ws_heap *);
+static size_t ws_heap_insert_position(const ws_heap *, const ws_int *);
+static void ws_heap_resize(ws_heap *, size_t);
+void ws_heap_reserve(ws_heap *, size_t);
 void ws_heap_set(ws_heap *, const ws_int *, const ws_int *);
 void ws_heap_get(ws_int *, const ws_heap *, const ws_int *);
+int ws_heap_lookup(ws_int *, const ws_heap *, const ws_int *);
+static WS_INLINE void ws_heap_slot_set(ws_heap *, sdigit, const ws_int *);
+static WS_INLINE int ws_heap_slot_lookup(ws_int *, const ws_heap *, sdigit);
+static WS_NORETURN WS_NOINLINE void ws_heap_missing(const ws_int *, int);
+static WS_INLINE void ws_int_add_immediate(ws_int *, sdigit);
 
 void ws_stack_initialize(ws_stack *);
+void ws_stack_clear(ws_stack *);
 void ws_stack_finish(ws_stack *);
+static void ws_stack_spill(ws_stack *, const ws_int *);
 
 void ws_heap_print(ws_heap *);
 void ws_stack_print(ws_stack *);
 
 void ws_callstack_initialize(ws_callstack *);
+void ws_callstack_clear(ws_callstack *);
 void ws_callstack_finish(ws_callstack *);
 
 static void ws_command_push(ws_stack *, const ws_int *);
@@ -69,143 +86,424 @@ static void ws_command_printnum(ws_stack *);
 static void ws_command_inputchar(ws_stack *, ws_heap *);
 static void ws_command_inputnum(ws_stack *, ws_heap *);
 
+static void ws_command_addimmediate(ws_stack *, sdigit, ws_command_type);
+static void ws_command_negate(ws_stack *);
+static void ws_command_jumpifequal(size_t *, ws_stack *, size_t);
+static void ws_command_jumpifless(size_t *, ws_stack *, size_t);
+static void ws_command_jumpifequalimmediate(size_t *, ws_stack *, sdigit, size_t);
+static void ws_command_jumpiflessimmediate(size_t *, ws_stack *, sdigit, size_t);
+static void ws_command_duplicatejumpifzero(size_t *, ws_stack *, size_t);
+static void ws_command_duplicatejumpifnegative(size_t *, ws_stack *, size_t);
+static void ws_command_getimmediate(ws_stack *, ws_heap *, const ws_int *);
+static void ws_command_setimmediate(ws_stack *, ws_heap *, const ws_int *);
+static void ws_command_storeimmediate(ws_heap *, const ws_int *, sdigit);
+static void ws_command_getslot(ws_stack *, ws_heap *, sdigit);
+static void ws_command_setslot(ws_stack *, ws_heap *, sdigit);
+static void ws_command_storeslot(ws_heap *, sdigit, const ws_int *);
+static WS_INLINE void ws_command_decrementjumpifnonzero(size_t *, ws_stack *, sdigit, size_t, ws_command_type);
+static WS_INLINE void ws_command_incrementjumpifnotequal(size_t *, ws_stack *, sdigit, size_t, ws_command_type);
+static WS_INLINE void ws_command_decrementslotjumpifnonzero(size_t *, ws_heap *, sdigit, size_t);
+static WS_INLINE void ws_command_incrementslotjumpifless(size_t *, ws_heap *, sdigit, sdigit, size_t);
+static void ws_command_fillheap(size_t *, ws_stack *, ws_heap *, sdigit, sdigit, size_t);
+static void ws_command_copyheap(size_t *, ws_stack *, ws_heap *, sdigit, sdigit, size_t);
+static void ws_command_printstring(const ws_string *);
+static void ws_command_multiplyadd(ws_stack *, sdigit, sdigit);
+static void ws_command_pushpush(ws_stack *, sdigit, const ws_int *);
+static int ws_compare(const ws_int *, const ws_int *);
+static int ws_compare_int(const ws_int *, sdigit);
+
+static void ws_command_push_unchecked(ws_stack *, const ws_int *);
+static void ws_command_duplicate_unchecked(ws_stack *);
+static void ws_command_copy_unchecked(ws_stack *, const ws_int *);
+static void ws_command_swap_unchecked(ws_stack *);
+static void ws_command_discard_unchecked(ws_int *, ws_stack *);
+static void ws_command_slide_unchecked(ws_stack *, const ws_int *);
+static void ws_command_add_unchecked(ws_stack *);
+static void ws_command_subtract_unchecked(ws_stack *);
+static void ws_command_multiply_unchecked(ws_stack *);
+static void ws_command_divide_unchecked(ws_stack *);
+static void ws_command_modulo_unchecked(ws_stack *);
+static void ws_command_set_unchecked(ws_stack *, ws_heap *);
+static void ws_command_get_unchecked(ws_stack *, ws_heap *);
+static void ws_command_jumpifzero_unchecked(size_t *, ws_stack *, size_t);
+static void ws_command_jumpifnegative_unchecked(size_t *, ws_stack *, size_t);
+static void ws_command_printchar_unchecked(ws_stack *);
+static void ws_command_printnum_unchecked(ws_stack *);
+static void ws_command_reserve(ws_stack *, sdigit);
+
+static size_t ws_command_registerblock(const ws_program *, const ws_command *, size_t, ws_stack *, ws_heap *);
+
+static void ws_execute_exit(int);
+
+
+
+/* Runs the superinstructions of wssuper.h. They're kept out of ws_execute_command, as they'd make the code of its
+ * other cases worse, and the dispatches they save make up for the call.
+ */
+static WS_NOINLINE int ws_execute_super(const ws_command *const current_command, size_t *const next_index,
+                                        ws_stack *const stack, ws_heap *const heap) {
+    // whichever superinstructions wsgen.c picked needn't use all of them
+    (void)stack;
+    (void)heap;
+    // the superinstructions aren't named in ws_command_type
+    switch ((int)current_command->type) {
+
+        WS_SUPER_CASES
+
+        default:
+            return 2;
+    }
+    return 0;
+}
 
-
-/* And now the actual main loop of the program 
+/* Runs a single command, returns 0 to continue, 1 at the end of the program and 2 for invalid commands
  */
-void ws_execute(const ws_program *const program) {
+static WS_INLINE int ws_execute_command(const ws_program *const program, const ws_command *const current_command, size_t *const next_index,
+                                     ws_stack *const stack, ws_heap *const heap, ws_callstack *const callstack) {
+    switch (current_command->type) {
 
-    if (!(program->flags & 0x1)) {
-        printf("This program has not been compiled yet");
-        exit(EXIT_FAILURE);
-    }
-    
-    // initialize the heap
-    ws_heap heap;
-    ws_heap_initialize(&heap);
+        case push:
+            ws_command_push(stack, &current_command->parameter);
+            break;
 
-    // and the stack
-    ws_stack stack;
-    ws_stack_initialize(&stack);
+        case duplicate:
+            ws_command_duplicate(stack);
+            break;
 
-    // and the callstack
-    ws_callstack callstack;
-    ws_callstack_initialize(&callstack);
+        case copy:
+            ws_command_copy(stack, &current_command->parameter);
+            break;
 
-    size_t next_index = 0;
-    ws_command *current_command;
+        case swap:
+            ws_command_swap(stack);
+            break;
 
-    //size_t commands_executed = 0;
-    //clock_t thetime = clock();
+        case discard:
+            ws_command_discard(NULL, stack);
+            break;
 
-    int exitcode = 0;
+        case slide:
+            ws_command_slide(stack, &current_command->parameter);
+            break;
 
-    while (!exitcode) {
-        current_command = program->commands + next_index;
-        next_index++;
-        //commands_executed++;
+        case add:
+            ws_command_add(stack);
+            break;
 
-        switch (current_command->type) {
+        case subtract:
+            ws_command_subtract(stack);
+            break;
 
-            case push:
-                ws_command_push(&stack, &current_command->parameter);
-                break;
+        case multiply:
+            ws_command_multiply(stack);
+            break;
 
-            case duplicate:
-                ws_command_duplicate(&stack);
-                break;
+        case divide:
+            ws_command_divide(stack);
+            break;
 
-            case copy:
-                ws_command_copy(&stack, &current_command->parameter);
-                break;
+        case modulo:
+            ws_command_modulo(stack);
+            break;
 
-            case swap:
-                ws_command_swap(&stack);
-                break;
+        case set:
+            ws_command_set(stack, heap);
+            break;
 
-            case discard:
-                ws_command_discard(NULL, &stack);
-                break;
+        case get:
+            ws_command_get(stack, heap);
+            break;
 
-            case slide:
-                ws_command_slide(&stack, &current_command->parameter);
-                break;
+        case label:
+            break;
 
-            case add:
-                ws_command_add(&stack);
-                break;
+        case call:
+            ws_command_call(next_index, callstack, current_command->jumpoffset);
+            break;
 
-            case subtract:
-                ws_command_subtract(&stack);
-                break;
+        case jump:
+            ws_command_jump(next_index, current_command->jumpoffset);
+            break;
 
-            case multiply:
-                ws_command_multiply(&stack);
-                break;
+        case jumpifzero:
+            ws_command_jumpifzero(next_index, stack, current_command->jumpoffset);
+            break;
 
-            case divide:
-                ws_command_divide(&stack);
-                break;
+        case jumpifnegative:
+            ws_command_jumpifnegative(next_index, stack, current_command->jumpoffset);
+            break;
 
-            case modulo:
-                ws_command_modulo(&stack);
-                break;
+        case endsubroutine:
+            ws_command_endsubroutine(next_index, callstack);
+            break;
 
-            case set:
-                ws_command_set(&stack, &heap);
-                break;
+        case endprogram:
+            ws_command_endprogram(callstack);
+            return 1;
 
-            case get:
-                ws_command_get(&stack, &heap);
-                break;
+        case printchar:
+            ws_command_printchar(stack);
+            break;
 
-            case label:
-                break;
+        case printnum:
+            ws_command_printnum(stack);
+            break;
 
-            case call:
-                ws_command_call(&next_index, &callstack, current_command->jumpoffset);
-                break;
+        case inputchar:
+            ws_command_inputchar(stack, heap);
+            break;
 
-            case jump:
-                ws_command_jump(&next_index, current_command->jumpoffset);
-                break;
+        case inputnum:
+            ws_command_inputnum(stack, heap);
+            break;
 
-            case jumpifzero:
-                ws_command_jumpifzero(&next_index, &stack, current_command->jumpoffset);
-                break;
+        case addimmediate:
+            ws_command_addimmediate(stack, current_command->immediate, current_command->operation);
+            break;
 
-            case jumpifnegative:
-                ws_command_jumpifnegative(&next_index, &stack, current_command->jumpoffset);
-                break;
+        case negate:
+            ws_command_negate(stack);
+            break;
 
-            case endsubroutine:
-                ws_command_endsubroutine(&next_index, &callstack);
-                break;
+        case jumpifequal:
+            ws_command_jumpifequal(next_index, stack, current_command->jumpoffset);
+            break;
 
-            case endprogram:
-                ws_command_endprogram(&callstack);
-                exitcode = 1;
-                break;
+        case jumpifless:
+            ws_command_jumpifless(next_index, stack, current_command->jumpoffset);
+            break;
 
-            case printchar:
-                ws_command_printchar(&stack);
-                break;
+        case jumpifequalimmediate:
+            ws_command_jumpifequalimmediate(next_index, stack, current_command->immediate, current_command->jumpoffset);
+            break;
 
-            case printnum:
-                ws_command_printnum(&stack);
-                break;
+        case jumpiflessimmediate:
+            ws_command_jumpiflessimmediate(next_index, stack, current_command->immediate, current_command->jumpoffset);
+            break;
 
-            case inputchar:
-                ws_command_inputchar(&stack, &heap);
-                break;
+        case duplicatejumpifzero:
+            ws_command_duplicatejumpifzero(next_index, stack, current_command->jumpoffset);
+            break;
 
-            case inputnum:
-                ws_command_inputnum(&stack, &heap);
-                break;
+        case duplicatejumpifnegative:
+            ws_command_duplicatejumpifnegative(next_index, stack, current_command->jumpoffset);
+            break;
 
-            default:
-                exitcode = 2;
-                break;
+        case getimmediate:
+            ws_command_getimmediate(stack, heap, &current_command->parameter);
+            break;
+
+        case setimmediate:
+            ws_command_setimmediate(stack, heap, &current_command->parameter);
+            break;
+
+        case storeimmediate:
+            ws_command_storeimmediate(heap, &current_command->parameter, current_command->immediate);
+            break;
+
+        case getslot:
+            ws_command_getslot(stack, heap, current_command->immediate);
+            break;
+
+        case setslot:
+            ws_command_setslot(stack, heap, current_command->immediate);
+            break;
+
+        case storeslot:
+            ws_command_storeslot(heap, current_command->immediate, &current_command->parameter);
+            break;
+
+        case decrementjumpifnonzero:
+            ws_command_decrementjumpifnonzero(next_index, stack, current_command->immediate, current_command->jumpoffset,
+                                              current_command->operation);
+            break;
+
+        case incrementjumpifnotequal:
+            ws_command_incrementjumpifnotequal(next_index, stack, current_command->immediate, current_command->jumpoffset,
+                                               current_command->operation);
+            break;
+
+        case decrementslotjumpifnonzero:
+            ws_command_decrementslotjumpifnonzero(next_index, heap, current_command->immediate, current_command->jumpoffset);
+            break;
+
+        case incrementslotjumpifless:
+            ws_command_incrementslotjumpifless(next_index, heap, current_command->immediate, current_command->limit,
+                                               current_command->jumpoffset);
+            break;
+
+        case fillheap:
+            ws_command_fillheap(next_index, stack, heap, current_command->immediate, current_command->limit,
+                                current_command->jumpoffset);
+            break;
+
+        case copyheap:
+            ws_command_copyheap(next_index, stack, heap, current_command->immediate, current_command->limit,
+                                current_command->jumpoffset);
+            break;
+
+        case printstring:
+            ws_command_printstring(&current_command->string);
+            break;
+
+        case multiplyadd:
+            ws_command_multiplyadd(stack, current_command->immediate, current_command->addend);
+            break;
+
+        case pushpush:
+            ws_command_pushpush(stack, current_command->immediate, &current_command->parameter);
+            break;
+
+        case pushunchecked:
+            ws_command_push_unchecked(stack, &current_command->parameter);
+            break;
+
+        case duplicateunchecked:
+            ws_command_duplicate_unchecked(stack);
+            break;
+
+        case copyunchecked:
+            ws_command_copy_unchecked(stack, &current_command->parameter);
+            break;
+
+        case swapunchecked:
+            ws_command_swap_unchecked(stack);
+            break;
+
+        case discardunchecked:
+            ws_command_discard_unchecked(NULL, stack);
+            break;
+
+        case slideunchecked:
+            ws_command_slide_unchecked(stack, &current_command->parameter);
+            break;
+
+        case addunchecked:
+            ws_command_add_unchecked(stack);
+            break;
+
+        case subtractunchecked:
+            ws_command_subtract_unchecked(stack);
+            break;
+
+        case multiplyunchecked:
+            ws_command_multiply_unchecked(stack);
+            break;
+
+        case divideunchecked:
+            ws_command_divide_unchecked(stack);
+            break;
+
+        case modulounchecked:
+            ws_command_modulo_unchecked(stack);
+            break;
+
+        case setunchecked:
+            ws_command_set_unchecked(stack, heap);
+            break;
+
+        case getunchecked:
+            ws_command_get_unchecked(stack, heap);
+            break;
+
+        case jumpifzerounchecked:
+            ws_command_jumpifzero_unchecked(next_index, stack, current_command->jumpoffset);
+            break;
+
+        case jumpifnegativeunchecked:
+            ws_command_jumpifnegative_unchecked(next_index, stack, current_command->jumpoffset);
+            break;
+
+        case printcharunchecked:
+            ws_command_printchar_unchecked(stack);
+            break;
+
+        case printnumunchecked:
+            ws_command_printnum_unchecked(stack);
+            break;
+
+        case reserve:
+            ws_command_reserve(stack, current_command->immediate);
+            break;
+
+        case registerblock:
+            *next_index = ws_command_registerblock(program, current_command, *next_index, stack, heap);
+            break;
+
+        case lazycall:
+        case lazyjump:
+        case lazyjumpifzero:
+        case lazyjumpifnegative:
+            //parse the target and execute the command again, now as a normal jump
+            ws_lazy_resolve(program->lazy, --*next_index);
+            break;
+
+        default:
+            if (WS_IS_SUPER(current_command->type)) {
+                return ws_execute_super(current_command, next_index, stack, heap);
+            }
+            return 2;
+    }
+    return 0;
+}
+
+/* And now the actual main loop of the program 
+ */
+/* The main loop. With a profile it counts the sequences of commands or the blocks that run, and runs the commands
+ * superinstructions stand for one by one so the profile sees those.
+ */
+static WS_INLINE void ws_execute_loop(const ws_program *const program, ws_profile *const profile) {
+
+    if (!(program->flags & 0x1)) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "This program has not been compiled yet");
+    }
+    
+    // initialize the heap
+    ws_heap heap;
+    ws_heap_initialize(&heap);
+    ws_heap_slots(&heap, program);
+
+    // and the stack
+    ws_stack stack;
+    ws_stack_initialize(&stack);
+
+    // and the callstack
+    ws_callstack callstack;
+    ws_callstack_initialize(&callstack);
+
+    size_t next_index = 0;
+    ws_command *current_command;
+
+    //size_t commands_executed = 0;
+    //clock_t thetime = clock();
+
+    int exitcode = 0;
+
+    while (!exitcode) {
+        current_command = program->commands + next_index;
+        next_index++;
+        //commands_executed++;
+
+        if (profile) {
+            // the commands a superinstruction stands for always follow it
+            if (WS_IS_SUPER(current_command->type)) {
+                continue;
+            }
+            if (profile->filename) {
+                ws_profile_record(profile, current_command->type);
+            }
+            if (profile->counts) {
+                profile->counts[next_index - 1]++;
+            }
+        }
+
+        exitcode = ws_execute_command(program, current_command, &next_index, &stack, &heap, &callstack);
+
+        if (profile && next_index != (size_t)(current_command - program->commands) + 1) {
+            ws_profile_break(profile);
+            if (profile->taken) {
+                profile->taken[current_command - program->commands]++;
+            }
         }
 
         if (next_index >= program->length && !exitcode) {
@@ -218,6 +516,20 @@ void ws_execute(const ws_program *const program) {
     ws_stack_finish(&stack);
     ws_heap_finish(&heap);
 
+    ws_execute_exit(exitcode);
+}
+
+void ws_execute(const ws_program *const program) {
+    ws_execute_loop(program, NULL);
+}
+
+/* Runs program while counting what profile counts, see wsprofile.h. The profile is written when the program exits.
+ */
+void ws_execute_profile(const ws_program *const program, ws_profile *const profile) {
+    ws_execute_loop(program, profile);
+}
+
+static void ws_execute_exit(const int exitcode) {
     switch (exitcode) {
         case 1: //clean exit
             //printf("time taken: %f\ncommands executed: %d\n", ((double)(clock()-thetime))/(double)CLOCKS_PER_SEC, commands_executed);
@@ -225,13 +537,11 @@ void ws_execute(const ws_program *const program) {
             break;
 
         case 2: //unsupported command type
-            printf("invalid command type\n");
-            exit(EXIT_FAILURE);
+            ws_fail(WS_STATUS_RUNTIME_ERROR, "invalid command type\n");
             break;
 
         case 3: //code index pointer out of bounds
-            printf("code index out of bounds\n");
-            exit(EXIT_FAILURE);
+            ws_fail(WS_STATUS_RUNTIME_ERROR, "code index out of bounds\n");
             break;
     }
 
@@ -243,12 +553,18 @@ void ws_execute(const ws_program *const program) {
  * It only supports inserting and getting values
  * 
  * The details of this implementation have been inspired by cpythons dict implementation
+ *
+ * Addresses which the program uses as constants live in slots outside of the table, so the slot commands can get to
+ * them without hashing. The table holds an entry for each of them which refers to its slot instead of holding a value,
+ * that way a computed address which happens to be the same ends up at the same value.
  * 
  */
 #define WS_HEAP_SIZE 16
 #define WS_HEAP_RESIZE_FACTOR 4
 #define WS_HEAP_RESIZE_TIME(length, size) (((length)+1)*3 > (size)*2)
 #define WS_HEAP_PERTURB_SHIFT 5
+#define WS_HEAP_SLOT 2 //the initialized value of entries which refer to the slot in value.data
+#define WS_HEAP_RESERVE_LIMIT ((size_t)1 << 24) //the most entries ws_heap_reserve makes room for in one go
 
 void ws_heap_initialize(ws_heap *const result) {
     result->size = WS_HEAP_SIZE;
@@ -257,190 +573,793 @@ void ws_heap_initialize(ws_heap *const result) {
     for(size_t i = 0; i < WS_HEAP_SIZE; i++) {
         result->entries[i].initialized = 0;
     }
+    result->slots = NULL;
+    result->slots_length = 0;
 }
 
-void ws_heap_finish(ws_heap *const table) {
+/* Creates the slots of a program, which all start out without a value
+ */
+void ws_heap_slots(ws_heap *const table, const ws_program *const program) {
+    ws_int key, reference;
+
+    table->slots = (ws_heap_entry *)malloc(sizeof(ws_heap_entry) * (program->slots_length + 1));
+    table->slots_length = program->slots_length;
+    for(size_t i = 0; i < program->slots_length; i++) {
+        ws_int_copy(&table->slots[i].key, program->slots + i);
+        table->slots[i].initialized = 0;
+
+        ws_int_copy(&key, program->slots + i);
+        reference.length = 0;
+        reference.data = (sdigit)i;
+        ws_heap_set(table, &key, &reference);
+        table->entries[ws_heap_insert_position(table, program->slots + i)].initialized = WS_HEAP_SLOT;
+    }
+}
+
+/* Empties the heap and drops its slots, but keeps the entries it has grown to
+ */
+void ws_heap_clear(ws_heap *const table) {
     for(size_t i = 0; i < table->size; i++) {
         if(table->entries[i].initialized) {
             ws_int_free(&table->entries[i].key);
+        }
+        if(table->entries[i].initialized == 1) {
             ws_int_free(&table->entries[i].value);
         }
+        table->entries[i].initialized = 0;
     }
+    for(size_t i = 0; i < table->slots_length; i++) {
+        ws_int_free(&table->slots[i].key);
+        if (table->slots[i].initialized) {
+            ws_int_free(&table->slots[i].value);
+        }
+    }
+    free(table->slots);
+    table->length = 0;
+    table->slots = NULL;
+    table->slots_length = 0;
+}
+
+void ws_heap_finish(ws_heap *const table) {
+    ws_heap_clear(table);
     free(table->entries);
 }
 
 void ws_heap_print(ws_heap *const table) {
     printf("hashtable size %#X, length %#X\n", table->size, table->length);
     char *keystr, *valstr;
+    const ws_heap_entry *entry;
     for(size_t i = 0; i < table->size; i++) {
-        if (table->entries[i].initialized) {
-            keystr = ws_int_to_dec_string(&table->entries[i].key);
-            valstr = ws_int_to_dec_string(&table->entries[i].value);
+        entry = table->entries + i;
+        if (entry->initialized == WS_HEAP_SLOT) {
+            entry = table->slots + entry->value.data;
+            if (!entry->initialized) {
+                continue;
+            }
+        }
+        if (entry->initialized) {
+            keystr = ws_int_to_dec_string(&entry->key);
+            valstr = ws_int_to_dec_string(&entry->value);
             printf("%#4X %s: %s\n", i % table->size, keystr, valstr);
         }
     }
 }
 
-static size_t ws_heap_insert_position(const ws_heap *const table, const ws_int *const key) {
-    //find the correct spot in the heap, this function is only for internal use
-    unsigned int hash = ws_int_hash(key);
-    unsigned int perturb = hash;
-    size_t position = hash % table->size;
-    while (table->entries[position].initialized &&
-           ws_int_compare(&table->entries[position].key, key)) {
-        position = (position * 5 + 1 + perturb) % table->size;
-        perturb >>= WS_HEAP_PERTURB_SHIFT;
+static size_t ws_heap_insert_position(const ws_heap *const table, const ws_int *const key) {
+    //find the correct spot in the heap, this function is only for internal use
+    unsigned int hash = ws_int_hash(key);
+    unsigned int perturb = hash;
+    size_t position = hash % table->size;
+    while (table->entries[position].initialized &&
+           ws_int_compare(&table->entries[position].key, key)) {
+        position = (position * 5 + 1 + perturb) % table->size;
+        perturb >>= WS_HEAP_PERTURB_SHIFT;
+    }
+    return position;
+}
+
+// the entry which holds the value of key, which can be a slot
+static ws_heap_entry *ws_heap_entry_of(const ws_heap *const table, const ws_int *const key) {
+    ws_heap_entry *const entry = table->entries + ws_heap_insert_position(table, key);
+    if (entry->initialized == WS_HEAP_SLOT) {
+        return table->slots + entry->value.data;
+    }
+    return entry;
+}
+
+static void ws_heap_resize(ws_heap *const table, const size_t size) {
+    // save the old table
+    ws_heap_entry *old = table->entries;
+    size_t old_size = table->size;
+    size_t position;
+
+    // create a new array to hold everything
+    table->size = size;
+    table->entries = (ws_heap_entry *)malloc(sizeof(ws_heap_entry) * table->size);
+
+    // set everyting to uninitialized
+    for(size_t i = 0; i < table->size; i++) {
+        table->entries[i].initialized = 0;
+    }
+
+    // and populate the new array with the old values
+    for(size_t i = 0; i < old_size; i++) {
+        if (old[i].initialized) {
+            position = ws_heap_insert_position(table, &old[i].key);
+            table->entries[position] = old[i];
+        }
+    }
+
+    // finally, free the old array
+    free(old);
+}
+
+/* Makes sure count more entries can be inserted without resizing halfway
+ */
+void ws_heap_reserve(ws_heap *const table, size_t count) {
+    if (count > WS_HEAP_RESERVE_LIMIT) {
+        count = WS_HEAP_RESERVE_LIMIT;
+    }
+    size_t size = table->size;
+    while (count && WS_HEAP_RESIZE_TIME(table->length + count - 1, size)) {
+        size *= WS_HEAP_RESIZE_FACTOR;
+    }
+    if (size != table->size) {
+        ws_heap_resize(table, size);
+    }
+}
+
+void ws_heap_set(ws_heap *const table, const ws_int *const key, const ws_int *const value) {
+    // check if we'e getting too large, and resize
+    if (WS_HEAP_RESIZE_TIME(table->length, table->size)) {
+        ws_heap_resize(table, table->size * WS_HEAP_RESIZE_FACTOR);
+    }
+    // actual insertion
+    const size_t position = ws_heap_insert_position(table, key);
+    ws_heap_entry *entry = table->entries + position;
+
+    if (!entry->initialized) {
+        table->length++;
+        entry->initialized = 1;
+        entry->key = *key;
+    } else {
+        ws_int_free(key);
+        if (entry->initialized == WS_HEAP_SLOT) {
+            entry = table->slots + entry->value.data;
+            entry->initialized = 1;
+        }
+    }
+    entry->value = *value;
+}
+
+/* Stores value in a slot, which takes it over
+ */
+static WS_INLINE void ws_heap_slot_set(ws_heap *const table, const sdigit slot, const ws_int *const value) {
+    table->slots[slot].value = *value;
+    table->slots[slot].initialized = 1;
+}
+
+/* Returns the value of a slot like ws_heap_lookup does
+ */
+static WS_INLINE int ws_heap_slot_lookup(ws_int *const result, const ws_heap *const table, const sdigit slot) {
+    if (!table->slots[slot].initialized) {
+        return 0;
+    }
+    *result = table->slots[slot].value;
+    return 1;
+}
+
+/* Looks up key without consuming it, and returns 0 if it isn't there. result refers to the value in the heap.
+ */
+int ws_heap_lookup(ws_int *const result, const ws_heap *const table, const ws_int *const key) {
+    const ws_heap_entry *const entry = ws_heap_entry_of(table, key);
+    if (!entry->initialized) {
+        return 0;
+    }
+    *result = entry->value;
+    return 1;
+}
+
+void ws_heap_get(ws_int *const result, const ws_heap *const table, const ws_int *const key) {
+    //find the spot key and return the value
+    const ws_heap_entry *const entry = ws_heap_entry_of(table, key);
+    if (entry->initialized) {
+        ws_int_free(key);
+        *result = entry->value;
+        return;
+    }
+
+    ws_heap_missing(key, 1);
+}
+
+/* Fails on looking up key, which did not exist. The heap takes over key like it would have if consume is set
+ */
+static void ws_heap_missing(const ws_int *const key, const int consume) {
+    char *const decstring = ws_int_to_dec_string(key);
+    if (consume) {
+        ws_int_free(key);
+    }
+    ws_cleanup cleanup;
+    ws_cleanup_begin(&cleanup, free, decstring);
+    ws_fail(WS_STATUS_RUNTIME_ERROR, "Tried to look up value in the heap at %s which did not exist\n", decstring);
+}
+
+
+
+/* The stack, a simple resizing array
+ */
+#define WS_STACK_SIZE 1024
+#define WS_STACK_RESIZE_FACTOR 2
+
+void ws_stack_initialize(ws_stack *const result) {
+    result->size = WS_STACK_SIZE;
+    result->length = 0;
+    result->entries = (ws_int *)malloc(sizeof(ws_int) * WS_STACK_SIZE);
+}
+
+void ws_stack_clear(ws_stack *const stack) {
+    for(size_t i = 0; i < stack->length; i++) {
+        ws_int_free(stack->entries + i);
+    }
+    stack->length = 0;
+}
+
+void ws_stack_finish(ws_stack *const stack) {
+    ws_stack_clear(stack);
+    free(stack->entries);
+}
+
+// moves a value onto the stack without copying it
+static void ws_stack_spill(ws_stack *const stack, const ws_int *const value) {
+    if (stack->length == stack->size) {
+        stack->size *= WS_STACK_RESIZE_FACTOR;
+        stack->entries = (ws_int *)realloc(stack->entries, sizeof(ws_int) * stack->size);
+    }
+    stack->entries[stack->length++] = *value;
+}
+
+void ws_stack_print(ws_stack *const stack) {
+    printf("stack contents with length %d:\n", stack->length);
+    char *entstr;
+    for (size_t i = 0; i < stack->length; i++) {
+        entstr = ws_int_to_dec_string(stack->entries + i);
+        printf("%s\n", entstr);
+        free(entstr);
+    }
+}
+
+
+
+/* Same for the callstack
+ */
+void ws_callstack_initialize(ws_callstack *const result) {
+    result->size = WS_STACK_SIZE;
+    result->length = 0;
+    result->entries = (size_t *)malloc(sizeof(size_t) * WS_STACK_SIZE);
+}
+
+void ws_callstack_clear(ws_callstack *const stack) {
+    stack->length = 0;
+}
+
+void ws_callstack_finish(ws_callstack *const stack) {
+    free(stack->entries);
+}
+
+
+
+/* And implementations of all commands
+ */
+static void ws_command_push(ws_stack *const stack, const ws_int *const input) {
+    if (stack->length == stack->size) {
+        stack->size *= WS_STACK_RESIZE_FACTOR;
+        stack->entries = (ws_int *)realloc(stack->entries, sizeof(ws_int) * stack->size);
+    }
+
+    ws_command_push_unchecked(stack, input);
+}
+
+static void ws_command_duplicate(ws_stack *const stack) {
+
+    ws_command_push(stack, stack->entries + stack->length-1);
+}
+
+static void ws_command_copy(ws_stack *const stack, const ws_int *const index) {
+    int i = ws_int_to_int(index);
+    if (i < 0 || i >= stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "Tried to copy from position not on stack\n");
+    }
+    ws_command_push(stack, stack->entries + i);
+}
+
+static void ws_command_swap(ws_stack *const stack) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to swap\n");
+    }
+    ws_command_swap_unchecked(stack);
+}
+
+static void ws_command_discard(ws_int *const result, ws_stack *const stack) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    ws_command_discard_unchecked(result, stack);
+}
+
+static void ws_command_slide(ws_stack *const stack, const ws_int *const amount) {
+    ws_int tokeep = stack->entries[stack->length-1];
+    int i = ws_int_to_int(amount);
+    if (i < 0 || i >= stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "Tried to slide amount not on stack\n");
+    }
+    for (size_t pos = stack->length - 1 - i; pos < stack->length - 1; pos++) {
+        ws_int_free(stack->entries + pos);
+    }
+    stack->length -= i;
+    stack->entries[stack->length-1] = tokeep;
+}
+
+static void ws_command_add(ws_stack *const stack) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to add\n");
+    }
+    ws_command_add_unchecked(stack);
+}
+
+static void ws_command_subtract(ws_stack *const stack) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to subtract\n");
+    }
+    ws_command_subtract_unchecked(stack);
+}
+
+static void ws_command_multiply(ws_stack *const stack) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to multiply\n");
+    }
+    ws_command_multiply_unchecked(stack);
+}
+
+static void ws_command_divide(ws_stack *const stack) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to divide\n");
+    }
+    ws_command_divide_unchecked(stack);
+}
+
+static void ws_command_modulo(ws_stack *const stack) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to modulo\n");
+    }
+    ws_command_modulo_unchecked(stack);
+}
+
+static void ws_command_set(ws_stack *const stack, ws_heap *const heap) {
+    ws_int value, key;
+    ws_command_discard(&value, stack);
+    ws_command_discard(&key, stack);
+    ws_heap_set(heap, &key, &value); //don't have to free here since the heap consumes key and value
+}
+
+static void ws_command_get(ws_stack *const stack, ws_heap *const heap) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    ws_command_get_unchecked(stack, heap);
+}
+
+static void ws_command_call(size_t *const next_index, ws_callstack *const callstack, const size_t dest) {
+    if (callstack->length == callstack->size) {
+        callstack->size *= WS_STACK_RESIZE_FACTOR;
+        callstack->entries = (size_t *)realloc(callstack->entries, sizeof(size_t) * callstack->size);
+    }
+    callstack->entries[callstack->length++] = *next_index;
+    *next_index = dest;
+}
+
+static void ws_command_jump(size_t *const next_index, const size_t dest) {
+    *next_index = dest;
+}
+
+static void ws_command_jumpifzero(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    ws_command_jumpifzero_unchecked(next_index, stack, dest);
+}
+
+static void ws_command_jumpifnegative(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    ws_command_jumpifnegative_unchecked(next_index, stack, dest);
+}
+
+static void ws_command_endsubroutine(size_t *const next_index, ws_callstack *const callstack) {
+    if (!callstack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "can't end subroutine without calls on the callstack\n");
+    }
+    *next_index = callstack->entries[--(callstack->length)];
+}
+
+static void ws_command_endprogram(ws_callstack *const callstack) {
+    if (callstack->length) {
+        fprintf(WS_OUTPUT, "warning: attempted to end the program with a non-empty callstack\n");
+    }
+}
+
+static void ws_command_printchar(ws_stack *const stack) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    ws_command_printchar_unchecked(stack);
+}
+
+static void ws_command_printnum(ws_stack *const stack){
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    ws_command_printnum_unchecked(stack);
+}
+
+static void ws_command_inputchar(ws_stack *const stack, ws_heap *const heap){
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    int i = ws_input_char();
+    ws_int test, key;
+    ws_int_from_int(&test, i, NULL);
+
+    ws_int_copy(&key, stack->entries + stack->length - 1); //heap doesnt copy it
+    ws_heap_set(heap, &key, &test); //heap consumes both, no need to free
+}
+
+static void ws_command_inputnum(ws_stack *const stack, ws_heap *const heap) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    ws_int test, key;
+    ws_int_input(&test);
+
+    ws_int_copy(&key, stack->entries + stack->length - 1);
+    ws_heap_set(heap, &key, &test);
+}
+
+
+
+
+/* Superinstructions, which do the same as the sequence of commands they replaced (see wsoptimizer.h)
+ * with fast paths for small ints.
+ */
+// adds a small immediate to value in place
+static WS_INLINE void ws_int_add_immediate(ws_int *const value, const sdigit immediate) {
+    if (!value->length) {
+        ws_int_from_int(value, value->data + immediate, NULL);
+        return;
+    }
+    ws_int temp, right;
+    ws_int_from_int(&right, immediate, NULL);
+    ws_int_add(&temp, value, &right);
+    ws_int_free(&right);
+    ws_int_free(value);
+    *value = temp;
+}
+
+// operation is the add or subtract the immediate was pushed for, which the error names
+static void ws_command_addimmediate(ws_stack *const stack, const sdigit immediate, const ws_command_type operation) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to %s\n", (operation == subtract)? "subtract": "add");
+    }
+    ws_int_add_immediate(stack->entries + stack->length - 1, immediate);
+}
+
+static void ws_command_negate(ws_stack *const stack) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to swap\n");
+    }
+    ws_int *const top = stack->entries + stack->length - 1;
+    if (!top->length) {
+        top->data = -top->data;
+        return;
+    }
+    ws_int temp, zero;
+    ws_int_from_int(&zero, 0, NULL);
+    ws_int_subtract(&temp, &zero, top);
+    ws_int_free(top);
+    *top = temp;
+}
+
+// returns the sign of left - right
+static int ws_compare(const ws_int *const left, const ws_int *const right) {
+    if (!left->length && !right->length) {
+        return (left->data > right->data) - (left->data < right->data);
+    }
+    ws_int temp;
+    ws_int_subtract(&temp, left, right);
+    const int sign = ws_int_iszero(&temp)? 0: ws_int_isnegative(&temp)? -1: 1;
+    ws_int_free(&temp);
+    return sign;
+}
+
+// returns the sign of left - right for a small right
+static int ws_compare_int(const ws_int *const left, const sdigit right) {
+    ws_int temp;
+    ws_int_from_int(&temp, right, NULL);
+    const int sign = ws_compare(left, &temp);
+    ws_int_free(&temp);
+    return sign;
+}
+
+static int ws_compare_top(ws_stack *const stack) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to subtract\n");
+    }
+    const int sign = ws_compare(stack->entries + stack->length - 2, stack->entries + stack->length - 1);
+    ws_int_free(stack->entries + stack->length - 2);
+    ws_int_free(stack->entries + stack->length - 1);
+    stack->length -= 2;
+    return sign;
+}
+
+static int ws_compare_immediate(ws_stack *const stack, const sdigit immediate) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to subtract\n");
+    }
+    ws_int right;
+    ws_int_from_int(&right, immediate, NULL);
+    const int sign = ws_compare(stack->entries + stack->length - 1, &right);
+    ws_int_free(stack->entries + --stack->length);
+    return sign;
+}
+
+static void ws_command_jumpifequal(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+    if(stack->length < 2) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to subtract\n");
+    }
+    if (!ws_int_compare(stack->entries + stack->length - 2, stack->entries + stack->length - 1)) {
+        *next_index = dest;
+    }
+    ws_int_free(stack->entries + stack->length - 2);
+    ws_int_free(stack->entries + stack->length - 1);
+    stack->length -= 2;
+}
+
+static void ws_command_jumpifless(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+    if (ws_compare_top(stack) < 0) {
+        *next_index = dest;
+    }
+}
+
+static void ws_command_jumpifequalimmediate(size_t *const next_index, ws_stack *const stack, const sdigit immediate, const size_t dest) {
+    if (!ws_compare_immediate(stack, immediate)) {
+        *next_index = dest;
+    }
+}
+
+static void ws_command_jumpiflessimmediate(size_t *const next_index, ws_stack *const stack, const sdigit immediate, const size_t dest) {
+    if (ws_compare_immediate(stack, immediate) < 0) {
+        *next_index = dest;
+    }
+}
+
+static void ws_command_duplicatejumpifzero(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    if (ws_int_iszero(stack->entries + stack->length - 1)) {
+        *next_index = dest;
     }
-    return position;
 }
 
-void ws_heap_set(ws_heap *const table, const ws_int *const key, const ws_int *const value) {
-    // check if we'e getting too large, and resize
-    size_t position;
-    if (WS_HEAP_RESIZE_TIME(table->length, table->size)) {
-
-        // oh boy, resizing. save the old table size and 
-        ws_heap_entry *old = table->entries;
-        size_t old_size = table->size;
-        size_t old_length = table->length;
-
-        // create a new array to hold everything
-        table->size *= WS_HEAP_RESIZE_FACTOR;
-        table->length = old_length;
-        table->entries = (ws_heap_entry *)malloc(sizeof(ws_heap_entry) * table->size);
+static void ws_command_duplicatejumpifnegative(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "tried to pop from empty stack\n");
+    }
+    if (ws_int_isnegative(stack->entries + stack->length - 1)) {
+        *next_index = dest;
+    }
+}
 
-        // set everyting to uninitialized
-        for(size_t i = 0; i < table->size; i++) {
-            table->entries[i].initialized = 0;
-        }
+static void ws_command_getimmediate(ws_stack *const stack, ws_heap *const heap, const ws_int *const key) {
+    //look up the value directly, so the key doesn't have to be copied
+    ws_int value;
+    if (ws_heap_lookup(&value, heap, key)) {
+        ws_command_push(stack, &value);
+        return;
+    }
 
-        // and populate the new array with the old values
-        for(size_t i = 0; i < old_size; i++) {
-            if (old[i].initialized) {
-                position = ws_heap_insert_position(table, &old[i].key);
-                table->entries[position].key = old[i].key;
-                table->entries[position].value = old[i].value;
-                table->entries[position].initialized = 1;
-            }
-        }
+    ws_heap_missing(key, 0);
+}
 
-        // finally, free the old array
-        free(old);
+static void ws_command_setimmediate(ws_stack *const stack, ws_heap *const heap, const ws_int *const address) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to swap\n");
     }
-    // actual insertion
-    position = ws_heap_insert_position(table, key);
+    ws_int value, key;
+    ws_command_discard(&value, stack);
+    ws_int_copy(&key, address);
+    ws_heap_set(heap, &key, &value);
+}
 
-    if (!table->entries[position].initialized) {
-        table->length++;
-        table->entries[position].initialized = 1;
-        table->entries[position].key = *key;
-    } else {
-        ws_int_free(key);
-    }
-    table->entries[position].value = *value;
+static void ws_command_storeimmediate(ws_heap *const heap, const ws_int *const address, const sdigit immediate) {
+    ws_int value, key;
+    ws_int_from_int(&value, immediate, NULL);
+    ws_int_copy(&key, address);
+    ws_heap_set(heap, &key, &value);
 }
 
-void ws_heap_get(ws_int *const result, const ws_heap *const table, const ws_int *const key) {
-    //find the spot key and return the value
-    size_t position = ws_heap_insert_position(table, key);
-    ws_int_free(key);
-    if (table->entries[position].initialized) {
-        *result = table->entries[position].value;
+// like the immediate versions, but for addresses which have a slot in the heap
+static void ws_command_getslot(ws_stack *const stack, ws_heap *const heap, const sdigit slot) {
+    ws_int value;
+    if (ws_heap_slot_lookup(&value, heap, slot)) {
+        ws_command_push(stack, &value);
         return;
     }
 
-    char *decstring = ws_int_to_dec_string(key);
-    printf("Tried to look up value in the heap at %s which did not exist\n", decstring);
-    free(decstring);
-    exit(EXIT_FAILURE);
+    ws_heap_missing(&heap->slots[slot].key, 0);
 }
 
+static void ws_command_setslot(ws_stack *const stack, ws_heap *const heap, const sdigit slot) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to swap\n");
+    }
+    ws_int value;
+    ws_command_discard(&value, stack);
+    ws_heap_slot_set(heap, slot, &value);
+}
 
+static void ws_command_storeslot(ws_heap *const heap, const sdigit slot, const ws_int *const input) {
+    ws_int value;
+    ws_int_copy(&value, input);
+    ws_heap_slot_set(heap, slot, &value);
+}
 
-/* The stack, a simple resizing array
+/* The loop commands count and test in one go, doing the same as the commands they replaced (see ws_loops in wsoptimizer.h).
+ * The counter is updated where it is, so while it's a small int a loop iteration is a single machine add and compare.
  */
-#define WS_STACK_SIZE 1024
-#define WS_STACK_RESIZE_FACTOR 2
-
-void ws_stack_initialize(ws_stack *const result) {
-    result->size = WS_STACK_SIZE;
-    result->length = 0;
-    result->entries = (ws_int *)malloc(sizeof(ws_int) * WS_STACK_SIZE);
+static WS_INLINE void ws_command_decrementjumpifnonzero(size_t *const next_index, ws_stack *const stack, const sdigit amount, const size_t dest,
+                                                        const ws_command_type operation) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to %s\n", (operation == subtract)? "subtract": "add");
+    }
+    ws_int *const counter = stack->entries + stack->length - 1;
+    ws_int_add_immediate(counter, -amount);
+    if (counter->length? !ws_int_iszero(counter): counter->data) {
+        *next_index = dest;
+    }
 }
 
-void ws_stack_finish(ws_stack *const stack) {
-    for(size_t i = 0; i < stack->length; i++) {
-        ws_int_free(stack->entries + i);
+static WS_INLINE void ws_command_incrementjumpifnotequal(size_t *const next_index, ws_stack *const stack, const sdigit limit, const size_t dest,
+                                                         const ws_command_type operation) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to %s\n", (operation == subtract)? "subtract": "add");
+    }
+    ws_int *const counter = stack->entries + stack->length - 1;
+    ws_int_add_immediate(counter, 1);
+    if (counter->length? ws_compare_int(counter, limit): counter->data != limit) {
+        *next_index = dest;
     }
-    free(stack->entries);
 }
 
-void ws_stack_print(ws_stack *const stack) {
-    printf("stack contents with length %d:\n", stack->length);
-    char *entstr;
-    for (size_t i = 0; i < stack->length; i++) {
-        entstr = ws_int_to_dec_string(stack->entries + i);
-        printf("%s\n", entstr);
-        free(entstr);
+// the slot versions fail like the getslot they start with
+static ws_int *ws_loop_slot(ws_heap *const heap, const sdigit slot) {
+    if (!heap->slots[slot].initialized) {
+        ws_heap_missing(&heap->slots[slot].key, 0);
     }
+    return &heap->slots[slot].value;
 }
 
+static WS_INLINE void ws_command_decrementslotjumpifnonzero(size_t *const next_index, ws_heap *const heap, const sdigit slot, const size_t dest) {
+    ws_int *const counter = ws_loop_slot(heap, slot);
+    ws_int_add_immediate(counter, -1);
+    if (counter->length? !ws_int_iszero(counter): counter->data) {
+        *next_index = dest;
+    }
+}
 
+static WS_INLINE void ws_command_incrementslotjumpifless(size_t *const next_index, ws_heap *const heap, const sdigit slot, const sdigit limit, const size_t dest) {
+    ws_int *const counter = ws_loop_slot(heap, slot);
+    ws_int_add_immediate(counter, 1);
+    if (counter->length? ws_compare_int(counter, limit) < 0: counter->data < limit) {
+        *next_index = dest;
+    }
+}
 
-/* Same for the callstack
+/* The bulk heap commands run a whole fill or copy loop (see ws_bulk in wsoptimizer.h) when the address on top of the
+ * stack is a small int below limit, and then continue at dest with limit on top of the stack. Otherwise they leave
+ * everything to the loop after them. A copy which runs into an address that isn't in the heap stops there as well,
+ * so the loop fails the way it would have.
+ * limit is a small int, so every address and source address fits in an sdigit.
  */
-void ws_callstack_initialize(ws_callstack *const result) {
-    result->size = WS_STACK_SIZE;
-    result->length = 0;
-    result->entries = (size_t *)malloc(sizeof(size_t) * WS_STACK_SIZE);
+static void ws_command_fillheap(size_t *const next_index, ws_stack *const stack, ws_heap *const heap, const sdigit value,
+                                const sdigit limit, const size_t dest) {
+    if (!stack->length || stack->entries[stack->length - 1].length || stack->entries[stack->length - 1].data >= limit) {
+        return;
+    }
+    ws_int *const address = stack->entries + stack->length - 1;
+    ws_int key, fill;
+
+    ws_heap_reserve(heap, (size_t)(limit - address->data));
+    for(sdigit i = address->data; i < limit; i++) {
+        ws_int_from_int(&key, i, NULL);
+        ws_int_from_int(&fill, value, NULL);
+        ws_heap_set(heap, &key, &fill);
+    }
+    address->data = limit;
+    *next_index = dest;
 }
 
-void ws_callstack_finish(ws_callstack *const stack) {
-    free(stack->entries);
+static void ws_command_copyheap(size_t *const next_index, ws_stack *const stack, ws_heap *const heap, const sdigit offset,
+                                const sdigit limit, const size_t dest) {
+    if (!stack->length || stack->entries[stack->length - 1].length || stack->entries[stack->length - 1].data >= limit) {
+        return;
+    }
+    ws_int *const address = stack->entries + stack->length - 1;
+    ws_int key, found, copy;
+    sdigit i;
+
+    ws_heap_reserve(heap, (size_t)(limit - address->data));
+    for(i = address->data; i < limit; i++) {
+        ws_int_from_int(&key, i + offset, NULL);
+        if (!ws_heap_lookup(&found, heap, &key)) {
+            ws_int_free(&key);
+            break;
+        }
+        ws_int_free(&key);
+        ws_int_copy(&copy, &found);
+        ws_int_from_int(&key, i, NULL);
+        ws_heap_set(heap, &key, &copy);
+    }
+    address->data = i;
+    if (i == limit) {
+        *next_index = dest;
+    }
 }
 
+static void ws_command_printstring(const ws_string *const string) {
+    fwrite(string->data, 1, string->length, WS_OUTPUT);
+}
 
-
-/* And implementations of all commands
- */
-static void ws_command_push(ws_stack *const stack, const ws_int *const input) {
-    if (stack->length == stack->size) {
-        stack->size *= WS_STACK_RESIZE_FACTOR;
-        stack->entries = (ws_int *)realloc(stack->entries, sizeof(ws_int) * stack->size);
+static void ws_command_multiplyadd(ws_stack *const stack, const sdigit multiplier, const sdigit addend) {
+    if(!stack->length) {
+        ws_fail(WS_STATUS_RUNTIME_ERROR, "need at least two items on the stack to multiply\n");
     }
+    ws_int_muladd_small(stack->entries + stack->length - 1, multiplier, addend);
+}
 
-    ws_int_copy(stack->entries + stack->length++, input);
+static void ws_command_pushpush(ws_stack *const stack, const sdigit immediate, const ws_int *const input) {
+    ws_int first;
+    ws_int_from_int(&first, immediate, NULL);
+    ws_command_push(stack, &first);
+    ws_command_push(stack, input);
 }
 
-static void ws_command_duplicate(ws_stack *const stack) {
 
-    ws_command_push(stack, stack->entries + stack->length-1);
+
+/* Variants of the commands without checks on the stack size. The stack verifier in wscfg.h
+ * only emits these where it proved there are enough items on the stack, and commands which push
+ * only get them after a reserve at the start of their block made enough room.
+ */
+static void ws_command_push_unchecked(ws_stack *const stack, const ws_int *const input) {
+    ws_int_copy(stack->entries + stack->length++, input);
 }
 
-static void ws_command_copy(ws_stack *const stack, const ws_int *const index) {
-    int i = ws_int_to_int(index);
-    if (i < 0 || i >= stack->length) {
-        printf("Tried to copy from position not on stack\n");
-        exit(EXIT_FAILURE);
-    }
-    ws_command_push(stack, stack->entries + i);
+static void ws_command_duplicate_unchecked(ws_stack *const stack) {
+    ws_command_push_unchecked(stack, stack->entries + stack->length - 1);
 }
 
-static void ws_command_swap(ws_stack *const stack) {
-    if(stack->length < 2) {
-        printf("need at least two items on the stack to swap\n");
-        exit(EXIT_FAILURE);
-    }
+static void ws_command_copy_unchecked(ws_stack *const stack, const ws_int *const index) {
+    //the verifier only accepts small indexes
+    ws_command_push_unchecked(stack, stack->entries + index->data);
+}
+
+static void ws_command_swap_unchecked(ws_stack *const stack) {
     ws_int temp = stack->entries[stack->length-1];
     stack->entries[stack->length-1] = stack->entries[stack->length-2];
     stack->entries[stack->length-2] = temp;
 }
 
-static void ws_command_discard(ws_int *const result, ws_stack *const stack) {
-    if(!stack->length) {
-        printf("tried to pop from empty stack\n");
-        exit(EXIT_FAILURE);
-    }
+static void ws_command_discard_unchecked(ws_int *const result, ws_stack *const stack) {
     if(result) {
         *result = stack->entries[--stack->length];
     } else {
@@ -448,25 +1367,16 @@ static void ws_command_discard(ws_int *const result, ws_stack *const stack) {
     }
 }
 
-static void ws_command_slide(ws_stack *const stack, const ws_int *const amount) {
+static void ws_command_slide_unchecked(ws_stack *const stack, const ws_int *const amount) {
     ws_int tokeep = stack->entries[stack->length-1];
-    int i = ws_int_to_int(amount);
-    if (i < 0 || i >= stack->length) {
-        printf("Tried to slide amount not on stack\n");
-        exit(EXIT_FAILURE);
-    }
-    for (size_t pos = stack->length - 1 - i; pos < stack->length - 1; pos++) {
+    for (size_t pos = stack->length - 1 - amount->data; pos < stack->length - 1; pos++) {
         ws_int_free(stack->entries + pos);
     }
-    stack->length -= i;
+    stack->length -= amount->data;
     stack->entries[stack->length-1] = tokeep;
 }
 
-static void ws_command_add(ws_stack *const stack) {
-    if(stack->length < 2) {
-        printf("need at least two items on the stack to add\n");
-        exit(EXIT_FAILURE);
-    }
+static void ws_command_add_unchecked(ws_stack *const stack) {
     ws_int temp;
     ws_int_add(&temp, stack->entries + stack->length - 2, stack->entries + stack->length - 1);
     ws_int_free(stack->entries + stack->length - 2);
@@ -475,11 +1385,7 @@ static void ws_command_add(ws_stack *const stack) {
     stack->length--;
 }
 
-static void ws_command_subtract(ws_stack *const stack) {
-    if(stack->length < 2) {
-        printf("need at least two items on the stack to subtract\n");
-        exit(EXIT_FAILURE);
-    }
+static void ws_command_subtract_unchecked(ws_stack *const stack) {
     ws_int temp;
     ws_int_subtract(&temp, stack->entries + stack->length - 2, stack->entries + stack->length - 1);
     ws_int_free(stack->entries + stack->length - 2);
@@ -488,11 +1394,7 @@ static void ws_command_subtract(ws_stack *const stack) {
     stack->length--;
 }
 
-static void ws_command_multiply(ws_stack *const stack) {
-    if(stack->length < 2) {
-        printf("need at least two items on the stack to multiply\n");
-        exit(EXIT_FAILURE);
-    }
+static void ws_command_multiply_unchecked(ws_stack *const stack) {
     ws_int temp;
     ws_int_multiply(&temp, stack->entries + stack->length - 2, stack->entries + stack->length - 1);
     ws_int_free(stack->entries + stack->length - 2);
@@ -501,11 +1403,7 @@ static void ws_command_multiply(ws_stack *const stack) {
     stack->length--;
 }
 
-static void ws_command_divide(ws_stack *const stack) {
-    if(stack->length < 2) {
-        printf("need at least two items on the stack to divide\n");
-        exit(EXIT_FAILURE);
-    }
+static void ws_command_divide_unchecked(ws_stack *const stack) {
     ws_int temp;
     ws_int_divide(&temp, stack->entries + stack->length - 2, stack->entries + stack->length - 1);
     ws_int_free(stack->entries + stack->length - 2);
@@ -514,11 +1412,7 @@ static void ws_command_divide(ws_stack *const stack) {
     stack->length--;
 }
 
-static void ws_command_modulo(ws_stack *const stack) {
-    if(stack->length < 2) {
-        printf("need at least two items on the stack to modulo\n");
-        exit(EXIT_FAILURE);
-    }
+static void ws_command_modulo_unchecked(ws_stack *const stack) {
     ws_int temp;
     ws_int_modulo(&temp, stack->entries + stack->length - 2, stack->entries + stack->length - 1);
     ws_int_free(stack->entries + stack->length - 2);
@@ -527,100 +1421,215 @@ static void ws_command_modulo(ws_stack *const stack) {
     stack->length--;
 }
 
-static void ws_command_set(ws_stack *const stack, ws_heap *const heap) {
+static void ws_command_set_unchecked(ws_stack *const stack, ws_heap *const heap) {
     ws_int value, key;
-    ws_command_discard(&value, stack);
-    ws_command_discard(&key, stack);
+    ws_command_discard_unchecked(&value, stack);
+    ws_command_discard_unchecked(&key, stack);
     ws_heap_set(heap, &key, &value); //don't have to free here since the heap consumes key and value
 }
 
-static void ws_command_get(ws_stack *const stack, ws_heap *const heap) {
+static void ws_command_get_unchecked(ws_stack *const stack, ws_heap *const heap) {
     ws_int value, key;
-    ws_command_discard(&key, stack);
+    ws_command_discard_unchecked(&key, stack);
     ws_heap_get(&value, heap, &key); //get consumes the key and does not return a copied ws_int, merely a reference
-    ws_command_push(stack, &value);
-}
-
-static void ws_command_call(size_t *const next_index, ws_callstack *const callstack, const size_t dest) {
-    if (callstack->length == callstack->size) {
-        callstack->size *= WS_STACK_RESIZE_FACTOR;
-        callstack->entries = (size_t *)realloc(callstack->entries, sizeof(size_t) * callstack->size);
-    }
-    callstack->entries[callstack->length++] = *next_index;
-    *next_index = dest;
-}
-
-static void ws_command_jump(size_t *const next_index, const size_t dest) {
-    *next_index = dest;
+    //the key just made room for the value
+    ws_command_push_unchecked(stack, &value);
 }
 
-static void ws_command_jumpifzero(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+static void ws_command_jumpifzero_unchecked(size_t *const next_index, ws_stack *const stack, const size_t dest) {
     ws_int test;
-    ws_command_discard(&test, stack);
+    ws_command_discard_unchecked(&test, stack);
     if (ws_int_iszero(&test)) {
         *next_index = dest;
     }
     ws_int_free(&test);
 }
 
-static void ws_command_jumpifnegative(size_t *const next_index, ws_stack *const stack, const size_t dest) {
+static void ws_command_jumpifnegative_unchecked(size_t *const next_index, ws_stack *const stack, const size_t dest) {
     ws_int test;
-    ws_command_discard(&test, stack);
+    ws_command_discard_unchecked(&test, stack);
     if (ws_int_isnegative(&test)) {
         *next_index = dest;
     }
     ws_int_free(&test);
 }
 
-static void ws_command_endsubroutine(size_t *const next_index, ws_callstack *const callstack) {
-    if (!callstack->length) {
-        printf("can't end subroutine without calls on the callstack\n");
-        exit(EXIT_FAILURE);
-    }
-    *next_index = callstack->entries[--(callstack->length)];
-}
-
-static void ws_command_endprogram(ws_callstack *const callstack) {
-    if (callstack->length) {
-        printf("warning: attempted to end the program with a non-empty callstack\n");
-    }
-}
-
-static void ws_command_printchar(ws_stack *const stack) {
+static void ws_command_printchar_unchecked(ws_stack *const stack) {
     ws_int test;
-    ws_command_discard(&test, stack);
+    ws_command_discard_unchecked(&test, stack);
 
-    putchar(ws_int_to_int(&test));
+    putc(ws_int_to_int(&test), WS_OUTPUT);
 
     ws_int_free(&test);
 }
 
-static void ws_command_printnum(ws_stack *const stack){
+static void ws_command_printnum_unchecked(ws_stack *const stack) {
     ws_int test;
-    ws_command_discard(&test, stack);
+    ws_command_discard_unchecked(&test, stack);
 
     char *buffer = ws_int_to_dec_string(&test);
-    printf("%s", buffer);
+    fputs(buffer, WS_OUTPUT);
 
     free(buffer);
     ws_int_free(&test);
 }
 
-static void ws_command_inputchar(ws_stack *const stack, ws_heap *const heap){
-    int i = getchar();
-    ws_int test, key;
-    ws_int_from_int(&test, i, NULL);
-
-    ws_int_copy(&key, stack->entries + stack->length - 1); //heap doesnt copy it
-    ws_heap_set(heap, &key, &test); //heap consumes both, no need to free
+static void ws_command_reserve(ws_stack *const stack, const sdigit amount) {
+    if (stack->length + amount > stack->size) {
+        while (stack->length + amount > stack->size) {
+            stack->size *= WS_STACK_RESIZE_FACTOR;
+        }
+        stack->entries = (ws_int *)realloc(stack->entries, sizeof(ws_int) * stack->size);
+    }
 }
 
-static void ws_command_inputnum(ws_stack *const stack, ws_heap *const heap) {
-    ws_int test, key;
-    ws_int_input(&test);
 
-    ws_int_copy(&key, stack->entries + stack->length - 1);
-    ws_heap_set(heap, &key, &test);
+
+/* The register machine, which runs the register code of a block (see wsregister.h) and returns where to continue.
+ * If the stack isn't deep enough, the original commands following the registerblock run instead.
+ */
+static size_t ws_command_registerblock(const ws_program *const program, const ws_command *const command, const size_t next_index,
+                                       ws_stack *const stack, ws_heap *const heap) {
+    const ws_registers *const registers = program->registers;
+    const ws_register_block *const block = registers->blocks + command->immediate;
+    if (stack->length < block->need) {
+        return next_index;
+    }
+
+    ws_int *const values = ws_register_values? ws_register_values: registers->values;
+    const ws_register_op *op = registers->ops + block->ops;
+    const ws_register_op *const end = op + block->ops_length;
+    ws_int key, value;
+    char *buffer;
+
+    stack->length -= block->need;
+    memcpy(values, stack->entries + stack->length, sizeof(ws_int) * block->need);
+
+    for(; op < end; op++) {
+        switch (op->opcode) {
+
+            case register_add:
+                ws_int_add(values + op->result, values + op->left, values + op->right);
+                break;
+
+            case register_subtract:
+                ws_int_subtract(values + op->result, values + op->left, values + op->right);
+                break;
+
+            case register_multiply:
+                ws_int_multiply(values + op->result, values + op->left, values + op->right);
+                break;
+
+            case register_divide:
+                ws_int_divide(values + op->result, values + op->left, values + op->right);
+                break;
+
+            case register_modulo:
+                ws_int_modulo(values + op->result, values + op->left, values + op->right);
+                break;
+
+            case register_set:
+                ws_int_copy(&key, values + op->left);
+                ws_int_copy(&value, values + op->right);
+                ws_heap_set(heap, &key, &value);
+                break;
+
+            case register_get:
+                if (!ws_heap_lookup(&value, heap, values + op->left)) {
+                    ws_heap_missing(values + op->left, 0);
+                }
+                ws_int_copy(values + op->result, &value);
+                break;
+
+            case register_setslot:
+                ws_int_copy(&value, values + op->right);
+                ws_heap_slot_set(heap, (sdigit)op->left, &value);
+                break;
+
+            case register_getslot:
+                if (!ws_heap_slot_lookup(&value, heap, (sdigit)op->left)) {
+                    ws_heap_missing(&heap->slots[op->left].key, 0);
+                }
+                ws_int_copy(values + op->result, &value);
+                break;
+
+            case register_printchar:
+                putc(ws_int_to_int(values + op->left), WS_OUTPUT);
+                break;
+
+            case register_printnum:
+                buffer = ws_int_to_dec_string(values + op->left);
+                fputs(buffer, WS_OUTPUT);
+                free(buffer);
+                break;
+
+            case register_inputchar:
+                ws_int_from_int(&value, ws_input_char(), NULL);
+                ws_int_copy(&key, values + op->left);
+                ws_heap_set(heap, &key, &value);
+                break;
+
+            case register_inputnum:
+                ws_int_input(&value);
+                ws_int_copy(&key, values + op->left);
+                ws_heap_set(heap, &key, &value);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    // decide where to go before the registers are spilled or freed
+    const ws_register_op *const terminator = &block->terminator;
+    const size_t resume = command->jumpoffset;
+    size_t destination = resume;
+
+    switch (terminator->opcode) {
+        case register_jump:
+            destination = program->commands[resume].jumpoffset;
+            break;
+
+        case register_jumpifzero:
+            destination = ws_int_iszero(values + terminator->left)? program->commands[resume].jumpoffset: resume + 1;
+            break;
+
+        case register_jumpifnegative:
+            destination = ws_int_isnegative(values + terminator->left)? program->commands[resume].jumpoffset: resume + 1;
+            break;
+
+        case register_jumpifequal:
+            destination = !ws_int_compare(values + terminator->left, values + terminator->right)? program->commands[resume].jumpoffset: resume + 1;
+            break;
+
+        case register_jumpifless:
+            destination = (ws_compare(values + terminator->left, values + terminator->right) < 0)? program->commands[resume].jumpoffset: resume + 1;
+            break;
+
+        default:
+            break;
+    }
+
+    if (stack->length + block->spills_length > stack->size) {
+        ws_command_reserve(stack, (sdigit)block->spills_length);
+    }
+    const ws_register_spill *spill = registers->spills + block->spills;
+    const ws_register_spill *const spills_end = spill + block->spills_length;
+    for(; spill < spills_end; spill++) {
+        if (spill->move) {
+            stack->entries[stack->length++] = values[spill->value];
+        } else {
+            ws_int_copy(stack->entries + stack->length++, values + spill->value);
+        }
+    }
+
+    const unsigned int *free_register = registers->frees + block->frees;
+    const unsigned int *const frees_end = free_register + block->frees_length;
+    for(; free_register < frees_end; free_register++) {
+        ws_int_free(values + *free_register);
+    }
+
+    return destination;
 }
 
 #endif
\ No newline at end of file
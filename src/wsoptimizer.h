@@ -0,0 +1,1445 @@
+/* wsoptimizer.h, optimization passes over compiled programs */
+#ifndef WSOPTIMIZER_H
+#define WSOPTIMIZER_H
+
+#include "wstypes.h"
+#include "wsparser.h"
+#include "wscfg.h"
+#include "wssuper.h"
+
+
+
+/* The optimizer runs after ws_compile, so all jumps already refer to command indexes.
+ * Passes which remove or merge commands build a new command array through a ws_rewrite,
+ * which remembers where every old command ended up so the jumpoffsets can be fixed afterwards.
+ * Commands which get removed are mapped to the next command that is kept.
+ *
+ * optimization levels:
+ * 1: removal of labels and unreachable code, jump threading, inlining of small subroutines, constant folding,
+ *    fusion of literal output, promotion of constant heap addresses to slots,
+ *    peephole optimization, replacing common sequences of commands by superinstructions, bulk heap operations for
+ *    fill and copy loops, and counted loops
+ * 2: removal of stack checks the stack verifier can prove unnecessary
+ * 3: conversion of blocks into register code, see wsregister.h
+ *
+ * A program with a block profile from an instrumented run first gets its blocks laid out by it, at every level.
+ *
+ * Levels 1 and 2 finish by putting the superinstructions of wssuper.h, which were found by profiling, in front of
+ * the sequences they stand for. Level 3 leaves them out as register code runs those blocks anyway.
+ */
+
+#define WS_THREAD_LIMIT 64 //the maximum length of a jump chain that gets followed
+#define WS_RESERVE_PUSHES 4 //how many pushes a block needs before a reserve is worth it
+#define WS_INLINE_LIMIT 8 //the maximum amount of commands in a subroutine that gets inlined
+#define WS_INLINE_NONE ((size_t)-1)
+#define WS_PRINT_NONE ((size_t)-1)
+#define WS_PROMOTE_WINDOW 32 //how far after pushing an address the set or get that uses it is looked for
+#define WS_PROMOTE_NONE ((size_t)-1)
+#define WS_LAYOUT_TAKEN 8 //how many times more often a branch has to be taken than not to move what follows it
+
+// a command array under construction, and the new index of each old command
+typedef struct {
+    ws_command *commands;
+    size_t length;
+    size_t *remap;
+} ws_rewrite;
+
+/* forward declarations
+ */
+char *ws_jump_targets(const ws_program *);
+char *ws_reachable(const ws_program *);
+static void ws_rewrite_initialize(ws_rewrite *, const ws_program *, size_t);
+static ws_command *ws_rewrite_emit(ws_rewrite *, size_t, const ws_command *);
+static ws_command *ws_rewrite_append(ws_rewrite *, const ws_command *);
+static void ws_rewrite_finish(ws_rewrite *, ws_program *);
+static void ws_command_discard_parameter(ws_command *);
+void ws_layout(ws_program *);
+void ws_strip(ws_program *);
+void ws_inline(ws_program *);
+void ws_fold(ws_program *);
+void ws_print(ws_program *);
+void ws_promote(ws_program *);
+void ws_bulk(ws_program *);
+void ws_loops(ws_program *);
+void ws_peephole(ws_program *);
+void ws_unchecked(ws_program *);
+void ws_super(ws_program *);
+void ws_register_compile(ws_program *); //in wsregister.h
+
+
+
+/* Runs the passes belonging to the optimization level on a compiled program
+ */
+void ws_optimize(ws_program *const program, const int level) {
+    if (!(program->flags & 0x1) || program->lazy) {
+        ws_fail(WS_STATUS_COMPILE_ERROR, "can only optimize compiled programs\n");
+    }
+    if (program->profile) {
+        ws_layout(program);
+    }
+    if (level >= 1) {
+        ws_strip(program);
+        ws_inline(program);
+        ws_fold(program);
+        ws_print(program);
+        ws_strip(program);
+        ws_promote(program);
+        ws_peephole(program);
+        ws_bulk(program);
+        ws_loops(program);
+    }
+    if (level >= 2) {
+        ws_unchecked(program);
+    }
+    if (level >= 3) {
+        ws_register_compile(program);
+    } else if (level >= 1) {
+        ws_super(program);
+    }
+}
+
+
+
+/* Returns an array which is 1 at every index that can be reached by something else than falling through
+ * from the previous command: jump targets, the command after a call and the start of the program.
+ */
+char *ws_jump_targets(const ws_program *const program) {
+    char *const targets = (char *)calloc(program->length + 1, 1);
+    const ws_command *command;
+
+    targets[0] = 1;
+    for(size_t i = 0; i < program->length; i++) {
+        command = program->commands + i;
+        if (ws_label_map[command->type] && command->type != label) {
+            targets[command->jumpoffset] = 1;
+        }
+        if (command->type == call) {
+            targets[i + 1] = 1;
+        }
+    }
+    return targets;
+}
+
+/* Commands which don't continue with the next command
+ */
+static int ws_ends_block(const ws_command_type type) {
+    return type == jump || type == endsubroutine || type == endprogram;
+}
+
+/* Returns an array which is 1 at every index that can be reached from the start of the program.
+ * the command after a call is assumed to be reachable, even if the subroutine never returns.
+ */
+char *ws_reachable(const ws_program *const program) {
+    char *const reachable = (char *)calloc(program->length + 1, 1);
+    size_t *const worklist = (size_t *)malloc(sizeof(size_t) * (program->length + 1));
+    size_t worklist_length = 0;
+    const ws_command *command;
+    size_t i;
+
+    reachable[0] = 1;
+    worklist[worklist_length++] = 0;
+    while (worklist_length) {
+        i = worklist[--worklist_length];
+
+        // walk along the fall through path, only jumps go on the worklist
+        while (i < program->length) {
+            command = program->commands + i;
+            if (ws_label_map[command->type] && command->type != label && !reachable[command->jumpoffset]) {
+                reachable[command->jumpoffset] = 1;
+                worklist[worklist_length++] = command->jumpoffset;
+            }
+            if (ws_ends_block(command->type) || reachable[++i]) {
+                break;
+            }
+            reachable[i] = 1;
+        }
+    }
+
+    free(worklist);
+    return reachable;
+}
+
+/* extra is the amount of commands that can be added on top of the ones in program
+ */
+static void ws_rewrite_initialize(ws_rewrite *const rewrite, const ws_program *const program, const size_t extra) {
+    rewrite->commands = (ws_command *)malloc(sizeof(ws_command) * (program->length + extra + 1));
+    rewrite->length = 0;
+    rewrite->remap = (size_t *)malloc(sizeof(size_t) * (program->length + 1));
+}
+
+/* Adds a copy of command to the new array, which replaces the old commands from index up to the next emit.
+ */
+static ws_command *ws_rewrite_emit(ws_rewrite *const rewrite, const size_t index, const ws_command *const command) {
+    rewrite->remap[index] = rewrite->length;
+    rewrite->commands[rewrite->length] = *command;
+    return rewrite->commands + rewrite->length++;
+}
+
+/* Adds a copy of command to the new array without changing where any old command ended up
+ */
+static ws_command *ws_rewrite_append(ws_rewrite *const rewrite, const ws_command *const command) {
+    rewrite->commands[rewrite->length] = *command;
+    return rewrite->commands + rewrite->length++;
+}
+
+/* Fixes up all jumpoffsets and replaces the commands of program. remap has to be filled in for every old index.
+ */
+static void ws_rewrite_finish(ws_rewrite *const rewrite, ws_program *const program) {
+    ws_command *command;
+
+    // the machine needs at least one command, so a program which falls off the end straight away jumps there
+    if (!rewrite->length) {
+        ws_command end;
+        memset(&end, 0, sizeof(ws_command));
+        end.type = jump;
+        end.jumpoffset = program->length;
+        ws_rewrite_append(rewrite, &end);
+    }
+
+    rewrite->remap[program->length] = rewrite->length;
+    for(size_t i = 0; i < rewrite->length; i++) {
+        command = rewrite->commands + i;
+        if (ws_label_map[command->type]) {
+            command->jumpoffset = rewrite->remap[command->jumpoffset];
+        }
+    }
+
+    free(program->commands);
+    free(rewrite->remap);
+    program->commands = (ws_command *)realloc(rewrite->commands, sizeof(ws_command) * (rewrite->length + !rewrite->length));
+    program->length = rewrite->length;
+}
+
+/* Frees whatever a command that is merged into another one owned
+ */
+static void ws_command_discard_parameter(ws_command *const command) {
+    if (ws_parameter_map[command->type]) {
+        ws_int_free(&command->parameter);
+    } else if (command->type == printstring) {
+        ws_string_free(&command->string);
+    }
+#if DEBUG
+    ws_string_free(&command->text);
+#endif
+}
+
+
+
+/* The layout pass puts the blocks of a program in the order they ran in during an instrumented run.
+ * Starting at the entry, and then at the hottest block that isn't placed yet, it builds chains of blocks:
+ * a block is followed by the target of the jump it ends with, which makes the jump unnecessary,
+ * and otherwise by the block it falls through to, unless that never ran while this one did,
+ * or its branch was taken WS_LAYOUT_TAKEN times more often than not. The branch still jumps to its hot target,
+ * which starts a chain of its own, but the cold block it falls through to moves out of the way.
+ * Blocks which never ran end up behind the ones that did, in their old order.
+ * A block which isn't followed by the block it falls through to anymore gets a jump there,
+ * which also keeps the command after a call where the call returns to.
+ *
+ * The profile counts refer to the command indexes of the program as it was compiled, so this has to be the first pass,
+ * after which the profile is dropped.
+ */
+typedef struct {
+    uint64_t count;
+    size_t block;
+} ws_layout_start;
+
+static int ws_layout_compare(const void *const a, const void *const b) {
+    const ws_layout_start *const left = (const ws_layout_start *)a;
+    const ws_layout_start *const right = (const ws_layout_start *)b;
+    if (left->count != right->count) {
+        return (left->count < right->count) - (left->count > right->count);
+    }
+    return (left->block > right->block) - (left->block < right->block);
+}
+
+// returns the block that should follow block b, or WS_CFG_NONE
+static size_t ws_layout_next(const ws_cfg *const cfg, const uint64_t *const counts, const uint64_t *const taken,
+                             const char *const placed, const size_t b) {
+    const ws_block *const block = cfg->blocks + b;
+    const size_t fall = block->successors[0];
+    const size_t target = block->successors[1];
+
+    // only the target of a jump can follow a block, a branch would still have to jump there
+    if (fall == WS_CFG_NONE) {
+        return (target != WS_CFG_NONE && !placed[target])? target: WS_CFG_NONE;
+    }
+    if (!placed[fall] && (counts[fall] || !counts[b]) &&
+        (target == WS_CFG_NONE || taken[b] / WS_LAYOUT_TAKEN <= counts[b] - taken[b])) {
+        return fall;
+    }
+    return WS_CFG_NONE;
+}
+
+void ws_layout(ws_program *const program) {
+    ws_block_profile *const profile = program->profile;
+    program->profile = NULL;
+    if (!program->length) {
+        ws_block_profile_free(profile);
+        return;
+    }
+
+    ws_cfg cfg;
+    ws_cfg_build(&cfg, program);
+
+    uint64_t *const counts = (uint64_t *)calloc(cfg.length, sizeof(uint64_t));
+    uint64_t *const taken = (uint64_t *)calloc(cfg.length, sizeof(uint64_t));
+    size_t b;
+    for(size_t i = 0; i < profile->length; i++) {
+        const ws_block_count *const count = profile->blocks + i;
+        if (count->start < program->length && cfg.blocks[b = cfg.block_of[count->start]].start == count->start &&
+            count->taken <= count->count) {
+            counts[b] = count->count;
+            taken[b] = count->taken;
+        }
+    }
+    ws_block_profile_free(profile);
+
+    ws_layout_start *const starts = (ws_layout_start *)malloc(sizeof(ws_layout_start) * cfg.length);
+    for(b = 0; b < cfg.length; b++) {
+        starts[b].count = counts[b];
+        starts[b].block = b;
+    }
+    qsort(starts, cfg.length, sizeof(ws_layout_start), ws_layout_compare);
+
+    size_t *const order = (size_t *)malloc(sizeof(size_t) * cfg.length);
+    char *const placed = (char *)calloc(cfg.length, 1);
+    size_t length = 0;
+    for(size_t i = 0; i <= cfg.length; i++) {
+        // the entry goes first
+        b = i? starts[i - 1].block: 0;
+        while (b != WS_CFG_NONE && !placed[b]) {
+            placed[b] = 1;
+            order[length++] = b;
+            b = ws_layout_next(&cfg, counts, taken, placed, b);
+        }
+    }
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, cfg.length);
+
+    const ws_block *block;
+    ws_command *command, fallthrough;
+    size_t next;
+
+    memset(&fallthrough, 0, sizeof(ws_command));
+    fallthrough.type = jump;
+
+    for(size_t k = 0; k < length; k++) {
+        block = cfg.blocks + order[k];
+        next = (k + 1 < length)? cfg.blocks[order[k + 1]].start: program->length;
+
+        for(size_t i = block->start; i < block->end - 1; i++) {
+            ws_rewrite_emit(&rewrite, i, program->commands + i);
+        }
+
+        command = program->commands + block->end - 1;
+        if (command->type == jump && command->jumpoffset == next) {
+            rewrite.remap[block->end - 1] = rewrite.length;
+            ws_command_discard_parameter(command);
+        } else {
+            ws_rewrite_emit(&rewrite, block->end - 1, command);
+        }
+
+        if (!ws_ends_block(command->type) && block->end != next) {
+            fallthrough.jumpoffset = block->end;
+            ws_rewrite_append(&rewrite, &fallthrough);
+        }
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(placed);
+    free(order);
+    free(starts);
+    free(taken);
+    free(counts);
+    ws_cfg_finish(&cfg);
+}
+
+
+
+/* The peephole optimizer looks at small windows of commands and replaces them by a single superinstruction.
+ * A window is only replaced if nothing but its first command can be jumped to.
+ * The patterns, with a and b as literal numbers, which for immediates have to be small ints:
+ *
+ * push a; multiply; push b; add    multiplyadd (immediate a, addend b), also with subtract (addend -b)
+ * push a; push b; set              storeimmediate (parameter a, immediate b)
+ * push 0; swap; subtract           negate
+ * push a; swap; set                setimmediate (parameter a)
+ * push a; subtract; jumpifzero     jumpifequalimmediate (immediate a)
+ * push a; subtract; jumpifnegative jumpiflessimmediate (immediate a)
+ * push a; add                      addimmediate (immediate a, operation add)
+ * push a; subtract                 addimmediate (immediate -a, operation subtract)
+ * push a; get                      getimmediate (parameter a)
+ * subtract; jumpifzero             jumpifequal
+ * subtract; jumpifnegative         jumpifless
+ * duplicate; jumpifzero            duplicatejumpifzero
+ * duplicate; jumpifnegative        duplicatejumpifnegative
+ * push a; push b                   pushpush (immediate a, parameter b)
+ * push a; setslot                  storeslot (parameter a)
+ */
+#define WS_IS_SMALL_PUSH(command) ((command)->type == push && !(command)->parameter.length)
+
+// checks if the window of length commands at i exists, and can't be entered anywhere but at the start
+static int ws_peephole_window(const ws_program *const program, const char *const targets, const size_t i, const size_t length) {
+    if (i + length > program->length) {
+        return 0;
+    }
+    for(size_t j = 1; j < length; j++) {
+        if (targets[i + j]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// returns the superinstruction for a window and how many commands it replaces, or 0 if nothing matches
+static size_t ws_peephole_match(ws_command *const result, const ws_program *const program, const char *const targets, const size_t i) {
+    const ws_command *const c = program->commands + i;
+    *result = c[0];
+
+    if (ws_peephole_window(program, targets, i, 4)) {
+        if (WS_IS_SMALL_PUSH(c) && c[1].type == multiply && WS_IS_SMALL_PUSH(c + 2) && (c[3].type == add || c[3].type == subtract)) {
+            result->type = multiplyadd;
+            result->immediate = c[0].parameter.data;
+            result->addend = (c[3].type == add)? c[2].parameter.data: -c[2].parameter.data;
+            return 4;
+        }
+    }
+
+    if (ws_peephole_window(program, targets, i, 3)) {
+        if (c[0].type == push && WS_IS_SMALL_PUSH(c + 1) && c[2].type == set) {
+            result->type = storeimmediate;
+            result->immediate = c[1].parameter.data;
+            return 3;
+        }
+        if (WS_IS_SMALL_PUSH(c) && c[0].parameter.data == 0 && c[1].type == swap && c[2].type == subtract) {
+            result->type = negate;
+            return 3;
+        }
+        if (c[0].type == push && c[1].type == swap && c[2].type == set) {
+            result->type = setimmediate;
+            return 3;
+        }
+        if (WS_IS_SMALL_PUSH(c) && c[1].type == subtract && (c[2].type == jumpifzero || c[2].type == jumpifnegative)) {
+            result->type = (c[2].type == jumpifzero)? jumpifequalimmediate: jumpiflessimmediate;
+            result->immediate = c[0].parameter.data;
+            result->jumpoffset = c[2].jumpoffset;
+            return 3;
+        }
+    }
+
+    if (ws_peephole_window(program, targets, i, 2)) {
+        if (WS_IS_SMALL_PUSH(c) && (c[1].type == add || c[1].type == subtract)) {
+            result->type = addimmediate;
+            result->immediate = (c[1].type == add)? c[0].parameter.data: -c[0].parameter.data;
+            result->operation = c[1].type;
+            return 2;
+        }
+        if (c[0].type == push && c[1].type == get) {
+            result->type = getimmediate;
+            return 2;
+        }
+        if (c[0].type == subtract && (c[1].type == jumpifzero || c[1].type == jumpifnegative)) {
+            result->type = (c[1].type == jumpifzero)? jumpifequal: jumpifless;
+            result->jumpoffset = c[1].jumpoffset;
+            return 2;
+        }
+        if (c[0].type == duplicate && (c[1].type == jumpifzero || c[1].type == jumpifnegative)) {
+            result->type = (c[1].type == jumpifzero)? duplicatejumpifzero: duplicatejumpifnegative;
+            result->jumpoffset = c[1].jumpoffset;
+            return 2;
+        }
+        if (c[0].type == push && c[1].type == setslot) {
+            result->type = storeslot;
+            result->immediate = c[1].immediate;
+            return 2;
+        }
+        if (WS_IS_SMALL_PUSH(c) && c[1].type == push) {
+            result->type = pushpush;
+            result->immediate = c[0].parameter.data;
+            result->parameter = c[1].parameter;
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+void ws_peephole(ws_program *const program) {
+    char *const targets = ws_jump_targets(program);
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, 0);
+
+    ws_command fused, next;
+    size_t replaced;
+    size_t i = 0;
+
+    while (i < program->length) {
+        replaced = ws_peephole_match(&fused, program, targets, i);
+
+        // pushpush only saves a single dispatch, so any other superinstruction starting at the second push goes first
+        if (replaced && fused.type == pushpush && ws_peephole_match(&next, program, targets, i + 1) && next.type != pushpush) {
+            replaced = 0;
+        }
+
+        if (!replaced) {
+            ws_rewrite_emit(&rewrite, i, program->commands + i);
+            i++;
+            continue;
+        }
+
+        // the parameter of the first push is the only one which can be moved into the superinstruction,
+        // unless pushpush took the second one
+        ws_rewrite_emit(&rewrite, i, &fused);
+        for(size_t j = 1; j < replaced; j++) {
+            rewrite.remap[i + j] = rewrite.remap[i];
+            if (fused.type != pushpush) {
+                ws_command_discard_parameter(program->commands + i + j);
+            }
+#if DEBUG
+            else {
+                ws_string_free(&program->commands[i + j].text);
+            }
+#endif
+        }
+        i += replaced;
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(targets);
+}
+
+/* Labels don't do anything once a program is compiled, so they are removed from the program and
+ * any jumps to them end up at the next command.
+ * Before that, jump chains are threaded: a jump to a jump goes straight to the final target, and a jump to
+ * endprogram or endsubroutine is replaced by that command. A jump to the next command disappears.
+ * Anything that can't be reached from the start of the program is removed as well.
+ */
+static size_t ws_thread_target(const ws_program *const program, size_t index) {
+    for(size_t steps = 0; steps < WS_THREAD_LIMIT; steps++) {
+        while (index < program->length && program->commands[index].type == label) {
+            index++;
+        }
+        if (index == program->length || program->commands[index].type != jump) {
+            break;
+        }
+        index = program->commands[index].jumpoffset;
+    }
+    return index;
+}
+
+void ws_strip(ws_program *const program) {
+    ws_command *command;
+    size_t target;
+
+    for(size_t i = 0; i < program->length; i++) {
+        command = program->commands + i;
+        if (!ws_label_map[command->type] || command->type == label) {
+            continue;
+        }
+
+        command->jumpoffset = ws_thread_target(program, command->jumpoffset);
+        if (command->type == jump && command->jumpoffset < program->length &&
+            (program->commands[command->jumpoffset].type == endprogram ||
+             program->commands[command->jumpoffset].type == endsubroutine)) {
+            command->type = program->commands[command->jumpoffset].type;
+        }
+    }
+
+    char *const reachable = ws_reachable(program);
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, 0);
+
+    for(size_t i = 0; i < program->length; i++) {
+        command = program->commands + i;
+
+        if (command->type == jump && reachable[i]) {
+            // check if everything up to the target is going to be removed
+            target = i + 1;
+            while (target < command->jumpoffset && (!reachable[target] || program->commands[target].type == label)) {
+                target++;
+            }
+            if (target == command->jumpoffset) {
+                reachable[i] = 0;
+            }
+        }
+
+        if (command->type == label || !reachable[i]) {
+            rewrite.remap[i] = rewrite.length;
+            ws_command_discard_parameter(command);
+        } else {
+            ws_rewrite_emit(&rewrite, i, command);
+        }
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(reachable);
+}
+
+/* Calls to small leaf subroutines are replaced by a copy of the subroutine. Only subroutines that run straight
+ * through to their endsubroutine qualify, so nothing in a copy jumps anywhere or can be jumped to.
+ * The subroutine itself stays for any other callers, until the next strip finds out there aren't any.
+ */
+// returns the amount of commands before the endsubroutine, or WS_INLINE_NONE if the subroutine can't be inlined
+static size_t ws_inline_length(const ws_program *const program, const size_t entry) {
+    ws_command_type type;
+
+    for(size_t i = entry; i < program->length && i - entry <= WS_INLINE_LIMIT; i++) {
+        type = program->commands[i].type;
+        if (type == endsubroutine) {
+            return i - entry;
+        }
+        if (ws_label_map[type] || type == endprogram) {
+            break;
+        }
+    }
+    return WS_INLINE_NONE;
+}
+
+void ws_inline(ws_program *const program) {
+    size_t *const lengths = (size_t *)malloc(sizeof(size_t) * (program->length + 1));
+    size_t extra = 0;
+    const ws_command *command, *original;
+    ws_command copy;
+
+    for(size_t i = 0; i < program->length; i++) {
+        lengths[i] = WS_INLINE_NONE;
+        if (program->commands[i].type == call) {
+            lengths[i] = ws_inline_length(program, program->commands[i].jumpoffset);
+            if (lengths[i] != WS_INLINE_NONE && lengths[i] > 1) {
+                extra += lengths[i] - 1;
+            }
+        }
+    }
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, extra);
+
+    for(size_t i = 0; i < program->length; i++) {
+        command = program->commands + i;
+        if (lengths[i] == WS_INLINE_NONE) {
+            ws_rewrite_emit(&rewrite, i, command);
+            continue;
+        }
+
+        rewrite.remap[i] = rewrite.length;
+        for(size_t j = 0; j < lengths[i]; j++) {
+            original = program->commands + command->jumpoffset + j;
+            copy = *original;
+            if (ws_parameter_map[copy.type]) {
+                ws_int_copy(&copy.parameter, &original->parameter);
+            }
+#if DEBUG
+            ws_strcpy(&copy.text, &original->text);
+#endif
+            ws_rewrite_append(&rewrite, &copy);
+        }
+        ws_command_discard_parameter(program->commands + i);
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(lengths);
+}
+
+/* Constant folding evaluates everything that only works on values pushed earlier in the same block at compile time.
+ * Pushes are held back as pending values, and commands that only touch pending values act on those instead of being
+ * emitted: duplicate, swap, discard and slide, add, subtract and multiply, and divide and modulo on small ints with
+ * a nonzero divisor, as the machine would fail on the others. Copy indexes from the bottom of the stack, so it is
+ * only folded at the start of the program, where the whole stack is known.
+ * A conditional jump on a pending value turns into a jump or disappears, and the strip pass that runs afterwards
+ * removes the branches which can't be reached anymore.
+ * Anything else, and the start of every block, first emits the pending values as pushes.
+ *
+ * A pending value is the command that produced it turned into a push, so it keeps its debug text.
+ */
+typedef struct {
+    ws_command *values;
+    size_t length;
+    int exact; //nothing is on the stack below the pending values
+} ws_fold_stack;
+
+static void ws_fold_flush(ws_fold_stack *const pending, ws_rewrite *const rewrite) {
+    for(size_t i = 0; i < pending->length; i++) {
+        ws_rewrite_append(rewrite, pending->values + i);
+    }
+    pending->length = 0;
+    pending->exact = 0;
+}
+
+// returns 1 if command was evaluated on the pending values, in which case it was consumed
+static int ws_fold_command(ws_fold_stack *const pending, ws_rewrite *const rewrite, const size_t index, ws_command *const command) {
+    ws_command *const top = pending->values + pending->length - 1;
+    ws_int result;
+    int condition;
+
+    switch (command->type) {
+        case push:
+            pending->values[pending->length++] = *command;
+            return 1;
+
+        case duplicate:
+            if (pending->length < 1) {
+                return 0;
+            }
+            pending->values[pending->length] = *command;
+            pending->values[pending->length].type = push;
+            ws_int_copy(&pending->values[pending->length++].parameter, &top->parameter);
+            return 1;
+
+        case copy:
+            if (!pending->exact || command->parameter.length || command->parameter.data < 0 ||
+                (size_t)command->parameter.data >= pending->length) {
+                return 0;
+            }
+            ws_int_copy(&result, &pending->values[command->parameter.data].parameter);
+            ws_int_free(&command->parameter);
+            command->type = push;
+            command->parameter = result;
+            pending->values[pending->length++] = *command;
+            return 1;
+
+        case swap:
+            if (pending->length < 2) {
+                return 0;
+            }
+            result = top[-1].parameter;
+            top[-1].parameter = top->parameter;
+            top->parameter = result;
+            ws_command_discard_parameter(command);
+            return 1;
+
+        case discard:
+            if (pending->length < 1) {
+                return 0;
+            }
+            ws_command_discard_parameter(top);
+            ws_command_discard_parameter(command);
+            pending->length--;
+            return 1;
+
+        case slide:
+            if (command->parameter.length || command->parameter.data < 0 ||
+                (size_t)command->parameter.data >= pending->length) {
+                return 0;
+            }
+            for(sdigit i = 0; i < command->parameter.data; i++) {
+                ws_command_discard_parameter(top - i - 1);
+            }
+            pending->length -= command->parameter.data;
+            pending->values[pending->length - 1] = *top;
+            ws_command_discard_parameter(command);
+            return 1;
+
+        case divide:
+        case modulo:
+            if (pending->length < 2 || top[-1].parameter.length || top->parameter.length || !top->parameter.data) {
+                return 0;
+            }
+            // fall through
+        case add:
+        case subtract:
+        case multiply:
+            if (pending->length < 2) {
+                return 0;
+            }
+            switch (command->type) {
+                case add:
+                    ws_int_add(&result, &top[-1].parameter, &top->parameter);
+                    break;
+                case subtract:
+                    ws_int_subtract(&result, &top[-1].parameter, &top->parameter);
+                    break;
+                case multiply:
+                    ws_int_multiply(&result, &top[-1].parameter, &top->parameter);
+                    break;
+                case divide:
+                    ws_int_divide(&result, &top[-1].parameter, &top->parameter);
+                    break;
+                default:
+                    ws_int_modulo(&result, &top[-1].parameter, &top->parameter);
+                    break;
+            }
+            ws_command_discard_parameter(top - 1);
+            ws_command_discard_parameter(top);
+            pending->length -= 2;
+            command->type = push;
+            command->parameter = result;
+            pending->values[pending->length++] = *command;
+            return 1;
+
+        case jumpifzero:
+        case jumpifnegative:
+            if (pending->length < 1) {
+                return 0;
+            }
+            condition = (command->type == jumpifzero)? ws_int_iszero(&top->parameter): ws_int_isnegative(&top->parameter);
+            ws_command_discard_parameter(top);
+            pending->length--;
+            if (condition) {
+                ws_fold_flush(pending, rewrite);
+                command->type = jump;
+                ws_rewrite_emit(rewrite, index, command);
+            } else {
+                ws_command_discard_parameter(command);
+            }
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+void ws_fold(ws_program *const program) {
+    char *const targets = ws_jump_targets(program);
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, 0);
+
+    // every pending value comes from a different command, so this can't run out
+    ws_fold_stack pending;
+    pending.values = (ws_command *)malloc(sizeof(ws_command) * (program->length + 1));
+    pending.length = 0;
+    pending.exact = 1;
+
+    ws_command *command;
+
+    // the stack is only known to be empty at the start if nothing jumps back there
+    for(size_t i = 0; i < program->length; i++) {
+        command = program->commands + i;
+        if (ws_label_map[command->type] && command->type != label && !command->jumpoffset) {
+            pending.exact = 0;
+        }
+    }
+
+    for(size_t i = 0; i < program->length; i++) {
+        command = program->commands + i;
+        if (targets[i] && i) {
+            ws_fold_flush(&pending, &rewrite);
+        }
+
+        // removed commands end up at whatever gets emitted next, which is only observable at the start of a block
+        rewrite.remap[i] = rewrite.length;
+        if (!ws_fold_command(&pending, &rewrite, i, command)) {
+            ws_fold_flush(&pending, &rewrite);
+            ws_rewrite_emit(&rewrite, i, command);
+        }
+    }
+    ws_fold_flush(&pending, &rewrite);
+
+    ws_rewrite_finish(&rewrite, program);
+    free(pending.values);
+    free(targets);
+}
+
+/* Literal output: a run of pushes of small ints and printchars, in which every printchar prints a value pushed in the
+ * run, becomes a single printstring followed by the pushes that weren't printed.
+ * Strings are also often pushed all at once, on top of a zero, and then printed by a loop:
+ *
+ * L: duplicate; jumpifzero E; printchar; jump L
+ *
+ * If nothing but the loop itself jumps to L, the run continues into the loop. It prints the pushed values down to
+ * the zero and then jumps to E, past E if that discards the zero, or if there is no zero, goes on with the loop for
+ * whatever was on the stack before.
+ */
+// returns where the print loop at index exits to if the run before it can go through it, or WS_PRINT_NONE
+static size_t ws_print_loop(const ws_program *const program, const size_t *const entries, const size_t index) {
+    const ws_command *const c = program->commands + index;
+    if (index + 4 > program->length || entries[index] != 1 || entries[index + 1] || entries[index + 2] || entries[index + 3] ||
+        c[0].type != duplicate || c[1].type != jumpifzero || c[2].type != printchar ||
+        c[3].type != jump || c[3].jumpoffset != index) {
+        return WS_PRINT_NONE;
+    }
+    return c[1].jumpoffset;
+}
+
+void ws_print(ws_program *const program) {
+    // how many commands can go to every index other than by falling through
+    size_t *const entries = (size_t *)calloc(program->length + 1, sizeof(size_t));
+    entries[0] = 1;
+    for(size_t i = 0; i < program->length; i++) {
+        if (ws_label_map[program->commands[i].type]) {
+            entries[program->commands[i].jumpoffset]++;
+        }
+        if (program->commands[i].type == call) {
+            entries[i + 1]++;
+        }
+    }
+
+    // the pushes that weren't printed yet, and what was printed
+    size_t *const pending = (size_t *)malloc(sizeof(size_t) * (program->length + 1));
+    char *const buffer = (char *)malloc(program->length + 1);
+    size_t pending_length, printed, end, exit;
+    const ws_command *command;
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, program->length);
+
+    ws_command output, leave;
+    memset(&output, 0, sizeof(ws_command));
+    output.type = printstring;
+    memset(&leave, 0, sizeof(ws_command));
+    leave.type = jump;
+
+    size_t i = 0;
+    while (i < program->length) {
+        pending_length = 0;
+        printed = 0;
+        for(end = i; end < program->length && (end == i || !entries[end]); end++) {
+            command = program->commands + end;
+            if (WS_IS_SMALL_PUSH(command)) {
+                pending[pending_length++] = end;
+            } else if (command->type == printchar && pending_length) {
+                buffer[printed++] = (char)program->commands[pending[--pending_length]].parameter.data;
+            } else {
+                break;
+            }
+        }
+
+        exit = WS_PRINT_NONE;
+        if (pending_length && end < program->length && program->commands[end].type == duplicate) {
+            exit = ws_print_loop(program, entries, end);
+        }
+        if (exit != WS_PRINT_NONE) {
+            while (pending_length && program->commands[pending[pending_length - 1]].parameter.data) {
+                buffer[printed++] = (char)program->commands[pending[--pending_length]].parameter.data;
+            }
+            if (!pending_length) {
+                // the loop goes on with the stack from before the run
+                exit = WS_PRINT_NONE;
+            } else if (exit < program->length && program->commands[exit].type == discard) {
+                // the zero usually gets discarded right away, so it doesn't have to be pushed at all
+                pending_length--;
+                exit++;
+            }
+        }
+
+        // a run which prints nothing is only pushes, and any part of it would print nothing either
+        if (!printed) {
+            do {
+                ws_rewrite_emit(&rewrite, i, program->commands + i);
+                i++;
+            } while (i < end);
+            continue;
+        }
+
+        output.string.data = (char *)malloc(printed);
+        output.string.length = printed;
+        memcpy(output.string.data, buffer, printed);
+        ws_rewrite_emit(&rewrite, i, &output);
+
+        // the pushes that are left stay in order, everything else in the run goes
+        for(size_t j = i, k = 0; j < end; j++) {
+            if (j != i) {
+                rewrite.remap[j] = rewrite.remap[i];
+            }
+            if (k < pending_length && pending[k] == j) {
+                ws_rewrite_append(&rewrite, program->commands + j);
+                k++;
+            } else {
+                ws_command_discard_parameter(program->commands + j);
+            }
+        }
+        if (exit != WS_PRINT_NONE) {
+            leave.jumpoffset = exit;
+            ws_rewrite_append(&rewrite, &leave);
+        }
+        i = end;
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(buffer);
+    free(pending);
+    free(entries);
+}
+
+/* Heap addresses which are pushed as a constant right before they are used get a slot of their own in the heap,
+ * which the slot commands can get to without hashing the address. The push of the address is removed, and
+ * the get or set that uses it becomes a getslot or setslot. That works for:
+ *
+ * push a; get
+ * push a; swap; set
+ * push a; ...; set     where the commands in between only work on what they push themselves, and end with one value
+ *
+ * The value of a promoted address lives only in its slot, and the heap sends computed addresses which equal it
+ * there too (see ws_heap_slots in wsmachine.h), so both ways of getting to it always agree.
+ * copy counts from the bottom of the stack, which changes once the address isn't pushed, so it ends the search.
+ */
+typedef struct {
+    ws_int *keys;
+    size_t length;
+    size_t *table;  //slot + 1 of every key, 0 for unused positions
+    size_t mask;
+} ws_slot_map;
+
+static size_t ws_slot_of(ws_slot_map *const map, const ws_int *const address) {
+    size_t position = ws_int_hash(address) & map->mask;
+    while (map->table[position]) {
+        if (!ws_int_compare(map->keys + map->table[position] - 1, address)) {
+            return map->table[position] - 1;
+        }
+        position = (position + 1) & map->mask;
+    }
+    ws_int_copy(map->keys + map->length, address);
+    map->table[position] = ++map->length;
+    return map->length - 1;
+}
+
+// returns the index of the get or set which uses the address pushed at index, or WS_PROMOTE_NONE
+static size_t ws_promote_user(const ws_program *const program, const char *const targets, const size_t *const users, const size_t index) {
+    const ws_command *command;
+    long need, net;
+    long above = 0; //the amount of values on top of the address
+
+    for(size_t i = index + 1; i < program->length && i <= index + WS_PROMOTE_WINDOW && !targets[i]; i++) {
+        command = program->commands + i;
+        if (users[i] != WS_PROMOTE_NONE) {
+            break;
+        }
+        if (command->type == get && above == 0) {
+            return i;
+        }
+        if (command->type == set && above == 1) {
+            return i;
+        }
+        if (command->type == swap && i == index + 1 && i + 1 < program->length && !targets[i + 1] &&
+            program->commands[i + 1].type == set && users[i + 1] == WS_PROMOTE_NONE) {
+            return i + 1;
+        }
+        if (ws_label_map[command->type] || command->type == endsubroutine || command->type == endprogram || command->type == copy) {
+            break;
+        }
+
+        ws_stack_effect(command, &need, &net);
+        if (need > above) {
+            break;
+        }
+        above += net;
+    }
+    return WS_PROMOTE_NONE;
+}
+
+void ws_promote(ws_program *const program) {
+    char *const targets = ws_jump_targets(program);
+    // for every command, the push of the address it uses, or the get or set using the address it pushes
+    size_t *const users = (size_t *)malloc(sizeof(size_t) * (program->length + 1));
+    size_t user;
+
+    ws_slot_map map;
+    map.keys = (ws_int *)malloc(sizeof(ws_int) * (program->length + 1));
+    map.length = 0;
+    for(map.mask = 15; map.mask < 2 * program->length; map.mask = map.mask * 2 + 1);
+    map.table = (size_t *)calloc(map.mask + 1, sizeof(size_t));
+
+    for(size_t i = 0; i < program->length; i++) {
+        users[i] = WS_PROMOTE_NONE;
+    }
+    for(size_t i = 0; i < program->length; i++) {
+        if (program->commands[i].type == push && users[i] == WS_PROMOTE_NONE) {
+            user = ws_promote_user(program, targets, users, i);
+            if (user != WS_PROMOTE_NONE) {
+                users[i] = user;
+                users[user] = i;
+            }
+        }
+    }
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, 0);
+    ws_command *command;
+
+    for(size_t i = 0; i < program->length; i++) {
+        command = program->commands + i;
+        user = users[i];
+
+        if (user == WS_PROMOTE_NONE) {
+            ws_rewrite_emit(&rewrite, i, command);
+
+        } else if (user > i) {
+            // the push of the address goes, and so does the swap of push a; swap; set
+            program->commands[user].immediate = (sdigit)ws_slot_of(&map, &command->parameter);
+            rewrite.remap[i] = rewrite.length;
+            ws_command_discard_parameter(command);
+            if (user == i + 2 && program->commands[i + 1].type == swap) {
+                rewrite.remap[++i] = rewrite.length;
+                ws_command_discard_parameter(program->commands + i);
+            }
+
+        } else {
+            command->type = (command->type == get)? getslot: setslot;
+            ws_rewrite_emit(&rewrite, i, command);
+        }
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+
+    program->slots = (ws_int *)realloc(map.keys, sizeof(ws_int) * (map.length + 1));
+    program->slots_length = map.length;
+    free(map.table);
+    free(users);
+    free(targets);
+}
+
+/* Fill and copy loops walk over consecutive heap addresses, with the address on top of the stack. After the peephole
+ * optimizer they look like this, with v, o and n as small ints:
+ *
+ * fill body: duplicate; push v; set
+ * copy body: duplicate; duplicate; addimmediate o; get; set          (heap[a] = heap[a + o])
+ *
+ * L: body; addimmediate 1; duplicate; jumpiflessimmediate n L
+ * L: duplicate; jumpifequalimmediate n E; body; addimmediate 1; jump L
+ *
+ * A fillheap or copyheap (immediate v or o, limit n) in front of the loop does all of its iterations in one go when
+ * the address is below n, and then jumps to where the loop exits. In every other case it continues with the loop
+ * itself, which stays where it was to handle them. Everything that jumped to the loop ends up at the bulk command.
+ */
+// returns if the loop from start up to and including index can be done by a bulk command
+static int ws_bulk_match(ws_command *const bulk, const ws_program *const program, const char *const targets,
+                         const size_t start, const size_t index) {
+    const ws_command *const c = program->commands + start;
+    const size_t length = index + 1 - start;
+    memset(bulk, 0, sizeof(ws_command));
+
+    for(size_t i = start + 1; i <= index; i++) {
+        if (targets[i]) {
+            return 0;
+        }
+    }
+
+    // the test, after which only the body is left in c[body] up to c[body + size]
+    size_t body, size;
+    if (program->commands[index].type == jumpiflessimmediate && length >= 3 &&
+        c[length - 3].type == addimmediate && c[length - 3].immediate == 1 && c[length - 2].type == duplicate) {
+        bulk->limit = c[length - 1].immediate;
+        bulk->jumpoffset = index + 1;
+        body = 0;
+        size = length - 3;
+    } else if (program->commands[index].type == jump && length >= 4 &&
+               c[0].type == duplicate && c[1].type == jumpifequalimmediate &&
+               c[length - 2].type == addimmediate && c[length - 2].immediate == 1) {
+        bulk->limit = c[1].immediate;
+        bulk->jumpoffset = c[1].jumpoffset;
+        body = 2;
+        size = length - 4;
+    } else {
+        return 0;
+    }
+
+    if (size == 3 && c[body].type == duplicate && WS_IS_SMALL_PUSH(c + body + 1) && c[body + 2].type == set) {
+        bulk->type = fillheap;
+        bulk->immediate = c[body + 1].parameter.data;
+        return 1;
+    }
+    if (size == 5 && c[body].type == duplicate && c[body + 1].type == duplicate && c[body + 2].type == addimmediate &&
+        c[body + 3].type == get && c[body + 4].type == set) {
+        bulk->type = copyheap;
+        bulk->immediate = c[body + 2].immediate;
+        return 1;
+    }
+    return 0;
+}
+
+void ws_bulk(ws_program *const program) {
+    char *const targets = ws_jump_targets(program);
+    ws_cfg cfg;
+    ws_cfg_build(&cfg, program);
+
+    // the loop every command starts, if any
+    ws_command *const bulks = (ws_command *)malloc(sizeof(ws_command) * (program->length + 1));
+    char *const starts = (char *)calloc(program->length + 1, sizeof(char));
+    size_t bulks_length = 0;
+    const ws_command *last;
+
+    for(size_t b = 0; b < cfg.length; b++) {
+        if (cfg.blocks[b].successors[1] == WS_CFG_NONE || cfg.blocks[b].successors[1] > b) {
+            continue;
+        }
+        last = program->commands + cfg.blocks[b].end - 1;
+        if (!starts[last->jumpoffset] &&
+            ws_bulk_match(bulks + last->jumpoffset, program, targets, last->jumpoffset, cfg.blocks[b].end - 1)) {
+            starts[last->jumpoffset] = 1;
+            bulks_length++;
+        }
+    }
+    ws_cfg_finish(&cfg);
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, bulks_length);
+    for(size_t i = 0; i < program->length; i++) {
+        if (starts[i]) {
+            ws_rewrite_emit(&rewrite, i, bulks + i);
+            ws_rewrite_append(&rewrite, program->commands + i);
+        } else {
+            ws_rewrite_emit(&rewrite, i, program->commands + i);
+        }
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(starts);
+    free(bulks);
+    free(targets);
+}
+
+/* Counted loops are found by looking at the back edges of the control flow graph: branches to a block that doesn't
+ * come after their own. If the commands leading up to one count a loop counter and test it, they are replaced by a
+ * single loop command. The patterns, with k as a slot, n as a small int and E as where the loop exits to:
+ *
+ * addimmediate a; duplicatejumpifzero E; jump L                          decrementjumpifnonzero (immediate -a)
+ * addimmediate 1; duplicate; jumpifequalimmediate n E; jump L            incrementjumpifnotequal (immediate n)
+ * getslot k; addimmediate -1; setslot k; getslot k; jumpifzero E; jump L decrementslotjumpifnonzero (immediate k)
+ * getslot k; addimmediate 1; setslot k; getslot k; jumpiflessimmediate n L
+ *                                                                        incrementslotjumpifless (immediate k, limit n)
+ *
+ * The loop command continues with the next command when the loop ends, so unless E is the command after the
+ * window a jump to E follows it. Like with the peephole optimizer, only the first command can be a jump target.
+ * The loop commands on the stack keep the operation of their addimmediate, as their errors name it.
+ */
+static int ws_loop_window(const char *const targets, const size_t start, const size_t end) {
+    for(size_t i = start + 1; i <= end; i++) {
+        if (targets[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// returns how many commands ending at the back edge at index are replaced by loop, or 0
+static size_t ws_loop_match(ws_command *const loop, size_t *const exit, const ws_program *const program,
+                            const char *const targets, const size_t index) {
+    const ws_command *const c = program->commands + index;
+    *loop = *c;
+    *exit = index + 1;
+
+    if (c->type == jump && index >= 2 && ws_loop_window(targets, index - 2, index) &&
+        c[-2].type == addimmediate && c[-2].immediate != -c[-2].immediate && c[-1].type == duplicatejumpifzero) {
+        loop->type = decrementjumpifnonzero;
+        loop->immediate = -c[-2].immediate;
+        loop->operation = c[-2].operation;
+        *exit = c[-1].jumpoffset;
+        return 3;
+    }
+    if (c->type == jump && index >= 3 && ws_loop_window(targets, index - 3, index) &&
+        c[-3].type == addimmediate && c[-3].immediate == 1 && c[-2].type == duplicate && c[-1].type == jumpifequalimmediate) {
+        loop->type = incrementjumpifnotequal;
+        loop->immediate = c[-1].immediate;
+        loop->operation = c[-3].operation;
+        *exit = c[-1].jumpoffset;
+        return 4;
+    }
+    if (c->type == jump && index >= 5 && ws_loop_window(targets, index - 5, index) &&
+        c[-5].type == getslot && c[-4].type == addimmediate && c[-4].immediate == -1 && c[-3].type == setslot &&
+        c[-2].type == getslot && c[-1].type == jumpifzero &&
+        c[-3].immediate == c[-5].immediate && c[-2].immediate == c[-5].immediate) {
+        loop->type = decrementslotjumpifnonzero;
+        loop->immediate = c[-5].immediate;
+        *exit = c[-1].jumpoffset;
+        return 6;
+    }
+    if (c->type == jumpiflessimmediate && index >= 4 && ws_loop_window(targets, index - 4, index) &&
+        c[-4].type == getslot && c[-3].type == addimmediate && c[-3].immediate == 1 && c[-2].type == setslot &&
+        c[-1].type == getslot && c[-2].immediate == c[-4].immediate && c[-1].immediate == c[-4].immediate) {
+        loop->type = incrementslotjumpifless;
+        loop->immediate = c[-4].immediate;
+        loop->limit = c->immediate;
+        return 5;
+    }
+    return 0;
+}
+
+void ws_loops(ws_program *const program) {
+    char *const targets = ws_jump_targets(program);
+    ws_cfg cfg;
+    ws_cfg_build(&cfg, program);
+
+    // where each loop command starts, how many commands it replaces, where it exits to and the command itself
+    size_t *const starts = (size_t *)malloc(sizeof(size_t) * (cfg.length + 1));
+    size_t *const lengths = (size_t *)malloc(sizeof(size_t) * (cfg.length + 1));
+    size_t *const exits = (size_t *)malloc(sizeof(size_t) * (cfg.length + 1));
+    ws_command *const loops = (ws_command *)malloc(sizeof(ws_command) * (cfg.length + 1));
+    size_t loops_length = 0;
+    size_t replaced, last;
+
+    // the blocks are in program order, so the loops are as well
+    for(size_t b = 0; b < cfg.length; b++) {
+        if (cfg.blocks[b].successors[1] == WS_CFG_NONE || cfg.blocks[b].successors[1] > b) {
+            continue;
+        }
+        last = cfg.blocks[b].end - 1;
+        replaced = ws_loop_match(loops + loops_length, exits + loops_length, program, targets, last);
+        // only a jump or jumpiflessimmediate ends a window and a window never contains one before its end
+        if (replaced && (!loops_length || last + 1 - replaced >= starts[loops_length - 1] + lengths[loops_length - 1])) {
+            lengths[loops_length] = replaced;
+            starts[loops_length++] = last + 1 - replaced;
+        }
+    }
+    ws_cfg_finish(&cfg);
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, loops_length);
+
+    ws_command leave;
+    memset(&leave, 0, sizeof(ws_command));
+    leave.type = jump;
+
+    size_t loop = 0;
+    size_t i = 0;
+    while (i < program->length) {
+        if (loop == loops_length || i != starts[loop]) {
+            ws_rewrite_emit(&rewrite, i, program->commands + i);
+            i++;
+            continue;
+        }
+
+        // none of the replaced commands own a parameter, only the debug text of the first one is kept
+#if DEBUG
+        loops[loop].text = program->commands[i].text;
+#endif
+        ws_rewrite_emit(&rewrite, i, loops + loop);
+        for(size_t j = 1; j < lengths[loop]; j++) {
+            rewrite.remap[i + j] = rewrite.remap[i];
+            ws_command_discard_parameter(program->commands + i + j);
+        }
+        i += lengths[loop];
+
+        if (exits[loop] != i) {
+            leave.jumpoffset = exits[loop];
+            ws_rewrite_append(&rewrite, &leave);
+        }
+        loop++;
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(loops);
+    free(exits);
+    free(lengths);
+    free(starts);
+    free(targets);
+}
+
+/* Replaces commands by their unchecked variants wherever the stack depths found by ws_cfg_stack_depths
+ * guarantee they have enough items to work with. Blocks that push a lot start with a single reserve
+ * for everything they push, after which the pushes don't have to check for room either.
+ * Commands in blocks which are never reached, or which need more than can be proven, keep their checks.
+ */
+void ws_unchecked(ws_program *const program) {
+    ws_cfg cfg;
+    ws_cfg_build(&cfg, program);
+    ws_cfg_stack_depths(&cfg, program);
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, cfg.length);
+
+    const ws_block *block;
+    ws_command command, reservation;
+    long need, net, running;
+    size_t pushes;
+    int reserved;
+
+    memset(&reservation, 0, sizeof(ws_command));
+    reservation.type = reserve;
+
+    for(size_t b = 0; b < cfg.length; b++) {
+        block = cfg.blocks + b;
+
+        if (block->depth == WS_DEPTH_UNKNOWN) {
+            for(size_t i = block->start; i < block->end; i++) {
+                ws_rewrite_emit(&rewrite, i, program->commands + i);
+            }
+            continue;
+        }
+
+        pushes = 0;
+        for(size_t i = block->start; i < block->end; i++) {
+            pushes += ws_unchecked_map[program->commands[i].type] >= 0 && ws_stack_net_map[program->commands[i].type] > 0;
+        }
+        reserved = pushes >= WS_RESERVE_PUSHES && block->growth <= INT32_MAX;
+        if (reserved) {
+            reservation.immediate = (sdigit)block->growth;
+            ws_rewrite_emit(&rewrite, block->start, &reservation);
+        }
+
+        running = block->depth;
+        for(size_t i = block->start; i < block->end; i++) {
+            command = program->commands[i];
+            ws_stack_effect(&command, &need, &net);
+
+            if (ws_unchecked_map[command.type] >= 0 && running >= need && (net <= 0 || reserved)) {
+                command.type = (ws_command_type)ws_unchecked_map[command.type];
+            }
+            running = ((running > need)? running: need) + net;
+
+            if (reserved && i == block->start) {
+                ws_rewrite_append(&rewrite, &command);
+            } else {
+                ws_rewrite_emit(&rewrite, i, &command);
+            }
+        }
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    ws_cfg_finish(&cfg);
+}
+
+
+
+/* Puts superinstruction + s in front of every sequence of commands that matches pattern s of wssuper.h.
+ * The commands stay where they are behind it: the superinstruction runs them itself and continues after them,
+ * and a jump into the middle of the sequence still finds them. So only the first command has to be a jump target,
+ * and sequences don't overlap. This is the last pass, as nothing else knows about the commands behind a
+ * superinstruction.
+ */
+static size_t ws_super_match(const ws_program *const program, const size_t i) {
+    for(size_t s = 0; s < WS_SUPER_COUNT; s++) {
+        size_t k = 0;
+        while (k < ws_super_lengths[s] && i + k < program->length && program->commands[i + k].type == ws_super_patterns[s][k]) {
+            k++;
+        }
+        if (k == ws_super_lengths[s]) {
+            return s;
+        }
+    }
+    return WS_SUPER_COUNT;
+}
+
+void ws_super(ws_program *const program) {
+    if (!WS_SUPER_COUNT) {
+        return;
+    }
+
+    unsigned char *const matches = (unsigned char *)malloc(program->length + 1);
+    size_t found = 0;
+    for(size_t i = 0; i < program->length;) {
+        matches[i] = (unsigned char)ws_super_match(program, i);
+        if (matches[i] == WS_SUPER_COUNT) {
+            i++;
+        } else {
+            found++;
+            i += ws_super_lengths[matches[i]];
+        }
+    }
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, found);
+
+    ws_command super;
+    memset(&super, 0, sizeof(ws_command));
+
+    for(size_t i = 0; i < program->length;) {
+        if (matches[i] == WS_SUPER_COUNT) {
+            ws_rewrite_emit(&rewrite, i, program->commands + i);
+            i++;
+            continue;
+        }
+
+        super.type = (ws_command_type)(superinstruction + matches[i]);
+        ws_rewrite_emit(&rewrite, i, &super);
+        ws_rewrite_append(&rewrite, program->commands + i);
+        for(size_t k = 1; k < ws_super_lengths[matches[i]]; k++) {
+            ws_rewrite_emit(&rewrite, i + k, program->commands + i + k);
+        }
+        i += ws_super_lengths[matches[i]];
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    free(matches);
+}
+
+#endif
@@ -4,6 +4,7 @@
 
 #define PARAMETER_CACHE_SIZE 32
 #define COMMANDLENGTH 24
+#define COMMANDTYPES 86 //COMMANDLENGTH plus the internal commands and the superinstructions
 
 #define COMMAND_ARRAY_SIZE 10
 #define COMMAND_ARRAY_RESIZE 2
@@ -14,7 +15,7 @@
 
 /* A map for easy printing of the commands
  */
-const ws_string ws_command_names[COMMANDLENGTH] = {
+const ws_string ws_command_names[COMMANDTYPES] = {
     {"push", 4},
     {"duplicate", 9},
     {"copy", 4},
@@ -42,7 +43,65 @@ const ws_string ws_command_names[COMMANDLENGTH] = {
     {"printchar", 9},
     {"printnum", 8},
     {"inputchar", 9},
-    {"inputnum", 8}
+    {"inputnum", 8},
+
+    {"lazycall", 8},
+    {"lazyjump", 8},
+    {"lazyjumpifzero", 14},
+    {"lazyjumpifnegative", 18},
+
+    {"addimmediate", 12},
+    {"negate", 6},
+    {"jumpifequal", 11},
+    {"jumpifless", 10},
+    {"jumpifequalimmediate", 20},
+    {"jumpiflessimmediate", 19},
+    {"duplicatejumpifzero", 19},
+    {"duplicatejumpifnegative", 23},
+    {"getimmediate", 12},
+    {"setimmediate", 12},
+    {"storeimmediate", 14},
+    {"pushpush", 8},
+
+    {"pushunchecked", 13},
+    {"duplicateunchecked", 18},
+    {"copyunchecked", 13},
+    {"swapunchecked", 13},
+    {"discardunchecked", 16},
+    {"slideunchecked", 14},
+    {"addunchecked", 12},
+    {"subtractunchecked", 17},
+    {"multiplyunchecked", 17},
+    {"divideunchecked", 15},
+    {"modulounchecked", 15},
+    {"setunchecked", 12},
+    {"getunchecked", 12},
+    {"jumpifzerounchecked", 19},
+    {"jumpifnegativeunchecked", 23},
+    {"printcharunchecked", 18},
+    {"printnumunchecked", 17},
+    {"reserve", 7},
+    {"registerblock", 13},
+
+    {"getslot", 7},
+    {"setslot", 7},
+    {"storeslot", 9},
+
+    {"decrementjumpifnonzero", 22},
+    {"incrementjumpifnotequal", 23},
+    {"decrementslotjumpifnonzero", 26},
+    {"incrementslotjumpifless", 23},
+
+    {"fillheap", 8},
+    {"copyheap", 8},
+
+    {"printstring", 11},
+    {"multiplyadd", 11},
+
+    {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16},
+    {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16},
+    {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16},
+    {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16}, {"superinstruction", 16}
 };
 
 
@@ -82,14 +141,131 @@ const ws_string ws_command_map[COMMANDLENGTH] = {
 
 
 
-/* data structures indicating if a certain command takes a parameter or a label
+/* data structures indicating if a certain command takes a parameter, a label (a jumpoffset after compiling)
+ * or an immediate
  */
-const char ws_parameter_map[COMMANDLENGTH] = {
-    1, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+const char ws_parameter_map[COMMANDTYPES] = {
+    1, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+    1, 0, 1, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 1,
+    0, 0, 0, 0,
+    0, 0,
+    0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-const char ws_label_map[COMMANDLENGTH] = {
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0
+const char ws_label_map[COMMANDTYPES] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0,
+    0, 0, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 1,
+    0, 0, 0,
+    1, 1, 1, 1,
+    1, 1,
+    0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+const char ws_immediate_map[COMMANDTYPES] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0,
+    1, 0, 0, 0, 1, 1, 0, 0, 0, 0, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+    1, 1, 1,
+    1, 1, 1, 1,
+    1, 1,
+    0, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* The stack effect of every command: how many items it needs on the stack, and how much the stack grows.
+ * copy and slide depend on their parameter, see ws_stack_effect. registerblock and the superinstructions are
+ * emitted by the last pass and never analysed.
+ */
+const char ws_stack_need_map[COMMANDTYPES] = {
+    0, 1, 0, 2, 1, 0, 2, 2, 2, 2, 2, 2, 1, 0, 0, 0, 1, 1, 0, 0, 1, 1, 1, 1,
+    0, 0, 1, 1,
+    1, 1, 2, 2, 1, 1, 1, 1, 0, 1, 0, 0,
+    0, 1, 0, 2, 1, 0, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 0, 0,
+    0, 1, 0,
+    1, 1, 0, 0,
+    0, 0,
+    0, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+const signed char ws_stack_net_map[COMMANDTYPES] = {
+    1, 1, 1, 0, -1, 0, -1, -1, -1, -1, -1, -2, 0, 0, 0, 0, -1, -1, 0, 0, -1, -1, 0, 0,
+    0, 0, -1, -1,
+    0, 0, -2, -2, -1, -1, 0, 0, 1, -1, 0, 2,
+    1, 1, 1, 0, -1, 0, -1, -1, -1, -1, -1, -2, 0, -1, -1, -1, -1, 0, 0,
+    1, -1, 0,
+    0, 0, 0, 0,
+    0, 0,
+    0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* The variant of a command without stack checks, or -1 if there is none
+ */
+const signed char ws_unchecked_map[COMMANDTYPES] = {
+    pushunchecked, duplicateunchecked, copyunchecked, swapunchecked, discardunchecked, slideunchecked,
+    addunchecked, subtractunchecked, multiplyunchecked, divideunchecked, modulounchecked,
+    setunchecked, getunchecked,
+    -1, -1, -1, jumpifzerounchecked, jumpifnegativeunchecked, -1, -1,
+    printcharunchecked, printnumunchecked, -1, -1,
+    -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1,
+    -1, -1, -1, -1,
+    -1, -1,
+    -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/* And the other way around, the command every command does the same as apart from the checks
+ */
+const signed char ws_checked_map[COMMANDTYPES] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23,
+    24, 25, 26, 27,
+    28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39,
+    push, duplicate, copy, swap, discard, slide, add, subtract, multiply, divide, modulo, set, get,
+    jumpifzero, jumpifnegative, printchar, printnum, reserve, registerblock,
+    getslot, setslot, storeslot,
+    decrementjumpifnonzero, incrementjumpifnotequal, decrementslotjumpifnonzero, incrementslotjumpifless,
+    fillheap, copyheap,
+    printstring, multiplyadd,
+    70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85
+};
+
+
+
+/* A decoding tree for the prefixes in ws_command_map. Every node has an entry for space, tab and break.
+ * positive entries point to the next node, negative entries are finished commands, stored as -(type + 1),
+ * and 0 marks a character sequence which isn't a valid command (the root is never a child).
+ */
+#define WS_TREE_COMMAND(type) (-(type) - 1)
+
+const signed char ws_command_tree[16][3] = {
+    {1, 2, 3},                                                                           // root
+    {WS_TREE_COMMAND(push), 4, 5},                                                       // S
+    {6, 7, 8},                                                                           // T
+    {13, 14, 15},                                                                        // N
+    {WS_TREE_COMMAND(copy), 0, WS_TREE_COMMAND(slide)},                                  // ST
+    {WS_TREE_COMMAND(duplicate), WS_TREE_COMMAND(swap), WS_TREE_COMMAND(discard)},       // SN
+    {9, 10, 0},                                                                          // TS
+    {WS_TREE_COMMAND(set), WS_TREE_COMMAND(get), 0},                                     // TT
+    {11, 12, 0},                                                                         // TN
+    {WS_TREE_COMMAND(add), WS_TREE_COMMAND(subtract), WS_TREE_COMMAND(multiply)},        // TSS
+    {WS_TREE_COMMAND(divide), WS_TREE_COMMAND(modulo), 0},                               // TST
+    {WS_TREE_COMMAND(printchar), WS_TREE_COMMAND(printnum), 0},                          // TNS
+    {WS_TREE_COMMAND(inputchar), WS_TREE_COMMAND(inputnum), 0},                          // TNT
+    {WS_TREE_COMMAND(label), WS_TREE_COMMAND(call), WS_TREE_COMMAND(jump)},              // NS
+    {WS_TREE_COMMAND(jumpifzero), WS_TREE_COMMAND(jumpifnegative), WS_TREE_COMMAND(endsubroutine)}, // NT
+    {0, 0, WS_TREE_COMMAND(endprogram)}                                                  // NN
 };
 
 
@@ -98,161 +274,183 @@ const char ws_label_map[COMMANDLENGTH] = {
  */
 void ws_visualize(ws_string *);
 void ws_program_initialize(ws_program *, size_t);
-void ws_program_free(ws_program *);
+void ws_program_finish(const ws_program *);
+void ws_block_profile_free(ws_block_profile *);
+void ws_lazy_finish(struct ws_lazy *);
+void ws_register_finish(struct ws_registers *);
+void ws_image_finish(struct ws_image *);
 
 
 
-/* The actual parser implementation
+/* Helpers shared by the normal parser and the lazy parser in wslazy.h.
+ * they all take the position in the text and return the position after whatever they parsed.
  */
-void ws_parse(ws_program *const program, const ws_string *const text) {
-
-    ws_command *command_array = (ws_command *)malloc(sizeof(ws_command)*COMMAND_ARRAY_SIZE);
-    ws_command *current_node;
-    size_t command_array_length = 0;
-    size_t command_array_size = COMMAND_ARRAY_SIZE;
-
-    char command_buffer[5] = {0};
-    ws_string current_command = {command_buffer , 0};
-    char succes;
+size_t ws_skip_comments(const ws_string *const text, size_t i) {
+    while (i != text->length && (text->data[i] != SPACE && text->data[i] != TAB && text->data[i] != BREAK)) {
+        i++;
+    }
+    return i;
+}
 
-    size_t parameter_start;
-    size_t parameter_end;
-    char *parameter_end_loc;
-    size_t parameter_max_size = PARAMETER_CACHE_SIZE;
-    ws_string current_parameter = {(char *)malloc(PARAMETER_CACHE_SIZE), 0};
-    size_t current_parameter_size;
+size_t ws_parse_command_type(ws_command_type *const type, const ws_string *const text, size_t i) {
+    const size_t command_start = i;
+    int node = 0;
 
-#if DEBUG
-    ws_string debug_text;
-#endif
+    while (1) {
+        //check if we're not running out of bounds
+        if (i == text->length) {
+            ws_fail(WS_STATUS_PARSE_ERROR, "end of buffer while parsing command at position %zu\n", i);
+        }
 
-    register size_t i = 0;
-    while (i < text->length) {
-        //this is the node to be set up
-        current_node = command_array + command_array_length;
-
-        //setup for command parsing, we'll loop one character at the time
-        current_command.length = 0;
-        succes = 0;
-        while (!succes) {
-
-            //check if we're not running out of bounds
-            if (i == text->length) {
-                printf("end of buffer while parsing command at position %d\n", i);
-                exit(EXIT_FAILURE);
-            }
-
-            //there are no commands of length 5 or higher
-            if (current_command.length==4) {
-                printf("no valid command at position %d\n", i - 4);
-                exit(EXIT_FAILURE);
-            }
-
-            //comments
-            if (text->data[i] != SPACE && text->data[i] != TAB && text->data[i] != BREAK) {
-                i++;
+        //walk the decoding tree, skipping any comments
+        switch (text->data[i++]) {
+            case SPACE:
+                node = ws_command_tree[node][0];
+                break;
+            case TAB:
+                node = ws_command_tree[node][1];
+                break;
+            case BREAK:
+                node = ws_command_tree[node][2];
+                break;
+            default:
                 continue;
-            }
+        }
 
-            current_command.data[current_command.length++] = text->data[i++];
+        if (node < 0) {
+            *type = (ws_command_type)WS_TREE_COMMAND(node);
+            return i;
+        }
+        if (!node) {
+            ws_fail(WS_STATUS_PARSE_ERROR, "no valid command at position %zu\n", command_start);
+        }
+    }
+}
 
-            //check if we have a command, commands have at least length 2 and at most length 4
-            if (current_command.length == 1) {
-                continue;
-            }
+size_t ws_parse_parameter(ws_string *const parameter, size_t *const parameter_max_size, const ws_string *const text, size_t i) {
+    //figure out the size of the parameter
+    const size_t parameter_start = i;
+    char *const parameter_end_loc = (char *)memchr(text->data + parameter_start, BREAK, text->length - parameter_start);
+    if (!parameter_end_loc) {
+        ws_fail(WS_STATUS_PARSE_ERROR, "end of buffer while parsing parameter at position %zu\n", parameter_start);
+    }
+    const size_t parameter_end = (size_t)(parameter_end_loc - text->data);
+    const size_t current_parameter_size = parameter_end - parameter_start + 1; //include the newline in here!
 
-            for(size_t j = 0; j < COMMANDLENGTH; j++) {
+    //if our buffer isn't large enough, make it larger to fit
+    if (*parameter_max_size < current_parameter_size) {
+        *parameter_max_size = current_parameter_size;
+        parameter->data = (char *)realloc(parameter->data, *parameter_max_size);
+    }
 
-                if (!ws_string_compare(ws_command_map+j, &current_command)) {
-                    current_node->type = j;
-                    succes = 1;
-                    break;
-                }
-            }
+    //we know we can safely collect the characters of the parameter now
+    parameter->length = 0;
+    for(; i < (parameter_start + current_parameter_size); i++) {
+        if (text->data[i] == SPACE || text->data[i] == TAB || text->data[i] == BREAK) {
+            parameter->data[parameter->length++] = text->data[i];
         }
+    }
 
-        //parse parameter
-        if (ws_parameter_map[current_node->type] || ws_label_map[current_node->type]) {
-            parameter_start = i;
-
-            //figure out the size of the parameter
-            parameter_end_loc = (char *)memchr(text->data + parameter_start, BREAK, text->length - parameter_start);
-            if (!parameter_end_loc) {
-                printf("end of buffer while parsing parameter at position %d\n", parameter_start);
-                exit(EXIT_FAILURE);
-            }
-            parameter_end = (size_t)(parameter_end_loc - text->data);
-            current_parameter_size = parameter_end - parameter_start + 1; //include the newline in here!
-
-            //if our buffer isn't large enough, make it larger to fit
-            if (parameter_max_size < current_parameter_size) {
-                parameter_max_size = current_parameter_size;
-                current_parameter.data = (char *)realloc(current_parameter.data, parameter_max_size);
-            }
-
-            //we know we can safely collect the characters of the parameter now
-            current_parameter.length = 0;
-            for(; i < (parameter_start + current_parameter_size); i++) {
-                if (text->data[i] == SPACE || text->data[i] == TAB || text->data[i] == BREAK) {
-                    current_parameter.data[current_parameter.length++] = text->data[i];
-                }
-            }
-
-            current_parameter.length--; //newline
-
-            //parse the parameters into their data structures
-            if (ws_label_map[current_node->type]) {
-                ws_label_from_whitespace(&current_node->label, &current_parameter);
-            } else {
-                ws_int_from_whitespace(&current_node->parameter, &current_parameter);
-            }
-#if DEBUG
-            //if we're debugging, create new strings holding the whole whitespace code
-            debug_text.length = current_command.length + current_parameter.length + 1;
-            debug_text.data = (char *)malloc(debug_text.length);
+    parameter->length--; //newline
+    return i;
+}
+
+size_t ws_parse_command(ws_command *const node, ws_string *const parameter, size_t *const parameter_max_size,
+                        const ws_string *const text, size_t i) {
+    i = ws_parse_command_type(&node->type, text, i);
 
-            memcpy(debug_text.data, current_command.data, current_command.length);
-            memcpy(debug_text.data + current_command.length, current_parameter.data , current_parameter.length + 1);
+    //parse parameter
+    if (ws_parameter_map[node->type] || ws_label_map[node->type]) {
+        i = ws_parse_parameter(parameter, parameter_max_size, text, i);
+
+        //parse the parameters into their data structures
+        if (ws_label_map[node->type]) {
+            ws_label_from_whitespace(&node->label, parameter);
         } else {
-            ws_strcpy(&debug_text, &current_command);
-            
+            ws_int_from_whitespace(&node->parameter, parameter);
         }
+    }
+#if DEBUG
+    //if we're debugging, create new strings holding the whole whitespace code
+    const ws_string *const command = ws_command_map + node->type;
+    ws_string debug_text;
+    if (ws_parameter_map[node->type] || ws_label_map[node->type]) {
+        debug_text.length = command->length + parameter->length + 1;
+        debug_text.data = (char *)malloc(debug_text.length);
+
+        memcpy(debug_text.data, command->data, command->length);
+        memcpy(debug_text.data + command->length, parameter->data , parameter->length + 1);
+    } else {
+        ws_strcpy(&debug_text, command);
+    }
 
-        //these are added to the node and printed
-        ws_visualize(&debug_text);
-        current_node->text = debug_text;
-        printf("%s: ", ws_command_names[current_node->type]);
-        ws_string_print(&debug_text);
-        putchar('\n');
-#else
-        }
+    //these are added to the node and printed
+    ws_visualize(&debug_text);
+    node->text = debug_text;
+    printf("%s: ", ws_command_names[node->type].data);
+    ws_string_print(&debug_text);
+    putchar('\n');
 #endif
-        //bump command_array_length
-        command_array_length++;
+    //read till we encounter a new whitespace character
+    return ws_skip_comments(text, i);
+}
+
+
+
+/* The actual parser implementation
+ */
+// what has been parsed so far, which gets freed if parsing fails inside a ws_vm
+typedef struct {
+    ws_program program;
+    ws_string parameter;
+} ws_parse_state;
+
+static void ws_parse_cleanup(void *const data) {
+    ws_parse_state *const state = (ws_parse_state *)data;
+    ws_program_finish(&state->program);
+    ws_string_free(&state->parameter);
+}
+
+void ws_parse(ws_program *const program, const ws_string *const text) {
+
+    ws_parse_state state;
+    ws_program_initialize(&state.program, 0);
+    state.program.commands = (ws_command *)malloc(sizeof(ws_command)*COMMAND_ARRAY_SIZE);
+    size_t command_array_size = COMMAND_ARRAY_SIZE;
+
+    size_t parameter_max_size = PARAMETER_CACHE_SIZE;
+    state.parameter.data = (char *)malloc(PARAMETER_CACHE_SIZE);
+    state.parameter.length = 0;
+
+    ws_cleanup cleanup;
+    ws_cleanup_begin(&cleanup, ws_parse_cleanup, &state);
+
+    register size_t i = ws_skip_comments(text, 0);
+    while (i < text->length) {
+        i = ws_parse_command(state.program.commands + state.program.length, &state.parameter, &parameter_max_size,
+                             text, i);
+
+        //bump the length of the program
+        state.program.length++;
 
-        //read till we encounter a new whitespace character
-        while (i != text->length && (text->data[i] != SPACE && text->data[i] != TAB && text->data[i] != BREAK)) {
-            i++;
-        }
-        
         //if we get here we're expecting a new whitespace command but we've maxed out our array
-        if (command_array_size == command_array_length) {
+        if (command_array_size == state.program.length) {
             command_array_size *= COMMAND_ARRAY_RESIZE;
-            command_array = (ws_command *)realloc(command_array, sizeof(ws_command) * command_array_size);
+            state.program.commands = (ws_command *)realloc(state.program.commands,
+                                                           sizeof(ws_command) * command_array_size);
         }
     }
 
-    //put the program together and clean up
-    ws_string_free(&current_parameter);
-
-    if (!command_array_length) {
-        printf("empty program\n");
-        exit(EXIT_FAILURE);
+    if (!state.program.length) {
+        ws_fail(WS_STATUS_PARSE_ERROR, "empty program\n");
     }
 
-    ws_program_initialize(program, 0);
-    program->commands = (ws_command *)realloc(command_array, sizeof(ws_command)*command_array_length);
-    program->length = command_array_length;
+    //put the program together and clean up
+    ws_cleanup_end(&cleanup);
+    ws_string_free(&state.parameter);
+
+    *program = state.program;
+    program->commands = (ws_command *)realloc(state.program.commands, sizeof(ws_command)*state.program.length);
 }
 
 void ws_visualize(ws_string *const string) {
@@ -277,9 +475,21 @@ void ws_program_initialize(ws_program *const result, const size_t commandno) {
     }
     result->length = commandno;
     result->flags = 'W'<<24 | 'S'<<16 | 'C'<<8 | '\0';
+    result->lazy = NULL;
+    result->registers = NULL;
+    result->slots = NULL;
+    result->slots_length = 0;
+    result->profile = NULL;
+    result->image = NULL;
 }
 
 void ws_program_finish(const ws_program *const program) {
+    //a frozen image holds all of it
+    if (program->image) {
+        ws_image_finish(program->image);
+        return;
+    }
+
     //free the program, commands, label strings and ws_ints
     ws_command *command;
     for(size_t i = 0; i < program->length; i++){
@@ -290,12 +500,33 @@ void ws_program_finish(const ws_program *const program) {
 
         } else if (ws_label_map[command->type] && !(program->flags & 0x1)) {
             ws_label_free(&command->label);
+
+        } else if (command->type == printstring) {
+            ws_string_free(&command->string);
         }
 #if DEBUG
         ws_string_free(&command->text);
 #endif
-        free(command);
     }
+    free(program->commands);
+    if (program->lazy) {
+        ws_lazy_finish(program->lazy);
+    }
+    if (program->registers) {
+        ws_register_finish(program->registers);
+    }
+    for(size_t i = 0; i < program->slots_length; i++) {
+        ws_int_free(program->slots + i);
+    }
+    free(program->slots);
+    if (program->profile) {
+        ws_block_profile_free(program->profile);
+    }
+}
+
+void ws_block_profile_free(ws_block_profile *const profile) {
+    free(profile->blocks);
+    free(profile);
 }
 
 #endif
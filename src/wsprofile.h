@@ -0,0 +1,234 @@
+/* wsprofile.h, counts how often sequences of commands run, which wsgen.c turns into superinstructions,
+ * and how often every block runs, which ws_layout in wsoptimizer.h lays out the program by */
+#ifndef WSPROFILE_H
+#define WSPROFILE_H
+
+#include "wstypes.h"
+#include "wsparser.h"
+#include "wscfg.h"
+#include "wsserialize.h"
+
+#define WS_PROFILE_MIN 2   //the shortest sequence that gets counted
+#define WS_PROFILE_MAX 4   //and the longest one
+#define WS_PROFILE_SIZE 1024
+
+
+
+/* A profile counts every sequence of WS_PROFILE_MIN to WS_PROFILE_MAX commands that runs one after another,
+ * so without any jump in between: a jump can only be the last command of a sequence.
+ * window holds the types of the last commands that ran, one per byte with the newest in the lowest byte.
+ *
+ * The entries are a hash table on the length of the sequence and its window, a key of 0 marks an empty entry.
+ * As a run can end with an exit anywhere the profile gets written by an atexit handler, in the format:
+ *
+ * count name name [name [name]]
+ *
+ * with the most common sequences first.
+ *
+ * An instrumented run counts blocks instead: how often every command runs, and how often it jumps elsewhere than
+ * the next command. At exit those are summed up per block of the program, which then gets stored in compiledname
+ * again together with them. The program mustn't be optimized, as the counts go by the command indexes it was
+ * parsed with.
+ */
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+} ws_profile_entry;
+
+typedef struct {
+    size_t size;
+    size_t length;
+    ws_profile_entry *entries;
+    uint32_t window;
+    unsigned int window_length;
+    char *filename; //NULL if sequences aren't counted
+
+    uint64_t *counts; //NULL if blocks aren't counted
+    uint64_t *taken;
+    const ws_program *program;
+    char *compiledname;
+    ws_cache_header header;
+} ws_profile;
+
+#define WS_PROFILE_KEY(length, window) (((uint64_t)(length) << 32) | (window))
+
+static ws_profile *ws_profile_current; //the profile written at exit
+
+
+
+static void ws_profile_write(void);
+
+static char *ws_profile_strdup(const char *const string) {
+    const size_t length = strlen(string);
+    char *const result = (char *)malloc(length + 1);
+    memcpy(result, string, length + 1);
+    return result;
+}
+
+/* Starts a profile which counts sequences into filename if it isn't NULL. It's written when the program exits.
+ */
+ws_profile *ws_profile_initialize(const char *const filename) {
+    ws_profile *const profile = (ws_profile *)malloc(sizeof(ws_profile));
+    profile->size = WS_PROFILE_SIZE;
+    profile->length = 0;
+    profile->entries = (ws_profile_entry *)calloc(WS_PROFILE_SIZE, sizeof(ws_profile_entry));
+    profile->window = 0;
+    profile->window_length = 0;
+    profile->filename = filename? ws_profile_strdup(filename): NULL;
+
+    profile->counts = NULL;
+    profile->taken = NULL;
+    profile->program = NULL;
+    profile->compiledname = NULL;
+
+    ws_profile_current = profile;
+    atexit(ws_profile_write);
+    return profile;
+}
+
+/* Makes profile count the blocks of program as well, see above. header describes the source of program.
+ */
+void ws_profile_blocks(ws_profile *const profile, const ws_program *const program, const char *const compiledname,
+                       const ws_cache_header *const header) {
+    profile->counts = (uint64_t *)calloc(program->length + 1, sizeof(uint64_t));
+    profile->taken = (uint64_t *)calloc(program->length + 1, sizeof(uint64_t));
+    profile->program = program;
+    profile->compiledname = ws_profile_strdup(compiledname);
+    profile->header = *header;
+}
+
+void ws_profile_finish(ws_profile *const profile) {
+    free(profile->entries);
+    free(profile->filename);
+    free(profile->counts);
+    free(profile->taken);
+    free(profile->compiledname);
+    free(profile);
+}
+
+static size_t ws_profile_position(const ws_profile_entry *const entries, const size_t size, const uint64_t key) {
+    size_t i = (size_t)((key * ws_hash_multiplier) >> 32) & (size - 1);
+    while (entries[i].key && entries[i].key != key) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+static void ws_profile_count(ws_profile *const profile, const uint64_t key) {
+    size_t i = ws_profile_position(profile->entries, profile->size, key);
+    if (profile->entries[i].key) {
+        profile->entries[i].count++;
+        return;
+    }
+
+    // keep the table at most 3/4 full
+    if (4 * (profile->length + 1) > 3 * profile->size) {
+        const size_t size = profile->size * 2;
+        ws_profile_entry *const entries = (ws_profile_entry *)calloc(size, sizeof(ws_profile_entry));
+        for(size_t j = 0; j < profile->size; j++) {
+            if (profile->entries[j].key) {
+                entries[ws_profile_position(entries, size, profile->entries[j].key)] = profile->entries[j];
+            }
+        }
+        free(profile->entries);
+        profile->entries = entries;
+        profile->size = size;
+        i = ws_profile_position(entries, size, key);
+    }
+
+    profile->entries[i].key = key;
+    profile->entries[i].count = 1;
+    profile->length++;
+}
+
+/* Counts the sequences ending in a command of type that is about to run
+ */
+static void ws_profile_record(ws_profile *const profile, const ws_command_type type) {
+    profile->window = (profile->window << 8) | (uint8_t)type;
+    if (profile->window_length < WS_PROFILE_MAX) {
+        profile->window_length++;
+    }
+    for(unsigned int length = WS_PROFILE_MIN; length <= profile->window_length; length++) {
+        ws_profile_count(profile, WS_PROFILE_KEY(length, profile->window & (uint32_t)(((uint64_t)1 << (8 * length)) - 1)));
+    }
+}
+
+/* Control didn't fall through to the next command, so no sequence continues past the last one
+ */
+static void ws_profile_break(ws_profile *const profile) {
+    profile->window_length = 0;
+}
+
+static int ws_profile_compare(const void *const a, const void *const b) {
+    const uint64_t left = ((const ws_profile_entry *)a)->count;
+    const uint64_t right = ((const ws_profile_entry *)b)->count;
+    return (left < right) - (left > right);
+}
+
+/* Sums up the counts of the commands into the counts of the blocks, and stores the program with those in the .wsc
+ */
+static void ws_profile_write_blocks(const ws_profile *const profile) {
+    ws_cfg cfg;
+    ws_cfg_build(&cfg, profile->program);
+
+    ws_block_profile blocks;
+    blocks.length = cfg.length;
+    blocks.blocks = (ws_block_count *)malloc(sizeof(ws_block_count) * (cfg.length + 1));
+    for(size_t b = 0; b < cfg.length; b++) {
+        blocks.blocks[b].start = cfg.blocks[b].start;
+        blocks.blocks[b].count = profile->counts[cfg.blocks[b].start];
+        blocks.blocks[b].taken = profile->taken[cfg.blocks[b].end - 1];
+    }
+    ws_cfg_finish(&cfg);
+
+    ws_program profiled = *profile->program;
+    profiled.profile = &blocks;
+    ws_cache_store(profile->compiledname, &profiled, &profile->header);
+    free(blocks.blocks);
+}
+
+static void ws_profile_write_sequences(ws_profile *const profile) {
+    FILE *const file = fopen(profile->filename, "w");
+    if (!file) {
+        printf("failure to open profile %s\n", profile->filename);
+        return;
+    }
+
+    size_t length = 0;
+    for(size_t i = 0; i < profile->size; i++) {
+        if (profile->entries[i].key) {
+            profile->entries[length++] = profile->entries[i];
+        }
+    }
+    qsort(profile->entries, length, sizeof(ws_profile_entry), ws_profile_compare);
+
+    unsigned int sequence;
+    for(size_t i = 0; i < length; i++) {
+        sequence = (unsigned int)(profile->entries[i].key >> 32);
+        fprintf(file, "%llu", (unsigned long long)profile->entries[i].count);
+        for(unsigned int j = sequence; j--;) {
+            fprintf(file, " %s", ws_command_names[(profile->entries[i].key >> (8 * j)) & 0xFF].data);
+        }
+        fputc('\n', file);
+    }
+
+    fclose(file);
+}
+
+static void ws_profile_write(void) {
+    ws_profile *const profile = ws_profile_current;
+    if (!profile) {
+        return;
+    }
+    ws_profile_current = NULL;
+
+    if (profile->filename) {
+        ws_profile_write_sequences(profile);
+    }
+    if (profile->counts) {
+        ws_profile_write_blocks(profile);
+    }
+    ws_profile_finish(profile);
+}
+
+#endif
@@ -0,0 +1,508 @@
+/* wsregister.h, converts the blocks of compiled programs into register code */
+#ifndef WSREGISTER_H
+#define WSREGISTER_H
+
+#include "wstypes.h"
+#include "wsparser.h"
+#include "wscfg.h"
+#include "wsoptimizer.h"
+
+#define WS_REGISTER_MIN_COMMANDS 3          //the smallest block which is worth converting
+#define WS_REGISTER_CONSTANT (1U << 31)     //marks operands which refer to a constant while converting
+
+
+
+/* The stack machine loads and stores every operand through the stack, and spends commands on shuffling values around.
+ * Inside a basic block none of that is necessary: the values on the stack can be tracked while converting,
+ * so that swap, duplicate, discard and push disappear by just renaming which value sits where.
+ *
+ * A block which takes n values from the stack becomes register code which starts by moving the top n values of the stack
+ * into registers 0 to n-1. Every operation writes its result into a new register, and constants are registers
+ * which are filled in once. At the end of the block, the values which the block leaves on the stack are spilled
+ * back onto it, and any other registers are freed. If the block ends in a jump or a conditional jump on values of the block,
+ * that is done by the register code too, calls, endsubroutine and endprogram run as normal commands after the spill.
+ *
+ * The converted block starts with a registerblock command, followed by the original commands. If the stack
+ * doesn't hold enough values for the whole block, the original commands run instead, so that any errors happen
+ * at exactly the same place. copy and slide count from the bottom of the stack, which depends on how deep the stack is
+ * when the block runs, so blocks containing them aren't converted.
+ *
+ * This is the last pass, nothing can analyse the program after the registerblocks are in.
+ */
+
+typedef enum {
+    // operations
+    register_add,
+    register_subtract,
+    register_multiply,
+    register_divide,
+    register_modulo,
+    register_set,               //left is the key, right the value
+    register_get,
+    register_setslot,           //left is the slot, right the value
+    register_getslot,
+    register_printchar,
+    register_printnum,
+    register_inputchar,
+    register_inputnum,
+
+    // ways to end a block
+    register_fallthrough,
+    register_jump,
+    register_jumpifzero,
+    register_jumpifnegative,
+    register_jumpifequal,
+    register_jumpifless
+} ws_register_opcode;
+
+// result, left and right are indexes in ws_registers.values
+typedef struct {
+    ws_register_opcode opcode;
+    unsigned int result;
+    unsigned int left;
+    unsigned int right;
+} ws_register_op;
+
+// a register pushed onto the stack at the end of a block, the last one of every register is moved instead of copied
+typedef struct {
+    unsigned int value;
+    unsigned int move;
+} ws_register_spill;
+
+typedef struct {
+    size_t need;                //values moved from the stack into registers when the block starts
+    size_t ops;
+    size_t ops_length;
+    size_t spills;
+    size_t spills_length;
+    size_t frees;
+    size_t frees_length;
+    size_t inputs;              //the commands reading input, see ws_vm_ready in wsvm.h
+    ws_register_op terminator;
+} ws_register_block;
+
+// the register code of a whole program. values holds the registers of the running block followed by the constants
+typedef struct ws_registers {
+    ws_int *values;
+    size_t registers;
+    size_t constants;
+
+    ws_register_block *blocks;
+    size_t length;
+    ws_register_op *ops;
+    size_t ops_length;
+    ws_register_spill *spills;
+    size_t spills_length;
+    unsigned int *frees;
+    size_t frees_length;
+} ws_registers;
+
+/* The values the register machine uses on this thread instead of those of the program. The registers of the running
+ * block are scratch space, so machines running the same program at the same time each need their own.
+ */
+static WS_THREAD_LOCAL ws_int *ws_register_values = NULL;
+
+/* forward declarations
+ */
+void ws_register_compile(ws_program *);
+void ws_register_finish(ws_registers *);
+ws_int *ws_register_values_copy(const ws_registers *);
+static int ws_register_convertible(const ws_program *, const ws_block *, size_t *);
+static void ws_register_convert(ws_registers *, const ws_program *, const ws_block *, size_t);
+
+
+
+/* Converts every block which is worth it. Expects a compiled program that isn't lazy.
+ */
+void ws_register_compile(ws_program *const program) {
+    ws_cfg cfg;
+    ws_cfg_build(&cfg, program);
+    ws_cfg_stack_depths(&cfg, program);
+
+    const size_t length = program->length;
+    ws_registers *const registers = (ws_registers *)malloc(sizeof(ws_registers));
+    registers->registers = 0;
+    registers->constants = 0;
+    registers->length = 0;
+    registers->ops_length = 0;
+    registers->spills_length = 0;
+    registers->frees_length = 0;
+
+    // every command adds at most 2 values, so these are large enough for all blocks together
+    registers->blocks = (ws_register_block *)malloc(sizeof(ws_register_block) * (cfg.length + 1));
+    registers->ops = (ws_register_op *)malloc(sizeof(ws_register_op) * (length + 1));
+    registers->spills = (ws_register_spill *)malloc(sizeof(ws_register_spill) * (4 * length + 1));
+    registers->frees = (unsigned int *)malloc(sizeof(unsigned int) * (4 * length + 1));
+    registers->values = (ws_int *)malloc(sizeof(ws_int) * (2 * length + 1));
+
+    ws_rewrite rewrite;
+    ws_rewrite_initialize(&rewrite, program, cfg.length);
+
+    const ws_block *block;
+    ws_command entry;
+    size_t region_end;
+
+    memset(&entry, 0, sizeof(ws_command));
+    entry.type = registerblock;
+
+    for(size_t b = 0; b < cfg.length; b++) {
+        block = cfg.blocks + b;
+
+        if (block->depth != WS_DEPTH_UNKNOWN && ws_register_convertible(program, block, &region_end)) {
+            // the constants are collected in values for now, and moved behind the registers when everything is converted
+            ws_register_convert(registers, program, block, region_end);
+
+            entry.immediate = (sdigit)(registers->length - 1);
+            entry.jumpoffset = region_end;
+            ws_rewrite_emit(&rewrite, block->start, &entry);
+            ws_rewrite_append(&rewrite, program->commands + block->start);
+        } else {
+            ws_rewrite_emit(&rewrite, block->start, program->commands + block->start);
+        }
+
+        for(size_t i = block->start + 1; i < block->end; i++) {
+            ws_rewrite_emit(&rewrite, i, program->commands + i);
+        }
+    }
+
+    ws_rewrite_finish(&rewrite, program);
+    ws_cfg_finish(&cfg);
+
+    // now the operands can point at the constants
+    ws_int *const values = (ws_int *)malloc(sizeof(ws_int) * (registers->registers + registers->constants + 1));
+    memcpy(values + registers->registers, registers->values, sizeof(ws_int) * registers->constants);
+    free(registers->values);
+    registers->values = values;
+
+#define WS_REGISTER_FIX(operand) if ((operand) & WS_REGISTER_CONSTANT) { (operand) = ((operand) & ~WS_REGISTER_CONSTANT) + registers->registers; }
+    for(size_t i = 0; i < registers->ops_length; i++) {
+        WS_REGISTER_FIX(registers->ops[i].left)
+        WS_REGISTER_FIX(registers->ops[i].right)
+    }
+    for(size_t i = 0; i < registers->length; i++) {
+        WS_REGISTER_FIX(registers->blocks[i].terminator.left)
+        WS_REGISTER_FIX(registers->blocks[i].terminator.right)
+    }
+    for(size_t i = 0; i < registers->spills_length; i++) {
+        WS_REGISTER_FIX(registers->spills[i].value)
+    }
+#undef WS_REGISTER_FIX
+
+    program->registers = registers;
+}
+
+void ws_register_finish(ws_registers *const registers) {
+    for(size_t i = 0; i < registers->constants; i++) {
+        ws_int_free(registers->values + registers->registers + i);
+    }
+    free(registers->values);
+    free(registers->blocks);
+    free(registers->ops);
+    free(registers->spills);
+    free(registers->frees);
+    free(registers);
+}
+
+// values for another machine: fresh registers, and the constants, which are only ever read, shared with the program
+ws_int *ws_register_values_copy(const ws_registers *const registers) {
+    ws_int *const values = (ws_int *)malloc(sizeof(ws_int) * (registers->registers + registers->constants + 1));
+    memcpy(values + registers->registers, registers->values + registers->registers,
+           sizeof(ws_int) * registers->constants);
+    return values;
+}
+
+
+
+/* Commands that can be converted, and jumps that can end the register code
+ */
+static int ws_register_command(const ws_command_type type) {
+    switch (ws_checked_map[type]) {
+        case push: case duplicate: case swap: case discard:
+        case add: case subtract: case multiply: case divide: case modulo:
+        case set: case get: case printchar: case printnum: case inputchar: case inputnum:
+        case addimmediate: case negate: case getimmediate: case setimmediate: case storeimmediate: case pushpush:
+        case getslot: case setslot: case storeslot:
+        case reserve:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int ws_register_terminator(const ws_command_type type) {
+    switch (ws_checked_map[type]) {
+        case jump: case jumpifzero: case jumpifnegative:
+        case duplicatejumpifzero: case duplicatejumpifnegative:
+        case jumpifequal: case jumpifless: case jumpifequalimmediate: case jumpiflessimmediate:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Checks if a block can be converted. region_end is set to the first command the register code doesn't do.
+ */
+static int ws_register_convertible(const ws_program *const program, const ws_block *const block, size_t *const region_end) {
+    size_t i = block->start;
+    size_t converted = 0;
+    while (i < block->end && ws_register_command(program->commands[i].type)) {
+        converted += program->commands[i].type != reserve;
+        i++;
+    }
+
+    *region_end = i;
+    if (i + 1 == block->end && ws_register_terminator(program->commands[i].type)) {
+        converted++;
+    } else if (i != block->end && !ws_is_branch(program->commands[i].type) &&
+               program->commands[i].type != endsubroutine && program->commands[i].type != endprogram) {
+        return 0;
+    }
+
+    return converted >= WS_REGISTER_MIN_COMMANDS;
+}
+
+/* The values on the stack while converting
+ */
+typedef struct {
+    unsigned int *entries;
+    size_t length;
+    unsigned int next;          //the next unused register
+} ws_register_stack;
+
+static unsigned int ws_register_pop(ws_register_stack *const stack) {
+    return stack->entries[--stack->length];
+}
+
+static void ws_register_push(ws_register_stack *const stack, const unsigned int value) {
+    stack->entries[stack->length++] = value;
+}
+
+static unsigned int ws_register_constant(ws_registers *const registers, const ws_int *const value) {
+    ws_int_copy(registers->values + registers->constants, value);
+    return (unsigned int)registers->constants++ | WS_REGISTER_CONSTANT;
+}
+
+static unsigned int ws_register_constant_int(ws_registers *const registers, const sdigit value) {
+    ws_int_from_int(registers->values + registers->constants, value, NULL);
+    return (unsigned int)registers->constants++ | WS_REGISTER_CONSTANT;
+}
+
+static void ws_register_op_emit(ws_registers *const registers, const ws_register_opcode opcode, const unsigned int result,
+                                const unsigned int left, const unsigned int right) {
+    ws_register_op *const op = registers->ops + registers->ops_length++;
+    op->opcode = opcode;
+    op->result = result;
+    op->left = left;
+    op->right = right;
+}
+
+static void ws_register_convert(ws_registers *const registers, const ws_program *const program, const ws_block *const block, const size_t region_end) {
+    ws_register_block *const result = registers->blocks + registers->length++;
+    const size_t end = (region_end < block->end && ws_register_terminator(program->commands[region_end].type))? block->end: region_end;
+    const ws_command *command;
+    long need = 0, net, running = 0;
+    long command_need;
+    unsigned int left, right, value;
+
+    // how many values the block takes from the stack
+    for(size_t i = block->start; i < end; i++) {
+        ws_stack_effect(program->commands + i, &command_need, &net);
+        if (command_need - running > need) {
+            need = command_need - running;
+        }
+        running += net;
+    }
+
+    ws_register_stack stack;
+    stack.entries = (unsigned int *)malloc(sizeof(unsigned int) * (need + 2 * (end - block->start) + 1));
+    stack.length = 0;
+    for(stack.next = 0; stack.next < (unsigned int)need; stack.next++) {
+        ws_register_push(&stack, stack.next);
+    }
+
+    result->need = (size_t)need;
+    result->ops = registers->ops_length;
+    result->inputs = 0;
+    result->terminator.opcode = register_fallthrough;
+    result->terminator.left = 0;
+    result->terminator.right = 0;
+
+    for(size_t i = block->start; i < end; i++) {
+        command = program->commands + i;
+
+        switch (ws_checked_map[command->type]) {
+            case push:
+                ws_register_push(&stack, ws_register_constant(registers, &command->parameter));
+                break;
+
+            case duplicate:
+                ws_register_push(&stack, stack.entries[stack.length - 1]);
+                break;
+
+            case swap:
+                left = stack.entries[stack.length - 2];
+                stack.entries[stack.length - 2] = stack.entries[stack.length - 1];
+                stack.entries[stack.length - 1] = left;
+                break;
+
+            case discard:
+                ws_register_pop(&stack);
+                break;
+
+            case add:
+            case subtract:
+            case multiply:
+            case divide:
+            case modulo:
+                right = ws_register_pop(&stack);
+                left = ws_register_pop(&stack);
+                ws_register_op_emit(registers, (ws_register_opcode)(register_add + ws_checked_map[command->type] - add), stack.next, left, right);
+                ws_register_push(&stack, stack.next++);
+                break;
+
+            case set:
+                right = ws_register_pop(&stack);
+                left = ws_register_pop(&stack);
+                ws_register_op_emit(registers, register_set, 0, left, right);
+                break;
+
+            case get:
+                left = ws_register_pop(&stack);
+                ws_register_op_emit(registers, register_get, stack.next, left, 0);
+                ws_register_push(&stack, stack.next++);
+                break;
+
+            case printchar:
+            case printnum:
+                left = ws_register_pop(&stack);
+                ws_register_op_emit(registers, (ws_checked_map[command->type] == printchar)? register_printchar: register_printnum, 0, left, 0);
+                break;
+
+            case inputchar:
+            case inputnum:
+                left = stack.entries[stack.length - 1];
+                ws_register_op_emit(registers, (ws_checked_map[command->type] == inputchar)? register_inputchar: register_inputnum, 0, left, 0);
+                result->inputs++;
+                break;
+
+            case addimmediate:
+                left = ws_register_pop(&stack);
+                ws_register_op_emit(registers, register_add, stack.next, left, ws_register_constant_int(registers, command->immediate));
+                ws_register_push(&stack, stack.next++);
+                break;
+
+            case negate:
+                right = ws_register_pop(&stack);
+                ws_register_op_emit(registers, register_subtract, stack.next, ws_register_constant_int(registers, 0), right);
+                ws_register_push(&stack, stack.next++);
+                break;
+
+            case getimmediate:
+                ws_register_op_emit(registers, register_get, stack.next, ws_register_constant(registers, &command->parameter), 0);
+                ws_register_push(&stack, stack.next++);
+                break;
+
+            case setimmediate:
+                right = ws_register_pop(&stack);
+                ws_register_op_emit(registers, register_set, 0, ws_register_constant(registers, &command->parameter), right);
+                break;
+
+            case storeimmediate:
+                ws_register_op_emit(registers, register_set, 0, ws_register_constant(registers, &command->parameter),
+                                    ws_register_constant_int(registers, command->immediate));
+                break;
+
+            case getslot:
+                ws_register_op_emit(registers, register_getslot, stack.next, (unsigned int)command->immediate, 0);
+                ws_register_push(&stack, stack.next++);
+                break;
+
+            case setslot:
+                right = ws_register_pop(&stack);
+                ws_register_op_emit(registers, register_setslot, 0, (unsigned int)command->immediate, right);
+                break;
+
+            case storeslot:
+                ws_register_op_emit(registers, register_setslot, 0, (unsigned int)command->immediate,
+                                    ws_register_constant(registers, &command->parameter));
+                break;
+
+            case pushpush:
+                ws_register_push(&stack, ws_register_constant_int(registers, command->immediate));
+                ws_register_push(&stack, ws_register_constant(registers, &command->parameter));
+                break;
+
+            case reserve:
+                break;
+
+            // the jumps at the end
+            case jump:
+                result->terminator.opcode = register_jump;
+                break;
+
+            case jumpifzero:
+            case jumpifnegative:
+                result->terminator.opcode = (ws_checked_map[command->type] == jumpifzero)? register_jumpifzero: register_jumpifnegative;
+                result->terminator.left = ws_register_pop(&stack);
+                break;
+
+            case duplicatejumpifzero:
+            case duplicatejumpifnegative:
+                result->terminator.opcode = (command->type == duplicatejumpifzero)? register_jumpifzero: register_jumpifnegative;
+                result->terminator.left = stack.entries[stack.length - 1];
+                break;
+
+            case jumpifequal:
+            case jumpifless:
+                result->terminator.opcode = (command->type == jumpifequal)? register_jumpifequal: register_jumpifless;
+                result->terminator.right = ws_register_pop(&stack);
+                result->terminator.left = ws_register_pop(&stack);
+                break;
+
+            case jumpifequalimmediate:
+            case jumpiflessimmediate:
+                result->terminator.opcode = (command->type == jumpifequalimmediate)? register_jumpifequal: register_jumpifless;
+                result->terminator.right = ws_register_constant_int(registers, command->immediate);
+                result->terminator.left = ws_register_pop(&stack);
+                break;
+
+            default:
+                break;
+        }
+    }
+    result->ops_length = registers->ops_length - result->ops;
+
+    // spill what is left on the stack, moving the topmost copy of every register
+    char *const moved = (char *)calloc(stack.next + 1, 1);
+    result->spills = registers->spills_length;
+    result->spills_length = stack.length;
+    registers->spills_length += stack.length;
+    for(size_t i = stack.length; i-- > 0;) {
+        ws_register_spill *const spill = registers->spills + result->spills + i;
+        value = stack.entries[i];
+        spill->value = value;
+        spill->move = 0;
+        if (!(value & WS_REGISTER_CONSTANT) && !moved[value]) {
+            moved[value] = 1;
+            spill->move = 1;
+        }
+    }
+
+    // and free the rest
+    result->frees = registers->frees_length;
+    for(unsigned int r = 0; r < stack.next; r++) {
+        if (!moved[r]) {
+            registers->frees[registers->frees_length++] = r;
+        }
+    }
+    result->frees_length = registers->frees_length - result->frees;
+
+    if (stack.next > registers->registers) {
+        registers->registers = stack.next;
+    }
+
+    free(moved);
+    free(stack.entries);
+}
+
+#endif
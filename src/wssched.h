@@ -0,0 +1,434 @@
+/* wssched.h, runs many machines at once on a few threads, each of them waiting for its input without blocking one */
+#ifndef WSSCHED_H
+#define WSSCHED_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#if WS_THREADS
+#include <pthread.h>
+#endif
+#include "wstypes.h"
+#include "wsvm.h"
+
+#define WS_SCHEDULER_THREADS_MAX 64
+#define WS_SCHEDULER_BUDGET 10000 //commands a machine runs before the next one gets its turn
+#define WS_SCHEDULER_EVENTS 64
+#define WS_SCHEDULER_INPUT_SIZE 4096
+
+
+
+/* The scheduler runs machines which read their input from a descriptor, such as a pipe or a socket. Every machine
+ * belongs to one of the threads, which takes turns running each of its machines for a budget of commands. A machine
+ * which needs input that hasn't arrived yet (see ws_vm_ready in wsvm.h) gets put aside until epoll says there's more,
+ * and the thread goes on with the others. Only when none of its machines can run does a thread wait.
+ *
+ * The machines write to their own output file as usual, see ws_vm_io. Once a machine has ended or failed the
+ * scheduler closes its descriptor and calls done on the thread which ran it, which can add new machines.
+ * Without WS_THREADS there is one thread, which only runs inside ws_scheduler_wait.
+ */
+typedef struct ws_task {
+    ws_vm *vm;
+    int descriptor;
+    int flags;                  //the file status flags of descriptor before the scheduler made it nonblocking
+    ws_input input;
+    int polled;                 //registered with epoll of its thread
+    void (*done)(ws_vm *, void *);
+    void *data;
+    struct ws_task *next;       //in the inbox or the ready queue of its thread
+} ws_task;
+
+typedef struct ws_scheduler_thread {
+    struct ws_scheduler *scheduler;
+    int epoll;
+    int wake;                   //an eventfd which wakes the thread when a machine gets added
+    ws_task *inbox;             //added tasks the thread hasn't taken yet
+    ws_task *ready;             //the tasks which can run, in turn
+    ws_task *ready_last;
+    size_t tasks;
+#if WS_THREADS
+    pthread_mutex_t lock;
+    pthread_t thread;
+#endif
+} ws_scheduler_thread;
+
+typedef struct ws_scheduler {
+    ws_scheduler_thread threads[WS_SCHEDULER_THREADS_MAX];
+    size_t length;
+    size_t budget;
+    size_t next;                //the thread which gets the next machine
+    size_t pending;             //machines which haven't been done yet
+    int stopping;
+#if WS_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+#endif
+} ws_scheduler;
+
+/* forward declarations
+ */
+ws_scheduler *ws_scheduler_create(size_t, size_t);
+void ws_scheduler_add(ws_scheduler *, ws_vm *, int, void (*)(ws_vm *, void *), void *);
+void ws_scheduler_wait(ws_scheduler *);
+void ws_scheduler_destroy(ws_scheduler *);
+static void *ws_scheduler_loop(void *);
+static int ws_task_fill(ws_task *);
+
+
+
+static void ws_scheduler_lock(ws_scheduler_thread *const thread) {
+#if WS_THREADS
+    pthread_mutex_lock(&thread->lock);
+#else
+    (void)thread;
+#endif
+}
+
+static void ws_scheduler_unlock(ws_scheduler_thread *const thread) {
+#if WS_THREADS
+    pthread_mutex_unlock(&thread->lock);
+#else
+    (void)thread;
+#endif
+}
+
+/* Creates a scheduler with the given amount of threads, or as many as there are processors with 0, which run each
+ * machine for budget commands at a time, or WS_SCHEDULER_BUDGET with 0.
+ */
+ws_scheduler *ws_scheduler_create(size_t threads, const size_t budget) {
+#if WS_THREADS
+    if (!threads) {
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0)? (size_t)cpus: 1;
+    }
+    if (threads > WS_SCHEDULER_THREADS_MAX) {
+        threads = WS_SCHEDULER_THREADS_MAX;
+    }
+#else
+    threads = 1;
+#endif
+
+    ws_scheduler *const scheduler = (ws_scheduler *)malloc(sizeof(ws_scheduler));
+    scheduler->length = threads;
+    scheduler->budget = budget? budget: WS_SCHEDULER_BUDGET;
+    scheduler->next = 0;
+    scheduler->pending = 0;
+    scheduler->stopping = 0;
+#if WS_THREADS
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->idle, NULL);
+#endif
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+
+    for(size_t i = 0; i < threads; i++) {
+        ws_scheduler_thread *const thread = scheduler->threads + i;
+        thread->scheduler = scheduler;
+        thread->epoll = epoll_create1(EPOLL_CLOEXEC);
+        thread->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (thread->epoll < 0 || thread->wake < 0 || epoll_ctl(thread->epoll, EPOLL_CTL_ADD, thread->wake, &event)) {
+            printf("couldn't create the event loop of the scheduler\n");
+            exit(EXIT_FAILURE);
+        }
+        thread->inbox = NULL;
+        thread->ready = NULL;
+        thread->ready_last = NULL;
+        thread->tasks = 0;
+#if WS_THREADS
+        pthread_mutex_init(&thread->lock, NULL);
+#endif
+    }
+
+#if WS_THREADS
+    for(size_t i = 0; i < threads; i++) {
+        if (pthread_create(&scheduler->threads[i].thread, NULL, ws_scheduler_loop, scheduler->threads + i)) {
+            printf("couldn't start the threads of the scheduler\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+    return scheduler;
+}
+
+/* Adds vm, which has a program, to the machines the scheduler runs, fed with what it reads from descriptor.
+ * The scheduler takes over descriptor, and calls done with vm and data once vm has ended or failed. It makes
+ * descriptor nonblocking meanwhile, and puts its flags back before closing it.
+ * vm runs from where it is, so normally it has just been reset. Can be called from any thread.
+ */
+void ws_scheduler_add(ws_scheduler *const scheduler, ws_vm *const vm, const int descriptor,
+                      void (*const done)(ws_vm *, void *), void *const data) {
+    ws_task *const task = (ws_task *)malloc(sizeof(ws_task));
+    task->vm = vm;
+    task->descriptor = descriptor;
+    task->input.data = (char *)malloc(WS_SCHEDULER_INPUT_SIZE);
+    task->input.start = 0;
+    task->input.end = 0;
+    task->input.size = WS_SCHEDULER_INPUT_SIZE;
+    task->input.closed = 0;
+    task->polled = 0;
+    task->done = done;
+    task->data = data;
+    task->flags = fcntl(descriptor, F_GETFL);
+    fcntl(descriptor, F_SETFL, task->flags | O_NONBLOCK);
+    ws_vm_source(vm, &task->input);
+
+#if WS_THREADS
+    pthread_mutex_lock(&scheduler->lock);
+#endif
+    ws_scheduler_thread *const thread = scheduler->threads + scheduler->next;
+    scheduler->next = (scheduler->next + 1) % scheduler->length;
+    scheduler->pending++;
+#if WS_THREADS
+    pthread_mutex_unlock(&scheduler->lock);
+#endif
+
+    ws_scheduler_lock(thread);
+    task->next = thread->inbox;
+    thread->inbox = task;
+    ws_scheduler_unlock(thread);
+
+    const uint64_t one = 1;
+    if (write(thread->wake, &one, sizeof(uint64_t)) < 0) {
+        // the counter is already nonzero, so the thread wakes up anyway
+    }
+}
+
+// waits until every machine added so far is done
+void ws_scheduler_wait(ws_scheduler *const scheduler) {
+#if WS_THREADS
+    pthread_mutex_lock(&scheduler->lock);
+    while (scheduler->pending) {
+        pthread_cond_wait(&scheduler->idle, &scheduler->lock);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+#else
+    ws_scheduler_loop(scheduler->threads);
+#endif
+}
+
+void ws_scheduler_destroy(ws_scheduler *const scheduler) {
+    ws_scheduler_wait(scheduler);
+
+#if WS_THREADS
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = 1;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    const uint64_t one = 1;
+    for(size_t i = 0; i < scheduler->length; i++) {
+        if (write(scheduler->threads[i].wake, &one, sizeof(uint64_t)) < 0) {
+            // already woken up
+        }
+    }
+    for(size_t i = 0; i < scheduler->length; i++) {
+        pthread_join(scheduler->threads[i].thread, NULL);
+    }
+#endif
+
+    for(size_t i = 0; i < scheduler->length; i++) {
+        close(scheduler->threads[i].epoll);
+        close(scheduler->threads[i].wake);
+#if WS_THREADS
+        pthread_mutex_destroy(&scheduler->threads[i].lock);
+#endif
+    }
+#if WS_THREADS
+    pthread_cond_destroy(&scheduler->idle);
+    pthread_mutex_destroy(&scheduler->lock);
+#endif
+    free(scheduler);
+}
+
+static void ws_scheduler_ready(ws_scheduler_thread *const thread, ws_task *const task) {
+    task->next = NULL;
+    if (thread->ready) {
+        thread->ready_last->next = task;
+    } else {
+        thread->ready = task;
+    }
+    thread->ready_last = task;
+}
+
+/* Reads what has arrived for task. Returns whether there was anything, or the end of the input.
+ */
+static int ws_task_fill(ws_task *const task) {
+    ws_input *const input = &task->input;
+    int progress = 0;
+
+    while (!input->closed) {
+        // make room behind what hasn't been read yet
+        if (input->start && input->start == input->end) {
+            input->start = 0;
+            input->end = 0;
+        }
+        if (input->end == input->size) {
+            if (input->start) {
+                memmove(input->data, input->data + input->start, input->end - input->start);
+                input->end -= input->start;
+                input->start = 0;
+            } else {
+                input->size *= 2;
+                input->data = (char *)realloc(input->data, input->size);
+            }
+        }
+
+        const ssize_t length = read(task->descriptor, input->data + input->end, input->size - input->end);
+        if (length > 0) {
+            input->end += (size_t)length;
+            progress = 1;
+        } else if (length < 0 && errno == EINTR) {
+            continue;
+        } else if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            // the end, or an error which ends the input just as well
+            input->closed = 1;
+            progress = 1;
+        }
+    }
+    return progress;
+}
+
+/* Puts a blocked task aside until epoll reports input for it. Returns 0 if it can go on right away, because its
+ * input arrived in the meantime, or because it's a file, which epoll doesn't do but never blocks either.
+ */
+static int ws_task_wait(ws_scheduler_thread *const thread, ws_task *const task) {
+    if (ws_task_fill(task)) {
+        return 0;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = task;
+    if (epoll_ctl(thread->epoll, task->polled? EPOLL_CTL_MOD: EPOLL_CTL_ADD, task->descriptor, &event)) {
+        task->input.closed = 1;
+        return 0;
+    }
+    task->polled = 1;
+    return 1;
+}
+
+static void ws_task_done(ws_scheduler_thread *const thread, ws_task *const task) {
+    ws_scheduler *const scheduler = thread->scheduler;
+    if (task->polled) {
+        epoll_ctl(thread->epoll, EPOLL_CTL_DEL, task->descriptor, NULL);
+    }
+    // the flags belong to the open file, which whoever passed descriptor may share
+    if (task->flags >= 0) {
+        fcntl(task->descriptor, F_SETFL, task->flags);
+    }
+    close(task->descriptor);
+    ws_vm_source(task->vm, NULL);
+    free(task->input.data);
+    thread->tasks--;
+
+    if (task->done) {
+        task->done(task->vm, task->data);
+    }
+    free(task);
+
+#if WS_THREADS
+    pthread_mutex_lock(&scheduler->lock);
+    if (!--scheduler->pending) {
+        pthread_cond_broadcast(&scheduler->idle);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+#else
+    scheduler->pending--;
+#endif
+}
+
+/* The event loop of a thread. Every round runs each ready machine once, and then looks at what epoll has, without
+ * waiting unless no machine is ready. Without WS_THREADS it returns once all machines are done.
+ */
+static void *ws_scheduler_loop(void *const argument) {
+    ws_scheduler_thread *const thread = (ws_scheduler_thread *)argument;
+    ws_scheduler *const scheduler = thread->scheduler;
+    struct epoll_event events[WS_SCHEDULER_EVENTS];
+    uint64_t counter;
+
+    while (1) {
+        // take the new machines
+        ws_scheduler_lock(thread);
+        ws_task *task = thread->inbox;
+        thread->inbox = NULL;
+        ws_scheduler_unlock(thread);
+        while (task) {
+            ws_task *const next = task->next;
+            thread->tasks++;
+            ws_scheduler_ready(thread, task);
+            task = next;
+        }
+
+#if WS_THREADS
+        if (!thread->tasks) {
+            pthread_mutex_lock(&scheduler->lock);
+            const int stopping = scheduler->stopping;
+            pthread_mutex_unlock(&scheduler->lock);
+            if (stopping) {
+                return NULL;
+            }
+        }
+#endif
+
+        // run a round
+        ws_task *const last = thread->ready_last;
+        while (thread->ready) {
+            task = thread->ready;
+            thread->ready = task->next;
+            if (!thread->ready) {
+                thread->ready_last = NULL;
+            }
+            const int end = task == last;
+
+            switch (ws_vm_step(task->vm, scheduler->budget)) {
+                case WS_STATUS_RUNNING:
+                    ws_scheduler_ready(thread, task);
+                    break;
+
+                case WS_STATUS_BLOCKED:
+                    if (!ws_task_wait(thread, task)) {
+                        ws_scheduler_ready(thread, task);
+                    }
+                    break;
+
+                default:
+                    ws_task_done(thread, task);
+                    break;
+            }
+
+            if (end) {
+                break;
+            }
+        }
+
+#if !WS_THREADS
+        // done can have added more
+        if (!thread->tasks && !thread->inbox) {
+            return NULL;
+        }
+#endif
+
+        // the input which arrived in the meantime
+        const int count = epoll_wait(thread->epoll, events, WS_SCHEDULER_EVENTS, thread->ready? 0: -1);
+        for(int i = 0; i < count; i++) {
+            task = (ws_task *)events[i].data.ptr;
+            if (!task) {
+                if (read(thread->wake, &counter, sizeof(uint64_t)) < 0) {
+                    // somebody else reset it already
+                }
+            } else {
+                ws_task_fill(task);
+                ws_scheduler_ready(thread, task);
+            }
+        }
+    }
+}
+
+#endif
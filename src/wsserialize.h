@@ -3,18 +3,113 @@
 
 #define SERIALIZING_BUFFER_SIZE 1000
 #define SERIALIZING_BUFFER_RESIZE 2
+#define SERIALIZING_STREAM_SIZE 65536   //the fixed size of the buffer of a stream
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "wstypes.h"
 
+#if WS_THREADS
+#include <pthread.h>
+#endif
+
+#define WS_FORMAT_MAGIC "\x7FWSC"
+#define WS_FORMAT_MAGIC_SIZE 4
+#define WS_FORMAT_VERSION 2
+#define WS_FORMAT_TAGS "HCLKP"   //the sections this version knows, see below
+#define WS_FORMAT_SECTIONS 5
+#define WS_FORMAT_CHECKSUM_SIZE 4
+#define WS_FORMAT_POOL_SIZE 64   //the initial size of the hash table which deduplicates a pool
+
 
 
-//the buffer used when serializing
+/* The .wsc format, version 2. Everything but the magic and the checksum is made of bytes and LEB128 varints: 7 bits
+ * at a time starting with the lowest, with the high bit set on every byte but the last. Signed numbers are zigzag
+ * encoded first, so small negative numbers stay short as well.
+ *
+ * magic      the 4 bytes 7F 'W' 'S' 'C'
+ * version    a byte, WS_FORMAT_VERSION
+ * sections   a count, then a tag byte and a length for every section. the sections follow the table in its order
+ * ...        the sections themselves
+ * checksum   the CRC-32 of everything before it, as 4 little endian bytes
+ *
+ * The sections are, by tag:
+ * 'H' the cache header: the size and mtime of the source, and its hash as 8 little endian bytes
+ * 'C' the constant pool: a count, then every distinct parameter. a small int is a 0 followed by its value,
+ *     a big int is (length << 1 | sign) followed by its digits
+ * 'L' the label pool of a program that isn't compiled: a count, then every distinct label as its length in bits
+ *     followed by its bytes
+ * 'K' the commands: the program flags and a count, then every command as its type, its immediate if it has one,
+ *     and then its parameter in the constant pool, its label in the label pool, or the distance from the command to
+ *     its jumpoffset. the pools are in the order the commands first use them, so a command refers to an item by
+ *     the amount of items used before it minus the index of the item: 0 is a new item, 1 the item new last
+ * 'P' the block profile, if there is one: a count, then for every block the distance from the start of the last
+ *     block to its start, how often it ran and how often the jump at its end was taken
+ *
+ * The pools come before the commands, so a file can be read from front to back. Readers skip the sections they
+ * don't know. Files of another version or with the wrong checksum, like the files written before there were
+ * versions, get rejected before anything in them is read.
+ */
+
+/* The buffer used when serializing. The buffer of a stream doesn't grow: whatever gets serialized into it is written
+ * to the descriptor of the stream when it's full, and unserializing from it reads the next part of the descriptor
+ * once it's used up. A stream with descriptor -1 only counts what gets serialized into it.
+ */
+typedef struct ws_serializing_stream ws_serializing_stream;
+
 typedef struct {
     size_t length;
     char *buffer;
     size_t index;
+    ws_serializing_stream *stream;
 } ws_serializing_buffer;
 
+/* total is the amount of bytes in front of the buffer and crc their CRC-32, unless checked is set because the
+ * checksum was verified before reading. end is where the section being read ends.
+ */
+struct ws_serializing_stream {
+    int descriptor;
+    int failed;
+    int checked;
+    uint64_t total;
+    uint32_t crc;
+    uint64_t end;
+};
+
+/* A pool of distinct constants or labels. Every item gets serialized at the end of data, and taken back out again
+ * if the pool already holds the same bytes. offsets[i] is where item i starts, offsets[length] where the next one
+ * will, and table is a hash table of item indexes + 1 on their bytes. used is the amount of items the commands
+ * serialized so far refer to.
+ */
+typedef struct {
+    ws_serializing_buffer data;
+    size_t length;
+    size_t used;
+    size_t capacity;
+    size_t *offsets;
+    size_t size;
+    size_t *table;
+} ws_serializing_pool;
+
+//the pools as they are read back. used is the amount of items used so far
+typedef struct {
+    size_t constants_length;
+    size_t constants_used;
+    ws_int *constants;
+    size_t labels_length;
+    size_t labels_used;
+    ws_label *labels;
+} ws_serializing_pools;
+
+// the source a cached program was compiled from, see ws_cache_load below
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+} ws_cache_header;
+
 
 
 /* First a set serializing and unserializing functiosn for each datatype
@@ -25,6 +120,21 @@ static void serializing_buffer_initialize(ws_serializing_buffer *const dest) {
     dest->length = SERIALIZING_BUFFER_SIZE;
     dest->buffer = (char *)malloc(SERIALIZING_BUFFER_SIZE);
     dest->index = 0;
+    dest->stream = NULL;
+}
+
+static void serializing_stream_initialize(ws_serializing_buffer *const buffer, ws_serializing_stream *const stream,
+                                          const int descriptor) {
+    buffer->length = SERIALIZING_STREAM_SIZE;
+    buffer->buffer = (char *)malloc(SERIALIZING_STREAM_SIZE);
+    buffer->index = 0;
+    buffer->stream = stream;
+    stream->descriptor = descriptor;
+    stream->failed = 0;
+    stream->checked = 0;
+    stream->total = 0;
+    stream->crc = 0;
+    stream->end = UINT64_MAX;
 }
 
 static void serializing_buffer_finish(ws_string *const result, const ws_serializing_buffer *const dest) {
@@ -32,7 +142,15 @@ static void serializing_buffer_finish(ws_string *const result, const ws_serializ
     result->length = dest->index;
 }
 
+static void serializing_flush(ws_serializing_buffer *const dest);
+
 static void reserve_space(ws_serializing_buffer *const dest, const size_t size) {
+    if (dest->stream) {
+        if ((dest->index + size) > (dest->length)) {
+            serializing_flush(dest);
+        }
+        return;
+    }
     while ((dest->index + size) > (dest->length)) {
         dest->length *= 2;
         dest->buffer = (char *)realloc(dest->buffer, dest->length);
@@ -43,13 +161,171 @@ static void reserve_space(ws_serializing_buffer *const dest, const size_t size)
     }
 }
 
-static void check_space(const ws_serializing_buffer *const source, const size_t size) {
-    if (size > (source->length - source->index)) {
+// where in everything serialized into or read from buffer it is
+static uint64_t serializing_position(const ws_serializing_buffer *const buffer) {
+    return (buffer->stream? buffer->stream->total: 0) + buffer->index;
+}
+
+// the amount of bytes left to read, which for a stream is up to the end of the section being read
+static uint64_t serializing_left(const ws_serializing_buffer *const source) {
+    if (source->stream) {
+        return source->stream->end - serializing_position(source);
+    }
+    return source->length - source->index;
+}
+
+static void check_space(const ws_serializing_buffer *const source, const uint64_t size) {
+    if (size > serializing_left(source)) {
         printf("tried to read out of source buffer bounds\n");
         exit(EXIT_FAILURE);
     }
 }
 
+// writes all length bytes of data to descriptor, returns 0 if that failed
+static int ws_serializing_write(const int descriptor, const char *const data, const size_t length) {
+    for(size_t done = 0; done < length;) {
+        const ssize_t written = write(descriptor, data + done, length - done);
+        if (written > 0) {
+            done += (size_t)written;
+        } else if (written == 0 || errno != EINTR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// reads 8 bytes as a little endian number, which compilers turn into a single load where they can
+static uint64_t ws_serializing_word(const char *const data) {
+    const unsigned char *const bytes = (const unsigned char *)data;
+    return (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8 | (uint64_t)bytes[2] << 16 | (uint64_t)bytes[3] << 24 |
+           (uint64_t)bytes[4] << 32 | (uint64_t)bytes[5] << 40 | (uint64_t)bytes[6] << 48 | (uint64_t)bytes[7] << 56;
+}
+
+// mixes in 8 bytes at a time like ws_label_hash does
+static uint64_t ws_serializing_hash(const char *const data, const size_t length) {
+    uint64_t hash = (uint64_t)length * ws_hash_prime;
+    char last[sizeof(uint64_t)] = {0};
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        hash = (hash ^ ws_serializing_word(data + i)) * ws_hash_multiplier;
+        hash ^= hash >> 29;
+    }
+    if (i < length) {
+        memcpy(last, data + i, length - i);
+        hash = (hash ^ ws_serializing_word(last)) * ws_hash_multiplier;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+/* The standard CRC-32, 8 bytes at a time. ws_crc_table[k][b] is the crc of byte b followed by k zero bytes.
+ * crc is that of the data in front of this, so it can be computed a part at a time starting from 0.
+ * The table gets filled on first use, which with WS_THREADS happens exactly once, as --batch and --serve compute
+ * checksums on several threads at the same time.
+ */
+static uint32_t ws_crc_table[8][256];
+#if WS_THREADS
+static pthread_once_t ws_crc_once = PTHREAD_ONCE_INIT;
+#else
+static int ws_crc_filled;
+#endif
+
+static void ws_crc_fill(void) {
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+        }
+        ws_crc_table[0][i] = crc;
+    }
+    for(int k = 1; k < 8; k++) {
+        for(uint32_t i = 0; i < 256; i++) {
+            ws_crc_table[k][i] = (ws_crc_table[k - 1][i] >> 8) ^ ws_crc_table[0][ws_crc_table[k - 1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t ws_crc32(const uint32_t previous, const char *const data, const size_t length) {
+#if WS_THREADS
+    pthread_once(&ws_crc_once, ws_crc_fill);
+#else
+    if (!ws_crc_filled) {
+        ws_crc_fill();
+        ws_crc_filled = 1;
+    }
+#endif
+
+    uint32_t crc = ~previous;
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        const uint64_t word = ws_serializing_word(data + i) ^ crc;
+        crc = ws_crc_table[7][word & 0xFF] ^ ws_crc_table[6][(word >> 8) & 0xFF] ^
+              ws_crc_table[5][(word >> 16) & 0xFF] ^ ws_crc_table[4][(word >> 24) & 0xFF] ^
+              ws_crc_table[3][(word >> 32) & 0xFF] ^ ws_crc_table[2][(word >> 40) & 0xFF] ^
+              ws_crc_table[1][(word >> 48) & 0xFF] ^ ws_crc_table[0][word >> 56];
+    }
+    for(; i < length; i++) {
+        crc = (crc >> 8) ^ ws_crc_table[0][(crc ^ (unsigned char)data[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+// writes out what was serialized into the buffer of a stream
+static void serializing_flush(ws_serializing_buffer *const dest) {
+    ws_serializing_stream *const stream = dest->stream;
+    if (stream->descriptor >= 0 && !stream->failed) {
+        stream->crc = ws_crc32(stream->crc, dest->buffer, dest->index);
+        stream->failed = !ws_serializing_write(stream->descriptor, dest->buffer, dest->index);
+    }
+    stream->total += dest->index;
+    dest->index = 0;
+}
+
+/* Whether the next size bytes of source are in its buffer. A stream reads from its descriptor until they are,
+ * or it ends. size can't be more than SERIALIZING_STREAM_SIZE.
+ */
+static int serializing_prefetch(ws_serializing_buffer *const source, const size_t size) {
+    ws_serializing_stream *const stream = source->stream;
+    if (!stream || (source->length - source->index) >= size) {
+        return (source->length - source->index) >= size;
+    }
+
+    if (!stream->checked) {
+        stream->crc = ws_crc32(stream->crc, source->buffer, source->index);
+    }
+    stream->total += source->index;
+    source->length -= source->index;
+    memmove(source->buffer, source->buffer + source->index, source->length);
+    source->index = 0;
+    while (source->length < size) {
+        const ssize_t got = read(stream->descriptor, source->buffer + source->length,
+                                 SERIALIZING_STREAM_SIZE - source->length);
+        if (got > 0) {
+            source->length += (size_t)got;
+        } else if (got == 0 || errno != EINTR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// makes sure the next size bytes of source can be read from its buffer
+static void serializing_read(ws_serializing_buffer *const source, const size_t size) {
+    check_space(source, size);
+    if (!serializing_prefetch(source, size)) {
+        printf("tried to read out of source buffer bounds\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// the CRC-32 of everything in front of the index of a stream, or from start up to it for other buffers
+static uint32_t serializing_crc(const ws_serializing_buffer *const buffer, const size_t start) {
+    if (buffer->stream) {
+        return ws_crc32(buffer->stream->crc, buffer->buffer, buffer->index);
+    }
+    return ws_crc32(0, buffer->buffer + start, buffer->index - start);
+}
+
 static void serialize_char(const char number, ws_serializing_buffer *const dest) {
 #if (DEBUG)
     printf("serializing uchar\n");
@@ -64,154 +340,658 @@ static unsigned char unserialize_char(ws_serializing_buffer *const source) {
     printf("unserializing uchar\n");
 #endif
     char data;
-    check_space(source, 1);
+    serializing_read(source, 1);
     memcpy(&data, source->buffer + source->index, 1);
     source->index++;
     return data;
 }
 
-static void serialize_uint32(const uint32_t number, ws_serializing_buffer *const dest) {
-#if (DEBUG)
-    printf("serializing uint32\n");
-#endif
-    reserve_space(dest, sizeof(uint32_t));
-    memcpy(dest->buffer+dest->index, &number, sizeof(uint32_t));
-    dest->index += sizeof(uint32_t);
+static void serialize_bytes(const char *const data, const size_t length, ws_serializing_buffer *const dest) {
+    if (!length) {
+        return;
+    }
+    // a stream takes them as large as its buffer at a time
+    size_t done = 0;
+    while (dest->stream && (length - done) > (dest->length - dest->index)) {
+        const size_t part = dest->length - dest->index;
+        memcpy(dest->buffer + dest->index, data + done, part);
+        dest->index += part;
+        done += part;
+        serializing_flush(dest);
+    }
+    reserve_space(dest, length - done);
+    memcpy(dest->buffer + dest->index, data + done, length - done);
+    dest->index += length - done;
 }
 
-static uint32_t unserialize_uint32(ws_serializing_buffer *const source) {
-#if (DEBUG)
-    printf("unserializing uint32\n");
-#endif
-    size_t data;
-    check_space(source, sizeof(uint32_t));
-    memcpy(&data, source->buffer + source->index, sizeof(uint32_t));
-    source->index += sizeof(uint32_t);
-    return data;
+static void unserialize_bytes(char *const data, const size_t length, ws_serializing_buffer *const source) {
+    check_space(source, length);
+    size_t done = 0;
+    while (done < length) {
+        serializing_read(source, 1);
+        const size_t left = source->length - source->index;
+        const size_t part = (length - done < left)? length - done: left;
+        memcpy(data + done, source->buffer + source->index, part);
+        source->index += part;
+        done += part;
+    }
 }
 
-void serialize_int32(const int32_t number, ws_serializing_buffer *const dest) {
-#if (DEBUG)
-    printf("serializing int32\n");
-#endif
-    reserve_space(dest, sizeof(int32_t));
-    memcpy(dest->buffer+dest->index, &number, sizeof(int32_t));
-    dest->index += sizeof(int32_t);
+static uint64_t ws_zigzag(const int64_t number) {
+    return ((uint64_t)number << 1) ^ (uint64_t)(number >> 63);
 }
 
-static int32_t unserialize_int32(ws_serializing_buffer *const source) {
-#if (DEBUG)
-    printf("unserializing int32\n");
-#endif
-    int data;
-    check_space(source, sizeof(int32_t));
-    memcpy(&data, source->buffer + source->index, sizeof(int32_t));
-    source->index += sizeof(int32_t);
-    return data;
+static int64_t ws_unzigzag(const uint64_t number) {
+    return (int64_t)(number >> 1) ^ -(int64_t)(number & 1);
+}
+
+static void serialize_varint(uint64_t number, ws_serializing_buffer *const dest) {
+    reserve_space(dest, 10);
+    while (number >= 0x80) {
+        dest->buffer[dest->index++] = (char)(number | 0x80);
+        number >>= 7;
+    }
+    dest->buffer[dest->index++] = (char)number;
+}
+
+static uint64_t unserialize_varint(ws_serializing_buffer *const source) {
+    size_t left = source->length - source->index;
+    if (source->stream) {
+        // the buffer can hold the next section as well
+        const uint64_t section = serializing_left(source);
+        left = (section < 10)? (size_t)section: 10;
+        serializing_prefetch(source, left);
+        left = (left < source->length - source->index)? left: source->length - source->index;
+    }
+    const unsigned char *const bytes = (const unsigned char *)source->buffer + source->index;
+    // most of them are a single byte
+    if (left && bytes[0] < 0x80) {
+        source->index++;
+        return bytes[0];
+    }
+
+    // none is longer than 10 bytes
+    const size_t limit = (left < 10)? left: 10;
+    uint64_t number = 0;
+    for(size_t i = 0; i < limit; i++) {
+        number |= (uint64_t)(bytes[i] & 0x7F) << (7 * i);
+        if (bytes[i] < 0x80) {
+            source->index += i + 1;
+            return number;
+        }
+    }
+    check_space(source, limit + 1);
+    printf("invalid varint while unserializing\n");
+    exit(EXIT_FAILURE);
+}
+
+//numbers of a fixed size are little endian
+static void serialize_fixed(const uint64_t number, const size_t size, ws_serializing_buffer *const dest) {
+    reserve_space(dest, size);
+    for(size_t i = 0; i < size; i++) {
+        dest->buffer[dest->index++] = (char)(number >> (8 * i));
+    }
+}
 
+static uint64_t unserialize_fixed(ws_serializing_buffer *const source, const size_t size) {
+    serializing_read(source, size);
+    uint64_t number = 0;
+    for(size_t i = 0; i < size; i++) {
+        number |= (uint64_t)(unsigned char)source->buffer[source->index++] << (8 * i);
+    }
+    return number;
 }
 
 static void serialize_label(const ws_label *const string, ws_serializing_buffer *const dest) {
 #if (DEBUG)
     printf("serializing label\n");
 #endif
-    serialize_uint32(string->length, dest);
-    size_t length = ws_round8up(string->length);
-
-    reserve_space(dest, length);
-    memcpy(dest->buffer+dest->index, string->data, length);
-    dest->index += length;
+    serialize_varint(string->length, dest);
+    serialize_bytes(string->data, ws_round8up(string->length), dest);
 }
 
 static void unserialize_label(ws_label *const string, ws_serializing_buffer *const source) {
 #if (DEBUG)
     printf("unserializing label\n");
 #endif
-    string->length = unserialize_uint32(source);
+    string->length = unserialize_varint(source);
     size_t length = ws_round8up(string->length);
-    string->data = (char *)malloc(length);
-
     check_space(source, length);
-    memcpy(string->data, source->buffer + source->index, length);
-    source->index += string->length;
+
+    string->data = (char *)malloc(length);
+    unserialize_bytes(string->data, length, source);
 }
 
 static void serialize_ws_int(const ws_int *const number, ws_serializing_buffer *const dest) {
-    serialize_uint32(number->length, dest);
-    size_t length = number->length;
-    if (number->length) {
-        for (size_t i = 0; i < length; i++) {
-            serialize_uint32(number->digits[i], dest);
-        }
-    } else {
-        serialize_int32(number->data, dest);
+    if (!number->length) {
+        serialize_varint(0, dest);
+        serialize_varint(ws_zigzag(number->data), dest);
+        return;
+    }
+    size_t length = ACTLEN(number->length);
+    serialize_varint((uint64_t)length << 1 | !!(number->length & WS_INT_SIGN_MASK), dest);
+    for (size_t i = 0; i < length; i++) {
+        serialize_varint(number->digits[i], dest);
     }
 }
 
 static void unserialize_ws_int(ws_int *const result, ws_serializing_buffer *const source) {
-    result->length = unserialize_uint32(source);
-    size_t length = ACTLEN(result->length);
+    const uint64_t tag = unserialize_varint(source);
+    if (!tag) {
+        result->length = 0;
+        result->data = (sdigit)ws_unzigzag(unserialize_varint(source));
+        return;
+    }
+
+    // every digit takes at least a byte
+    size_t length = tag >> 1;
+    if (!length || length >= WS_INT_SIGN_MASK || length > serializing_left(source)) {
+        printf("invalid int while unserializing\n");
+        exit(EXIT_FAILURE);
+    }
+    result->length = (digit)length | ((tag & 1)? WS_INT_SIGN_MASK: 0);
     result->digits = (digit *)malloc(sizeof(digit) * length);
-    if (result->length) {
-        for (size_t i = 0; i < length; i++) {
-            result->digits[i] = unserialize_uint32(source);
+    for (size_t i = 0; i < length; i++) {
+        result->digits[i] = (digit)unserialize_varint(source);
+    }
+}
+
+
+
+/* The pools. An item gets added by serializing it into pool->data first, see ws_serializing_pool
+ */
+static void serializing_pool_initialize(ws_serializing_pool *const pool) {
+    serializing_buffer_initialize(&pool->data);
+    pool->length = 0;
+    pool->used = 0;
+    pool->capacity = WS_FORMAT_POOL_SIZE;
+    pool->offsets = (size_t *)malloc(sizeof(size_t) * WS_FORMAT_POOL_SIZE);
+    pool->offsets[0] = 0;
+    pool->size = WS_FORMAT_POOL_SIZE;
+    pool->table = (size_t *)calloc(WS_FORMAT_POOL_SIZE, sizeof(size_t));
+}
+
+static void serializing_pool_finish(const ws_serializing_pool *const pool) {
+    free(pool->data.buffer);
+    free(pool->offsets);
+    free(pool->table);
+}
+
+//the position in the table of the item with the bytes from start to the end of data, or the empty one it would get
+static size_t serializing_pool_position(const ws_serializing_pool *const pool, const size_t start, const size_t end) {
+    const size_t length = end - start;
+    size_t i = (size_t)ws_serializing_hash(pool->data.buffer + start, length) & (pool->size - 1);
+    size_t item;
+    while ((item = pool->table[i])) {
+        item--;
+        if (pool->offsets[item + 1] - pool->offsets[item] == length &&
+            !memcmp(pool->data.buffer + pool->offsets[item], pool->data.buffer + start, length)) {
+            break;
         }
-    } else {
-        result->data = unserialize_int32(source);
+        i = (i + 1) & (pool->size - 1);
     }
+    return i;
 }
 
-static void serialize_command(const ws_command *const command, const int compiled, ws_serializing_buffer *const dest) {
-#if DEBUG
-    serialize_char(0xff, dest);
-#endif
+// adds the item serialized into the pool last, and returns its index
+static size_t serializing_pool_add(ws_serializing_pool *const pool) {
+    const size_t start = pool->offsets[pool->length];
+    size_t i = serializing_pool_position(pool, start, pool->data.index);
+    if (pool->table[i]) {
+        pool->data.index = start;
+        return pool->table[i] - 1;
+    }
+
+    // keep the table at most 3/4 full
+    if (4 * (pool->length + 1) > 3 * pool->size) {
+        free(pool->table);
+        pool->size *= 2;
+        pool->table = (size_t *)calloc(pool->size, sizeof(size_t));
+        for(size_t item = 0; item < pool->length; item++) {
+            pool->table[serializing_pool_position(pool, pool->offsets[item], pool->offsets[item + 1])] = item + 1;
+        }
+        i = serializing_pool_position(pool, start, pool->data.index);
+    }
+
+    if (pool->length + 2 > pool->capacity) {
+        pool->capacity *= 2;
+        pool->offsets = (size_t *)realloc(pool->offsets, sizeof(size_t) * pool->capacity);
+    }
+    pool->table[i] = ++pool->length;
+    pool->offsets[pool->length] = pool->data.index;
+    return pool->length - 1;
+}
+
+// adds the item serialized into the pool last, and serializes the reference to it, see the top
+static void serialize_pool_reference(ws_serializing_pool *const pool, ws_serializing_buffer *const dest) {
+    const size_t item = serializing_pool_add(pool);
+    serialize_varint(pool->used - item, dest);
+    pool->used += (item == pool->used);
+}
+
+static size_t unserialize_pool_reference(size_t *const used, const size_t length, ws_serializing_buffer *const source) {
+    const uint64_t distance = unserialize_varint(source);
+    if (distance > *used || (!distance && *used == length)) {
+        printf("invalid pool reference while unserializing\n");
+        exit(EXIT_FAILURE);
+    }
+    return distance? *used - distance: (*used)++;
+}
+
+static void serialize_pool(const ws_serializing_pool *const pool, ws_serializing_buffer *const dest) {
+    serialize_varint(pool->length, dest);
+    serialize_bytes(pool->data.buffer, pool->data.index, dest);
+}
+
+static void unserialize_constants(ws_serializing_pools *const pools, ws_serializing_buffer *const source) {
+    // every constant takes at least a byte
+    const uint64_t length = unserialize_varint(source);
+    check_space(source, length);
+    pools->constants_length = length;
+    pools->constants = (ws_int *)malloc(sizeof(ws_int) * (length + 1));
+    for(size_t i = 0; i < length; i++) {
+        unserialize_ws_int(pools->constants + i, source);
+    }
+}
+
+static void unserialize_labels(ws_serializing_pools *const pools, ws_serializing_buffer *const source) {
+    const uint64_t length = unserialize_varint(source);
+    check_space(source, length);
+    pools->labels_length = length;
+    pools->labels = (ws_label *)malloc(sizeof(ws_label) * (length + 1));
+    for(size_t i = 0; i < length; i++) {
+        unserialize_label(pools->labels + i, source);
+    }
+}
+
+static void unserializing_pools_finish(const ws_serializing_pools *const pools) {
+    for(size_t i = 0; i < pools->constants_length; i++) {
+        ws_int_free(pools->constants + i);
+    }
+    for(size_t i = 0; i < pools->labels_length; i++) {
+        ws_label_free(pools->labels + i);
+    }
+    free(pools->constants);
+    free(pools->labels);
+}
+
+
+
+static void serialize_command(const ws_command *const command, const size_t index, const int compiled,
+                              ws_serializing_pool *const constants, ws_serializing_pool *const labels,
+                              ws_serializing_buffer *const dest) {
     serialize_char(command->type, dest);
+    if (ws_immediate_map[command->type]) {
+        serialize_varint(ws_zigzag(command->immediate), dest);
+    }
     if (ws_parameter_map[command->type]) {
-        serialize_ws_int(&command->parameter, dest);
+        serialize_ws_int(&command->parameter, &constants->data);
+        serialize_pool_reference(constants, dest);
     } else if (ws_label_map[command->type]) {
         if (compiled) {
-            serialize_uint32(command->jumpoffset, dest);
+            serialize_varint(ws_zigzag((int64_t)(command->jumpoffset - index)), dest);
         } else {
-            serialize_label(&command->label, dest);
+            serialize_label(&command->label, &labels->data);
+            serialize_pool_reference(labels, dest);
         }
     }
 }
 
-static void unserialize_command(ws_command *const command, const int compiled, ws_serializing_buffer *const source) {
-#if DEBUG
-    if (unserialize_char(source) != 0xff) {
-        printf("expected new command while serializing");
+static void unserialize_command(ws_command *const command, const size_t index, const int compiled,
+                                ws_serializing_pools *const pools, ws_serializing_buffer *const source) {
+    //the debug text isn't stored
+    memset(command, 0, sizeof(ws_command));
+    command->type = unserialize_char(source);
+    if (command->type >= COMMANDTYPES) {
+        printf("invalid command type while unserializing\n");
         exit(EXIT_FAILURE);
     }
-#endif
-    command->type = unserialize_char(source);
+    if (ws_immediate_map[command->type]) {
+        command->immediate = (sdigit)ws_unzigzag(unserialize_varint(source));
+    }
     if (ws_parameter_map[command->type]) {
-        unserialize_ws_int(&command->parameter, source);
+        const size_t constant = unserialize_pool_reference(&pools->constants_used, pools->constants_length, source);
+        ws_int_copy(&command->parameter, pools->constants + constant);
     } else if (ws_label_map[command->type]) {
         if (compiled) {
-            command->jumpoffset = unserialize_uint32(source);
+            command->jumpoffset = index + (size_t)ws_unzigzag(unserialize_varint(source));
         } else {
-            unserialize_label(&command->label, source);
+            const size_t label = unserialize_pool_reference(&pools->labels_used, pools->labels_length, source);
+            command->label.length = pools->labels[label].length;
+            command->label.data = (char *)malloc(ws_round8up(command->label.length));
+            memcpy(command->label.data, pools->labels[label].data, ws_round8up(command->label.length));
         }
     }
 }
 
-static void serialize_program(const ws_program *const program, ws_serializing_buffer *const dest) {
-    serialize_int32(program->flags, dest);
-    serialize_uint32(program->length, dest);
-    for (size_t i = 0; i < (program->length); i++) {
-        serialize_command(program->commands + i, program->flags & 0x1, dest);
+static void serialize_block_profile(const ws_block_profile *const profile, ws_serializing_buffer *const dest) {
+    serialize_varint(profile->length, dest);
+    size_t start = 0;
+    for (size_t i = 0; i < profile->length; i++) {
+        serialize_varint(ws_zigzag((int64_t)(profile->blocks[i].start - start)), dest);
+        serialize_varint(profile->blocks[i].count, dest);
+        serialize_varint(profile->blocks[i].taken, dest);
+        start = profile->blocks[i].start;
     }
 }
 
-static void unserialize_program(ws_program *const program, ws_serializing_buffer *const source) {
-    const int flags = unserialize_int32(source);
-    const size_t length = unserialize_uint32(source);
-    ws_program_initialize(program, length);
-    program->flags = flags;
-    for(size_t i = 0; i < program->length; i++) {
-        unserialize_command(program->commands + i, flags & 0x1, source);
+static ws_block_profile *unserialize_block_profile(ws_serializing_buffer *const source) {
+    ws_block_profile *const profile = (ws_block_profile *)malloc(sizeof(ws_block_profile));
+    profile->length = unserialize_varint(source);
+    // every block takes at least 3 bytes
+    check_space(source, profile->length);
+    check_space(source, 3 * profile->length);
+    profile->blocks = (ws_block_count *)malloc(sizeof(ws_block_count) * (profile->length + 1));
+    size_t start = 0;
+    for (size_t i = 0; i < profile->length; i++) {
+        start += (size_t)ws_unzigzag(unserialize_varint(source));
+        profile->blocks[i].start = start;
+        profile->blocks[i].count = unserialize_varint(source);
+        profile->blocks[i].taken = unserialize_varint(source);
     }
+    return profile;
+}
+
+
+
+/* Serializes section i of WS_FORMAT_TAGS of program into dest, returns 0 without serializing anything if program
+ * doesn't have it
+ */
+static int serialize_section(const size_t i, const ws_program *const program, const ws_cache_header *const header,
+                             ws_serializing_pool *const constants, ws_serializing_pool *const labels,
+                             ws_serializing_buffer *const dest) {
+    switch (WS_FORMAT_TAGS[i]) {
+        case 'H':
+            if (!header) {
+                return 0;
+            }
+            serialize_varint(header->size, dest);
+            serialize_varint(ws_zigzag(header->mtime), dest);
+            serialize_fixed(header->hash, sizeof(uint64_t), dest);
+            return 1;
+        case 'C':
+            serialize_pool(constants, dest);
+            return 1;
+        case 'L':
+            if (program->flags & 0x1) {
+                return 0;
+            }
+            serialize_pool(labels, dest);
+            return 1;
+        case 'K':
+            constants->used = 0;
+            labels->used = 0;
+            serialize_varint((uint32_t)program->flags, dest);
+            serialize_varint(program->length, dest);
+            for (size_t j = 0; j < (program->length); j++) {
+                serialize_command(program->commands + j, j, program->flags & 0x1, constants, labels, dest);
+            }
+            return 1;
+        default:
+            if (!program->profile) {
+                return 0;
+            }
+            serialize_block_profile(program->profile, dest);
+            return 1;
+    }
+}
+
+/* Serializes program, with a cache header if header isn't NULL. The table in front of the sections holds their
+ * lengths, so they get serialized twice: into a stream which only counts them first, and then into dest. Apart from
+ * the pools, that only takes the fixed buffer of the stream.
+ */
+static void serialize_program(const ws_program *const program, const ws_cache_header *const header,
+                              ws_serializing_buffer *const dest) {
+    ws_serializing_pool constants, labels;
+    serializing_pool_initialize(&constants);
+    serializing_pool_initialize(&labels);
+
+    // the commands fill the pools, so they go first
+    ws_serializing_buffer counter;
+    ws_serializing_stream counted;
+    serializing_stream_initialize(&counter, &counted, -1);
+    uint64_t lengths[WS_FORMAT_SECTIONS];
+    int present[WS_FORMAT_SECTIONS];
+    size_t count = 0;
+    const size_t commands = (size_t)(strchr(WS_FORMAT_TAGS, 'K') - WS_FORMAT_TAGS);
+    for(size_t j = 0; j < WS_FORMAT_SECTIONS; j++) {
+        const size_t i = (commands + j) % WS_FORMAT_SECTIONS;
+        const uint64_t start = serializing_position(&counter);
+        present[i] = serialize_section(i, program, header, &constants, &labels, &counter);
+        lengths[i] = serializing_position(&counter) - start;
+        count += present[i];
+    }
+    free(counter.buffer);
+
+    const size_t start = dest->index;
+    serialize_bytes(WS_FORMAT_MAGIC, WS_FORMAT_MAGIC_SIZE, dest);
+    serialize_char(WS_FORMAT_VERSION, dest);
+    serialize_varint(count, dest);
+    for(size_t i = 0; i < WS_FORMAT_SECTIONS; i++) {
+        if (present[i]) {
+            serialize_char(WS_FORMAT_TAGS[i], dest);
+            serialize_varint(lengths[i], dest);
+        }
+    }
+    for(size_t i = 0; i < WS_FORMAT_SECTIONS; i++) {
+        if (present[i]) {
+            serialize_section(i, program, header, &constants, &labels, dest);
+        }
+    }
+    serialize_fixed(serializing_crc(dest, start), WS_FORMAT_CHECKSUM_SIZE, dest);
+    serializing_pool_finish(&constants);
+    serializing_pool_finish(&labels);
+}
+
+/* Points section at the next size bytes of source, see serializing_section_finish
+ */
+static void serializing_section_start(ws_serializing_buffer *const section, const ws_serializing_buffer *const source,
+                                      const uint64_t size) {
+    check_space(source, size);
+    *section = *source;
+    if (source->stream) {
+        section->stream->end = serializing_position(source) + size;
+    } else {
+        section->length = source->index + (size_t)size;
+    }
+}
+
+// continues reading source behind section, skipping what's left of it
+static void serializing_section_finish(const ws_serializing_buffer *const section, ws_serializing_buffer *const source,
+                                       const uint64_t end) {
+    if (!section->stream) {
+        source->index = section->length;
+        return;
+    }
+    *source = *section;
+    while (serializing_left(source)) {
+        const uint64_t left = serializing_left(source);
+        serializing_read(source, 1);
+        const size_t buffered = source->length - source->index;
+        source->index += (left < buffered)? (size_t)left: buffered;
+    }
+    source->stream->end = end;
+}
+
+/* Reads the program in source from front to back. Returns 0 without touching program if source isn't of this
+ * version, or if header isn't NULL and source wasn't stored for the source it describes. The checksum of a buffer
+ * in memory gets checked first, that of a stream at the end.
+ */
+static int unserialize_program(ws_program *const program, const ws_cache_header *const header,
+                               ws_serializing_buffer *const source) {
+    if (!serializing_prefetch(source, WS_FORMAT_MAGIC_SIZE + 2 + WS_FORMAT_CHECKSUM_SIZE) ||
+        memcmp(source->buffer + source->index, WS_FORMAT_MAGIC, WS_FORMAT_MAGIC_SIZE) ||
+        source->buffer[source->index + WS_FORMAT_MAGIC_SIZE] != WS_FORMAT_VERSION) {
+        return 0;
+    }
+    const size_t start = source->index;
+    if (!source->stream) {
+        const size_t length = source->length - WS_FORMAT_CHECKSUM_SIZE;
+        ws_serializing_buffer checksum = {source->length, source->buffer, length, NULL};
+        if (unserialize_fixed(&checksum, WS_FORMAT_CHECKSUM_SIZE) !=
+            ws_crc32(0, source->buffer + start, length - start)) {
+            return 0;
+        }
+        source->length = length;
+    }
+    source->index += WS_FORMAT_MAGIC_SIZE + 1;
+
+    // every entry of the table takes at least 2 bytes
+    const uint64_t count = unserialize_varint(source);
+    if (count > serializing_left(source) / 2) {
+        printf("invalid section while unserializing\n");
+        exit(EXIT_FAILURE);
+    }
+    char *const tags = (char *)malloc(count + 1);
+    uint64_t *const sizes = (uint64_t *)malloc(sizeof(uint64_t) * (count + 1));
+    if (!tags || !sizes) {
+        printf("out of memory in unserialize_program\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < count; i++) {
+        tags[i] = (char)unserialize_char(source);
+        sizes[i] = unserialize_varint(source);
+    }
+
+    // the cache header comes first, and the commands after the pools
+    ws_serializing_pools pools = {0, 0, NULL, 0, 0, NULL};
+    ws_block_profile *profile = NULL;
+    int matched = !header, seen = 0;
+    for(size_t i = 0; i < count; i++) {
+        const char *const known = (const char *)memchr(WS_FORMAT_TAGS, tags[i], WS_FORMAT_SECTIONS);
+        const int bit = known? 1 << (known - WS_FORMAT_TAGS): 0;
+        if (seen & bit) {
+            printf("invalid section while unserializing\n");
+            exit(EXIT_FAILURE);
+        }
+        seen |= bit;
+        if (tags[i] == 'K' && !matched) {
+            break;
+        }
+
+        ws_serializing_buffer section;
+        const uint64_t outside = source->stream? source->stream->end: 0;
+        serializing_section_start(&section, source, sizes[i]);
+        switch (tags[i]) {
+            case 'H':
+                matched = !header || (unserialize_varint(&section) == header->size &&
+                                      ws_unzigzag(unserialize_varint(&section)) == header->mtime &&
+                                      unserialize_fixed(&section, sizeof(uint64_t)) == header->hash);
+                break;
+            case 'C':
+                unserialize_constants(&pools, &section);
+                break;
+            case 'L':
+                unserialize_labels(&pools, &section);
+                break;
+            case 'K': {
+                const int flags = (int)(uint32_t)unserialize_varint(&section);
+                const uint64_t commandno = unserialize_varint(&section);
+                // every command takes at least a byte
+                check_space(&section, commandno);
+                ws_program_initialize(program, commandno);
+                program->flags = flags;
+                for(size_t j = 0; j < program->length; j++) {
+                    unserialize_command(program->commands + j, j, flags & 0x1, &pools, &section);
+                }
+                break;
+            }
+            case 'P':
+                profile = unserialize_block_profile(&section);
+                break;
+        }
+        serializing_section_finish(&section, source, outside);
+        if (!matched) {
+            break;
+        }
+    }
+    unserializing_pools_finish(&pools);
+    free(tags);
+    free(sizes);
+
+    const int commands = strchr(WS_FORMAT_TAGS, 'K') - WS_FORMAT_TAGS;
+    if (!matched || !(seen & (1 << commands))) {
+        if (profile) {
+            free(profile->blocks);
+            free(profile);
+        }
+        if (!matched) {
+            return 0;
+        }
+        printf("missing commands while unserializing\n");
+        exit(EXIT_FAILURE);
+    }
+    program->profile = profile;
+
+    if (source->stream && !source->stream->checked) {
+        const uint32_t crc = serializing_crc(source, start);
+        if (unserialize_fixed(source, WS_FORMAT_CHECKSUM_SIZE) != crc) {
+            printf("invalid checksum while unserializing\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 1;
+}
+
+/* Whether the file of size bytes at offset of descriptor ends in the checksum of the rest, read through buffer
+ */
+static int unserializing_check(const int descriptor, const off_t offset, const uint64_t size, char *const buffer) {
+    char last[WS_FORMAT_CHECKSUM_SIZE];
+    if (size < WS_FORMAT_MAGIC_SIZE + 2 + WS_FORMAT_CHECKSUM_SIZE) {
+        return 0;
+    }
+    const uint64_t length = size - WS_FORMAT_CHECKSUM_SIZE;
+    if (pread(descriptor, last, WS_FORMAT_CHECKSUM_SIZE, offset + (off_t)length) != WS_FORMAT_CHECKSUM_SIZE) {
+        return 0;
+    }
+
+    uint32_t crc = 0;
+    for(uint64_t done = 0; done < length;) {
+        const size_t part = (length - done < SERIALIZING_STREAM_SIZE)? (size_t)(length - done): SERIALIZING_STREAM_SIZE;
+        const ssize_t got = pread(descriptor, buffer, part, offset + (off_t)done);
+        if (got > 0) {
+            crc = ws_crc32(crc, buffer, (size_t)got);
+            done += (uint64_t)got;
+        } else if (got == 0 || errno != EINTR) {
+            return 0;
+        }
+    }
+    ws_serializing_buffer checksum = {WS_FORMAT_CHECKSUM_SIZE, last, 0, NULL};
+    return unserialize_fixed(&checksum, WS_FORMAT_CHECKSUM_SIZE) == crc;
+}
+
+/* Reads the program from descriptor through a buffer of a fixed size. If descriptor is a file its checksum gets
+ * checked first, so a broken one is rejected like in memory, without reading the rest of the file twice otherwise.
+ */
+static int unserialize_stream(ws_program *const program, const ws_cache_header *const header, const int descriptor) {
+    ws_serializing_buffer source;
+    ws_serializing_stream stream;
+    serializing_stream_initialize(&source, &stream, descriptor);
+    source.length = 0;
+
+    struct stat status;
+    const off_t offset = lseek(descriptor, 0, SEEK_CUR);
+    int loaded = 1;
+    if (offset >= 0 && !fstat(descriptor, &status) && S_ISREG(status.st_mode)) {
+        loaded = status.st_size >= offset &&
+                 unserializing_check(descriptor, offset, (uint64_t)(status.st_size - offset), source.buffer);
+        stream.checked = 1;
+    }
+    loaded = loaded && unserialize_program(program, header, &source);
+    free(source.buffer);
+    return loaded;
+}
+
+/* Writes program to descriptor through a buffer of a fixed size, returns 0 if that failed
+ */
+static int serialize_stream(const int descriptor, const ws_program *const program, const ws_cache_header *const header) {
+    ws_serializing_buffer dest;
+    ws_serializing_stream stream;
+    serializing_stream_initialize(&dest, &stream, descriptor);
+    serialize_program(program, header, &dest);
+    serializing_flush(&dest);
+    free(dest.buffer);
+    return !stream.failed;
 }
 
 
@@ -220,13 +1000,100 @@ static void unserialize_program(ws_program *const program, ws_serializing_buffer
 void ws_serialize(ws_string *buffer, const ws_program *const program) {
     ws_serializing_buffer dest;
     serializing_buffer_initialize(&dest);
-    serialize_program(program, &dest);
+    serialize_program(program, NULL, &dest);
     serializing_buffer_finish(buffer, &dest);
 }
 
 void ws_unserialize(ws_program *const program, const ws_string *const buffer) {
-    ws_serializing_buffer source = {buffer->length, buffer->data, 0};
-    unserialize_program(program, &source);
+    ws_serializing_buffer source = {buffer->length, buffer->data, 0, NULL};
+    if (!unserialize_program(program, NULL, &source)) {
+        printf("not a version %d compiled whitespace program\n", WS_FORMAT_VERSION);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* The same as ws_serialize and ws_unserialize, but straight to and from a descriptor, with the same bytes.
+ * ws_serialize_fd returns 0 if writing failed.
+ */
+int ws_serialize_fd(const int descriptor, const ws_program *const program) {
+    return serialize_stream(descriptor, program, NULL);
+}
+
+void ws_unserialize_fd(ws_program *const program, const int descriptor) {
+    if (!unserialize_stream(program, NULL, descriptor)) {
+        printf("not a version %d compiled whitespace program\n", WS_FORMAT_VERSION);
+        exit(EXIT_FAILURE);
+    }
 }
 
-#endif
\ No newline at end of file
+
+
+/* The compiled cache. main stores the program right after compiling it in <file>c, together with a header describing
+ * the source it came from, and loads it from there instead of parsing and compiling it again while the source matches.
+ * The cache gets written to a temporary file which then replaces the old one, so a run reading it at the same time
+ * never sees half of it.
+ */
+void ws_cache_header_of(ws_cache_header *const header, const ws_string *const source, const int64_t mtime) {
+    header->size = source->length;
+    header->mtime = mtime;
+    header->hash = ws_serializing_hash(source->data, source->length);
+}
+
+/* Loads the program cached in compiledname into program, returns 0 if there is none for the source described by header
+ */
+int ws_cache_load(ws_program *const program, const char *const compiledname, const ws_cache_header *const header) {
+    const int descriptor = open(compiledname, O_RDONLY);
+    if (descriptor < 0) {
+        return 0;
+    }
+    const int loaded = unserialize_stream(program, header, descriptor);
+    close(descriptor);
+    return loaded;
+}
+
+/* Writes the contents of filename through a temporary file: ws_cache_create opens it, and ws_cache_commit replaces
+ * filename by it if written, or removes it
+ */
+static int ws_cache_create(char **const temporary, const char *const filename) {
+    const size_t namelength = strlen(filename);
+    *temporary = (char *)malloc(namelength + 7);
+    memcpy(*temporary, filename, namelength);
+    memcpy(*temporary + namelength, "XXXXXX", 7);
+
+    const int descriptor = mkstemp(*temporary);
+    if (descriptor >= 0) {
+        fchmod(descriptor, 0644);
+    }
+    return descriptor;
+}
+
+static int ws_cache_commit(char *const temporary, const char *const filename, const int descriptor, int written) {
+    if (descriptor >= 0) {
+        written &= !close(descriptor);
+        if (!written || rename(temporary, filename)) {
+            remove(temporary);
+            written = 0;
+        }
+    }
+    free(temporary);
+    return written && descriptor >= 0;
+}
+
+/* Writes length bytes of data to filename through a temporary file, returns 0 if that failed
+ */
+int ws_cache_write(const char *const filename, const char *const data, const size_t length) {
+    char *temporary;
+    const int descriptor = ws_cache_create(&temporary, filename);
+    const int written = descriptor >= 0 && ws_serializing_write(descriptor, data, length);
+    return ws_cache_commit(temporary, filename, descriptor, written);
+}
+
+void ws_cache_store(const char *const compiledname, const ws_program *const program, const ws_cache_header *const header) {
+    // the cache is only an optimization, so failing to write it isn't an error
+    char *temporary;
+    const int descriptor = ws_cache_create(&temporary, compiledname);
+    const int written = descriptor >= 0 && serialize_stream(descriptor, program, header);
+    ws_cache_commit(temporary, compiledname, descriptor, written);
+}
+
+#endif
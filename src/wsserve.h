@@ -0,0 +1,593 @@
+/* wsserve.h, a daemon which keeps compiled programs around and runs them for clients over a unix socket */
+#ifndef WSSERVE_H
+#define WSSERVE_H
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#if WS_THREADS
+#include <pthread.h>
+#endif
+#include "wstypes.h"
+#include "wsparser.h"
+#include "wsserialize.h"
+#include "wscompiler.h"
+#include "wsoptimizer.h"
+#include "wsvm.h"
+#include "wssched.h"
+
+#define WS_SERVE_CACHE_SIZE 64           //the compiled programs kept by default
+#define WS_SERVE_SOURCE_MAX (1UL << 28)  //the largest source a client can send
+#define WS_SERVE_SPARE 16                //the machines kept for the next connections
+#define WS_SERVE_RUNNING_MAX 1024        //the programs running at once, more connections wait for one to end
+#define WS_SERVE_QUEUE 64                //accepted connections which wait for a worker
+#define WS_SERVE_BACKLOG 64
+#define WS_SERVE_TIMEOUT 10              //seconds a client gets for each read of its request
+
+
+
+/* A client sends a request with the length of its source and the level to optimize it at, along with its stdin and
+ * stdout as SCM_RIGHTS, followed by the source. The server compiles it, unless it already has the same source
+ * compiled at that level, and runs it on the scheduler of wssched.h. The program reads and prints through the
+ * client's own descriptors, so the server never copies any of it, and errors get printed to the client's stdout like
+ * the command line prints them. The server ends with the exit code the command line would have, which the client
+ * exits with.
+ *
+ * The compiled programs are kept in a least recently used list along with their source, which a hit is compared to,
+ * so only the exact same program can ever run in place of another. Programs which are running aren't evicted until
+ * they're done. The socket is only accessible to the user running the server, and any file it had at the path is
+ * replaced.
+ *
+ * With WS_THREADS the requests get read and compiled by a few workers, and the programs run on the threads of the
+ * scheduler, which share them like wsbatch.h does. Without it the server handles one connection at a time.
+ */
+typedef struct {
+    uint64_t length; //of the source
+    int32_t optimize;
+    int32_t reserved;
+} ws_serve_request;
+
+typedef struct ws_serve_entry {
+    uint64_t hash;                //ws_serializing_hash of the source
+    ws_string source;
+    int optimize;
+    ws_program program;
+    size_t users;                 //connections running the program
+    struct ws_serve_entry *newer;
+    struct ws_serve_entry *older;
+} ws_serve_entry;
+
+typedef struct {
+#if WS_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t queued;        //a connection was queued
+    pthread_cond_t room;          //a connection was taken from the queue, or a program ended
+#endif
+    ws_scheduler *scheduler;
+    ws_serve_entry *newest;
+    ws_serve_entry *oldest;
+    size_t length;
+    size_t size;                  //the programs kept once nothing runs them anymore
+    ws_vm *spare[WS_SERVE_SPARE]; //machines of finished connections
+    size_t spares;
+    size_t running;
+    int queue[WS_SERVE_QUEUE];    //connections from queue_start on, which wrap around
+    size_t queue_start;
+    size_t queue_length;
+} ws_server;
+
+// a program the scheduler runs for a connection
+typedef struct {
+    ws_server *server;
+    ws_serve_entry *entry;
+    int connection;
+    FILE *output;
+} ws_serve_run;
+
+/* forward declarations
+ */
+int ws_serve(const char *, size_t, size_t);
+int ws_serve_client(const char *, const char *, int);
+#if WS_THREADS
+static void *ws_serve_work(void *);
+#endif
+static void ws_serve_connection(ws_server *, int);
+static void ws_serve_done(ws_vm *, void *);
+static void ws_serve_end(int, FILE *, int32_t);
+static ws_serve_entry *ws_serve_find(ws_server *, const ws_string *, uint64_t, int);
+static ws_serve_entry *ws_serve_compile(ws_server *, ws_string *, uint64_t, int, ws_failure *);
+static void ws_serve_evict(ws_server *);
+static int ws_serve_receive(int, ws_serve_request *, int *);
+static int ws_serve_read(int, char *, size_t);
+static int ws_serve_address(struct sockaddr_un *, const char *);
+
+
+
+static void ws_serve_lock(ws_server *const server) {
+#if WS_THREADS
+    pthread_mutex_lock(&server->lock);
+#else
+    (void)server;
+#endif
+}
+
+static void ws_serve_unlock(ws_server *const server) {
+#if WS_THREADS
+    pthread_mutex_unlock(&server->lock);
+#else
+    (void)server;
+#endif
+}
+
+/* Serves clients on the unix socket at path, keeping up to size compiled programs, with as many threads as jobs, or
+ * as there are processors if that is 0. Only returns if it can't listen.
+ */
+int ws_serve(const char *const path, const size_t size, const size_t jobs) {
+    struct sockaddr_un address;
+    if (!ws_serve_address(&address, path)) {
+        return EXIT_FAILURE;
+    }
+
+    // the socket is created without access for anyone else, as its clients get to run programs as this user
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    const mode_t mask = umask(077);
+    const int bound = listener >= 0 && !bind(listener, (const struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (!bound || listen(listener, WS_SERVE_BACKLOG)) {
+        printf("failure to listen on %s\n", path);
+        if (listener >= 0) {
+            close(listener);
+        }
+        return EXIT_FAILURE;
+    }
+    // a client which goes away shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    ws_server *const server = (ws_server *)malloc(sizeof(ws_server));
+#if WS_THREADS
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->queued, NULL);
+    pthread_cond_init(&server->room, NULL);
+#endif
+    server->scheduler = ws_scheduler_create(jobs, 0);
+    server->newest = NULL;
+    server->oldest = NULL;
+    server->length = 0;
+    server->size = size;
+    server->spares = 0;
+    server->running = 0;
+    server->queue_start = 0;
+    server->queue_length = 0;
+
+#if WS_THREADS
+    // as many workers as the scheduler has threads read and compile the requests, if none starts this thread does
+    size_t workers = 0;
+    for(size_t i = 0; i < server->scheduler->length; i++) {
+        pthread_t thread;
+        if (!pthread_create(&thread, NULL, ws_serve_work, server)) {
+            pthread_detach(thread);
+            workers++;
+        }
+    }
+#endif
+
+    for(;;) {
+        const int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            continue;
+        }
+        // a client which stops sending its request doesn't keep a worker forever
+        const struct timeval timeout = {WS_SERVE_TIMEOUT, 0};
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+#if WS_THREADS
+        if (workers) {
+            pthread_mutex_lock(&server->lock);
+            while (server->queue_length == WS_SERVE_QUEUE) {
+                pthread_cond_wait(&server->room, &server->lock);
+            }
+            server->queue[(server->queue_start + server->queue_length++) % WS_SERVE_QUEUE] = connection;
+            pthread_cond_signal(&server->queued);
+            pthread_mutex_unlock(&server->lock);
+            continue;
+        }
+#endif
+        ws_serve_connection(server, connection);
+        // without threads the scheduler only runs while it's waited for
+        ws_scheduler_wait(server->scheduler);
+    }
+}
+
+#if WS_THREADS
+// takes the connections from the queue of server
+static void *ws_serve_work(void *const argument) {
+    ws_server *const server = (ws_server *)argument;
+    for(;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->queue_length) {
+            pthread_cond_wait(&server->queued, &server->lock);
+        }
+        const int connection = server->queue[server->queue_start];
+        server->queue_start = (server->queue_start + 1) % WS_SERVE_QUEUE;
+        server->queue_length--;
+        pthread_cond_broadcast(&server->room);
+        pthread_mutex_unlock(&server->lock);
+
+        ws_serve_connection(server, connection);
+    }
+    return NULL;
+}
+#endif
+
+/* Reads the request of a connection, compiles its program if it has to, and hands it to the scheduler.
+ */
+static void ws_serve_connection(ws_server *const server, const int connection) {
+    ws_serve_request request;
+    int descriptors[2];
+    if (!ws_serve_receive(connection, &request, descriptors)) {
+        close(connection);
+        return;
+    }
+    FILE *const output = fdopen(descriptors[1], "wb");
+    if (!output) {
+        close(descriptors[0]);
+        close(descriptors[1]);
+        close(connection);
+        return;
+    }
+
+    // the client has to send all of the source even for a cached program, which gets compared to it
+    if (request.length > WS_SERVE_SOURCE_MAX) {
+        close(descriptors[0]);
+        fprintf(output, "program is larger than %lu bytes\n", WS_SERVE_SOURCE_MAX);
+        ws_serve_end(connection, output, EXIT_FAILURE);
+        return;
+    }
+    ws_string source = {(char *)malloc(request.length? request.length: 1), (size_t)request.length};
+    if (!source.data || !ws_serve_read(connection, source.data, source.length)) {
+        close(descriptors[0]);
+        ws_string_free(&source);
+        ws_serve_end(connection, output, EXIT_FAILURE);
+        return;
+    }
+
+    const uint64_t hash = ws_serializing_hash(source.data, source.length);
+    ws_serve_entry *entry = ws_serve_find(server, &source, hash, request.optimize);
+    ws_failure failure = {WS_STATUS_OK, ""};
+    if (entry) {
+        ws_string_free(&source);
+    } else {
+        entry = ws_serve_compile(server, &source, hash, request.optimize, &failure);
+    }
+    if (!entry) {
+        close(descriptors[0]);
+        fprintf(output, "%s\n", failure.message);
+        ws_serve_end(connection, output, EXIT_FAILURE);
+        return;
+    }
+
+    ws_serve_lock(server);
+#if WS_THREADS
+    while (server->running == WS_SERVE_RUNNING_MAX) {
+        pthread_cond_wait(&server->room, &server->lock);
+    }
+#endif
+    server->running++;
+    ws_vm *const vm = server->spares? server->spare[--server->spares]: ws_vm_create();
+    ws_serve_unlock(server);
+
+    ws_serve_run *const run = (ws_serve_run *)malloc(sizeof(ws_serve_run));
+    run->server = server;
+    run->entry = entry;
+    run->connection = connection;
+    run->output = output;
+
+    // sharing can't fail on a program which was compiled here
+    ws_vm_share(vm, &entry->program);
+    ws_vm_io(vm, NULL, output);
+    ws_scheduler_add(server->scheduler, vm, descriptors[0], ws_serve_done, run);
+}
+
+// called by the scheduler once the program of a connection has ended
+static void ws_serve_done(ws_vm *const vm, void *const data) {
+    ws_serve_run *const run = (ws_serve_run *)data;
+    ws_server *const server = run->server;
+
+    const int ok = vm->status == WS_STATUS_OK;
+    if (!ok) {
+        fprintf(run->output, "%s\n", ws_vm_message(vm));
+    }
+    ws_serve_end(run->connection, run->output, ok? EXIT_SUCCESS: EXIT_FAILURE);
+
+    // the machine lets go of the program before it can be evicted
+    ws_vm_io(vm, NULL, NULL);
+    ws_vm_unload(vm);
+    ws_serve_lock(server);
+    if (server->spares < WS_SERVE_SPARE) {
+        server->spare[server->spares++] = vm;
+    } else {
+        ws_vm_destroy(vm);
+    }
+    run->entry->users--;
+    ws_serve_evict(server);
+    server->running--;
+#if WS_THREADS
+    pthread_cond_broadcast(&server->room);
+#endif
+    ws_serve_unlock(server);
+    free(run);
+}
+
+// closes the output of a connection, and sends it its exit code
+static void ws_serve_end(const int connection, FILE *const output, const int32_t exitcode) {
+    fclose(output);
+    ws_serializing_write(connection, (const char *)&exitcode, sizeof(exitcode));
+    close(connection);
+}
+
+/* Looks up the program with this source at level optimize, and marks it used and running. Returns NULL if it isn't
+ * cached.
+ */
+static ws_serve_entry *ws_serve_find(ws_server *const server, const ws_string *const source, const uint64_t hash,
+                                     const int optimize) {
+    ws_serve_lock(server);
+    ws_serve_entry *entry = server->newest;
+    for(; entry; entry = entry->older) {
+        if (entry->hash == hash && entry->optimize == optimize && entry->source.length == source->length &&
+            !memcmp(entry->source.data, source->data, source->length)) {
+            break;
+        }
+    }
+
+    if (entry) {
+        entry->users++;
+        // moves it to the front
+        if (entry->newer) {
+            entry->newer->older = entry->older;
+            if (entry->older) {
+                entry->older->newer = entry->newer;
+            } else {
+                server->oldest = entry->newer;
+            }
+            entry->newer = NULL;
+            entry->older = server->newest;
+            server->newest->newer = entry;
+            server->newest = entry;
+        }
+    }
+    ws_serve_unlock(server);
+    return entry;
+}
+
+/* Compiles source at level optimize and adds it to the cache, marked running. Other connections keep going
+ * meanwhile. Takes over source. Returns NULL with the error in failure if it didn't compile.
+ */
+static ws_serve_entry *ws_serve_compile(ws_server *const server, ws_string *const source, const uint64_t hash,
+                                        const int optimize, ws_failure *const failure) {
+    ws_serve_entry *const volatile entry = (ws_serve_entry *)malloc(sizeof(ws_serve_entry));
+    volatile int parsed = 0;
+
+    ws_catcher catcher;
+    ws_catch(&catcher, failure);
+    if (setjmp(catcher.jump)) {
+        // the parser cleans up after itself, the rest fails on a parsed program
+        if (parsed) {
+            ws_program_finish(&entry->program);
+        }
+        ws_string_free(source);
+        free(entry);
+        return NULL;
+    }
+    ws_parse(&entry->program, source);
+    parsed = 1;
+    ws_compile(&entry->program);
+    ws_optimize(&entry->program, optimize);
+    ws_catch_end(&catcher);
+
+    entry->hash = hash;
+    entry->source = *source;
+    entry->optimize = optimize;
+    entry->users = 1;
+
+    // another connection may have compiled the same program in the meantime
+    ws_serve_entry *const existing = ws_serve_find(server, source, hash, optimize);
+    if (existing) {
+        ws_program_finish(&entry->program);
+        ws_string_free(source);
+        free(entry);
+        return existing;
+    }
+
+    ws_serve_lock(server);
+    entry->newer = NULL;
+    entry->older = server->newest;
+    if (server->newest) {
+        server->newest->newer = entry;
+    } else {
+        server->oldest = entry;
+    }
+    server->newest = entry;
+    server->length++;
+    ws_serve_evict(server);
+    ws_serve_unlock(server);
+    return entry;
+}
+
+/* Drops the least recently used programs which aren't running until no more than size are left. Has to be called
+ * with the server locked.
+ */
+static void ws_serve_evict(ws_server *const server) {
+    ws_serve_entry *entry = server->oldest;
+    while (server->length > server->size && entry) {
+        ws_serve_entry *const newer = entry->newer;
+        if (!entry->users) {
+            if (newer) {
+                newer->older = entry->older;
+            } else {
+                server->newest = entry->older;
+            }
+            if (entry->older) {
+                entry->older->newer = newer;
+            } else {
+                server->oldest = newer;
+            }
+            ws_program_finish(&entry->program);
+            ws_string_free(&entry->source);
+            free(entry);
+            server->length--;
+        }
+        entry = newer;
+    }
+}
+
+/* Receives a request along with the two descriptors sent with it. Returns 0 if either didn't arrive whole.
+ */
+static int ws_serve_receive(const int connection, ws_serve_request *const request, int *const descriptors) {
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int) * 2)];
+    } control;
+    struct iovec vector = {request, sizeof(ws_serve_request)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    ssize_t received;
+    do {
+        received = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    // the descriptors come with the first byte, everything else might take a while longer
+    int count = 0;
+    const struct cmsghdr *const header = received > 0? CMSG_FIRSTHDR(&message): NULL;
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+        count = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        memcpy(descriptors, CMSG_DATA(header), sizeof(int) * (count < 2? count: 2));
+    }
+    for(int i = 2; i < count; i++) {
+        close(((const int *)CMSG_DATA(header))[i]);
+    }
+    if (count < 2 || (message.msg_flags & MSG_CTRUNC) ||
+        !ws_serve_read(connection, (char *)request + received, sizeof(ws_serve_request) - received)) {
+        for(int i = 0; i < count && i < 2; i++) {
+            close(descriptors[i]);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// reads all length bytes into data, returns 0 if the connection ended, failed or timed out first
+static int ws_serve_read(const int descriptor, char *const data, const size_t length) {
+    for(size_t done = 0; done < length;) {
+        const ssize_t received = read(descriptor, data + done, length - done);
+        if (received > 0) {
+            done += (size_t)received;
+        } else if (received == 0 || errno != EINTR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int ws_serve_address(struct sockaddr_un *const address, const char *const path) {
+    const size_t length = strlen(path);
+    if (length >= sizeof(address->sun_path)) {
+        printf("socket path %s is too long\n", path);
+        return 0;
+    }
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, length + 1);
+    return 1;
+}
+
+/* Runs the program in filename at level optimize on the server at path, with this process's stdin and stdout.
+ * Returns the exit code of the run.
+ */
+int ws_serve_client(const char *const path, const char *const filename, const int optimize) {
+    struct sockaddr_un address;
+    if (!ws_serve_address(&address, path)) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *const wsfile = fopen(filename, "rb");
+    if (!wsfile) {
+        printf("failure to open file\n");
+        return EXIT_FAILURE;
+    }
+    ws_string data = {NULL, 0};
+    fseek(wsfile, 0L, SEEK_END);
+    const long wssize = ftell(wsfile);
+    rewind(wsfile);
+    if (wssize < 0) {
+        printf("file doesn't have size\n");
+        fclose(wsfile);
+        return EXIT_FAILURE;
+    }
+    data.data = (char *)malloc(wssize? wssize: 1);
+    data.length = fread(data.data, 1, wssize, wsfile);
+    fclose(wsfile);
+
+    ws_serve_request request = {data.length, optimize, 0};
+    const int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection < 0 || connect(connection, (const struct sockaddr *)&address, sizeof(address))) {
+        printf("failure to connect to %s\n", path);
+        if (connection >= 0) {
+            close(connection);
+        }
+        ws_string_free(&data);
+        return EXIT_FAILURE;
+    }
+
+    union {
+        struct cmsghdr header;
+        char data[CMSG_SPACE(sizeof(int) * 2)];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec vector = {&request, sizeof(request)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    struct cmsghdr *const header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+    const int descriptors[2] = {STDIN_FILENO, STDOUT_FILENO};
+    memcpy(CMSG_DATA(header), descriptors, sizeof(descriptors));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(connection, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    // a server which refuses the source still sends an exit code, so that gets read even if sending failed
+    int32_t exitcode = EXIT_FAILURE;
+    if (sent >= 0 && ws_serializing_write(connection, (const char *)&request + sent, sizeof(request) - sent)) {
+        ws_serializing_write(connection, data.data, data.length);
+    }
+    ws_string_free(&data);
+    const int ok = sent >= 0 && ws_serve_read(connection, (char *)&exitcode, sizeof(exitcode));
+    close(connection);
+
+    if (!ok) {
+        printf("lost connection to %s\n", path);
+        return EXIT_FAILURE;
+    }
+    return exitcode;
+}
+
+#endif
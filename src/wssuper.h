@@ -0,0 +1,204 @@
+/* wssuper.h, the superinstructions found in 8 profiles. generated by wsgen.c, don't edit */
+#ifndef WSSUPER_H
+#define WSSUPER_H
+
+#include "wstypes.h"
+
+#define WS_SUPER_COUNT 16
+
+
+
+/* The commands every superinstruction stands for, the longest ones first.
+ * ws_super in wsoptimizer.h puts superinstruction + i in front of every run of the commands of entry i.
+ */
+const unsigned char ws_super_lengths[WS_SUPER_COUNT + !WS_SUPER_COUNT] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+const unsigned char ws_super_patterns[WS_SUPER_COUNT + !WS_SUPER_COUNT][4] = {
+    {getslot, addimmediate, setslot, decrementjumpifnonzero}, // 40000000 times
+    {push, multiply, add, push}, // 3000000 times
+    {push, modulo, duplicate, duplicate}, // 3000000 times
+    {push, modulo, discard, duplicate}, // 3000000 times
+    {duplicate, duplicate, add, discard}, // 3000000 times
+    {duplicate, duplicate, multiply, swap}, // 3000000 times
+    {multiply, swap, push, multiply}, // 3000000 times
+    {pushunchecked, multiplyunchecked, addunchecked, pushunchecked}, // 3000000 times
+    {pushunchecked, modulounchecked, duplicateunchecked, duplicateunchecked}, // 3000000 times
+    {pushunchecked, modulounchecked, discardunchecked, duplicateunchecked}, // 3000000 times
+    {duplicateunchecked, duplicateunchecked, addunchecked, discardunchecked}, // 3000000 times
+    {duplicateunchecked, duplicateunchecked, multiplyunchecked, swapunchecked}, // 3000000 times
+    {multiplyunchecked, swapunchecked, pushunchecked, multiplyunchecked}, // 3000000 times
+    {reserve, duplicateunchecked, pushunchecked, modulounchecked}, // 3000000 times
+    {getslot, add, setslot, incrementslotjumpifless}, // 3000000 times
+    {getslot, addunchecked, setslot, incrementslotjumpifless} // 3000000 times
+};
+
+
+
+/* The cases of ws_execute_super in wsmachine.h that run them. The commands of a superinstruction follow it,
+ * so every part moves next_index past its own command first.
+ */
+#define WS_SUPER_CASES \
+        case superinstruction + 0: /* getslot addimmediate setslot decrementjumpifnonzero */ \
+            *next_index += 1; \
+            ws_command_getslot(stack, heap, (current_command + 1)->immediate); \
+            *next_index += 1; \
+            ws_command_addimmediate(stack, (current_command + 2)->immediate, (current_command + 2)->operation); \
+            *next_index += 1; \
+            ws_command_setslot(stack, heap, (current_command + 3)->immediate); \
+            *next_index += 1; \
+            ws_command_decrementjumpifnonzero(next_index, stack, (current_command + 4)->immediate, (current_command + 4)->jumpoffset, (current_command + 4)->operation); \
+            break; \
+        case superinstruction + 1: /* push multiply add push */ \
+            *next_index += 1; \
+            ws_command_push(stack, &(current_command + 1)->parameter); \
+            *next_index += 1; \
+            ws_command_multiply(stack); \
+            *next_index += 1; \
+            ws_command_add(stack); \
+            *next_index += 1; \
+            ws_command_push(stack, &(current_command + 4)->parameter); \
+            break; \
+        case superinstruction + 2: /* push modulo duplicate duplicate */ \
+            *next_index += 1; \
+            ws_command_push(stack, &(current_command + 1)->parameter); \
+            *next_index += 1; \
+            ws_command_modulo(stack); \
+            *next_index += 1; \
+            ws_command_duplicate(stack); \
+            *next_index += 1; \
+            ws_command_duplicate(stack); \
+            break; \
+        case superinstruction + 3: /* push modulo discard duplicate */ \
+            *next_index += 1; \
+            ws_command_push(stack, &(current_command + 1)->parameter); \
+            *next_index += 1; \
+            ws_command_modulo(stack); \
+            *next_index += 1; \
+            ws_command_discard(NULL, stack); \
+            *next_index += 1; \
+            ws_command_duplicate(stack); \
+            break; \
+        case superinstruction + 4: /* duplicate duplicate add discard */ \
+            *next_index += 1; \
+            ws_command_duplicate(stack); \
+            *next_index += 1; \
+            ws_command_duplicate(stack); \
+            *next_index += 1; \
+            ws_command_add(stack); \
+            *next_index += 1; \
+            ws_command_discard(NULL, stack); \
+            break; \
+        case superinstruction + 5: /* duplicate duplicate multiply swap */ \
+            *next_index += 1; \
+            ws_command_duplicate(stack); \
+            *next_index += 1; \
+            ws_command_duplicate(stack); \
+            *next_index += 1; \
+            ws_command_multiply(stack); \
+            *next_index += 1; \
+            ws_command_swap(stack); \
+            break; \
+        case superinstruction + 6: /* multiply swap push multiply */ \
+            *next_index += 1; \
+            ws_command_multiply(stack); \
+            *next_index += 1; \
+            ws_command_swap(stack); \
+            *next_index += 1; \
+            ws_command_push(stack, &(current_command + 3)->parameter); \
+            *next_index += 1; \
+            ws_command_multiply(stack); \
+            break; \
+        case superinstruction + 7: /* pushunchecked multiplyunchecked addunchecked pushunchecked */ \
+            *next_index += 1; \
+            ws_command_push_unchecked(stack, &(current_command + 1)->parameter); \
+            *next_index += 1; \
+            ws_command_multiply_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_add_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_push_unchecked(stack, &(current_command + 4)->parameter); \
+            break; \
+        case superinstruction + 8: /* pushunchecked modulounchecked duplicateunchecked duplicateunchecked */ \
+            *next_index += 1; \
+            ws_command_push_unchecked(stack, &(current_command + 1)->parameter); \
+            *next_index += 1; \
+            ws_command_modulo_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            break; \
+        case superinstruction + 9: /* pushunchecked modulounchecked discardunchecked duplicateunchecked */ \
+            *next_index += 1; \
+            ws_command_push_unchecked(stack, &(current_command + 1)->parameter); \
+            *next_index += 1; \
+            ws_command_modulo_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_discard_unchecked(NULL, stack); \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            break; \
+        case superinstruction + 10: /* duplicateunchecked duplicateunchecked addunchecked discardunchecked */ \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_add_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_discard_unchecked(NULL, stack); \
+            break; \
+        case superinstruction + 11: /* duplicateunchecked duplicateunchecked multiplyunchecked swapunchecked */ \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_multiply_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_swap_unchecked(stack); \
+            break; \
+        case superinstruction + 12: /* multiplyunchecked swapunchecked pushunchecked multiplyunchecked */ \
+            *next_index += 1; \
+            ws_command_multiply_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_swap_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_push_unchecked(stack, &(current_command + 3)->parameter); \
+            *next_index += 1; \
+            ws_command_multiply_unchecked(stack); \
+            break; \
+        case superinstruction + 13: /* reserve duplicateunchecked pushunchecked modulounchecked */ \
+            *next_index += 1; \
+            ws_command_reserve(stack, (current_command + 1)->immediate); \
+            *next_index += 1; \
+            ws_command_duplicate_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_push_unchecked(stack, &(current_command + 3)->parameter); \
+            *next_index += 1; \
+            ws_command_modulo_unchecked(stack); \
+            break; \
+        case superinstruction + 14: /* getslot add setslot incrementslotjumpifless */ \
+            *next_index += 1; \
+            ws_command_getslot(stack, heap, (current_command + 1)->immediate); \
+            *next_index += 1; \
+            ws_command_add(stack); \
+            *next_index += 1; \
+            ws_command_setslot(stack, heap, (current_command + 3)->immediate); \
+            *next_index += 1; \
+            ws_command_incrementslotjumpifless(next_index, heap, (current_command + 4)->immediate, (current_command + 4)->limit, (current_command + 4)->jumpoffset); \
+            break; \
+        case superinstruction + 15: /* getslot addunchecked setslot incrementslotjumpifless */ \
+            *next_index += 1; \
+            ws_command_getslot(stack, heap, (current_command + 1)->immediate); \
+            *next_index += 1; \
+            ws_command_add_unchecked(stack); \
+            *next_index += 1; \
+            ws_command_setslot(stack, heap, (current_command + 3)->immediate); \
+            *next_index += 1; \
+            ws_command_incrementslotjumpifless(next_index, heap, (current_command + 4)->immediate, (current_command + 4)->limit, (current_command + 4)->jumpoffset); \
+            break; \
+
+#endif
@@ -6,14 +6,42 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <setjmp.h>
 
 #define DEBUG 0
 
+// build with -DWS_THREADS=1 to use multiple threads where it helps (needs -pthread)
+#ifndef WS_THREADS
+#define WS_THREADS 0
+#endif
+
+// for the hot functions which the main loops can't do without being inlined,
+// and the rare ones that would make the main loops slower if they were
+#if defined(__GNUC__)
+#define WS_INLINE inline __attribute__((always_inline))
+#define WS_NOINLINE __attribute__((noinline))
+#else
+#define WS_INLINE inline
+#define WS_NOINLINE
+#endif
+
+// for the functions which don't return, and the state every thread keeps for itself
+#if defined(__GNUC__)
+#define WS_NORETURN __attribute__((noreturn))
+#define WS_THREAD_LOCAL __thread
+#else
+#define WS_NORETURN
+#define WS_THREAD_LOCAL
+#endif
+
 #define SPACE ' '
 #define TAB '\t'
 #define BREAK '\n'
 
 #define ws_hash_prime 1000003
+#define ws_hash_multiplier 0x9E3779B97F4A7C15ULL
 
 //the constants used to indicate the type of ws command the current node has
 typedef enum {
@@ -44,9 +72,81 @@ typedef enum {
     printchar       = 20,
     printnum        = 21,
     inputchar       = 22,
-    inputnum        = 23
+    inputnum        = 23,
+
+    //internal commands which don't exist in whitespace source
+    //lazy jumps refer to a label which hasn't been parsed yet, see wslazy.h
+    lazycall            = 24,
+    lazyjump            = 25,
+    lazyjumpifzero      = 26,
+    lazyjumpifnegative  = 27,
+
+    //superinstructions made by the peephole optimizer, see wsoptimizer.h
+    addimmediate            = 28,
+    negate                  = 29,
+    jumpifequal             = 30,
+    jumpifless              = 31,
+    jumpifequalimmediate    = 32,
+    jumpiflessimmediate     = 33,
+    duplicatejumpifzero     = 34,
+    duplicatejumpifnegative = 35,
+    getimmediate            = 36,
+    setimmediate            = 37,
+    storeimmediate          = 38,
+    pushpush                = 39,
+
+    //variants without stack checks, for where the stack verifier proved them unnecessary
+    //the pushing ones rely on a reserve at the start of their block
+    pushunchecked           = 40,
+    duplicateunchecked      = 41,
+    copyunchecked           = 42,
+    swapunchecked           = 43,
+    discardunchecked        = 44,
+    slideunchecked          = 45,
+    addunchecked            = 46,
+    subtractunchecked       = 47,
+    multiplyunchecked       = 48,
+    divideunchecked         = 49,
+    modulounchecked         = 50,
+    setunchecked            = 51,
+    getunchecked            = 52,
+    jumpifzerounchecked     = 53,
+    jumpifnegativeunchecked = 54,
+    printcharunchecked      = 55,
+    printnumunchecked       = 56,
+    reserve                 = 57,
+
+    //runs a block as register code when the stack is deep enough, see wsregister.h
+    registerblock           = 58,
+
+    //heap accesses at a constant address, which go to a slot numbered by immediate, see ws_promote in wsoptimizer.h
+    getslot                 = 59,
+    setslot                 = 60,
+    storeslot               = 61,
+
+    //the counting and test at the end of a counted loop, made by ws_loops in wsoptimizer.h
+    decrementjumpifnonzero      = 62,
+    incrementjumpifnotequal     = 63,
+    decrementslotjumpifnonzero  = 64,
+    incrementslotjumpifless     = 65,
+
+    //fill and copy loops over consecutive heap addresses, made by ws_bulk in wsoptimizer.h
+    fillheap                = 66,
+    copyheap                = 67,
+
+    //prints the bytes in string, made by ws_print in wsoptimizer.h
+    printstring             = 68,
+
+    //multiplies the top of the stack by immediate and adds addend to it
+    multiplyadd             = 69,
+
+    //superinstructions found by profiling, the types up to superinstruction + WS_SUPER_LIMIT, see wssuper.h
+    superinstruction        = 70
 } ws_command_type;
 
+#define WS_SUPER_LIMIT 16 //the amount of command types reserved for superinstructions
+#define WS_IS_SUPER(type) ((type) >= superinstruction && (type) < superinstruction + WS_SUPER_LIMIT)
+
 // a container of a char pointer and size_t length for easy manipulation of strings
 // in ws_label length represents the amount of bits, not amount of bytes.
 typedef struct {
@@ -54,28 +154,204 @@ typedef struct {
     size_t length;
 } ws_string, ws_label;
 
+
+
+/* Errors. Outside of a ws_vm (see wsvm.h) ws_fail prints the message and exits, like every error always did.
+ * A ws_vm catches them instead: ws_fail runs the cleanups registered since the innermost ws_catch of the thread,
+ * puts the status and the message in its failure and jumps back to it. The code which fails doesn't need to know.
+ */
+typedef enum {
+    WS_STATUS_OK,             // loaded, or the program ended
+    WS_STATUS_RUNNING,        // the program can run (further)
+    WS_STATUS_BLOCKED,        // the program waits for input which isn't there yet, see wssched.h
+    WS_STATUS_PARSE_ERROR,
+    WS_STATUS_COMPILE_ERROR,
+    WS_STATUS_RUNTIME_ERROR
+} ws_status;
+
+#define WS_MESSAGE_SIZE 256
+
+typedef struct {
+    ws_status status;
+    char message[WS_MESSAGE_SIZE];
+} ws_failure;
+
+// frees what a function has allocated so far if something it calls fails
+typedef struct ws_cleanup {
+    void (*function)(void *);
+    void *data;
+    struct ws_cleanup *outer;
+} ws_cleanup;
+
+typedef struct ws_catcher {
+    jmp_buf jump;
+    ws_failure *failure;
+    ws_cleanup *cleanups;
+    struct ws_catcher *outer;
+} ws_catcher;
+
+static WS_THREAD_LOCAL ws_catcher *ws_catching = NULL;
+static WS_THREAD_LOCAL ws_cleanup *ws_cleanups = NULL;
+
+/* Starts catching the errors of this thread into failure. Has to be followed by if (setjmp(catcher->jump)) in the
+ * same function, which is where ws_fail continues, with the catcher already ended. ws_catch_end ends it otherwise.
+ */
+static void ws_catch(ws_catcher *const catcher, ws_failure *const failure) {
+    catcher->failure = failure;
+    catcher->cleanups = ws_cleanups;
+    catcher->outer = ws_catching;
+    ws_catching = catcher;
+}
+
+static void ws_catch_end(const ws_catcher *const catcher) {
+    ws_catching = catcher->outer;
+}
+
+// registers function to be called with data if an error gets caught before ws_cleanup_end
+static void ws_cleanup_begin(ws_cleanup *const cleanup, void (*const function)(void *), void *const data) {
+    cleanup->function = function;
+    cleanup->data = data;
+    cleanup->outer = ws_cleanups;
+    ws_cleanups = cleanup;
+}
+
+static void ws_cleanup_end(const ws_cleanup *const cleanup) {
+    ws_cleanups = cleanup->outer;
+}
+
+static WS_NORETURN WS_NOINLINE void ws_fail(const ws_status status, const char *const format, ...) {
+    ws_catcher *const catcher = ws_catching;
+    va_list arguments;
+    va_start(arguments, format);
+    if (!catcher) {
+        vprintf(format, arguments);
+        exit(EXIT_FAILURE);
+    }
+    vsnprintf(catcher->failure->message, WS_MESSAGE_SIZE, format, arguments);
+    va_end(arguments);
+
+    char *const newline = strchr(catcher->failure->message, '\n');
+    if (newline) {
+        *newline = '\0';
+    }
+    catcher->failure->status = status;
+    for(; ws_cleanups != catcher->cleanups; ws_cleanups = ws_cleanups->outer) {
+        ws_cleanups->function(ws_cleanups->data);
+    }
+    ws_catching = catcher->outer;
+    longjmp(catcher->jump, 1);
+}
+
+/* The files the commands read from and write to. They're stdin and stdout, unless a ws_vm runs on this thread.
+ */
+static WS_THREAD_LOCAL FILE *ws_input_file = NULL;
+static WS_THREAD_LOCAL FILE *ws_output_file = NULL;
+#define WS_INPUT (ws_input_file? ws_input_file: stdin)
+#define WS_OUTPUT (ws_output_file? ws_output_file: stdout)
+
+/* Input which gets fed to a machine as it arrives instead of read from a file, by the scheduler in wssched.h.
+ * Machines wait until the input a command reads is there before running it, so reading from it never blocks.
+ */
+typedef struct ws_input {
+    char *data;
+    size_t start; //the bytes from start up to end haven't been read yet
+    size_t end;
+    size_t size;
+    int closed;   //no more bytes will come, reading past end gets EOF
+} ws_input;
+
+#define WS_INPUT_MORE ((size_t)-1)
+
+static WS_THREAD_LOCAL ws_input *ws_input_source = NULL;
+
+static int ws_input_char(void) {
+    ws_input *const source = ws_input_source;
+    if (!source) {
+        return getc(WS_INPUT);
+    }
+    return (source->start != source->end)? (unsigned char)source->data[source->start++]: EOF;
+}
+
+/* Reads a number at position like scanf's %d: whitespace, a sign and digits, and 0 if there are no digits.
+ * Returns the position after it, or WS_INPUT_MORE if the number might not be complete yet.
+ */
+static size_t ws_input_number(const ws_input *const source, size_t position, int *const value) {
+    unsigned int number = 0;
+    int negative = 0;
+    *value = 0;
+
+    while (position != source->end && isspace((unsigned char)source->data[position])) {
+        position++;
+    }
+    if (position != source->end && (source->data[position] == '-' || source->data[position] == '+')) {
+        negative = source->data[position++] == '-';
+    }
+    while (position != source->end && isdigit((unsigned char)source->data[position])) {
+        number = number * 10 + (unsigned int)(source->data[position++] - '0');
+    }
+    if (position == source->end && !source->closed) {
+        return WS_INPUT_MORE;
+    }
+    *value = (int)(negative? 0U - number: number);
+    return position;
+}
+
 //this needs the definition of ws_string
 #include "wsint.h"
 
 // a whitespace command node. depending on the type and if it's parsed/compiled, the union contains:
-// a: a big int, b: a string label, or c: an offset in the program
+// a: a big int, b: a string label, c: an offset in the program, or d: the bytes printstring prints
+// superinstructions can have a small second operand in immediate, which fits in the padding after type.
+// jumps that need a third one have limit, which fits next to the jumpoffset, and others have addend.
+// addimmediate and the loop commands made from it keep the add or subtract it came from in operation, for errors.
 typedef struct {
     ws_command_type type; 
+    sdigit immediate;
     union {
         ws_int parameter;
         ws_label label;
-        size_t jumpoffset;
+        ws_string string;
+        sdigit addend;
+        struct {
+            size_t jumpoffset;
+            sdigit limit;
+            ws_command_type operation;
+        };
     };
 #if DEBUG
     ws_string text;
 #endif
 } ws_command;
 
+// how often a block of a compiled program ran during an instrumented run, and how often the jump at its end was taken.
+// start is the index of the first command of the block, which is the same before and after compiling.
+typedef struct {
+    size_t start;
+    uint64_t count;
+    uint64_t taken;
+} ws_block_count;
+
+typedef struct ws_block_profile {
+    size_t length;
+    ws_block_count *blocks;
+} ws_block_profile;
+
 // a container for whitespace nodes. the types are purely for indicating wether the label compilation has been performed
+// lazy is only set for programs which are parsed while they are executed.
+// registers holds the register code of programs optimized with -O3.
+// slots are the heap addresses which the slot commands refer to.
+// profile is the block profile stored with the program in its .wsc, until ws_layout uses it.
+// image is set for programs loaded from a frozen image, which their commands and slots point into.
 typedef struct {
     int flags;
     size_t length;
     ws_command *commands;
+    struct ws_lazy *lazy;
+    struct ws_registers *registers;
+    ws_int *slots;
+    size_t slots_length;
+    ws_block_profile *profile;
+    struct ws_image *image;
 } ws_program;
 
 
@@ -90,7 +366,10 @@ void ws_string_fromchar(ws_string *const output, char *const buffer, const size_
 
 void ws_strcpy(ws_string *const result, const ws_string *const old) {
     char *const buffer = malloc(old->length);
-    memcpy(buffer, old->data, old->length);
+    //the debug text of commands loaded from a .wsc is empty
+    if (old->length) {
+        memcpy(buffer, old->data, old->length);
+    }
     result->data = buffer;
     result->length = old->length;
 }
@@ -158,15 +437,26 @@ void ws_label_free(const ws_label *const input) {
 }
 
 unsigned int ws_label_hash(const ws_label *const input) {
-    /* An adapted version of the string hashing function
+    /* An adapted version of the string hashing function, which mixes in 8 bytes at a time.
+     * the trailing bytes are padded with zeros, the bit length tells labels with different padding apart.
      */
-    size_t length = ws_round8up(input->length);
-    unsigned int value = input->data[0] << 7; // [0] always exists
+    const size_t length = ws_round8up(input->length);
+    uint64_t value = (uint64_t)input->length * ws_hash_prime;
+    uint64_t word;
+    size_t i = 0;
 
-    for(size_t i = 0; i < length; i++) {
-        value = (value*ws_hash_prime) ^ input->data[i];
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        memcpy(&word, input->data + i, sizeof(uint64_t));
+        value = (value ^ word) * ws_hash_multiplier;
+        value ^= value >> 29;
     }
-    return value ^ input->length;
+    if (i < length) {
+        word = 0;
+        memcpy(&word, input->data + i, length - i);
+        value = (value ^ word) * ws_hash_multiplier;
+        value ^= value >> 29;
+    }
+    return (unsigned int)(value ^ (value >> 32));
 }
 
 int ws_label_compare(const ws_label *const a, const ws_label *const b) {
@@ -0,0 +1,330 @@
+/* wsvm.h, an embeddable machine: runs programs inside a long-lived process, without exiting on their errors */
+#ifndef WSVM_H
+#define WSVM_H
+
+#include "wstypes.h"
+#include "wsparser.h"
+#include "wscompiler.h"
+#include "wsoptimizer.h"
+#include "wsregister.h"
+#include "wssuper.h"
+#include "wsmachine.h"
+
+#define WS_VM_UNLIMITED ((size_t)-1)
+
+
+
+/* A ws_vm holds a loaded program and the state of running it. Loading, running and stepping report errors as a
+ * status, with the message ws_vm_message returns, instead of printing them and exiting like the command line
+ * does. A failed or ended machine stays that way until it gets reset or loads the next program, and both of those
+ * keep the stack, heap and callstack it has grown so far, so running many short programs in a row barely
+ * allocates anything but the programs themselves.
+ *
+ * The machine reads from and writes to the files set by ws_vm_io, stdin and stdout by default. Machines can run
+ * on different threads at the same time. With ws_vm_share they run one program which was loaded once, which
+ * they only read, so it has to be compiled already and can't be lazy.
+ */
+typedef struct {
+    const ws_program *program; //NULL until a program is loaded, own if it was loaded by the machine itself
+    ws_program own;
+    ws_int *values;            //the registers of a shared program, see wsregister.h
+    ws_stack stack;
+    ws_heap heap;
+    ws_callstack callstack;
+    size_t next_index;
+    ws_status status;
+    FILE *input;
+    FILE *output;
+    ws_input *source;          //input fed by the scheduler in wssched.h instead of read from input
+    ws_failure failure;
+} ws_vm;
+
+// the commands which can read input, which a machine fed with a ws_input checks before running them.
+// registerblock and the superinstructions run other commands, which can be inputs.
+const char ws_input_map[COMMANDTYPES] = {
+    [inputchar] = 1,
+    [inputnum] = 1,
+    [registerblock] = 1,
+    [superinstruction + 0] = 1, [superinstruction + 1] = 1, [superinstruction + 2] = 1, [superinstruction + 3] = 1,
+    [superinstruction + 4] = 1, [superinstruction + 5] = 1, [superinstruction + 6] = 1, [superinstruction + 7] = 1,
+    [superinstruction + 8] = 1, [superinstruction + 9] = 1, [superinstruction + 10] = 1, [superinstruction + 11] = 1,
+    [superinstruction + 12] = 1, [superinstruction + 13] = 1, [superinstruction + 14] = 1, [superinstruction + 15] = 1
+};
+_Static_assert(COMMANDTYPES == superinstruction + WS_SUPER_LIMIT, "ws_input_map has to know every command type");
+_Static_assert(WS_SUPER_LIMIT == 16, "ws_input_map has to mark every superinstruction");
+
+/* forward declarations
+ */
+ws_vm *ws_vm_create(void);
+void ws_vm_destroy(ws_vm *);
+ws_status ws_vm_load(ws_vm *, const char *, size_t, int);
+ws_status ws_vm_share(ws_vm *, const ws_program *);
+static void ws_vm_unload(ws_vm *);
+void ws_vm_io(ws_vm *, FILE *, FILE *);
+void ws_vm_source(ws_vm *, ws_input *);
+static int ws_vm_ready(const ws_input *, const ws_program *, const ws_command *);
+ws_status ws_vm_step(ws_vm *, size_t);
+static ws_status ws_vm_advance(ws_vm *, size_t, int);
+ws_status ws_vm_run(ws_vm *);
+void ws_vm_reset(ws_vm *);
+const char *ws_vm_message(const ws_vm *);
+size_t ws_vm_index(const ws_vm *);
+
+
+
+ws_vm *ws_vm_create(void) {
+    ws_vm *const vm = (ws_vm *)malloc(sizeof(ws_vm));
+    vm->program = NULL;
+    vm->values = NULL;
+    ws_stack_initialize(&vm->stack);
+    ws_heap_initialize(&vm->heap);
+    ws_callstack_initialize(&vm->callstack);
+    vm->next_index = 0;
+    vm->status = WS_STATUS_OK;
+    vm->input = NULL;
+    vm->output = NULL;
+    vm->source = NULL;
+    vm->failure.status = WS_STATUS_OK;
+    vm->failure.message[0] = '\0';
+    return vm;
+}
+
+void ws_vm_destroy(ws_vm *const vm) {
+    ws_vm_unload(vm);
+    ws_callstack_finish(&vm->callstack);
+    ws_heap_finish(&vm->heap);
+    ws_stack_finish(&vm->stack);
+    free(vm);
+}
+
+/* Parses, compiles and optimizes the length bytes of source at level optimize, replacing the program the machine
+ * had. Returns WS_STATUS_OK, or the error which kept it from loading, which leaves the machine without a program.
+ */
+ws_status ws_vm_load(ws_vm *const vm, const char *const source, const size_t length, const int optimize) {
+    ws_vm_unload(vm);
+
+    const ws_string text = {(char *)source, length};
+    ws_catcher catcher;
+    ws_catch(&catcher, &vm->failure);
+    if (setjmp(catcher.jump)) {
+        // the parser cleans up after itself, the rest fails on a parsed program
+        ws_vm_unload(vm);
+        vm->status = vm->failure.status;
+        return vm->status;
+    }
+
+    ws_parse(&vm->own, &text);
+    vm->program = &vm->own;
+    ws_compile(&vm->own);
+    ws_optimize(&vm->own, optimize);
+    ws_catch_end(&catcher);
+
+    vm->failure.status = WS_STATUS_OK;
+    vm->failure.message[0] = '\0';
+    ws_vm_reset(vm);
+    return WS_STATUS_OK;
+}
+
+/* Makes the machine run program, which stays owned by the caller and has to outlive the machine or its next load.
+ */
+ws_status ws_vm_share(ws_vm *const vm, const ws_program *const program) {
+    ws_vm_unload(vm);
+    if (!(program->flags & 0x1) || program->lazy) {
+        snprintf(vm->failure.message, WS_MESSAGE_SIZE, "can only share compiled programs");
+        vm->failure.status = WS_STATUS_COMPILE_ERROR;
+        vm->status = WS_STATUS_COMPILE_ERROR;
+        return vm->status;
+    }
+
+    vm->program = program;
+    if (program->registers) {
+        vm->values = ws_register_values_copy(program->registers);
+    }
+    vm->failure.status = WS_STATUS_OK;
+    vm->failure.message[0] = '\0';
+    ws_vm_reset(vm);
+    return WS_STATUS_OK;
+}
+
+static void ws_vm_unload(ws_vm *const vm) {
+    if (vm->program == &vm->own) {
+        ws_program_finish(&vm->own);
+    }
+    free(vm->values);
+    vm->program = NULL;
+    vm->values = NULL;
+    vm->next_index = 0;
+}
+
+// the files the program reads from and writes to, NULL for stdin and stdout
+void ws_vm_io(ws_vm *const vm, FILE *const input, FILE *const output) {
+    vm->input = input;
+    vm->output = output;
+}
+
+/* The main loop of wsmachine.h, but it stops after steps commands and keeps its state in the machine.
+ * Returns 4 when it has to wait for input.
+ */
+static int ws_vm_loop(ws_vm *const vm, size_t steps) {
+    const ws_program *const program = vm->program;
+    const ws_input *const source = vm->source;
+    int exitcode = 0;
+    int ready;
+
+    // only a machine which was left at the end by wslockstep.h starts there
+    if (vm->next_index >= program->length) {
+        return 3;
+    }
+    for(; steps && !exitcode; steps--) {
+        const ws_command *const current_command = program->commands + vm->next_index++;
+        if (source && ws_input_map[current_command->type]) {
+            ready = ws_vm_ready(source, program, current_command);
+            if (!ready) {
+                vm->next_index--;
+                return 4;
+            } else if (ready == 2) {
+                continue;
+            }
+        }
+        exitcode = ws_execute_command(program, current_command, &vm->next_index, &vm->stack, &vm->heap,
+                                      &vm->callstack);
+
+        if (vm->next_index >= program->length && !exitcode) {
+            exitcode = 3;
+        }
+    }
+    return exitcode;
+}
+
+// makes the machine read from source instead of its input file, or from the file again with NULL
+void ws_vm_source(ws_vm *const vm, ws_input *const source) {
+    vm->source = source;
+}
+
+/* Whether command can run with what's in source so far. 0 means it has to wait for more input. Register blocks and
+ * superinstructions which read input get 2 instead: the commands they stand for follow them and run one at a time,
+ * so whatever the block prints before it reads still gets printed before the machine waits.
+ */
+static int ws_vm_ready(const ws_input *const source, const ws_program *const program, const ws_command *const command) {
+    int value;
+
+    switch (command->type) {
+        case inputchar:
+            return source->start != source->end || source->closed;
+
+        case inputnum:
+            return ws_input_number(source, source->start, &value) != WS_INPUT_MORE;
+
+        case registerblock:
+            return program->registers->blocks[command->immediate].inputs? 2: 1;
+
+        default:
+            for(size_t i = 0; i < 4; i++) {
+                const int type = ws_super_patterns[command->type - superinstruction][i];
+                if (type == inputchar || type == inputnum) {
+                    return 2;
+                }
+            }
+            return 1;
+    }
+}
+
+/* Runs at most steps commands. Returns WS_STATUS_RUNNING if the program can go on, WS_STATUS_OK once it has ended,
+ * or the error it ran into. A machine fed by a ws_input returns WS_STATUS_BLOCKED when it has to wait for more of
+ * it, and goes on from there when stepped again. Output is flushed before returning.
+ */
+ws_status ws_vm_step(ws_vm *const vm, size_t steps) {
+    return ws_vm_advance(vm, steps, 1);
+}
+
+// ws_vm_step, which leaves the output unflushed if flush is 0 and the program can go on
+static ws_status ws_vm_advance(ws_vm *const vm, size_t steps, const int flush) {
+    if (vm->status != WS_STATUS_RUNNING && vm->status != WS_STATUS_BLOCKED) {
+        return vm->status;
+    }
+    vm->status = WS_STATUS_RUNNING;
+
+    FILE *const input = ws_input_file;
+    FILE *const output = ws_output_file;
+    ws_int *const values = ws_register_values;
+    ws_input *const source = ws_input_source;
+    ws_input_file = vm->input;
+    ws_output_file = vm->output;
+    ws_register_values = vm->values;
+    ws_input_source = vm->source;
+
+    ws_catcher catcher;
+    ws_catch(&catcher, &vm->failure);
+    if (setjmp(catcher.jump)) {
+        fflush(WS_OUTPUT);
+        ws_input_file = input;
+        ws_output_file = output;
+        ws_register_values = values;
+        ws_input_source = source;
+        vm->status = vm->failure.status;
+        return vm->status;
+    }
+
+    switch (ws_vm_loop(vm, steps)) {
+        case 0:
+            break;
+
+        case 1:
+            vm->status = WS_STATUS_OK;
+            break;
+
+        case 4:
+            vm->status = WS_STATUS_BLOCKED;
+            break;
+
+        case 2:
+            ws_fail(WS_STATUS_RUNTIME_ERROR, "invalid command type\n");
+            break;
+
+        default:
+            ws_fail(WS_STATUS_RUNTIME_ERROR, "code index out of bounds\n");
+            break;
+    }
+    ws_catch_end(&catcher);
+
+    if (flush || vm->status != WS_STATUS_RUNNING) {
+        fflush(WS_OUTPUT);
+    }
+    ws_input_file = input;
+    ws_output_file = output;
+    ws_register_values = values;
+    ws_input_source = source;
+    return vm->status;
+}
+
+ws_status ws_vm_run(ws_vm *const vm) {
+    return ws_vm_step(vm, WS_VM_UNLIMITED);
+}
+
+/* Puts the machine back at the start of its program, with an empty stack, heap and callstack.
+ */
+void ws_vm_reset(ws_vm *const vm) {
+    ws_stack_clear(&vm->stack);
+    ws_callstack_clear(&vm->callstack);
+    // a heap without slots or values has nothing to clear
+    if (vm->heap.length || vm->heap.slots) {
+        ws_heap_clear(&vm->heap);
+    }
+    if (vm->program) {
+        ws_heap_slots(&vm->heap, vm->program);
+    }
+    vm->next_index = 0;
+    vm->status = vm->program? WS_STATUS_RUNNING: vm->failure.status;
+}
+
+// the details of the last error, or an empty string
+const char *ws_vm_message(const ws_vm *const vm) {
+    return vm->failure.message;
+}
+
+// the index of the next command to run, or of the command after the one that failed
+size_t ws_vm_index(const ws_vm *const vm) {
+    return vm->next_index;
+}
+
+#endif